@@ -0,0 +1,797 @@
+#include <iostream>
+#include <chrono>
+#include <openssl/md5.h>
+#include <stdio.h>
+#include <string.h>
+#include "src/crypt.hpp"
+#include "src/blockchain.hpp"
+#include "src/pipeline.hpp"
+#include "src/sign.hpp"
+#include "src/store.hpp"
+#include "src/state.hpp"
+#include "src/accounts.hpp"
+#include "src/referrals.hpp"
+#include "src/forks.hpp"
+#include "src/mempool.hpp"
+#include "src/net.hpp"
+#include "src/protocol.hpp"
+#include "src/proof.hpp"
+#include "src/task.hpp"
+#include <random>
+#include <thread>
+
+// Prints one csv line per case: name,items,bytes per item,ns per item,MB/s
+template<class F> void bench(const char* name,size_t items,size_t bytes,F f){
+	f(); // warm up
+	auto start = std::chrono::steady_clock::now();
+	f();
+	double ns = std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now() - start).count();
+	double perItem = ns / items;
+	double mbs = bytes ? (double)bytes * items / (ns / 1e9) / (1024 * 1024) : 0;
+	std::cout << name << "," << items << "," << bytes << "," << perItem << "," << mbs << std::endl;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#pragma GCC diagnostic ignored "-Wvla"
+// The helper crypt.hpp used to provide, kept here as the baseline.
+void legacyHash(char* st,int size,char* ms){
+		unsigned char digest[MD5_DIGEST_LENGTH];
+		char str[size] = {*st};
+		MD5((unsigned char*)&str,strlen(str),(unsigned char*)&digest);
+		for (int i =0;i<16;i++){
+				sprintf(&ms[i*2],"%02x",(unsigned int)digest[i]);
+		}
+}
+#pragma GCC diagnostic pop
+
+void benchHash(){
+	const size_t sizes[] = {32,88,256,4096};
+	for(size_t size : sizes){
+		const size_t n = 200000;
+		std::vector<std::string> messages(n,std::string(size,'a'));
+		std::vector<Bytes> spans(messages.begin(),messages.end());
+		std::vector<Digest> out(n);
+		char legacy[33];
+		char hex[65];
+
+		std::cout << "# message size " << size << std::endl;
+		bench("legacy md5 + sprintf",n,size,[&](){
+			for(size_t i = 0;i < n;i++)
+				legacyHash(&messages[i][0],size,legacy);
+		});
+		bench("sha256 one shot",n,size,[&](){
+			for(size_t i = 0;i < n;i++)
+				out[i] = sha256(spans[i]);
+		});
+		bench("sha256 one shot + hex",n,size,[&](){
+			for(size_t i = 0;i < n;i++){
+				out[i] = sha256(spans[i]);
+				toHex(out[i].data(),out[i].size(),hex);
+			}
+		});
+		bench("sha256 hashMany",n,size,[&](){
+			hashMany(spans.data(),n,out.data());
+		});
+		unsigned threads = std::max(1u,std::thread::hardware_concurrency());
+		bench("sha256 hashMany all cores",n,size,[&](){
+			hashMany(spans.data(),n,out.data(),threads);
+		});
+		bench("sha256 new EVP context per message",n,size,[&](){
+			for(size_t i = 0;i < n;i++){
+				EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+				EVP_DigestInit_ex(ctx,EVP_sha256(),nullptr);
+				EVP_DigestUpdate(ctx,spans[i].data,spans[i].size);
+				EVP_DigestFinal_ex(ctx,out[i].data(),nullptr);
+				EVP_MD_CTX_free(ctx);
+			}
+		});
+	}
+}
+
+// Blocks per second through the verification pipeline for a few pool sizes,
+// with the deepest queue seen per stage so a node can be sized by it.
+void benchPipeline(){
+	const size_t n = 200;
+	const size_t txs = 100;
+	std::vector<std::vector<uint8_t>> encoded;
+	Digest phash;
+	phash.fill(0);
+	KeyPair keys = generateKeyPair();
+	for(size_t i = 0;i < n;i++){
+		BlockData b;
+		b.header = Block(0,Digest(),phash,1000 + i);
+		for(size_t t = 0;t < txs;t++){
+			Transaction tx;
+			memset(&tx,0,sizeof tx);
+			tx.amount = t;
+			tx.nonce = i;
+			signTransaction(tx,keys);
+			b.txs.push_back(tx);
+		}
+		seal(b);
+		phash = b.header.hash;
+		encoded.push_back(encodeBlock(b));
+	}
+	size_t bytes = encoded[0].size();
+	unsigned cores = std::max(1u,std::thread::hardware_concurrency());
+	std::cout << "# pipeline, " << txs << " transactions per block" << std::endl;
+	for(unsigned threads = 1;;threads = std::min(cores,threads * 2)){
+		ThreadPool pool(threads);
+		Pipeline pipe(pool,256);
+		pipe.checkSignature = verifyTransaction;
+		size_t deepest[STAGES] = {0,0,0,0};
+		std::atomic<bool> sampling(true);
+		std::thread sampler([&](){
+			while(sampling){
+				PipelineStats s = pipe.stats();
+				for(int i = 0;i < STAGES;i++)
+					deepest[i] = std::max(deepest[i],s.depth[i]);
+				std::this_thread::sleep_for(std::chrono::microseconds(200));
+			}
+		});
+		std::string name = "pipeline " + std::to_string(threads) + " threads";
+		bench(name.c_str(),n,bytes,[&](){
+			for(size_t i = 0;i < n;i++)
+				pipe.submit(std::vector<uint8_t>(encoded[i]),i);
+			pipe.drain();
+		});
+		sampling = false;
+		sampler.join();
+		PipelineStats s = pipe.stats();
+		std::cout << "# " << s.blocksPerSecond << " blocks/s " << s.transactionsPerSecond << " tx/s, deepest queue decode " << deepest[STAGE_DECODE] << " hash " << deepest[STAGE_HASH] << " signature " << deepest[STAGE_SIGNATURE] << " apply " << deepest[STAGE_APPLY] << std::endl;
+		if(threads == cores)
+			break;
+	}
+}
+
+// Ed25519 checks one at a time against verifyMany() on all cores,
+// with one signer and with a different signer for every message.
+void benchSign(){
+	const size_t n = 5000;
+	std::vector<KeyPair> signers;
+	for(int i = 0;i < 1000;i++)
+		signers.push_back(generateKeyPair());
+	std::vector<Digest> messages(n);
+	std::vector<Signature> signatures(n);
+	std::vector<SignedMessage> sameKey(n),manyKeys(n);
+	for(size_t i = 0;i < n;i++){
+		messages[i] = sha256(&i,sizeof i);
+		signatures[i] = sign(signers[i % signers.size()],messages[i]);
+	}
+	std::vector<Signature> sameSignatures(n);
+	for(size_t i = 0;i < n;i++){
+		sameSignatures[i] = sign(signers[0],messages[i]);
+		sameKey[i] = SignedMessage{&signers[0].publicKey,Bytes(messages[i]),&sameSignatures[i]};
+		manyKeys[i] = SignedMessage{&signers[i % signers.size()].publicKey,Bytes(messages[i]),&signatures[i]};
+	}
+	std::vector<uint8_t> ok(n);
+	unsigned threads = std::max(1u,std::thread::hardware_concurrency());
+	std::cout << "# ed25519" << std::endl;
+	bench("ed25519 sign",n,32,[&](){
+		for(size_t i = 0;i < n;i++)
+			signatures[i] = sign(signers[i % signers.size()],messages[i]);
+	});
+	bench("ed25519 verify one key",n,32,[&](){ verifyMany(sameKey.data(),n,ok.data()); });
+	bench("ed25519 verify many keys",n,32,[&](){ verifyMany(manyKeys.data(),n,ok.data()); });
+	bench("ed25519 verifyMany all cores",n,32,[&](){ verifyMany(manyKeys.data(),n,ok.data(),threads); });
+}
+
+// Appends, random lookups by hash and reopening a store.
+void benchStore(){
+	char dir[] = "/tmp/benchstoreXXXXXX";
+	if(!mkdtemp(dir))
+		return;
+	const size_t n = 50000;
+	std::vector<std::vector<uint8_t>> encoded;
+	std::vector<Digest> hashes;
+	Digest phash;
+	phash.fill(0);
+	for(size_t i = 0;i < n;i++){
+		BlockData b;
+		b.header = Block(0,Digest(),phash,1000 + i);
+		b.txs.resize(4);
+		memset(b.txs.data(),0,b.txs.size() * sizeof(Transaction));
+		b.txs[0].nonce = i;
+		seal(b);
+		phash = b.header.hash;
+		hashes.push_back(phash);
+		encoded.push_back(encodeBlock(b));
+	}
+	std::vector<size_t> order(n);
+	for(size_t i = 0;i < n;i++)
+		order[i] = i;
+	std::shuffle(order.begin(),order.end(),std::mt19937(42));
+	size_t bytes = encoded[0].size();
+	std::cout << "# block store" << std::endl;
+	{
+		BlockStore store;
+		store.open(dir);
+		auto start = std::chrono::steady_clock::now();
+		for(size_t i = 0;i < n;i++)
+			store.append(encoded[i].data(),encoded[i].size());
+		store.checkpoint();
+		double ns = std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "store append + checkpoints," << n << "," << bytes << "," << ns / n << "," << (double)bytes * n / (ns / 1e9) / (1024 * 1024) << std::endl;
+		volatile size_t found = 0; // keeps the lookups from being optimized away
+		bench("store random find",n,bytes,[&](){
+			for(size_t i : order)
+				found = found + store.find(hashes[i]).size;
+		});
+		BlockData b;
+		bench("store random get",n,bytes,[&](){
+			for(size_t i : order)
+				found = found + store.get(hashes[i],b);
+		});
+	}
+	bench("store open",1,0,[&](){
+		BlockStore store;
+		store.open(dir);
+	});
+	system((std::string("rm -rf ") + dir).c_str());
+	// pruning 4 MB segments, the unlink in place on the calling thread
+	strcpy(dir,"/tmp/benchstoreXXXXXX");
+	if(!mkdtemp(dir))
+		return;
+	{
+		BlockStore store(4 * 1024 * 1024);
+		store.open(dir);
+		for(size_t i = 0;i < n;i++)
+			store.append(encoded[i].data(),encoded[i].size());
+		store.checkpoint();
+		size_t pruned = 0;
+		auto start = std::chrono::steady_clock::now();
+		while(store.pruneOldest(hashes[n - 1]))
+			pruned++;
+		double ns = std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "store prune segment," << pruned << "," << 4 * 1024 * 1024 << "," << ns / pruned << "," << (double)pruned * 4 / (ns / 1e9) << std::endl;
+	}
+	system((std::string("rm -rf ") + dir).c_str());
+	// the same appends with segment and checkpoint syncs handed to io_uring, the loop reaps them in between
+	EventLoop loop(nullptr,LOOP_URING);
+	strcpy(dir,"/tmp/benchstoreXXXXXX");
+	if(loop.backend() != LOOP_URING || !mkdtemp(dir))
+		return;
+	{
+		BlockStore store;
+		store.sync = [&](int fd,std::function<void(int)> done){ loop.fsync(fd,done); };
+		store.open(dir);
+		auto start = std::chrono::steady_clock::now();
+		for(size_t i = 0;i < n;i++){
+			store.append(encoded[i].data(),encoded[i].size());
+			if(i % 64 == 0)
+				loop.runOnce(0);
+		}
+		store.checkpoint();
+		double ns = std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "store append + io_uring syncs," << n << "," << bytes << "," << ns / n << "," << (double)bytes * n / (ns / 1e9) / (1024 * 1024) << std::endl;
+	}
+	system((std::string("rm -rf ") + dir).c_str());
+	// pruning with the unlinks queued on the ring, the loop only waits for them at the end
+	strcpy(dir,"/tmp/benchstoreXXXXXX");
+	if(!mkdtemp(dir))
+		return;
+	{
+		BlockStore store(4 * 1024 * 1024);
+		size_t left = 0;
+		store.discard = [&](const std::string& path){
+			left++;
+			loop.unlink(path,[&](int32_t){ left--; });
+		};
+		store.open(dir);
+		for(size_t i = 0;i < n;i++)
+			store.append(encoded[i].data(),encoded[i].size());
+		store.checkpoint();
+		size_t pruned = 0;
+		auto start = std::chrono::steady_clock::now();
+		while(store.pruneOldest(hashes[n - 1]))
+			pruned++;
+		double ns = std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "store prune segment + io_uring unlink," << pruned << "," << 4 * 1024 * 1024 << "," << ns / pruned << "," << (double)pruned * 4 / (ns / 1e9) << std::endl;
+		while(left)
+			loop.runOnce(10);
+	}
+	system((std::string("rm -rf ") + dir).c_str());
+}
+
+// Replaying registrations and transfers against loading the same state from a snapshot.
+void benchState(){
+	const size_t accounts = 100000;
+	std::vector<Transaction> txs;
+	for(size_t i = 0;i < accounts;i++){
+		Transaction tx;
+		memset(&tx,0,sizeof tx);
+		tx.from = sha256(&i,sizeof i);
+		tx.to = tx.from;
+		tx.kind = TX_REGISTER;
+		txs.push_back(tx);
+	}
+	for(size_t i = 0;i + 1 < accounts;i++){
+		Transaction tx;
+		memset(&tx,0,sizeof tx);
+		tx.from = txs[i].from;
+		tx.to = txs[i + 1].from;
+		tx.amount = 1;
+		tx.nonce = 1;
+		txs.push_back(tx);
+	}
+	std::string path = "/tmp/benchstate.snap";
+	std::cout << "# account state" << std::endl;
+	State replayed;
+	bench("state apply",txs.size(),sizeof(Transaction),[&](){
+		replayed.clear();
+		for(const Transaction& tx : txs)
+			replayed.apply(tx);
+	});
+	bench("state hash",accounts,sizeof(SnapshotEntry),[&](){ replayed.hash(); });
+	Account account;
+	MerkleProof proof;
+	bench("state prove",1,sizeof(SnapshotEntry),[&](){ replayed.prove(txs[accounts / 2].from,account,proof); });
+	// an empty block committing to the state keeps its tree
+	BlockData committed;
+	committed.header.state = replayed.hash();
+	replayed.apply(committed);
+	const size_t proofs = 100000;
+	bench("state prove kept tree",proofs,sizeof(SnapshotEntry),[&](){
+		for(size_t i = 0;i < proofs;i++)
+			replayed.prove(committed.header.state,txs[i % accounts].from,account,proof);
+	});
+	bench("state snapshot",accounts,sizeof(SnapshotEntry),[&](){ replayed.snapshot(path,0,Digest()); });
+	State loaded;
+	SnapshotInfo info;
+	bench("state load snapshot",accounts,sizeof(SnapshotEntry),[&](){ loaded.load(path,info); });
+	unlink(path.c_str());
+}
+
+// A million accounts written one change at a time against one batch
+// spread over the shards, then looked up in random order with all of
+// them in memory and with most of them spilled to files.
+void benchAccounts(){
+	const size_t n = 1000000;
+	std::vector<AccountChange> changes;
+	changes.reserve(n);
+	for(size_t i = 0;i < n;i++){
+		Account a;
+		memset(&a,0,sizeof a);
+		a.balance = i;
+		changes.emplace_back(sha256(&i,sizeof i),a);
+	}
+	std::vector<size_t> order(n);
+	for(size_t i = 0;i < n;i++)
+		order[i] = i;
+	std::shuffle(order.begin(),order.end(),std::mt19937(42));
+	std::cout << "# account table, " << ACCOUNT_SHARDS << " shards" << std::endl;
+	bench("accounts update one by one",n,sizeof(SnapshotEntry),[&](){
+		AccountTable table;
+		for(const AccountChange& c : changes)
+			table.update(&c,1);
+	});
+	bench("accounts update batch",n,sizeof(SnapshotEntry),[&](){
+		AccountTable table;
+		table.update(changes);
+	});
+	char dir[] = "/tmp/benchaccountsXXXXXX";
+	if(!mkdtemp(dir))
+		return;
+	AccountTable table;
+	table.open(dir);
+	table.update(changes);
+	volatile uint64_t found = 0;
+	bench("accounts random find",n,sizeof(SnapshotEntry),[&](){
+		for(size_t i : order)
+			found = found + table.find(changes[i].first)->balance;
+	});
+	auto start = std::chrono::steady_clock::now();
+	size_t spilled = table.spill(n / 10);
+	double ns = std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "accounts spill," << spilled << "," << sizeof(SnapshotEntry) << "," << ns / spilled << "," << (double)spilled * sizeof(SnapshotEntry) / (ns / 1e9) / (1024 * 1024) << std::endl;
+	bench("accounts random find spilled",n,sizeof(SnapshotEntry),[&](){
+		for(size_t i : order)
+			found = found + table.find(changes[i].first)->balance;
+	});
+	system((std::string("rm -rf ") + dir).c_str());
+}
+
+// The referral graph of a million accounts, each referred by a random
+// earlier one: built from the state, the rewards of all accounts, depths
+// and the levels below the first account, and registrations added one by one.
+void benchReferrals(){
+	const size_t n = 1000000;
+	const size_t later = 100000;
+	std::mt19937 random(42);
+	std::vector<Transaction> registrations(n + later);
+	for(size_t i = 0;i < n + later;i++){
+		Transaction& tx = registrations[i];
+		memset(&tx,0,sizeof tx);
+		tx.from = sha256(&i,sizeof i);
+		tx.to = registrations[i ? random() % i : 0].from;
+		tx.kind = TX_REGISTER;
+	}
+	BlockData block;
+	block.txs.assign(registrations.begin(),registrations.begin() + n);
+	State state;
+	state.apply(block);
+	std::cout << "# referral graph, " << n << " accounts" << std::endl;
+	ReferralGraph graph;
+	bench("referrals build",n,sizeof(SnapshotEntry),[&](){ graph.build(state); });
+	volatile uint64_t sum = 0;
+	bench("referrals rewards",n,sizeof(uint64_t),[&](){ sum = sum + graph.rewards()[0]; });
+	bench("referrals depths",n,sizeof(uint64_t),[&](){ sum = sum + graph.depths()[0]; });
+	uint64_t root = graph.find(registrations[0].from);
+	bench("referrals levels",n,sizeof(uint64_t),[&](){ sum = sum + graph.levels(root).size(); });
+	// all of them fit into the overflow, none triggers a rebuild
+	auto start = std::chrono::steady_clock::now();
+	for(size_t i = n;i < n + later;i++)
+		graph.add(registrations[i].from,registrations[i].to);
+	double ns = std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "referrals add," << later << "," << sizeof(Transaction) << "," << ns / later << "," << (double)sizeof(Transaction) * later / (ns / 1e9) / (1024 * 1024) << std::endl;
+}
+
+// Reorganizations of depth 1, 10 and 1000 on a state of a million
+// accounts: the chain and a branch one block longer fork off the same
+// block, every block moves 1 THX between 100 accounts. Switching undoes
+// the chain down to the fork and applies the branch; rebuilding the state
+// from the registrations and applying the branch is what it would cost
+// without undo records.
+void benchForks(){
+	const size_t accounts = 1000000;
+	const size_t perBlock = 100;
+	std::vector<Transaction> registrations(accounts);
+	for(size_t i = 0;i < accounts;i++){
+		Transaction& tx = registrations[i];
+		memset(&tx,0,sizeof tx);
+		tx.from = sha256(&i,sizeof i);
+		tx.to = tx.from;
+		tx.kind = TX_REGISTER;
+	}
+	uint64_t serial = 0;
+	auto nextHash = [&](){
+		serial++;
+		return sha256(&serial,sizeof serial);
+	};
+	// transfers from the accounts from first on, each pays once
+	auto makeBlock = [&](const Digest& phash,int64_t timestamp,size_t first){
+		std::shared_ptr<BlockData> b = std::make_shared<BlockData>();
+		b->header = Block(perBlock,Digest(),phash,timestamp);
+		for(size_t i = first;i < first + perBlock;i++){
+			Transaction tx;
+			memset(&tx,0,sizeof tx);
+			tx.from = registrations[i].from;
+			tx.to = registrations[(i + perBlock / 2) % accounts].from;
+			tx.amount = 1;
+			tx.nonce = 1;
+			b->txs.push_back(tx);
+		}
+		b->header.hash = nextHash();
+		return b;
+	};
+	Digest none;
+	none.fill(0);
+	std::cout << "# fork choice, " << accounts << " accounts, " << perBlock << " transfers per block" << std::endl;
+	for(size_t depth : {1,10,1000}){
+		State state;
+		for(const Transaction& tx : registrations)
+			state.apply(tx);
+		Blockchain chain;
+		ForkChoice forks(chain,state);
+		std::shared_ptr<BlockData> genesis = std::make_shared<BlockData>();
+		genesis->header = Block(0,nextHash(),none,1000);
+		forks.add(genesis);
+		std::vector<std::shared_ptr<BlockData>> branch;
+		for(size_t i = 0;i < depth;i++)
+			forks.add(makeBlock(chain.tip().hash,2000 + i,i * perBlock));
+		for(size_t i = 0;i <= depth;i++)
+			branch.push_back(makeBlock(i ? branch.back()->header.hash : genesis->header.hash,3000 + i,accounts / 2 + i * perBlock));
+		for(size_t i = 0;i < depth;i++)
+			forks.add(branch[i]);
+		auto start = std::chrono::steady_clock::now();
+		int rc = forks.add(branch.back());
+		double ns = std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now() - start).count();
+		if(rc != FORK_REORG || chain.tip().hash != branch.back()->header.hash){
+			std::cout << "reorg failed" << std::endl;
+			return;
+		}
+		std::string name = "reorg depth " + std::to_string(depth);
+		std::cout << name << "," << depth * 2 + 1 << ",0," << ns / (depth * 2 + 1) << ",0" << std::endl;
+		if(depth == 1000){
+			start = std::chrono::steady_clock::now();
+			State rebuilt;
+			for(const Transaction& tx : registrations)
+				rebuilt.apply(tx);
+			for(const std::shared_ptr<BlockData>& b : branch)
+				rebuilt.apply(*b);
+			ns = std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now() - start).count();
+			std::cout << "rebuild state + depth 1000," << depth + 1 << ",0," << ns / (depth + 1) << ",0" << std::endl;
+		}
+	}
+}
+
+// The obvious pool, one mutex around a hash set and a ranking, as the baseline.
+class LockedMempool{
+	private:
+		std::mutex mutex;
+		std::unordered_map<Digest,Transaction,DigestHash> byHash;
+		std::map<std::pair<uint64_t,uint64_t>,Digest> ranked;
+		uint64_t arrivals = 0;
+	public:
+		int add(const Transaction& tx,uint64_t priority){
+			Digest hash = tx.computeHash();
+			std::lock_guard<std::mutex> lock(mutex);
+			if(!byHash.emplace(hash,tx).second)
+				return MEMPOOL_DUPLICATE;
+			ranked.emplace(std::make_pair(~priority,arrivals++),hash);
+			return MEMPOOL_OK;
+		}
+		size_t take(size_t max,std::vector<Transaction>& out){
+			std::lock_guard<std::mutex> lock(mutex);
+			size_t n = 0;
+			for(;n < max && !ranked.empty();n++){
+				auto it = byHash.find(ranked.begin()->second);
+				out.push_back(it->second);
+				byHash.erase(it);
+				ranked.erase(ranked.begin());
+			}
+			return n;
+		}
+};
+
+// Producers add distinct transactions, a quarter of them twice, while one
+// consumer takes batches of 1000 as a block builder would.
+template<class Pool> void stressMempool(const char* name,unsigned producers,const std::vector<Transaction>& txs){
+	bench(name,txs.size() + txs.size() / 4,sizeof(Transaction),[&](){
+		Pool pool;
+		std::atomic<unsigned> running(producers);
+		std::vector<std::thread> threads;
+		size_t chunk = txs.size() / producers;
+		for(unsigned t = 0;t < producers;t++){
+			threads.emplace_back([&,t](){
+				for(size_t i = t * chunk;i < (t + 1) * chunk;i++){
+					while(pool.add(txs[i],txs[i].amount % 100) == MEMPOOL_FULL)
+						std::this_thread::yield();
+					if(i % 4 == 0)
+						pool.add(txs[(i + chunk / 2) % txs.size()],0);
+				}
+				running--;
+			});
+		}
+		std::vector<Transaction> batch;
+		while(running){
+			batch.clear();
+			pool.take(1000,batch);
+		}
+		for(std::thread& t : threads)
+			t.join();
+	});
+}
+
+void benchMempool(){
+	const size_t n = 400000;
+	std::vector<Transaction> txs(n);
+	for(size_t i = 0;i < n;i++){
+		txs[i].from.fill(0);
+		memcpy(txs[i].from.data(),&i,sizeof i);
+		txs[i].to = txs[i].from;
+		txs[i].amount = i * 7919;
+		txs[i].nonce = 0;
+		txs[i].timestamp = 1000;
+		txs[i].kind = TX_TRANSFER;
+	}
+	std::cout << "# mempool admission, one consumer" << std::endl;
+	for(unsigned producers : {1u,2u,4u,8u}){
+		std::string locked = "locked mempool " + std::to_string(producers) + " producers";
+		std::string free = "lock-free mempool " + std::to_string(producers) + " producers";
+		stressMempool<LockedMempool>(locked.c_str(),producers,txs);
+		stressMempool<Mempool>(free.c_str(),producers,txs);
+	}
+}
+
+// Building the tree on one core and on all, against checking one proof.
+void benchMerkle(){
+	const size_t n = 1 << 20;
+	std::vector<Digest> leaves(n);
+	for(size_t i = 0;i < n;i++)
+		leaves[i] = merkleLeaf(Bytes(&i,sizeof i));
+	unsigned threads = std::max(1u,std::thread::hardware_concurrency());
+	std::cout << "# merkle tree" << std::endl;
+	Digest root;
+	bench("merkle root",n,sizeof(Digest),[&](){ root = merkleRoot(leaves.data(),n); });
+	bench("merkle root all cores",n,sizeof(Digest),[&](){ root = merkleRoot(leaves.data(),n,threads); });
+	MerkleProof proof = merkleProve(leaves.data(),n,n / 3);
+	const size_t checks = 100000;
+	bench("merkle verify",checks,proof.path.size() * sizeof(Digest),[&](){
+		for(size_t i = 0;i < checks;i++)
+			merkleVerify(root,leaves[n / 3],proof);
+	});
+	AccountProof ap;
+	ap.key = leaves[0];
+	memset(&ap.account,0,sizeof ap.account);
+	ap.path = proof;
+	std::vector<uint8_t> bytes;
+	bench("account proof encode + decode",checks,0,[&](){
+		for(size_t i = 0;i < checks;i++){
+			bytes = encodeProof(ap);
+			decodeProof(bytes.data(),bytes.size(),ap);
+		}
+	});
+}
+
+// One block of 10000 transactions: decoding into structs against reading
+// it through views, and hashing from structs against hashing the bytes.
+void benchWire(){
+	const size_t n = 10000;
+	BlockData block;
+	block.txs.resize(n);
+	memset(block.txs.data(),0,n * sizeof(Transaction));
+	for(size_t i = 0;i < n;i++)
+		block.txs[i].nonce = i;
+	seal(block);
+	std::vector<uint8_t> bytes = encodeBlock(block);
+	std::cout << "# wire format, " << n << " transactions per block" << std::endl;
+	bench("encode block",n,WIRE_TX_SIZE,[&](){ bytes = encodeBlock(block); });
+	BlockData decoded;
+	bench("decode block",n,WIRE_TX_SIZE,[&](){ decodeBlock(bytes.data(),bytes.size(),decoded); });
+	volatile uint64_t total = 0; // keeps the reads
+	bench("view block",n,WIRE_TX_SIZE,[&](){
+		BlockView view;
+		view.parse(bytes.data(),bytes.size());
+		uint64_t sum = 0;
+		for(size_t i = 0;i < view.count();i++)
+			sum += view.tx(i).amount() + view.tx(i).from()[0];
+		total = sum;
+	});
+	std::vector<Digest> hashes(n);
+	bench("hash transactions from structs",n,WIRE_TX_HASHED,[&](){
+		for(size_t i = 0;i < n;i++)
+			hashes[i] = block.txs[i].computeHash();
+	});
+	bench("hash transactions in place",n,WIRE_TX_HASHED,[&](){
+		BlockView view;
+		view.parse(bytes.data(),bytes.size());
+		for(size_t i = 0;i < n;i++)
+			hashes[i] = view.tx(i).computeHash();
+	});
+}
+
+// Link that only counts, so the cost measured is the send path itself.
+class NullLink : public Link{
+	public:
+		size_t bytes = 0;
+		void carry(Connection&,const uint8_t*,size_t size) override { bytes += size; }
+		void closed(Connection&) override {}
+};
+
+// A 1 MB block to 64 peers, serialized per peer against one shared frame.
+void benchBroadcast(){
+	const size_t peers = 64;
+	const size_t size = 1 << 20;
+	EventLoop loop;
+	PeerServer server(loop);
+	NullLink link;
+	for(size_t i = 0;i < peers;i++)
+		server.attach(&link);
+	std::vector<uint8_t> block(size,1);
+	std::cout << "# broadcast" << std::endl;
+	bench("broadcast copy per peer",peers,size,[&](){
+		server.forEach([&](Connection& c){ c.send(MSG_BLOCK,block.data(),block.size()); });
+	});
+	bench("broadcast shared frame",peers,size,[&](){
+		server.broadcast(makeFrame(MSG_BLOCK,block.data(),block.size()));
+	});
+}
+
+// Echo round trips with many peers on one loop thread, epoll against
+// io_uring. The clients write a frame on every socket, then read every echo.
+void benchLoopback(){
+	const size_t peers = 256;
+	const size_t rounds = 100;
+	std::cout << "# loopback, " << peers << " peers" << std::endl;
+	for(int io : {LOOP_EPOLL,LOOP_URING}){
+		EventLoop loop(nullptr,io);
+		if(loop.backend() != io){
+			std::cout << "io_uring not available" << std::endl;
+			continue;
+		}
+		PeerServer server(loop);
+		if(!server.listen(0))
+			return;
+		server.onMessage = [](Connection& c,const uint8_t* data,size_t size){ c.send(data,size); };
+		std::thread thread([&](){ loop.run(); });
+		std::vector<int> fds;
+		for(size_t i = 0;i < peers;i++){
+			int fd = socket(AF_INET,SOCK_STREAM,0);
+			sockaddr_in addr;
+			memset(&addr,0,sizeof addr);
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons(server.port());
+			inet_pton(AF_INET,"127.0.0.1",&addr.sin_addr);
+			int one = 1;
+			setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof one);
+			if(connect(fd,(sockaddr*)&addr,sizeof addr) == 0)
+				fds.push_back(fd);
+		}
+		for(size_t size : {64,16384}){
+			Frame frame = makeFrame(std::vector<uint8_t>(size,1).data(),size);
+			std::vector<uint8_t> echo(frame->size());
+			std::string name = std::string("echo ") + (io == LOOP_URING ? "io_uring " : "epoll ") + std::to_string(size) + " B";
+			bench(name.c_str(),fds.size() * rounds,size,[&](){
+				for(size_t r = 0;r < rounds;r++){
+					for(int fd : fds)
+						if(send(fd,frame->data(),frame->size(),MSG_NOSIGNAL) != (ssize_t)frame->size())
+							return;
+					for(int fd : fds)
+						if(recv(fd,echo.data(),echo.size(),MSG_WAITALL) != (ssize_t)echo.size())
+							return;
+				}
+			});
+		}
+		for(int fd : fds)
+			close(fd);
+		loop.stop();
+		thread.join();
+	}
+}
+
+Task<void> echoLoop(Stream& s){
+	for(;;){
+		Stream::Message m = co_await s.read();
+		if(!m)
+			break;
+		co_await s.write(MSG_PONG,m.payload(),m.payloadSize());
+	}
+}
+
+Task<void> echoOnce(Stream& s,const uint8_t* data,size_t size){
+	co_await s.write(MSG_PONG,data + 1,size - 1);
+}
+
+// Ping and pong over an in-process link, so what differs is the dispatch:
+// a callback, one coroutine reading the stream and a coroutine per message.
+void benchTask(){
+	const size_t n = 200000;
+	std::vector<uint8_t> ping(*makeFrame(MSG_PING,std::vector<uint8_t>(32,1).data(),32));
+	std::cout << "# coroutines, " << n << " pings" << std::endl;
+	for(int mode = 0;mode < 3;mode++){
+		EventLoop loop;
+		PeerServer server(loop);
+		NullLink link;
+		Connection* c = server.attach(&link);
+		Stream stream(server,c->id());
+		if(mode == 0)
+			server.onMessage = [](Connection& c,const uint8_t* data,size_t size){ c.send(MSG_PONG,data + 1,size - 1); };
+		else if(mode == 1)
+			server.onMessage = [&](Connection&,const uint8_t* data,size_t size){ stream.push(data,size); };
+		else
+			server.onMessage = [&](Connection&,const uint8_t* data,size_t size){ spawn(echoOnce(stream,data,size)); };
+		server.onDrained = [&](Connection&){ stream.drained(); };
+		server.onDisconnect = [&](Connection&){ stream.closed(); };
+		if(mode == 1)
+			spawn(echoLoop(stream));
+		const char* names[] = {"ping callback","ping coroutine loop","ping coroutine per message"};
+		bench(names[mode],n,ping.size(),[&](){
+			for(size_t i = 0;i < n;i++)
+				c->receive(ping.data(),ping.size());
+		});
+		if(mode)
+			std::cout << "# " << stream.frameArena().chunkCount() << " arena chunks, " << stream.frameArena().liveFrames() << " live frames, " << link.bytes << " bytes out" << std::endl;
+		c->close();
+	}
+}
+
+int main(){
+	std::cout << "name,items,bytes,ns/item,MB/s" << std::endl;
+	benchHash();
+	benchSign();
+	benchStore();
+	benchState();
+	benchAccounts();
+	benchReferrals();
+	benchForks();
+	benchMerkle();
+	benchWire();
+	benchPipeline();
+	benchMempool();
+	benchBroadcast();
+	benchLoopback();
+	benchTask();
+	return 0;
+}
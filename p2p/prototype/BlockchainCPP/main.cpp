@@ -1,6 +1,7 @@
 #include <iostream>
 #include "src/crypt.hpp"
 #include "src/blockchain.hpp"
+#include "src/sign.hpp"
 #include <ctime>
 
 #define log(x) std::cout << x << std::endl;
@@ -8,22 +9,38 @@
 int main(){
 	
 	char str[] = "Art Sent 10THX To Brian";
-	char sdigest[33];
-	int sizes = sizeof str;
+	int sizes = sizeof str - 1;
 	
-	hash(str,sizes,sdigest);
+	Digest sdigest = sha256(str,sizes);
 	
 	char genesisblockstr[] = "Do not go gentle into that good night , old age should burn and rave at close of day; Rage Rage against the dying of the light.";
-	
-	char genesisblockd[33]; // DIGEST
-	int gbsize = sizeof genesisblockstr;
-	
-	hash(genesisblockstr,gbsize,genesisblockd);
-	
-	Block* bl = new Block(sizeof sdigest,sdigest,genesisblockd,std::time(0)); // (size , hash , prev_hash,timestamp)
-	
-	bl->getDetails();// Directly prints block data to stdout
-	
-	// Block Cannot be destroyed
+	int gbsize = sizeof genesisblockstr - 1;
+	
+	Digest genesisblockd = sha256(genesisblockstr,gbsize); // DIGEST
+	
+	log("Transaction : " << toHex(sdigest));
+	
+	// the same transfer as a record Art signs, anybody holding Art's public key can check it
+	KeyPair art = generateKeyPair();
+	KeyPair brian = generateKeyPair();
+	Transaction transfer;
+	transfer.to = brian.publicKey;
+	transfer.amount = 10;
+	transfer.nonce = 0;
+	transfer.timestamp = std::time(0);
+	transfer.kind = TX_TRANSFER;
+	signTransaction(transfer,art);
+	log("Signed by : " << toHex(transfer.from) << " <|> Signature valid : " << verifyTransaction(transfer,transfer.computeHash()));
+	
+	Blockchain chain;
+	Digest none;
+	none.fill(0);
+	chain.append(Block(gbsize,genesisblockd,none,std::time(0))); // (size , hash , prev_hash,timestamp)
+	chain.append(Block(sizes,sdigest,genesisblockd,std::time(0)));
+	
+	for(uint64_t i = 0;i < chain.size();i++)
+		chain.at(i).getDetails();// Directly prints block data to stdout
+	
+	log("Chain valid : " << (chain.validate() == CHAIN_VALID));
 	return 0;
 }
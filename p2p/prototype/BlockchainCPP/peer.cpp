@@ -0,0 +1,70 @@
+#include <iostream>
+#include <cstdlib>
+#include <csignal>
+#include <chrono>
+#include <sys/stat.h>
+#include "src/peer.hpp"
+#include "src/sync.hpp"
+
+#define log(x) std::cout << x << std::endl;
+
+// peerexec <port> [workers] [data directory] [ports of local peers to sync from...]
+// PEER_IO=uring runs sockets and store syncs on io_uring where the kernel has it.
+// PEER_BUDGET=<megabytes> prunes old blocks to keep the data directory about that size.
+// PEER_ACCOUNTS=<count> keeps that many accounts in memory and spills the others to the data directory.
+int main(int argc,char** argv){
+	uint16_t port = argc > 1 ? atoi(argv[1]) : 10000;
+	unsigned workers = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+	const char* io = getenv("PEER_IO");
+	signal(SIGPIPE,SIG_IGN);
+
+	Peer peer(workers,nullptr,PEER_MEMPOOL_CAPACITY,io && strcmp(io,"uring") == 0 ? LOOP_URING : LOOP_EPOLL);
+	peer.gossip.relay = true;
+	const char* budget = getenv("PEER_BUDGET");
+	if(budget)
+		peer.diskBudget = strtoull(budget,nullptr,10) << 20;
+	if(argc > 3){
+		const char* resident = getenv("PEER_ACCOUNTS");
+		mkdir(argv[3],0755);
+		if(resident && !peer.state.spill(std::string(argv[3]) + "/accounts",strtoull(resident,nullptr,10))){
+			log("Could not create " << argv[3] << "/accounts");
+			return 1;
+		}
+		if(!peer.open(argv[3])){
+			log("Could not open the block store in " << argv[3]);
+			return 1;
+		}
+		log("Loaded " << peer.chain.size() << " blocks, " << peer.store.recovered() << " recovered after the last checkpoint");
+	}
+	if(!peer.listen(port)){
+		log("Could not listen on port " << port);
+		return 1;
+	}
+	log("Peer listening on port " << peer.server.port() << " with " << peer.pool.size() << " verification workers on " << (peer.loop.backend() == LOOP_URING ? "io_uring" : "epoll"));
+	// throughput and queue depths, to size the worker pool
+	std::thread report([&peer](){
+		for(;;){
+			std::this_thread::sleep_for(std::chrono::seconds(10));
+			PipelineStats s = peer.pipeline.stats();
+			log(s.blocksPerSecond << " blocks/s " << s.transactionsPerSecond << " tx/s, in flight " << s.inflight << " (decode " << s.depth[STAGE_DECODE] << " hash " << s.depth[STAGE_HASH] << " signature " << s.depth[STAGE_SIGNATURE] << " apply " << s.depth[STAGE_APPLY] << ")");
+		}
+	});
+	report.detach();
+	Sync sync(peer);
+	if(argc > 4){
+		peer.loop.post([&](){
+			for(int i = 4;i < argc;i++){
+				Connection* c = peer.server.connect("127.0.0.1",atoi(argv[i]));
+				if(c)
+					sync.addSource(c->id());
+			}
+			sync.onDone = [&](int status){
+				SyncStats s = sync.stats();
+				log((status == SYNC_DONE ? "Synced " : "Sync failed after ") << s.blocks << " blocks in " << s.seconds << " s, " << s.blocksPerSecond << " blocks/s " << s.megabytesPerSecond << " MB/s");
+			};
+			sync.start();
+		});
+	}
+	peer.run();
+	return 0;
+}
@@ -0,0 +1,58 @@
+#include <iostream>
+#include <cstdlib>
+#include "src/sim.hpp"
+
+#define log(x) std::cout << x << std::endl;
+
+// simexec [nodes] [outbound links per node] [latency ms] [bandwidth bytes/s] [loss] [seed] [transactions]
+// Spreads the transactions from random nodes, then a block holding all of
+// them from node 0, and prints propagation and bandwidth figures.
+int main(int argc,char** argv){
+	size_t n = argc > 1 ? atoi(argv[1]) : 1000;
+	size_t outbound = argc > 2 ? atoi(argv[2]) : 4;
+	uint32_t latency = argc > 3 ? atoi(argv[3]) : 50;
+	uint64_t bandwidth = argc > 4 ? atoll(argv[4]) : 1000000;
+	double loss = argc > 5 ? atof(argv[5]) : 0;
+	uint64_t seed = argc > 6 ? atoll(argv[6]) : 1;
+	size_t txs = argc > 7 ? atoi(argv[7]) : 100;
+
+	Simulator sim(seed);
+	std::mt19937_64 random(seed);
+	sim.addNodes(n);
+	sim.connectRandom(outbound,SimLinkConfig{latency,bandwidth,loss},latency);
+	Digest none;
+	none.fill(0);
+	BlockData block;
+	block.header = Block(0,Digest(),none,1000);
+	for(size_t i = 0;i < txs;i++){
+		Digest secret;
+		uint64_t k = i + 1;
+		secret.fill(0);
+		memcpy(secret.data(),&k,sizeof k);
+		KeyPair keys = keyPairFromSeed(secret);
+		Transaction tx;
+		tx.from = keys.publicKey;
+		tx.to = keys.publicKey;
+		tx.amount = 0;
+		tx.nonce = 0;
+		tx.timestamp = 1000;
+		tx.kind = TX_REGISTER;
+		signTransaction(tx,keys);
+		block.txs.push_back(tx);
+		sim.track(random() % n,tx);
+		sim.run(10);
+	}
+	sim.runUntilIdle(600000);
+	seal(block);
+	sim.mine(0,block);
+	sim.runUntilIdle(600000);
+
+	size_t synced = 0;
+	for(size_t i = 0;i < n;i++)
+		synced += sim.node(i).chain.size() == 1;
+	SimStats s = sim.stats();
+	log("nodes,links per node,latency ms,bandwidth,loss,seed,items,coverage,p50 ms,p90 ms,p99 ms,max ms,bytes per node,max bytes per node,segments,resent,virtual s,wall s,events");
+	log(n << "," << outbound << "," << latency << "," << bandwidth << "," << loss << "," << seed << "," << s.items << "," << s.coverage << "," << s.p50Ms << "," << s.p90Ms << "," << s.p99Ms << "," << s.maxMs << "," << s.bytesPerNode << "," << s.maxBytesPerNode << "," << s.segments << "," << s.lost << "," << s.seconds << "," << s.wallSeconds << "," << s.events);
+	log(synced << " of " << n << " nodes have the block");
+	return synced == n ? 0 : 1;
+}
@@ -0,0 +1,362 @@
+#ifndef ACCOUNTS_HPP
+#define ACCOUNTS_HPP
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <optional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include "transaction.hpp"
+
+#define ACCOUNT_SHARDS 256          // one per value of the key byte after the ones the slots hash
+#define ACCOUNT_SHARD_SLOTS 64      // slots of an empty shard
+#define ACCOUNT_PARALLEL_BATCH 4096 // changes from which a batch is written on all cores
+
+// Key and account, the fixed-width record of snapshots and spilled accounts.
+struct SnapshotEntry{
+	Digest key;
+	Account account;
+};
+
+// The new value of one account, nullopt removes it.
+typedef std::pair<Digest,std::optional<Account>> AccountChange;
+
+// Accounts by key, split into shards by one byte of the key. Every shard
+// is an open-addressing table of fixed-width slots with its own lock, so
+// a batch of changes is sorted by shard and written by all cores at once,
+// each shard by one thread. Changes of the same key keep their order.
+// With a directory opened, spill() moves the accounts of a shard that
+// were written longest ago to a file of records sorted by key, mapped and
+// searched in place; a later write puts the account back into memory
+// ahead of its spilled copy, a removal leaves a tombstone over it. The
+// files are a cache of the table and start over on open().
+// find() is for the thread that writes, get() copies under the shard lock
+// from any thread.
+class AccountTable{
+	private:
+		static const uint8_t SLOT_EMPTY = 0;
+		static const uint8_t SLOT_LIVE = 1;
+		static const uint8_t SLOT_GONE = 2; // removed, hides a spilled copy
+		struct Slot{
+			Digest key;
+			Account account;
+			uint32_t touched; // batch of the last write
+			uint8_t state;
+		};
+		struct Shard{
+			std::vector<Slot> slots;      // a power of two, at most half used
+			size_t used;                  // live and gone slots
+			size_t live;
+			size_t count;                 // accounts, in memory or spilled
+			const SnapshotEntry* cold;    // spilled accounts sorted by key
+			size_t coldCount;
+			mutable std::mutex lock;
+		};
+		std::unique_ptr<Shard[]> shards;
+		std::string dir;
+		uint32_t clock;
+
+		static size_t shardOf(const Digest& key){ return key[sizeof(size_t)]; }
+		static Slot* probe(const Shard& s,const Digest& key);
+		static const SnapshotEntry* findCold(const Shard& s,const Digest& key);
+		static void rebuild(Shard& s);
+		static void unmapCold(Shard& s);
+		void write(Shard& s,const AccountChange& change);
+		size_t spillShard(size_t shard,size_t keep);
+		std::string coldName(size_t shard) const;
+	public:
+		AccountTable();
+		~AccountTable();
+		AccountTable(const AccountTable&) = delete;
+		AccountTable& operator=(const AccountTable&) = delete;
+
+		bool open(const std::string& directory);
+		const Account* find(const Digest& key) const;
+		bool get(const Digest& key,Account& account) const;
+		void update(const AccountChange* changes,size_t n);
+		void update(const std::vector<AccountChange>& changes){ update(changes.data(),changes.size()); }
+		size_t spill(size_t resident);
+		template<class F> void forEach(F f) const;
+		void clear();
+		size_t size() const;
+		size_t resident() const;
+};
+
+inline AccountTable::AccountTable() : shards(new Shard[ACCOUNT_SHARDS]){
+	clock = 0;
+	for(size_t i = 0;i < ACCOUNT_SHARDS;i++){
+		shards[i].cold = nullptr;
+		shards[i].coldCount = 0;
+	}
+	clear();
+}
+
+inline AccountTable::~AccountTable(){
+	for(size_t i = 0;i < ACCOUNT_SHARDS;i++)
+		unmapCold(shards[i]);
+}
+
+// Spilled accounts go to directory, the table starts empty.
+inline bool AccountTable::open(const std::string& directory){
+	clear();
+	mkdir(directory.c_str(),0755);
+	struct stat st;
+	if(stat(directory.c_str(),&st) != 0 || !S_ISDIR(st.st_mode))
+		return false;
+	dir = directory;
+	return true;
+}
+
+inline std::string AccountTable::coldName(size_t shard) const {
+	char name[32];
+	snprintf(name,sizeof name,"/shard-%03zu.dat",shard);
+	return dir + name;
+}
+
+// Linear probing, returns the slot holding key or the empty slot where it would go.
+inline AccountTable::Slot* AccountTable::probe(const Shard& s,const Digest& key){
+	size_t mask = s.slots.size() - 1;
+	for(size_t i = DigestHash()(key) & mask;;i = (i + 1) & mask){
+		const Slot& slot = s.slots[i];
+		if(slot.state == SLOT_EMPTY || slot.key == key)
+			return const_cast<Slot*>(&slot);
+	}
+}
+
+inline const SnapshotEntry* AccountTable::findCold(const Shard& s,const Digest& key){
+	const SnapshotEntry* end = s.cold + s.coldCount;
+	const SnapshotEntry* e = std::lower_bound(s.cold,end,key,[](const SnapshotEntry& x,const Digest& k){ return x.key < k; });
+	return e != end && e->key == key ? e : nullptr;
+}
+
+// Valid until the next change.
+inline const Account* AccountTable::find(const Digest& key) const {
+	const Shard& s = shards[shardOf(key)];
+	const Slot* slot = probe(s,key);
+	if(slot->state == SLOT_LIVE)
+		return &slot->account;
+	if(slot->state == SLOT_GONE)
+		return nullptr;
+	const SnapshotEntry* e = findCold(s,key);
+	return e ? &e->account : nullptr;
+}
+
+inline bool AccountTable::get(const Digest& key,Account& account) const {
+	std::lock_guard<std::mutex> guard(shards[shardOf(key)].lock);
+	const Account* a = find(key);
+	if(a)
+		account = *a;
+	return a != nullptr;
+}
+
+// Sizes the table for the live slots and the tombstones still hiding a
+// spilled copy, everything else is dropped.
+inline void AccountTable::rebuild(Shard& s){
+	std::vector<Slot> kept;
+	for(const Slot& slot : s.slots)
+		if(slot.state == SLOT_LIVE || (slot.state == SLOT_GONE && findCold(s,slot.key)))
+			kept.push_back(slot);
+	size_t n = ACCOUNT_SHARD_SLOTS;
+	while((kept.size() + 1) * 4 > n)
+		n *= 2;
+	s.slots.assign(n,Slot());
+	s.live = 0;
+	for(const Slot& slot : kept){
+		*probe(s,slot.key) = slot;
+		s.live += slot.state == SLOT_LIVE;
+	}
+	s.used = kept.size();
+}
+
+inline void AccountTable::write(Shard& s,const AccountChange& change){
+	if((s.used + 1) * 2 > s.slots.size())
+		rebuild(s);
+	const Digest& key = change.first;
+	Slot* slot = probe(s,key);
+	bool had = slot->state == SLOT_LIVE || (slot->state == SLOT_EMPTY && findCold(s,key));
+	if(change.second){
+		s.used += slot->state == SLOT_EMPTY;
+		s.live += slot->state != SLOT_LIVE;
+		s.count += !had;
+		slot->key = key;
+		slot->account = *change.second;
+		slot->touched = clock;
+		slot->state = SLOT_LIVE;
+	}
+	else if(had){
+		s.used += slot->state == SLOT_EMPTY;
+		s.live -= slot->state == SLOT_LIVE;
+		s.count--;
+		slot->key = key;
+		slot->state = SLOT_GONE;
+	}
+}
+
+// Writes a batch of changes, on all cores if it is large.
+inline void AccountTable::update(const AccountChange* changes,size_t n){
+	clock++;
+	if(n < ACCOUNT_PARALLEL_BATCH){
+		for(size_t i = 0;i < n;i++){
+			Shard& s = shards[shardOf(changes[i].first)];
+			std::lock_guard<std::mutex> guard(s.lock);
+			write(s,changes[i]);
+		}
+		return;
+	}
+	// counting sort by shard, stable so changes of a key stay in order
+	std::vector<size_t> starts(ACCOUNT_SHARDS + 1,0);
+	for(size_t i = 0;i < n;i++)
+		starts[shardOf(changes[i].first) + 1]++;
+	for(size_t i = 0;i < ACCOUNT_SHARDS;i++)
+		starts[i + 1] += starts[i];
+	std::vector<size_t> next(starts.begin(),starts.end() - 1);
+	std::vector<uint32_t> order(n);
+	for(size_t i = 0;i < n;i++)
+		order[next[shardOf(changes[i].first)]++] = i;
+	unsigned threads = std::min<unsigned>(ACCOUNT_SHARDS,std::max(1u,std::thread::hardware_concurrency()));
+	auto writeShards = [&](unsigned t){
+		for(size_t i = t;i < ACCOUNT_SHARDS;i += threads){
+			std::lock_guard<std::mutex> guard(shards[i].lock);
+			for(size_t k = starts[i];k < starts[i + 1];k++)
+				write(shards[i],changes[order[k]]);
+		}
+	};
+	std::vector<std::thread> workers;
+	for(unsigned t = 1;t < threads;t++)
+		workers.emplace_back(writeShards,t);
+	writeShards(0);
+	for(std::thread& w : workers)
+		w.join();
+}
+
+inline void AccountTable::unmapCold(Shard& s){
+	if(s.cold)
+		munmap((void*)s.cold,s.coldCount * sizeof(SnapshotEntry));
+	s.cold = nullptr;
+	s.coldCount = 0;
+}
+
+// Moves the accounts of the shard written longest ago into its file until
+// keep are left in memory. The file is rewritten merged with what it held.
+inline size_t AccountTable::spillShard(size_t shard,size_t keep){
+	Shard& s = shards[shard];
+	std::lock_guard<std::mutex> guard(s.lock);
+	if(s.live <= keep)
+		return 0;
+	std::vector<Slot*> live;
+	live.reserve(s.live);
+	for(Slot& slot : s.slots)
+		if(slot.state == SLOT_LIVE)
+			live.push_back(&slot);
+	size_t n = live.size() - keep;
+	std::nth_element(live.begin(),live.begin() + n,live.end(),[](const Slot* x,const Slot* y){ return x->touched < y->touched; });
+	std::vector<SnapshotEntry> out(n);
+	for(size_t i = 0;i < n;i++)
+		out[i] = SnapshotEntry{live[i]->key,live[i]->account};
+	std::sort(out.begin(),out.end(),[](const SnapshotEntry& x,const SnapshotEntry& y){ return x.key < y.key; });
+	// spilled copies that memory holds a newer version of, or a tombstone, are dropped
+	std::vector<SnapshotEntry> merged;
+	merged.reserve(out.size() + s.coldCount);
+	size_t j = 0;
+	for(size_t i = 0;i < s.coldCount;i++){
+		const SnapshotEntry& e = s.cold[i];
+		if(probe(s,e.key)->state != SLOT_EMPTY)
+			continue;
+		for(;j < out.size() && out[j].key < e.key;j++)
+			merged.push_back(out[j]);
+		merged.push_back(e);
+	}
+	merged.insert(merged.end(),out.begin() + j,out.end());
+	std::string name = coldName(shard);
+	std::string tmp = name + ".tmp";
+	int fd = ::open(tmp.c_str(),O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,0644);
+	if(fd < 0)
+		return 0;
+	size_t bytes = merged.size() * sizeof(SnapshotEntry);
+	bool ok = true;
+	for(size_t at = 0;ok && at < bytes;){
+		ssize_t w = ::write(fd,(const uint8_t*)merged.data() + at,bytes - at);
+		ok = w > 0;
+		at += ok ? w : 0;
+	}
+	void* map = ok ? mmap(nullptr,bytes,PROT_READ,MAP_SHARED,fd,0) : MAP_FAILED;
+	::close(fd);
+	if(map == MAP_FAILED || rename(tmp.c_str(),name.c_str()) != 0){
+		if(map != MAP_FAILED)
+			munmap(map,bytes);
+		unlink(tmp.c_str());
+		return 0;
+	}
+	unmapCold(s);
+	s.cold = (const SnapshotEntry*)map;
+	s.coldCount = merged.size();
+	for(size_t i = 0;i < n;i++)
+		live[i]->state = SLOT_EMPTY;
+	rebuild(s);
+	return n;
+}
+
+// With more than resident accounts in memory, every shard above its share
+// spills down to half of it, so the next spill is some way off. Returns the
+// accounts spilled, none without a directory.
+inline size_t AccountTable::spill(size_t resident){
+	if(dir.empty() || this->resident() <= resident)
+		return 0;
+	size_t share = resident / ACCOUNT_SHARDS;
+	size_t spilled = 0;
+	for(size_t i = 0;i < ACCOUNT_SHARDS;i++)
+		if(shards[i].live > share)
+			spilled += spillShard(i,share / 2);
+	return spilled;
+}
+
+// f(key,account) for every account, in no particular order.
+template<class F> void AccountTable::forEach(F f) const {
+	for(size_t i = 0;i < ACCOUNT_SHARDS;i++){
+		const Shard& s = shards[i];
+		for(const Slot& slot : s.slots)
+			if(slot.state == SLOT_LIVE)
+				f(slot.key,slot.account);
+		for(size_t k = 0;k < s.coldCount;k++)
+			if(probe(s,s.cold[k].key)->state == SLOT_EMPTY)
+				f(s.cold[k].key,s.cold[k].account);
+	}
+}
+
+inline void AccountTable::clear(){
+	for(size_t i = 0;i < ACCOUNT_SHARDS;i++){
+		Shard& s = shards[i];
+		std::lock_guard<std::mutex> guard(s.lock);
+		unmapCold(s);
+		s.slots.assign(ACCOUNT_SHARD_SLOTS,Slot());
+		s.used = 0;
+		s.live = 0;
+		s.count = 0;
+	}
+}
+
+inline size_t AccountTable::size() const {
+	size_t n = 0;
+	for(size_t i = 0;i < ACCOUNT_SHARDS;i++)
+		n += shards[i].count;
+	return n;
+}
+
+// Accounts held in memory.
+inline size_t AccountTable::resident() const {
+	size_t n = 0;
+	for(size_t i = 0;i < ACCOUNT_SHARDS;i++)
+		n += shards[i].live;
+	return n;
+}
+
+#endif
@@ -1,23 +1,149 @@
+#ifndef BLOCKCHAIN_HPP
+#define BLOCKCHAIN_HPP
+
 #include <iostream>
 #include <ctime>
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <vector>
+#include <unordered_map>
+#include "crypt.hpp"
+
+#define CHAIN_VALID 0
+#define CHAIN_BAD_LINK -1
+#define CHAIN_BAD_TIMESTAMP -2
+#define CHAIN_DUPLICATE -3
+
+#define BLOCKS_PER_CHUNK 4096 // headers per contiguous arena chunk
 
+// Fixed-size block header. It owns its digests, so it can be copied into
+// the arena and outlives whatever buffer it was built from.
 class Block{
-	private:
-		static long long int order;
 	public:
-		int size;
-		char* hash;
-		char* phash;
-		std::time_t timestamp;
-		void getDetails(){
-			std::cout << "Hash : " << hash << " <|> Previous Hash : " << phash << " <|> Timestamp : " << timestamp << " <|> Block Hash Size : " << size << std::endl; 
+		uint32_t version;
+		uint32_t size;
+		uint64_t height;
+		int64_t timestamp;
+		Digest hash;
+		Digest phash;
+		Digest root;
+		Digest state; // account state after this block, all zero if the block does not commit to it
+		void getDetails() const {
+			std::cout << "Hash : " << toHex(hash) << " <|> Previous Hash : " << toHex(phash) << " <|> Timestamp : " << timestamp << " <|> Block Hash Size : " << size << std::endl;
+		}
+		// Everything in the header except the hash itself.
+		Digest computeHash() const {
+			return threadHasher().updateValue(version).updateValue(size).updateValue(timestamp).update(phash).update(root).update(state).final();
 		}
-		Block(int,char*,char*,std::time_t);
+		Block();
+		Block(int,const Digest&,const Digest&,std::time_t);
 };
 
-Block::Block(int s,char* h,char* ph,std::time_t ts){
+inline Block::Block(){
+	this->version = 1;
+	this->size = 0;
+	this->height = 0;
+	this->timestamp = 0;
+	this->hash.fill(0);
+	this->phash.fill(0);
+	this->root.fill(0);
+	this->state.fill(0);
+}
+
+inline Block::Block(int s,const Digest& h,const Digest& ph,std::time_t ts){
+	this->version = 1;
 	this->size = s;
+	this->height = 0;
+	this->timestamp = ts;
 	this->hash = h;
 	this->phash = ph;
-	this->timestamp = ts;
-}
\ No newline at end of file
+	this->root.fill(0);
+	this->state.fill(0);
+}
+
+// Chain of block headers, appended to at the tip and cut back from it
+// when the node switches branches.
+// Headers live in fixed-size contiguous chunks, so appending never moves
+// existing blocks and a validation pass walks memory linearly.
+class Blockchain{
+	private:
+		std::vector<Block*> chunks;
+		uint64_t count;
+		std::unordered_map<Digest,uint64_t,DigestHash> index;
+	public:
+		Blockchain();
+		~Blockchain();
+		Blockchain(const Blockchain&) = delete;
+		Blockchain& operator=(const Blockchain&) = delete;
+
+		int64_t append(const Block& block);
+		void truncate(uint64_t height);
+		int validate(uint64_t from = 0,uint64_t* bad = nullptr) const;
+		const Block* find(const Digest& hash) const;
+		const Block& at(uint64_t height) const { return chunks[height / BLOCKS_PER_CHUNK][height % BLOCKS_PER_CHUNK]; }
+		const Block& tip() const { return at(count - 1); }
+		uint64_t size() const { return count; }
+		bool empty() const { return count == 0; }
+};
+
+inline Blockchain::Blockchain(){
+	this->count = 0;
+}
+
+inline Blockchain::~Blockchain(){
+	for(Block* chunk : chunks)
+		delete[] chunk;
+}
+
+// Returns the height of the new block or CHAIN_DUPLICATE. Linkage is checked by validate().
+inline int64_t Blockchain::append(const Block& block){
+	if(index.count(block.hash))
+		return CHAIN_DUPLICATE;
+	if(count / BLOCKS_PER_CHUNK == chunks.size())
+		chunks.push_back(new Block[BLOCKS_PER_CHUNK]);
+	Block& b = chunks[count / BLOCKS_PER_CHUNK][count % BLOCKS_PER_CHUNK];
+	b = block;
+	b.height = count;
+	index.emplace(b.hash,count);
+	return count++;
+}
+
+// Drops the blocks from height on. The chunks stay for the next appends.
+inline void Blockchain::truncate(uint64_t height){
+	while(count > height){
+		count--;
+		index.erase(at(count).hash);
+	}
+}
+
+inline const Block* Blockchain::find(const Digest& hash) const {
+	auto it = index.find(hash);
+	if(it == index.end())
+		return nullptr;
+	return &at(it->second);
+}
+
+// One linear pass over the arena: every block must point to its predecessor
+// and must not be older than it. The height of the first bad block goes to *bad.
+inline int Blockchain::validate(uint64_t from,uint64_t* bad) const {
+	if(from == 0)
+		from = 1;
+	for(uint64_t i = from;i < count;i++){
+		const Block& prev = at(i - 1);
+		const Block& b = at(i);
+		int rc = CHAIN_VALID;
+		if(b.phash != prev.hash)
+			rc = CHAIN_BAD_LINK;
+		else if(b.timestamp < prev.timestamp)
+			rc = CHAIN_BAD_TIMESTAMP;
+		if(rc != CHAIN_VALID){
+			if(bad)
+				*bad = i;
+			return rc;
+		}
+	}
+	return CHAIN_VALID;
+}
+
+#endif
@@ -1,19 +1,134 @@
-#include <iostream>
-#include <openssl/md5.h>
-#include <stdio.h>
-#include <string.h>
+#ifndef CRYPT_HPP
+#define CRYPT_HPP
 
-void hash(char* st,int size,char* ms);
+#include <openssl/evp.h>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <array>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdexcept>
+#include "verify.hpp"
 
-void hash(char* st,int size,char* ms){
+// Digests are already uniformly distributed, the first word is a good bucket hash.
+struct DigestHash{
+	size_t operator()(const Digest& d) const {
+		size_t h;
+		memcpy(&h,d.data(),sizeof h);
+		return h;
+	}
+};
 
-		unsigned char digest[MD5_DIGEST_LENGTH];
+// A view on bytes owned by somebody else, nothing is copied.
+struct Bytes{
+	const void* data;
+	size_t size;
+	Bytes() : data(nullptr),size(0) {}
+	Bytes(const void* d,size_t s) : data(d),size(s) {}
+	Bytes(const std::string& s) : data(s.data()),size(s.size()) {}
+	Bytes(const Digest& d) : data(d.data()),size(d.size()) {}
+};
 
-		char str[size] = {*st};
+// SHA-256 is fetched once, so EVP does not look it up again for every message.
+inline const EVP_MD* sha256Md(){
+	static const EVP_MD* md = EVP_MD_fetch(nullptr,"SHA256",nullptr);
+	return md;
+}
 
-		MD5((unsigned char*)&str,strlen(str),(unsigned char*)&digest);		
+// Incremental SHA-256. One context is allocated per Hasher and reused
+// after every final(), so hashing a message never allocates.
+class Hasher{
+	private:
+		EVP_MD_CTX* ctx;
+	public:
+		Hasher(){
+			ctx = EVP_MD_CTX_new();
+			if(!ctx || !EVP_DigestInit_ex(ctx,sha256Md(),nullptr))
+				throw std::runtime_error("sha256 not available");
+		}
+		~Hasher(){
+			EVP_MD_CTX_free(ctx);
+		}
+		Hasher(const Hasher&) = delete;
+		Hasher& operator=(const Hasher&) = delete;
 
-		for (int i =0;i<16;i++){
-				sprintf(&ms[i*2],"%02x",(unsigned int)digest[i]);
+		Hasher& update(const void* data,size_t size){
+			EVP_DigestUpdate(ctx,data,size);
+			return *this;
+		}
+		Hasher& update(Bytes b){
+			return update(b.data,b.size);
+		}
+		template<class T> Hasher& updateValue(const T& value){
+			return update(&value,sizeof value);
 		}
-}
\ No newline at end of file
+		// Writes the digest and starts over for the next message.
+		Digest final(){
+			Digest d;
+			EVP_DigestFinal_ex(ctx,d.data(),nullptr);
+			EVP_DigestInit_ex(ctx,nullptr,nullptr);
+			return d;
+		}
+};
+
+inline Hasher& threadHasher(){
+	static thread_local Hasher hasher;
+	return hasher;
+}
+
+inline Digest sha256(const void* data,size_t size){
+	return threadHasher().update(data,size).final();
+}
+
+inline Digest sha256(Bytes b){
+	return sha256(b.data,b.size);
+}
+
+// Hashes many independent messages at once. Each thread reuses one context
+// for its share of the messages; out must hold n digests.
+inline void hashMany(const Bytes* messages,size_t n,Digest* out,unsigned threads = 1){
+	if(threads <= 1 || n < threads * 64){
+		Hasher& h = threadHasher();
+		for(size_t i = 0;i < n;i++)
+			out[i] = h.update(messages[i]).final();
+		return;
+	}
+	std::vector<std::thread> workers;
+	size_t chunk = (n + threads - 1) / threads;
+	for(unsigned t = 0;t < threads;t++){
+		size_t from = t * chunk;
+		size_t to = std::min(n,from + chunk);
+		if(from >= to)
+			break;
+		workers.emplace_back([=](){ hashMany(messages + from,to - from,out + from,1); });
+	}
+	for(std::thread& w : workers)
+		w.join();
+}
+
+// Table based hex encoding, two characters per byte without any formatting calls.
+inline void toHex(const unsigned char* in,size_t size,char* out){
+	static const char digits[] = "0123456789abcdef";
+	static const struct Table{
+		char pairs[512];
+		Table(){
+			for(int i = 0;i < 256;i++){
+				pairs[i * 2] = digits[i >> 4];
+				pairs[i * 2 + 1] = digits[i & 15];
+			}
+		}
+	} table;
+	for(size_t i = 0;i < size;i++)
+		memcpy(out + i * 2,table.pairs + in[i] * 2,2);
+	out[size * 2] = 0;
+}
+
+inline std::string toHex(const Digest& d){
+	char out[65];
+	toHex(d.data(),d.size(),out);
+	return std::string(out,64);
+}
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef FORKS_HPP
+#define FORKS_HPP
+
+#include <map>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include "blockchain.hpp"
+#include "state.hpp"
+
+// Results of ForkChoice::add()
+#define FORK_EXTENDED 0 // the block is the new tip
+#define FORK_SIDE 1     // kept on a branch that is not longer than the chain
+#define FORK_REORG 2    // its branch is longer, the chain switched over to it
+#define FORK_ORPHAN 3   // parent not known yet
+#define FORK_KNOWN 4    // already on the chain or a branch
+#define FORK_INVALID -1 // it or a block below it on its branch fails the state transition or could not be persisted
+#define FORK_FINAL -2   // branches off below the blocks that can still be undone
+
+#define FORK_WINDOW 2048 // blocks below the tip that can still be switched away from
+
+// Fork choice over the blocks the node knows: the chain, which the state
+// is at the tip of, and the branches off it. The ledger has no proof of
+// work, so the longest branch wins and of equally long ones the first
+// stays. Every block on the chain keeps its undo record, so switching to a
+// branch that forks off d blocks below the tip undoes d blocks and applies
+// the branch, whatever the length of the chain or the size of the state.
+// A branch block that fails is marked invalid and the old chain is put
+// back. Blocks more than the window below the tip are final, their undo
+// records and bodies are dropped together with the branches below them.
+class ForkChoice{
+	private:
+		struct Node{
+			std::shared_ptr<BlockData> block;
+			uint64_t height;
+			Undo undo; // while on the chain
+			bool onChain;
+			bool invalid;
+		};
+		std::unordered_map<Digest,Node,DigestHash> nodes;
+		std::map<uint64_t,std::vector<Digest>> heights; // the nodes by height, for pruning
+		std::vector<std::shared_ptr<BlockData>> added;
+		std::vector<std::shared_ptr<BlockData>> removed;
+		uint64_t window;
+		bool connect(Node& node);
+		void disconnect();
+		int reorganize(Node& node);
+		void prune();
+	public:
+		Blockchain& chain;
+		State& state;
+		std::function<bool(const BlockData&)> persist; // before a block joins the chain, false refuses it
+
+		ForkChoice(Blockchain& c,State& s,uint64_t w = FORK_WINDOW) : window(w),chain(c),state(s) {}
+		ForkChoice(const ForkChoice&) = delete;
+		ForkChoice& operator=(const ForkChoice&) = delete;
+
+		int add(const std::shared_ptr<BlockData>& block);
+		bool contains(const Digest& hash) const;
+		size_t size() const { return nodes.size(); }
+		// Lowest height that can still be switched away from.
+		uint64_t horizon() const { return chain.size() > window ? chain.size() - window : 0; }
+		// What the last add() put on the chain, from the bottom up, and took off it, from the tip down.
+		const std::vector<std::shared_ptr<BlockData>>& connected() const { return added; }
+		const std::vector<std::shared_ptr<BlockData>>& disconnected() const { return removed; }
+};
+
+// On the chain or on a branch that is not known to be invalid.
+inline bool ForkChoice::contains(const Digest& hash) const {
+	auto it = nodes.find(hash);
+	if(it != nodes.end())
+		return !it->second.invalid;
+	return chain.find(hash) != nullptr;
+}
+
+inline bool ForkChoice::connect(Node& node){
+	if(state.apply(*node.block,node.undo) != STATE_OK)
+		return false;
+	if(persist && !persist(*node.block)){
+		state.undo(node.undo);
+		node.undo.clear();
+		return false;
+	}
+	chain.append(node.block->header);
+	node.onChain = true;
+	added.push_back(node.block);
+	return true;
+}
+
+// Takes the tip off the chain, it has to have a node.
+inline void ForkChoice::disconnect(){
+	Node& node = nodes.at(chain.tip().hash);
+	state.undo(node.undo);
+	node.undo.clear();
+	node.onChain = false;
+	chain.truncate(chain.size() - 1);
+	removed.push_back(node.block);
+}
+
+inline int ForkChoice::add(const std::shared_ptr<BlockData>& block){
+	added.clear();
+	removed.clear();
+	const Block& header = block->header;
+	auto known = nodes.find(header.hash);
+	if(known != nodes.end())
+		return known->second.invalid ? FORK_INVALID : FORK_KNOWN;
+	if(chain.find(header.hash))
+		return FORK_KNOWN;
+	Digest none;
+	none.fill(0);
+	uint64_t height = 0;
+	bool invalid = false;
+	auto parent = nodes.find(header.phash);
+	if(header.phash == none)
+		height = 0;
+	else if(parent != nodes.end()){
+		height = parent->second.height + 1;
+		invalid = parent->second.invalid || header.timestamp < parent->second.block->header.timestamp;
+	}
+	// a final tip, right after a restart or with a window of 0
+	else if(!chain.empty() && header.phash == chain.tip().hash){
+		height = chain.size();
+		invalid = header.timestamp < chain.tip().timestamp;
+	}
+	else if(chain.find(header.phash))
+		return FORK_FINAL;
+	else
+		return FORK_ORPHAN;
+	Node& node = nodes.emplace(header.hash,Node{block,height,Undo(),false,invalid}).first->second;
+	heights[height].push_back(header.hash);
+	if(invalid)
+		return FORK_INVALID;
+	// no more blocks than the chain
+	if(height < chain.size())
+		return FORK_SIDE;
+	if(height == chain.size() && (chain.empty() ? header.phash == none : header.phash == chain.tip().hash)){
+		if(!connect(node)){
+			node.invalid = true;
+			return FORK_INVALID;
+		}
+		prune();
+		return FORK_EXTENDED;
+	}
+	return reorganize(node);
+}
+
+// Switches the chain to the branch ending in node, which is longer.
+inline int ForkChoice::reorganize(Node& node){
+	Digest none;
+	none.fill(0);
+	std::vector<Node*> branch;
+	for(Node* n = &node;;){
+		if(n->invalid){
+			node.invalid = true;
+			return FORK_INVALID;
+		}
+		branch.push_back(n);
+		const Digest& phash = n->block->header.phash;
+		if(phash == none)
+			break;
+		auto it = nodes.find(phash);
+		if(it == nodes.end()){
+			// the bottom of the branch was pruned
+			if(!chain.find(phash))
+				return FORK_FINAL;
+			break;
+		}
+		if(it->second.onChain)
+			break;
+		n = &it->second;
+	}
+	uint64_t fork = branch.back()->height;
+	if(fork < chain.size() && !nodes.count(chain.at(fork).hash))
+		return FORK_FINAL;
+	while(chain.size() > fork)
+		disconnect();
+	size_t old = removed.size();
+	for(auto it = branch.rbegin();it != branch.rend();++it){
+		if(connect(**it))
+			continue;
+		(*it)->invalid = true;
+		// back to the old chain, which applied before
+		while(chain.size() > fork)
+			disconnect();
+		for(size_t i = old;i-- > 0;)
+			connect(nodes.at(removed[i]->header.hash));
+		added.clear();
+		removed.clear();
+		node.invalid = true;
+		return FORK_INVALID;
+	}
+	prune();
+	return FORK_REORG;
+}
+
+// Forgets everything more than the window below the tip.
+inline void ForkChoice::prune(){
+	if(chain.size() <= window)
+		return;
+	uint64_t bottom = chain.size() - window;
+	while(!heights.empty() && heights.begin()->first < bottom){
+		for(const Digest& hash : heights.begin()->second)
+			nodes.erase(hash);
+		heights.erase(heights.begin());
+	}
+}
+
+#endif
@@ -0,0 +1,670 @@
+#ifndef GOSSIP_HPP
+#define GOSSIP_HPP
+
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <random>
+#include <optional>
+#include <unordered_map>
+#include "blockchain.hpp"
+#include "net.hpp"
+#include "mempool.hpp"
+#include "sign.hpp"
+#include "store.hpp"
+#include "protocol.hpp"
+
+#define INV_TX 1
+#define INV_BLOCK 2     // answered with MSG_BLOCK
+#define INV_COMPACT 3   // answered with MSG_COMPACT, only in MSG_GET_DATA
+
+#define INV_ITEM_SIZE 33           // type byte and hash
+#define SHORT_ID_BYTES 6
+#define GOSSIP_BATCH 1000          // items per MSG_INV
+#define GOSSIP_FLUSH_MS 25         // announcements wait this long to be batched
+#define GOSSIP_REQUEST_MS 1000     // until an item is asked from the next announcer
+#define GOSSIP_FILTER_ITEMS 50000  // announcements remembered per connection, at least half of them
+#define GOSSIP_FILTER_HASHES 20    // about one false positive in a million
+#define GOSSIP_RECENT_BLOCKS 64    // linked blocks kept, with their frames, to answer block requests
+#define GOSSIP_PARTIALS 8          // compact blocks being filled in at once
+#define GOSSIP_PARTIALS_PER_PEER 2 // of them from one connection
+#define GOSSIP_COMPACT_TXS ((FRAME_MAX - 1 - WIRE_PREFIX - WIRE_HEADER_SIZE) / WIRE_TX_SIZE) // more would not fit the full block
+
+struct GossipStats{
+	uint64_t announced;      // items put into MSG_INV
+	uint64_t requested;      // items asked for with MSG_GET_DATA
+	uint64_t transactions;   // new transactions admitted from the network
+	uint64_t compactBlocks;  // blocks rebuilt from a compact block
+	uint64_t missing;        // transactions fetched to complete them
+	uint64_t fullBlocks;     // compact blocks that did not add up and were fetched whole
+};
+
+// Source of filter seeds and compact block nonces. The simulator seeds it
+// so that runs repeat exactly.
+inline std::mt19937_64& gossipRandom(){
+	static thread_local std::mt19937_64 random(std::random_device{}());
+	return random;
+}
+
+// Bloom filter over the last items inserted: two generations of half the
+// capacity each, the older one is dropped when the current one is full.
+// Every filter has its own seeds, so false positives differ per connection.
+class RollingBloom{
+	private:
+		std::vector<uint64_t> bits[2];
+		size_t m;
+		unsigned k;
+		size_t half;
+		size_t inserted;
+		int current;
+		uint64_t seed0;
+		uint64_t seed1;
+		void hashes(const Digest& d,uint64_t& h0,uint64_t& h1) const;
+		bool test(const std::vector<uint64_t>& b,uint64_t h0,uint64_t h1) const;
+	public:
+		explicit RollingBloom(size_t items = GOSSIP_FILTER_ITEMS,unsigned hashes = GOSSIP_FILTER_HASHES);
+		void insert(const Digest& d);
+		bool contains(const Digest& d) const;
+};
+
+inline RollingBloom::RollingBloom(size_t items,unsigned hashes){
+	half = std::max<size_t>(1,items / 2);
+	k = hashes ? hashes : 1;
+	// optimal size for k hashes: n * k / ln 2 bits
+	m = std::max<size_t>(64,(size_t)(half * k / std::log(2.0)));
+	m = (m + 63) / 64 * 64;
+	bits[0].assign(m / 64,0);
+	bits[1].assign(m / 64,0);
+	inserted = 0;
+	current = 0;
+	seed0 = gossipRandom()();
+	seed1 = gossipRandom()();
+}
+
+// Two seeded hashes over the whole digest for double hashing, mixed so
+// that digests differing in one word still spread.
+inline void RollingBloom::hashes(const Digest& d,uint64_t& h0,uint64_t& h1) const {
+	auto mix = [](uint64_t x){
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		return x ^ (x >> 31);
+	};
+	uint64_t w[4];
+	memcpy(w,d.data(),sizeof w);
+	h0 = mix(w[0] ^ w[2] ^ seed0);
+	h1 = mix(w[1] ^ w[3] ^ seed1 ^ h0) | 1;
+}
+
+inline bool RollingBloom::test(const std::vector<uint64_t>& b,uint64_t h0,uint64_t h1) const {
+	for(unsigned i = 0;i < k;i++){
+		uint64_t bit = (h0 + i * h1) % m;
+		if(!(b[bit / 64] >> (bit % 64) & 1))
+			return false;
+	}
+	return true;
+}
+
+inline void RollingBloom::insert(const Digest& d){
+	if(inserted == half){
+		current ^= 1;
+		std::fill(bits[current].begin(),bits[current].end(),0);
+		inserted = 0;
+	}
+	uint64_t h0;
+	uint64_t h1;
+	hashes(d,h0,h1);
+	std::vector<uint64_t>& b = bits[current];
+	for(unsigned i = 0;i < k;i++){
+		uint64_t bit = (h0 + i * h1) % m;
+		b[bit / 64] |= 1ULL << (bit % 64);
+	}
+	inserted++;
+}
+
+inline bool RollingBloom::contains(const Digest& d) const {
+	uint64_t h0;
+	uint64_t h1;
+	hashes(d,h0,h1);
+	return test(bits[current],h0,h1) || test(bits[current ^ 1],h0,h1);
+}
+
+// SipHash-2-4 of a digest, keyed per compact block so that nobody can
+// prepare transactions whose short ids collide.
+inline uint64_t shortId(uint64_t k0,uint64_t k1,const Digest& d){
+	uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+	auto rotl = [](uint64_t x,int b){ return (x << b) | (x >> (64 - b)); };
+	auto round = [&](){
+		v0 += v1; v1 = rotl(v1,13); v1 ^= v0; v0 = rotl(v0,32);
+		v2 += v3; v3 = rotl(v3,16); v3 ^= v2;
+		v0 += v3; v3 = rotl(v3,21); v3 ^= v0;
+		v2 += v1; v1 = rotl(v1,17); v1 ^= v2; v2 = rotl(v2,32);
+	};
+	uint64_t w[5];
+	memcpy(w,d.data(),4 * sizeof(uint64_t));
+	w[4] = (uint64_t)d.size() << 56;
+	for(uint64_t m : w){
+		v3 ^= m;
+		round();
+		round();
+		v0 ^= m;
+	}
+	v2 ^= 0xff;
+	for(int i = 0;i < 4;i++)
+		round();
+	return (v0 ^ v1 ^ v2 ^ v3) & ((1ULL << (SHORT_ID_BYTES * 8)) - 1);
+}
+
+// Inventory based relay. New blocks and transactions are announced by
+// hash, batched per connection, and only sent to those that ask. A
+// rolling Bloom filter per connection remembers what it announced or was
+// told, so nothing is announced twice over one link and every item crosses
+// each link in full at most once. Blocks travel as compact blocks: the
+// header and a short id per transaction, which the receiver looks up in
+// its mempool, asking only for the ones it does not have. Recent blocks
+// are serialized at most once per form, every peer that asks gets a
+// reference to the same frame.
+// Loop thread only.
+class Gossip{
+	private:
+		struct Neighbour{
+			RollingBloom known;
+			std::vector<uint8_t> pending; // MSG_INV payload being batched
+		};
+		struct Request{
+			uint64_t conn;
+			int64_t deadline;
+			uint8_t type;
+			std::deque<uint64_t> others; // connections that announced it meanwhile
+		};
+		struct Partial{
+			BlockData block;
+			std::vector<bool> have;
+			int64_t deadline;
+			uint64_t conn; // that sent the compact block
+		};
+		struct Recent{
+			std::shared_ptr<BlockData> block;
+			Frame compact; // built on the first request
+			Frame full;
+		};
+		EventLoop& loop;
+		PeerServer& server;
+		Mempool& mempool;
+		Blockchain& chain;
+		BlockStore& store;
+		std::unordered_map<uint64_t,Neighbour> neighbours;
+		std::unordered_map<Digest,Request,DigestHash> requests;
+		std::unordered_map<Digest,Partial,DigestHash> partials;
+		std::deque<Recent> recent;
+		RollingBloom confirmed; // transactions that made it into a block
+		uint64_t flushTimer;
+		uint64_t requestTimer;
+		GossipStats counters;
+
+		Neighbour& neighbour(uint64_t conn);
+		bool have(uint8_t type,const Digest& hash) const;
+		void announce(uint8_t type,const Digest& hash,uint64_t from);
+		void flush();
+		void request(uint64_t conn,uint8_t type,const Digest& hash);
+		void schedule();
+		void expire();
+		size_t partialsOf(uint64_t conn) const;
+		Recent* cached(const Digest& hash);
+		std::shared_ptr<const BlockData> find(const Digest& hash);
+		void onInventory(Connection& c,const uint8_t* data,size_t size);
+		void onGetData(Connection& c,const uint8_t* data,size_t size);
+		void onTransaction(Connection& c,const uint8_t* data,size_t size);
+		void onCompact(Connection& c,const uint8_t* data,size_t size);
+		void onGetBlockTransactions(Connection& c,const uint8_t* data,size_t size);
+		void onBlockTransactions(Connection& c,const uint8_t* data,size_t size);
+		void complete(Connection& c,const Digest& hash);
+	public:
+		bool relay; // announce to every connection, off for nodes that only verify
+		size_t filterItems; // per connection, GOSSIP_FILTER_ITEMS unless a simulation is short of memory
+		std::function<void(const Transaction&)> onAdmitted; // every transaction that entered the mempool from the network
+		std::function<bool(const Transaction&,const Digest&)> checkSignature; // verifyTransaction, none to admit unchecked
+		std::function<void(Connection&,std::vector<uint8_t>&&)> submitBlock; // a rebuilt block, encoded
+
+		Gossip(EventLoop& l,PeerServer& s,Mempool& m,Blockchain& c,BlockStore& b);
+		~Gossip();
+		Gossip(const Gossip&) = delete;
+		Gossip& operator=(const Gossip&) = delete;
+
+		void onMessage(Connection& c,const uint8_t* data,size_t size);
+		int submit(const Transaction& tx);
+		void linked(const std::shared_ptr<BlockData>& block,uint64_t from);
+		void forget(uint64_t conn);
+		GossipStats stats() const { return counters; }
+		static Frame compactFrame(const BlockData& block);
+};
+
+inline Gossip::Gossip(EventLoop& l,PeerServer& s,Mempool& m,Blockchain& c,BlockStore& b) : loop(l),server(s),mempool(m),chain(c),store(b){
+	flushTimer = 0;
+	requestTimer = 0;
+	relay = false;
+	filterItems = GOSSIP_FILTER_ITEMS;
+	checkSignature = verifyTransaction;
+	counters = GossipStats{0,0,0,0,0,0};
+}
+
+inline Gossip::~Gossip(){
+	if(flushTimer)
+		loop.cancel(flushTimer);
+	if(requestTimer)
+		loop.cancel(requestTimer);
+}
+
+inline Gossip::Neighbour& Gossip::neighbour(uint64_t conn){
+	auto it = neighbours.find(conn);
+	if(it == neighbours.end())
+		it = neighbours.emplace(conn,Neighbour{RollingBloom(filterItems),{}}).first;
+	return it->second;
+}
+
+inline void Gossip::forget(uint64_t conn){
+	neighbours.erase(conn);
+	for(auto it = partials.begin();it != partials.end();)
+		it = it->second.conn == conn ? partials.erase(it) : std::next(it);
+}
+
+inline bool Gossip::have(uint8_t type,const Digest& hash) const {
+	if(type == INV_TX)
+		return mempool.contains(hash) || confirmed.contains(hash);
+	return chain.find(hash) || partials.count(hash);
+}
+
+inline void Gossip::onMessage(Connection& c,const uint8_t* data,size_t size){
+	switch(data[0]){
+		case MSG_INV:
+			onInventory(c,data + 1,size - 1);
+			break;
+		case MSG_GET_DATA:
+			onGetData(c,data + 1,size - 1);
+			break;
+		case MSG_TX:
+			onTransaction(c,data + 1,size - 1);
+			break;
+		case MSG_COMPACT:
+			onCompact(c,data + 1,size - 1);
+			break;
+		case MSG_GET_BLOCK_TXS:
+			onGetBlockTransactions(c,data + 1,size - 1);
+			break;
+		case MSG_BLOCK_TXS:
+			onBlockTransactions(c,data + 1,size - 1);
+			break;
+	}
+}
+
+// Queues the item for every connection that does not know it yet.
+inline void Gossip::announce(uint8_t type,const Digest& hash,uint64_t from){
+	if(from)
+		neighbour(from).known.insert(hash);
+	if(!relay)
+		return;
+	server.forEach([&](Connection& c){
+		Neighbour& n = neighbour(c.id());
+		if(n.known.contains(hash))
+			return;
+		n.known.insert(hash);
+		n.pending.push_back(type);
+		n.pending.insert(n.pending.end(),hash.begin(),hash.end());
+		counters.announced++;
+		if(n.pending.size() >= GOSSIP_BATCH * INV_ITEM_SIZE){
+			c.send(MSG_INV,n.pending.data(),n.pending.size());
+			n.pending.clear();
+		}
+	});
+	if(!flushTimer)
+		flushTimer = loop.after(GOSSIP_FLUSH_MS,[this](){
+			flushTimer = 0;
+			flush();
+		});
+}
+
+inline void Gossip::flush(){
+	for(auto& n : neighbours){
+		if(n.second.pending.empty())
+			continue;
+		Connection* c = server.find(n.first);
+		if(c)
+			c->send(MSG_INV,n.second.pending.data(),n.second.pending.size());
+		n.second.pending.clear();
+	}
+}
+
+// One item from one connection; the ones that announce it meanwhile are
+// kept in case it does not answer in time.
+inline void Gossip::request(uint64_t conn,uint8_t type,const Digest& hash){
+	auto it = requests.find(hash);
+	if(it != requests.end()){
+		if(it->second.conn != conn)
+			it->second.others.push_back(conn);
+		return;
+	}
+	requests.emplace(hash,Request{conn,loop.now() + GOSSIP_REQUEST_MS,type,{}});
+	uint8_t item[INV_ITEM_SIZE];
+	item[0] = type;
+	memcpy(item + 1,hash.data(),hash.size());
+	Connection* c = server.find(conn);
+	if(c)
+		c->send(MSG_GET_DATA,item,sizeof item);
+	counters.requested++;
+	schedule();
+}
+
+// Runs expire() while requests or partial blocks wait.
+inline void Gossip::schedule(){
+	if(requestTimer || (requests.empty() && partials.empty()))
+		return;
+	requestTimer = loop.after(GOSSIP_REQUEST_MS / 4,[this](){
+		requestTimer = 0;
+		expire();
+	});
+}
+
+// Asks the next announcer for items that did not arrive in time.
+inline void Gossip::expire(){
+	int64_t now = loop.now();
+	std::vector<std::pair<Digest,Request>> late;
+	for(auto it = requests.begin();it != requests.end();){
+		if(now < it->second.deadline){
+			++it;
+			continue;
+		}
+		if(!it->second.others.empty())
+			late.emplace_back(it->first,std::move(it->second));
+		it = requests.erase(it);
+	}
+	for(auto it = partials.begin();it != partials.end();)
+		it = now < it->second.deadline ? std::next(it) : partials.erase(it);
+	for(auto& l : late){
+		uint64_t next = l.second.others.front();
+		l.second.others.pop_front();
+		request(next,l.second.type,l.first);
+		requests[l.first].others = std::move(l.second.others);
+	}
+	schedule();
+}
+
+inline size_t Gossip::partialsOf(uint64_t conn) const {
+	size_t n = 0;
+	for(const auto& p : partials)
+		n += p.second.conn == conn;
+	return n;
+}
+
+inline void Gossip::onInventory(Connection& c,const uint8_t* data,size_t size){
+	Neighbour& n = neighbour(c.id());
+	for(size_t i = 0;i + INV_ITEM_SIZE <= size;i += INV_ITEM_SIZE){
+		uint8_t type = data[i];
+		Digest hash;
+		memcpy(hash.data(),data + i + 1,hash.size());
+		n.known.insert(hash);
+		if((type == INV_TX || type == INV_BLOCK) && !have(type,hash))
+			request(c.id(),type == INV_BLOCK ? INV_COMPACT : INV_TX,hash);
+	}
+}
+
+inline Gossip::Recent* Gossip::cached(const Digest& hash){
+	for(Recent& r : recent)
+		if(r.block->header.hash == hash)
+			return &r;
+	return nullptr;
+}
+
+inline std::shared_ptr<const BlockData> Gossip::find(const Digest& hash){
+	Recent* r = cached(hash);
+	if(r)
+		return r->block;
+	std::shared_ptr<BlockData> block = std::make_shared<BlockData>();
+	if(store.isOpen() && store.get(hash,*block))
+		return block;
+	return nullptr;
+}
+
+inline void Gossip::onGetData(Connection& c,const uint8_t* data,size_t size){
+	for(size_t i = 0;i + INV_ITEM_SIZE <= size;i += INV_ITEM_SIZE){
+		uint8_t type = data[i];
+		Digest hash;
+		memcpy(hash.data(),data + i + 1,hash.size());
+		if(type == INV_TX){
+			Transaction tx;
+			uint8_t bytes[WIRE_TX_SIZE];
+			if(!mempool.get(hash,tx))
+				continue;
+			writeTransaction(bytes,tx);
+			c.send(MSG_TX,bytes,sizeof bytes);
+			continue;
+		}
+		if(type != INV_COMPACT && type != INV_BLOCK)
+			continue;
+		Recent* r = cached(hash);
+		if(r){
+			Frame& f = type == INV_COMPACT ? r->compact : r->full;
+			if(!f && type == INV_COMPACT)
+				f = compactFrame(*r->block);
+			else if(!f){
+				std::vector<uint8_t> bytes = encodeBlock(*r->block);
+				f = makeFrame(MSG_BLOCK,bytes.data(),bytes.size());
+			}
+			c.send(f);
+			continue;
+		}
+		std::shared_ptr<const BlockData> block = find(hash);
+		if(!block)
+			continue;
+		if(type == INV_COMPACT)
+			c.send(compactFrame(*block));
+		else{
+			std::vector<uint8_t> bytes = encodeBlock(*block);
+			c.send(MSG_BLOCK,bytes.data(),bytes.size());
+		}
+	}
+}
+
+// Signatures are checked before admission, so only valid transactions are relayed.
+inline void Gossip::onTransaction(Connection& c,const uint8_t* data,size_t size){
+	if(size != WIRE_TX_SIZE)
+		return;
+	TransactionView view(data);
+	Digest hash = view.computeHash();
+	requests.erase(hash);
+	neighbour(c.id()).known.insert(hash);
+	if(have(INV_TX,hash))
+		return;
+	Transaction tx;
+	view.get(tx);
+	if(checkSignature && !checkSignature(tx,hash))
+		return;
+	if(mempool.add(tx,0) != MEMPOOL_OK)
+		return;
+	counters.transactions++;
+	if(onAdmitted)
+		onAdmitted(tx);
+	announce(INV_TX,hash,c.id());
+}
+
+// A transaction of this node's own, already signed. Returns the MEMPOOL_ code.
+inline int Gossip::submit(const Transaction& tx){
+	int rc = mempool.add(tx,0);
+	if(rc == MEMPOOL_OK)
+		announce(INV_TX,tx.computeHash(),0);
+	return rc;
+}
+
+inline Frame Gossip::compactFrame(const BlockData& block){
+	uint64_t nonce = gossipRandom()();
+	uint64_t k0;
+	uint64_t k1;
+	memcpy(&k0,block.header.hash.data(),sizeof k0);
+	memcpy(&k1,block.header.hash.data() + sizeof k0,sizeof k1);
+	std::vector<uint8_t> payload(WIRE_HEADER_SIZE + sizeof nonce + block.txs.size() * SHORT_ID_BYTES);
+	writeHeader(payload.data(),block.header);
+	memcpy(payload.data() + WIRE_HEADER_SIZE,&nonce,sizeof nonce);
+	uint8_t* ids = payload.data() + WIRE_HEADER_SIZE + sizeof nonce;
+	for(size_t i = 0;i < block.txs.size();i++){
+		uint64_t id = shortId(k0 ^ nonce,k1,block.txs[i].computeHash());
+		memcpy(ids + i * SHORT_ID_BYTES,&id,SHORT_ID_BYTES);
+	}
+	return makeFrame(MSG_COMPACT,payload.data(),payload.size());
+}
+
+// Fills in what the mempool has and asks the sender for the rest. Short
+// ids that match two pooled transactions count as missing. Only blocks
+// that were asked for or extend a known block are filled in, and only a
+// few at a time, since a header that hashes to itself costs nothing to
+// make up; a requested one beyond that is fetched in full instead.
+inline void Gossip::onCompact(Connection& c,const uint8_t* data,size_t size){
+	uint64_t nonce;
+	if(size < WIRE_HEADER_SIZE + sizeof nonce)
+		return;
+	HeaderView view(data);
+	Block header = view.get();
+	memcpy(&nonce,data + WIRE_HEADER_SIZE,sizeof nonce);
+	if(size != WIRE_HEADER_SIZE + sizeof nonce + (size_t)header.size * SHORT_ID_BYTES || header.hash != view.computeHash())
+		return;
+	// the request stays until the block is linked, so other announcements do not fetch it again
+	neighbour(c.id()).known.insert(header.hash);
+	if(have(INV_BLOCK,header.hash) || header.size > GOSSIP_COMPACT_TXS)
+		return;
+	bool asked = requests.count(header.hash) != 0;
+	if(!asked && !chain.find(header.phash))
+		return;
+	if(partials.size() >= GOSSIP_PARTIALS || partialsOf(c.id()) >= GOSSIP_PARTIALS_PER_PEER){
+		if(asked){
+			requests.erase(header.hash);
+			request(c.id(),INV_BLOCK,header.hash);
+		}
+		return;
+	}
+	uint64_t k0;
+	uint64_t k1;
+	memcpy(&k0,header.hash.data(),sizeof k0);
+	memcpy(&k1,header.hash.data() + sizeof k0,sizeof k1);
+	// pooled hashes by short id, none for an id two of them share
+	std::unordered_map<uint64_t,std::optional<Digest>> byId;
+	byId.reserve(mempool.size());
+	mempool.forEach([&](const Digest& hash,const Transaction&){
+		auto ins = byId.emplace(shortId(k0 ^ nonce,k1,hash),hash);
+		if(!ins.second)
+			ins.first->second.reset();
+	});
+	Partial& p = partials[header.hash];
+	p.block.header = header;
+	p.block.txs.resize(header.size);
+	p.have.assign(header.size,false);
+	p.deadline = loop.now() + GOSSIP_REQUEST_MS;
+	p.conn = c.id();
+	schedule();
+	std::vector<uint32_t> missing;
+	const uint8_t* ids = data + WIRE_HEADER_SIZE + sizeof nonce;
+	for(uint32_t i = 0;i < header.size;i++){
+		uint64_t id = 0;
+		memcpy(&id,ids + i * SHORT_ID_BYTES,SHORT_ID_BYTES);
+		auto it = byId.find(id);
+		if(it != byId.end() && it->second && mempool.get(*it->second,p.block.txs[i]))
+			p.have[i] = true;
+		else
+			missing.push_back(i);
+	}
+	if(missing.empty()){
+		complete(c,header.hash);
+		return;
+	}
+	counters.missing += missing.size();
+	std::vector<uint8_t> ask(header.hash.size() + missing.size() * sizeof(uint32_t));
+	memcpy(ask.data(),header.hash.data(),header.hash.size());
+	memcpy(ask.data() + header.hash.size(),missing.data(),missing.size() * sizeof(uint32_t));
+	c.send(MSG_GET_BLOCK_TXS,ask.data(),ask.size());
+}
+
+inline void Gossip::onGetBlockTransactions(Connection& c,const uint8_t* data,size_t size){
+	Digest hash;
+	if(size < hash.size() || (size - hash.size()) % sizeof(uint32_t))
+		return;
+	memcpy(hash.data(),data,hash.size());
+	std::shared_ptr<const BlockData> block = find(hash);
+	if(!block)
+		return;
+	size_t n = (size - hash.size()) / sizeof(uint32_t);
+	std::vector<uint8_t> payload(hash.size() + n * WIRE_TX_SIZE);
+	memcpy(payload.data(),hash.data(),hash.size());
+	for(size_t i = 0;i < n;i++){
+		uint32_t index;
+		memcpy(&index,data + hash.size() + i * sizeof index,sizeof index);
+		if(index >= block->txs.size())
+			return;
+		writeTransaction(payload.data() + hash.size() + i * WIRE_TX_SIZE,block->txs[index]);
+	}
+	c.send(MSG_BLOCK_TXS,payload.data(),payload.size());
+}
+
+inline void Gossip::onBlockTransactions(Connection& c,const uint8_t* data,size_t size){
+	Digest hash;
+	if(size < hash.size() || (size - hash.size()) % WIRE_TX_SIZE)
+		return;
+	memcpy(hash.data(),data,hash.size());
+	auto it = partials.find(hash);
+	if(it == partials.end())
+		return;
+	Partial& p = it->second;
+	size_t n = (size - hash.size()) / WIRE_TX_SIZE;
+	size_t next = 0;
+	for(size_t i = 0;i < p.have.size() && next < n;i++){
+		if(p.have[i])
+			continue;
+		TransactionView(data + hash.size() + next * WIRE_TX_SIZE).get(p.block.txs[i]);
+		p.have[i] = true;
+		next++;
+	}
+	complete(c,hash);
+}
+
+// A rebuilt block goes to the pipeline if its transactions add up to the
+// root, otherwise a short id matched the wrong transaction and the whole
+// block is fetched.
+inline void Gossip::complete(Connection& c,const Digest& hash){
+	auto it = partials.find(hash);
+	if(it == partials.end())
+		return;
+	BlockData& block = it->second.block;
+	bool whole = std::find(it->second.have.begin(),it->second.have.end(),false) == it->second.have.end();
+	std::vector<Digest> hashes(block.txs.size());
+	for(size_t i = 0;whole && i < block.txs.size();i++)
+		hashes[i] = block.txs[i].computeHash();
+	if(!whole || transactionRoot(hashes.data(),hashes.size()) != block.header.root){
+		partials.erase(it);
+		counters.fullBlocks++;
+		requests.erase(hash);
+		request(c.id(),INV_BLOCK,hash);
+		return;
+	}
+	counters.compactBlocks++;
+	std::vector<uint8_t> bytes = encodeBlock(block);
+	partials.erase(it);
+	if(submitBlock)
+		submitBlock(c,std::move(bytes));
+}
+
+// The block is part of the chain now: its transactions leave the mempool
+// and the block is announced to everybody but the connection it came from.
+inline void Gossip::linked(const std::shared_ptr<BlockData>& block,uint64_t from){
+	for(const Transaction& tx : block->txs){
+		Digest hash = tx.computeHash();
+		confirmed.insert(hash);
+		if(mempool.size())
+			mempool.erase(hash);
+	}
+	requests.erase(block->header.hash);
+	partials.erase(block->header.hash);
+	recent.push_back(Recent{block,nullptr,nullptr});
+	if(recent.size() > GOSSIP_RECENT_BLOCKS)
+		recent.pop_front();
+	announce(INV_BLOCK,block->header.hash,from);
+}
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef LIGHT_HPP
+#define LIGHT_HPP
+
+#include <memory>
+#include <unordered_map>
+#include "blockchain.hpp"
+#include "net.hpp"
+#include "task.hpp"
+#include "proof.hpp"
+#include "protocol.hpp"
+
+#define LIGHT_OK 0
+#define LIGHT_CLOSED -1      // the connection went away
+#define LIGHT_BAD_HEADERS -2 // headers that do not hash to themselves or do not link up
+#define LIGHT_NOT_FOUND -3   // the node has no such account or transaction
+#define LIGHT_BAD_PROOF -4   // a proof that does not check out against the header chain
+
+#define LIGHT_HEADERS 2000   // asked for per MSG_GET_HEADERS
+
+// Light client: keeps the header chain of full nodes and checks accounts
+// and transactions against it with their Merkle proofs, without the
+// ledger. The first header is taken as given, every later one has to hash
+// to itself and link to the one before. Each request is one coroutine on
+// the Stream of a connection, written top to bottom; a stream serves one
+// request at a time, more connections give more in parallel.
+class LightClient{
+	private:
+		std::unordered_map<uint64_t,std::unique_ptr<Stream>> streams;
+		Stream* stream(uint64_t conn);
+		Task<Stream::Message> reply(Stream& s,uint8_t type,uint8_t other);
+		int appendHeaders(const uint8_t* data,size_t size,size_t& n);
+	public:
+		EventLoop& loop;
+		PeerServer server;
+		Blockchain headers;
+
+		explicit LightClient(EventLoop& l);
+		Stream* connect(const char* host,uint16_t port);
+		Task<int> syncHeaders(Stream& s);
+		Task<int> account(Stream& s,const Digest& key,Account& account);
+		Task<int> transaction(Stream& s,const Digest& block,uint32_t index,Transaction& tx);
+};
+
+inline LightClient::LightClient(EventLoop& l) : loop(l),server(l){
+	server.onMessage = [this](Connection& c,const uint8_t* data,size_t size){
+		Stream* s = stream(c.id());
+		if(s)
+			s->push(data,size);
+	};
+	server.onDrained = [this](Connection& c){
+		Stream* s = stream(c.id());
+		if(s)
+			s->drained();
+	};
+	server.onDisconnect = [this](Connection& c){
+		Stream* s = stream(c.id());
+		if(s)
+			s->closed();
+	};
+}
+
+inline Stream* LightClient::stream(uint64_t conn){
+	auto it = streams.find(conn);
+	return it == streams.end() ? nullptr : it->second.get();
+}
+
+// The stream is usable right away, what it writes goes out once connected.
+inline Stream* LightClient::connect(const char* host,uint16_t port){
+	Connection* c = server.connect(host,port);
+	if(!c)
+		return nullptr;
+	Stream* s = new Stream(server,c->id());
+	streams.emplace(c->id(),std::unique_ptr<Stream>(s));
+	return s;
+}
+
+// The next message of one of the two types, announcements in between are skipped.
+inline Task<Stream::Message> LightClient::reply(Stream& s,uint8_t type,uint8_t other){
+	for(;;){
+		Stream::Message m = co_await s.read();
+		if(!m || m.type() == type || m.type() == other)
+			co_return m;
+	}
+}
+
+// A MSG_HEADERS payload continuing the chain. n is the number of headers in it.
+inline int LightClient::appendHeaders(const uint8_t* data,size_t size,size_t& n){
+	uint64_t first;
+	if(size < sizeof first || (size - sizeof first) % WIRE_HEADER_SIZE)
+		return LIGHT_BAD_HEADERS;
+	memcpy(&first,data,sizeof first);
+	n = (size - sizeof first) / WIRE_HEADER_SIZE;
+	if(first != headers.size())
+		return LIGHT_BAD_HEADERS;
+	for(size_t i = 0;i < n;i++){
+		HeaderView view(data + sizeof first + i * WIRE_HEADER_SIZE);
+		Block b = view.get();
+		if(view.computeHash() != b.hash)
+			return LIGHT_BAD_HEADERS;
+		if(!headers.empty() && (b.phash != headers.tip().hash || b.timestamp < headers.tip().timestamp))
+			return LIGHT_BAD_HEADERS;
+		if(headers.append(b) < 0)
+			return LIGHT_BAD_HEADERS;
+	}
+	return LIGHT_OK;
+}
+
+// Fetches headers from the tip on until the node has no more.
+inline Task<int> LightClient::syncHeaders(Stream& s){
+	for(;;){
+		uint64_t first = headers.size();
+		uint32_t count = LIGHT_HEADERS;
+		uint8_t request[sizeof first + sizeof count];
+		memcpy(request,&first,sizeof first);
+		memcpy(request + sizeof first,&count,sizeof count);
+		if(!co_await s.write(MSG_GET_HEADERS,request,sizeof request))
+			co_return LIGHT_CLOSED;
+		Stream::Message m = co_await reply(s,MSG_HEADERS,MSG_HEADERS);
+		if(!m)
+			co_return LIGHT_CLOSED;
+		size_t n = 0;
+		int rc = appendHeaders(m.payload(),m.payloadSize(),n);
+		if(rc != LIGHT_OK || n < count)
+			co_return rc;
+	}
+}
+
+// The node proves against its tip, the headers are brought up to it first if needed.
+inline Task<int> LightClient::account(Stream& s,const Digest& key,Account& account){
+	if(!co_await s.write(MSG_GET_ACCOUNT_PROOF,key.data(),key.size()))
+		co_return LIGHT_CLOSED;
+	Stream::Message m = co_await reply(s,MSG_PROOF,MSG_NOT_FOUND);
+	if(!m)
+		co_return LIGHT_CLOSED;
+	if(m.type() == MSG_NOT_FOUND)
+		co_return LIGHT_NOT_FOUND;
+	AccountProof proof;
+	if(!decodeProof(m.payload(),m.payloadSize(),proof) || proof.key != key)
+		co_return LIGHT_BAD_PROOF;
+	if(!headers.find(proof.header.hash)){
+		int rc = co_await syncHeaders(s);
+		if(rc != LIGHT_OK)
+			co_return rc;
+	}
+	const Block* header = headers.find(proof.header.hash);
+	if(!header || verifyProof(proof,header->hash) != PROOF_OK)
+		co_return LIGHT_BAD_PROOF;
+	account = proof.account;
+	co_return LIGHT_OK;
+}
+
+inline Task<int> LightClient::transaction(Stream& s,const Digest& block,uint32_t index,Transaction& tx){
+	uint8_t request[sizeof(Digest) + sizeof index];
+	memcpy(request,block.data(),block.size());
+	memcpy(request + block.size(),&index,sizeof index);
+	if(!co_await s.write(MSG_GET_TX_PROOF,request,sizeof request))
+		co_return LIGHT_CLOSED;
+	Stream::Message m = co_await reply(s,MSG_PROOF,MSG_NOT_FOUND);
+	if(!m)
+		co_return LIGHT_CLOSED;
+	if(m.type() == MSG_NOT_FOUND)
+		co_return LIGHT_NOT_FOUND;
+	TransactionProof proof;
+	if(!decodeProof(m.payload(),m.payloadSize(),proof) || proof.header.hash != block || proof.path.index != index)
+		co_return LIGHT_BAD_PROOF;
+	if(!headers.find(block)){
+		int rc = co_await syncHeaders(s);
+		if(rc != LIGHT_OK)
+			co_return rc;
+	}
+	if(!headers.find(block) || verifyProof(proof,block) != PROOF_OK)
+		co_return LIGHT_BAD_PROOF;
+	tx = proof.tx;
+	co_return LIGHT_OK;
+}
+
+#endif
@@ -0,0 +1,334 @@
+#ifndef MEMPOOL_HPP
+#define MEMPOOL_HPP
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <map>
+#include <array>
+#include <vector>
+#include "transaction.hpp"
+
+#define MEMPOOL_OK 0
+#define MEMPOOL_DUPLICATE -1
+#define MEMPOOL_FULL -2          // every entry is taken, the consumer has to catch up
+#define MEMPOOL_LOW_PRIORITY -3  // the pool is at its high water mark and everything in it ranks higher
+
+#define MEMPOOL_CAPACITY 65536
+#define MEMPOOL_HEADROOM 8       // 1/8 of the entries is kept free by evicting the lowest ranked
+
+// Pool of unconfirmed transactions, ranked by priority and then arrival.
+// The ledger has no fees, so the priority is whatever the caller ranks by.
+// add() is lock-free and may be called from any number of threads: an
+// entry comes off a free list, the hash is claimed in an open-addressing
+// table of atomics, which is where duplicates meet, and the entry is
+// pushed onto an intake stack. Everything else is the consumer side,
+// serialised by one mutex the producers never touch: the intake is moved
+// into the ranking, the lowest ranked entries are evicted down to the high
+// water mark and taken entries go back to the free list. Removed hashes
+// leave tombstones that are cleared by rebuilding the table, the only
+// moment producers wait.
+class Mempool{
+	private:
+		static const uint32_t NIL = 0xffffffff;
+		static const uint64_t SLOT_EMPTY = 0;
+		static const uint64_t SLOT_BUSY = 1;  // claimed, the hash is being written
+		static const uint64_t SLOT_DEAD = 2;  // tombstone
+		// any other slot state is live: hash tag << 32 | entry + 3
+		struct Slot{
+			std::atomic<uint64_t> state;
+			std::atomic<uint64_t> words[4];
+		};
+		struct Entry{
+			Transaction tx;
+			Digest hash;
+			uint64_t priority;
+			uint64_t arrival;
+			uint32_t slot;
+			std::atomic<uint32_t> next; // free list or intake
+		};
+		typedef std::pair<uint64_t,uint64_t> Rank; // inverted priority, arrival: best first
+
+		size_t capacity;
+		size_t highWater;
+		std::unique_ptr<Entry[]> entries;
+		std::unique_ptr<Slot[]> table;
+		size_t mask;
+		std::atomic<uint64_t> freeHead; // version << 32 | index, the version defeats ABA
+		std::atomic<uint32_t> intake;
+		std::atomic<uint64_t> arrivals;
+		std::atomic<uint64_t> floor;    // lowest priority still admitted
+		std::atomic<size_t> count;
+		std::atomic<int> active;        // producers inside add()
+		std::atomic<bool> compacting;
+
+		std::mutex consumer;
+		std::map<Rank,uint32_t> ranked;
+		size_t tombstones;
+		uint64_t evictions;
+
+		static void words(const Digest& hash,uint64_t* w){ memcpy(w,hash.data(),4 * sizeof(uint64_t)); }
+		bool matches(const Slot& s,const uint64_t* w) const;
+		uint32_t allocate();
+		void release(uint32_t e);
+		void collect();
+		void remove(std::map<Rank,uint32_t>::iterator it);
+		void compact();
+		int64_t lookup(const Digest& hash) const;
+	public:
+		explicit Mempool(size_t capacity = MEMPOOL_CAPACITY);
+		Mempool(const Mempool&) = delete;
+		Mempool& operator=(const Mempool&) = delete;
+
+		int add(const Transaction& tx,uint64_t priority);
+		bool contains(const Digest& hash) const { return lookup(hash) >= 0; }
+
+		size_t take(size_t max,std::vector<Transaction>& out);
+		bool get(const Digest& hash,Transaction& tx);
+		bool erase(const Digest& hash);
+		template<class F> void forEach(F f);
+		size_t size() const { return count.load(std::memory_order_relaxed); }
+		uint64_t evicted(){ std::lock_guard<std::mutex> lock(consumer); return evictions; }
+};
+
+inline Mempool::Mempool(size_t c) : capacity(c ? c : 1),entries(new Entry[capacity]){
+	highWater = capacity - capacity / MEMPOOL_HEADROOM;
+	// at most a quarter live and a quarter tombstones, so probes stay short
+	size_t slots = 4;
+	while(slots < capacity * 4)
+		slots *= 2;
+	table.reset(new Slot[slots]);
+	mask = slots - 1;
+	for(size_t i = 0;i < slots;i++){
+		table[i].state.store(SLOT_EMPTY,std::memory_order_relaxed);
+		for(int w = 0;w < 4;w++)
+			table[i].words[w].store(0,std::memory_order_relaxed);
+	}
+	for(size_t i = 0;i < capacity;i++)
+		entries[i].next.store(i + 1 < capacity ? i + 1 : NIL,std::memory_order_relaxed);
+	freeHead = 0;
+	intake = NIL;
+	arrivals = 0;
+	floor = 0;
+	count = 0;
+	active = 0;
+	compacting = false;
+	tombstones = 0;
+	evictions = 0;
+}
+
+inline bool Mempool::matches(const Slot& s,const uint64_t* w) const {
+	for(int i = 0;i < 4;i++)
+		if(s.words[i].load(std::memory_order_relaxed) != w[i])
+			return false;
+	return true;
+}
+
+inline uint32_t Mempool::allocate(){
+	uint64_t head = freeHead.load(std::memory_order_acquire);
+	for(;;){
+		uint32_t e = (uint32_t)head;
+		if(e == NIL)
+			return NIL;
+		uint64_t next = ((head >> 32) + 1) << 32 | entries[e].next.load(std::memory_order_relaxed);
+		if(freeHead.compare_exchange_weak(head,next,std::memory_order_acquire,std::memory_order_acquire))
+			return e;
+	}
+}
+
+inline void Mempool::release(uint32_t e){
+	uint64_t head = freeHead.load(std::memory_order_relaxed);
+	for(;;){
+		entries[e].next.store((uint32_t)head,std::memory_order_relaxed);
+		uint64_t next = ((head >> 32) + 1) << 32 | e;
+		if(freeHead.compare_exchange_weak(head,next,std::memory_order_release,std::memory_order_relaxed))
+			return;
+	}
+}
+
+// Lock-free. MEMPOOL_OK, MEMPOOL_DUPLICATE, MEMPOOL_FULL or MEMPOOL_LOW_PRIORITY.
+inline int Mempool::add(const Transaction& tx,uint64_t priority){
+	if(priority < floor.load(std::memory_order_relaxed))
+		return MEMPOOL_LOW_PRIORITY;
+	Digest hash = tx.computeHash();
+	uint64_t w[4];
+	words(hash,w);
+	uint64_t tag = w[0] >> 32;
+	for(;;){
+		active.fetch_add(1);
+		if(!compacting.load())
+			break;
+		active.fetch_sub(1);
+		while(compacting.load())
+			std::this_thread::yield();
+	}
+	uint32_t e = allocate();
+	if(e == NIL){
+		active.fetch_sub(1);
+		return MEMPOOL_FULL;
+	}
+	// duplicates probe the same sequence and meet at the first slot either claims
+	size_t i = w[0] & mask;
+	for(size_t probes = 0;;){
+		Slot& s = table[i];
+		uint64_t state = s.state.load(std::memory_order_acquire);
+		while(state == SLOT_BUSY){
+			std::this_thread::yield();
+			state = s.state.load(std::memory_order_acquire);
+		}
+		if(state == SLOT_EMPTY){
+			if(!s.state.compare_exchange_strong(state,SLOT_BUSY,std::memory_order_acquire))
+				continue; // someone else claimed it, look again
+			for(int k = 0;k < 4;k++)
+				s.words[k].store(w[k],std::memory_order_relaxed);
+			break;
+		}
+		if(state != SLOT_DEAD && state >> 32 == tag && matches(s,w)){
+			release(e);
+			active.fetch_sub(1);
+			return MEMPOOL_DUPLICATE;
+		}
+		i = (i + 1) & mask;
+		if(++probes > mask){
+			release(e);
+			active.fetch_sub(1);
+			return MEMPOOL_FULL;
+		}
+	}
+	Entry& entry = entries[e];
+	entry.tx = tx;
+	entry.hash = hash;
+	entry.priority = priority;
+	entry.arrival = arrivals.fetch_add(1,std::memory_order_relaxed);
+	entry.slot = i;
+	table[i].state.store(tag << 32 | (e + 3),std::memory_order_release);
+	uint32_t head = intake.load(std::memory_order_relaxed);
+	do
+		entry.next.store(head,std::memory_order_relaxed);
+	while(!intake.compare_exchange_weak(head,e,std::memory_order_release,std::memory_order_relaxed));
+	count.fetch_add(1,std::memory_order_relaxed);
+	active.fetch_sub(1);
+	return MEMPOOL_OK;
+}
+
+// Entry index of a live hash, or -1.
+inline int64_t Mempool::lookup(const Digest& hash) const {
+	uint64_t w[4];
+	words(hash,w);
+	uint64_t tag = w[0] >> 32;
+	size_t i = w[0] & mask;
+	for(size_t probes = 0;probes <= mask;probes++,i = (i + 1) & mask){
+		uint64_t state = table[i].state.load(std::memory_order_acquire);
+		if(state == SLOT_EMPTY)
+			return -1;
+		if(state > SLOT_DEAD && state >> 32 == tag && matches(table[i],w))
+			return (int64_t)(uint32_t)state - 3;
+	}
+	return -1;
+}
+
+// Consumer side: ranks what was admitted since the last call and evicts
+// down to the high water mark.
+inline void Mempool::collect(){
+	for(uint32_t e = intake.exchange(NIL,std::memory_order_acquire);e != NIL;){
+		uint32_t next = entries[e].next.load(std::memory_order_relaxed);
+		ranked.emplace(Rank(~entries[e].priority,entries[e].arrival),e);
+		e = next;
+	}
+	while(ranked.size() > highWater){
+		remove(std::prev(ranked.end()));
+		evictions++;
+	}
+	floor.store(ranked.size() >= highWater ? entries[std::prev(ranked.end())->second].priority + 1 : 0,std::memory_order_relaxed);
+	if(tombstones > (mask + 1) / 4)
+		compact();
+}
+
+inline void Mempool::remove(std::map<Rank,uint32_t>::iterator it){
+	uint32_t e = it->second;
+	ranked.erase(it);
+	table[entries[e].slot].state.store(SLOT_DEAD,std::memory_order_release);
+	tombstones++;
+	count.fetch_sub(1,std::memory_order_relaxed);
+	release(e);
+}
+
+// Rebuilds the table without tombstones while no producer is inside add().
+inline void Mempool::compact(){
+	compacting.store(true);
+	while(active.load())
+		std::this_thread::yield();
+	std::vector<std::pair<uint64_t,std::array<uint64_t,4>>> live;
+	for(size_t i = 0;i <= mask;i++){
+		uint64_t state = table[i].state.load(std::memory_order_relaxed);
+		if(state > SLOT_DEAD){
+			std::array<uint64_t,4> w;
+			for(int k = 0;k < 4;k++)
+				w[k] = table[i].words[k].load(std::memory_order_relaxed);
+			live.emplace_back(state,w);
+		}
+		table[i].state.store(SLOT_EMPTY,std::memory_order_relaxed);
+	}
+	for(const auto& l : live){
+		size_t i = l.second[0] & mask;
+		while(table[i].state.load(std::memory_order_relaxed) != SLOT_EMPTY)
+			i = (i + 1) & mask;
+		for(int k = 0;k < 4;k++)
+			table[i].words[k].store(l.second[k],std::memory_order_relaxed);
+		table[i].state.store(l.first,std::memory_order_relaxed);
+		entries[(uint32_t)l.first - 3].slot = i;
+	}
+	tombstones = 0;
+	compacting.store(false);
+}
+
+// Moves up to max of the best ranked transactions to out, for the next block.
+inline size_t Mempool::take(size_t max,std::vector<Transaction>& out){
+	std::lock_guard<std::mutex> lock(consumer);
+	collect();
+	size_t n = 0;
+	while(n < max && !ranked.empty()){
+		out.push_back(entries[ranked.begin()->second].tx);
+		remove(ranked.begin());
+		n++;
+	}
+	if(n)
+		floor.store(0,std::memory_order_relaxed);
+	return n;
+}
+
+inline bool Mempool::get(const Digest& hash,Transaction& tx){
+	std::lock_guard<std::mutex> lock(consumer);
+	collect();
+	int64_t e = lookup(hash);
+	if(e < 0)
+		return false;
+	tx = entries[e].tx;
+	return true;
+}
+
+// Drops a transaction that got into a block some other way. One still
+// inside add() is not seen yet.
+inline bool Mempool::erase(const Digest& hash){
+	std::lock_guard<std::mutex> lock(consumer);
+	collect();
+	int64_t e = lookup(hash);
+	if(e < 0)
+		return false;
+	auto it = ranked.find(Rank(~entries[e].priority,entries[e].arrival));
+	if(it == ranked.end())
+		return false;
+	remove(it);
+	return true;
+}
+
+// Calls f(hash,tx) for every ranked transaction, best first.
+template<class F> inline void Mempool::forEach(F f){
+	std::lock_guard<std::mutex> lock(consumer);
+	collect();
+	for(const auto& r : ranked)
+		f(entries[r.second].hash,entries[r.second].tx);
+}
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef MERKLE_HPP
+#define MERKLE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+#include "crypt.hpp"
+#include "verify.hpp"
+
+// Binary hash tree over leaf digests. Leaves and inner nodes are hashed
+// with different prefixes, so an inner node can not pass for a leaf. A
+// level with an odd number of nodes promotes the last one unchanged
+// instead of duplicating it, which would let two leaf lists share a root.
+// MerkleProof and merkleVerify() are in verify.hpp, which clients use
+// without the node.
+
+inline Digest merkleLeaf(Bytes data){
+	uint8_t prefix = MERKLE_LEAF;
+	return threadHasher().updateValue(prefix).update(data).final();
+}
+
+inline Digest merkleNode(const Digest& left,const Digest& right){
+	uint8_t prefix = MERKLE_NODE;
+	return threadHasher().updateValue(prefix).update(left).update(right).final();
+}
+
+// Replaces nodes[0] by the root over the n nodes, the rest is scratch.
+inline void merkleReduce(Digest* nodes,size_t n){
+	while(n > 1){
+		for(size_t i = 0;i + 1 < n;i += 2)
+			nodes[i / 2] = merkleNode(nodes[i],nodes[i + 1]);
+		if(n % 2)
+			nodes[n / 2] = nodes[n - 1];
+		n = (n + 1) / 2;
+	}
+}
+
+// Root over leaf digests, the hash of nothing for no leaves. With threads,
+// aligned power of two subtrees are reduced in parallel and then their roots,
+// which gives the same tree as reducing level by level.
+inline Digest merkleRoot(const Digest* leaves,size_t n,unsigned threads = 1){
+	if(n == 0)
+		return threadHasher().final();
+	std::vector<Digest> nodes(leaves,leaves + n);
+	if(threads <= 1 || n < threads * 64){
+		merkleReduce(nodes.data(),n);
+		return nodes[0];
+	}
+	size_t chunk = 1;
+	while(chunk * threads < n)
+		chunk *= 2;
+	size_t parts = (n + chunk - 1) / chunk;
+	std::vector<std::thread> workers;
+	for(size_t t = 0;t < parts;t++){
+		Digest* from = nodes.data() + t * chunk;
+		size_t size = std::min(chunk,n - t * chunk);
+		workers.emplace_back([from,size](){ merkleReduce(from,size); });
+	}
+	for(std::thread& w : workers)
+		w.join();
+	for(size_t t = 1;t < parts;t++)
+		nodes[t] = nodes[t * chunk];
+	merkleReduce(nodes.data(),parts);
+	return nodes[0];
+}
+
+// Path from leaf index to the root, hashes the whole tree once.
+inline MerkleProof merkleProve(const Digest* leaves,size_t n,size_t index){
+	MerkleProof proof;
+	proof.index = index;
+	proof.count = n;
+	if(index >= n)
+		return proof;
+	std::vector<Digest> level(leaves,leaves + n);
+	while(n > 1){
+		if((index ^ 1) < n)
+			proof.path.push_back(level[index ^ 1]);
+		for(size_t i = 0;i + 1 < n;i += 2)
+			level[i / 2] = merkleNode(level[i],level[i + 1]);
+		if(n % 2)
+			level[n / 2] = level[n - 1];
+		n = (n + 1) / 2;
+		index /= 2;
+	}
+	return proof;
+}
+
+// Every level of the tree, kept for many proofs against one root. Takes
+// twice the leaves in memory; a path is read off in O(log n) instead of
+// hashing the tree again. With threads, large levels are split across them.
+class MerkleTree{
+	private:
+		std::vector<std::vector<Digest> > levels; // leaves first, the root last
+		static void reduce(const std::vector<Digest>& from,std::vector<Digest>& to,size_t begin,size_t end);
+	public:
+		void build(std::vector<Digest>&& leaves,unsigned threads = 1);
+		Digest root() const;
+		MerkleProof prove(size_t index) const;
+		size_t size() const { return levels.empty() ? 0 : levels[0].size(); }
+		void clear(){ levels.clear(); }
+};
+
+// Nodes begin up to end of the level above from.
+inline void MerkleTree::reduce(const std::vector<Digest>& from,std::vector<Digest>& to,size_t begin,size_t end){
+	for(size_t i = begin;i < end;i++)
+		to[i] = i * 2 + 1 < from.size() ? merkleNode(from[i * 2],from[i * 2 + 1]) : from[i * 2];
+}
+
+inline void MerkleTree::build(std::vector<Digest>&& leaves,unsigned threads){
+	levels.clear();
+	levels.push_back(std::move(leaves));
+	while(levels.back().size() > 1){
+		const std::vector<Digest>& from = levels.back();
+		std::vector<Digest> to((from.size() + 1) / 2);
+		size_t n = to.size();
+		if(threads <= 1 || n < threads * 64)
+			reduce(from,to,0,n);
+		else{
+			std::vector<std::thread> workers;
+			size_t chunk = (n + threads - 1) / threads;
+			for(size_t begin = 0;begin < n;begin += chunk)
+				workers.emplace_back(reduce,std::cref(from),std::ref(to),begin,std::min(n,begin + chunk));
+			for(std::thread& w : workers)
+				w.join();
+		}
+		levels.push_back(std::move(to));
+	}
+}
+
+// The same as merkleRoot() over the leaves.
+inline Digest MerkleTree::root() const {
+	if(size() == 0)
+		return threadHasher().final();
+	return levels.back()[0];
+}
+
+// The same path as merkleProve().
+inline MerkleProof MerkleTree::prove(size_t index) const {
+	MerkleProof proof;
+	proof.index = index;
+	proof.count = size();
+	if(index >= size())
+		return proof;
+	for(size_t l = 0;l + 1 < levels.size();l++){
+		if((index ^ 1) < levels[l].size())
+			proof.path.push_back(levels[l][index ^ 1]);
+		index /= 2;
+	}
+	return proof;
+}
+
+#endif
@@ -0,0 +1,1061 @@
+#ifndef NET_HPP
+#define NET_HPP
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include "uring.hpp"
+
+#define FRAME_HEADER 4                  // little endian payload length in front of every message
+#define FRAME_MAX (16 * 1024 * 1024)    // larger frames close the connection
+#define READ_CHUNK 65536                // bytes reserved for every read() call
+#define EPOLL_EVENTS 256                // events fetched per epoll_wait()
+#define SEND_HIGH_WATER (8 * 1024 * 1024)   // queued bytes that stop reading from the peer
+#define SEND_LOW_WATER (2 * 1024 * 1024)    // and resume it again
+#define SEND_LIMIT (64 * 1024 * 1024)       // queued bytes that close a peer too slow to keep up
+#define WRITEV_MAX 64                       // frames per sendmsg() call
+
+// EventLoop backends
+#define LOOP_EPOLL 0
+#define LOOP_URING 1 // io_uring, falls back to LOOP_EPOLL where the kernel lacks it
+
+// Anything the event loop can wake up.
+class Pollable{
+	public:
+		virtual ~Pollable(){}
+		virtual void onEvents(uint32_t events) = 0;
+};
+
+class Connection;
+
+// Virtual clock and timer queue for loops without sockets, see Simulator.
+// Times are in milliseconds like EventLoop::nowMs().
+class Scheduler{
+	public:
+		virtual ~Scheduler(){}
+		virtual int64_t now() const = 0;
+		virtual uint64_t at(int64_t time,std::function<void()> f) = 0;
+		virtual void cancel(uint64_t id) = 0;
+};
+
+// Carries what a connection without a socket sends, see PeerServer::attach().
+class Link{
+	public:
+		virtual ~Link(){}
+		virtual void carry(Connection& from,const uint8_t* data,size_t size) = 0;
+		virtual void closed(Connection& c) = 0;
+};
+
+// Completion of an io_uring operation: the result and the CQE flags. A
+// multishot operation calls it until IORING_CQE_F_MORE is missing.
+typedef std::function<void(int32_t,uint32_t)> Done;
+
+// Single threaded epoll loop. post() is the only method that may be called
+// from other threads, it queues a function to run on the loop thread.
+// Timers are kept ordered by deadline and bound the epoll_wait() timeout.
+// With a scheduler the loop has no epoll instance: time, timers and posted
+// functions all come from the scheduler, which runs them on its own thread.
+//
+// On LOOP_URING the same interface sits on an io_uring: add() arms a
+// multishot poll, and sockets can receive, send and sync files through
+// operations that complete on the loop thread. Everything started during
+// an iteration goes to the kernel with the wait of the next one, a single
+// syscall however many connections were served.
+class EventLoop : public Pollable{
+	private:
+		struct Op{
+			Done done;
+			std::shared_ptr<void> keep; // memory the kernel reads until the last completion
+			bool dead;                  // forgotten, completions only give buffers back
+		};
+		Scheduler* scheduler;
+		int io;
+		int epfd;
+		int wakefd;
+		bool running;
+		Uring ring;
+		std::unordered_map<uint64_t,Op> ops;
+		std::unordered_map<int,uint64_t> watches; // fd -> multishot poll
+		uint64_t nextOp;
+		uint64_t start(io_uring_sqe* e,Done done,std::shared_ptr<void> keep = nullptr);
+		void abort(uint64_t op);
+		void watch(int fd,uint32_t events,Pollable* p);
+		void complete(uint64_t op,int32_t res,uint32_t flags);
+		std::mutex postMutex;
+		std::vector<std::function<void()>> posted;
+		std::map<std::pair<int64_t,uint64_t>,std::function<void()>> timers; // (deadline,id)
+		std::unordered_map<uint64_t,int64_t> timerDeadlines;
+		uint64_t nextTimer;
+		void runPosted();
+		void runTimers();
+	public:
+		static int64_t nowMs(){
+			return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+		explicit EventLoop(Scheduler* s = nullptr,int backend = LOOP_EPOLL);
+		~EventLoop();
+		EventLoop(const EventLoop&) = delete;
+		EventLoop& operator=(const EventLoop&) = delete;
+
+		int64_t now() const { return scheduler ? scheduler->now() : nowMs(); }
+		int backend() const { return io; }
+		bool add(int fd,uint32_t events,Pollable* p);
+		bool modify(int fd,uint32_t events,Pollable* p);
+		void remove(int fd);
+		// LOOP_URING only. The returned id names the operation until its last completion.
+		uint64_t receive(int fd,Done done);
+		uint64_t sendmsg(int fd,const msghdr* msg,std::shared_ptr<void> keep,Done done);
+		uint64_t fsync(int fd,std::function<void(int32_t)> done);
+		uint64_t unlink(const std::string& path,std::function<void(int32_t)> done);
+		void interrupt(uint64_t op);
+		void forget(uint64_t op);
+		const uint8_t* buffer(uint16_t id) const { return ring.buffer(id); }
+		void recycle(uint16_t id){ ring.recycle(id); }
+		void post(std::function<void()> f);
+		uint64_t after(int64_t ms,std::function<void()> f);
+		void cancel(uint64_t timer);
+		int runOnce(int timeoutMs);
+		void run();
+		void stop();
+		void onEvents(uint32_t events) override;
+};
+
+inline EventLoop::EventLoop(Scheduler* s,int backend) : scheduler(s){
+	io = LOOP_EPOLL;
+	epfd = -1;
+	wakefd = -1;
+	running = false;
+	nextTimer = 1;
+	nextOp = 1;
+	if(scheduler)
+		return;
+	if(backend == LOOP_URING && ring.open())
+		io = LOOP_URING;
+	else
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+	wakefd = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+	add(wakefd,EPOLLIN,this);
+}
+
+// Operations still running are cancelled and waited for, the kernel may
+// be reading memory they keep alive.
+inline EventLoop::~EventLoop(){
+	if(scheduler)
+		return;
+	if(io == LOOP_URING){
+		for(auto& op : ops)
+			if(!op.second.dead){
+				op.second.dead = true;
+				abort(op.first);
+			}
+		for(int i = 0;!ops.empty() && i < 100;i++){
+			ring.submit(1,10);
+			ring.reap([this](uint64_t op,int32_t res,uint32_t flags){ complete(op,res,flags); });
+		}
+		ring.close();
+	}
+	else
+		::close(epfd);
+	::close(wakefd);
+}
+
+inline bool EventLoop::add(int fd,uint32_t events,Pollable* p){
+	if(io == LOOP_URING){
+		watch(fd,events,p);
+		return true;
+	}
+	epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = p;
+	return epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev) == 0;
+}
+
+inline bool EventLoop::modify(int fd,uint32_t events,Pollable* p){
+	if(io == LOOP_URING){
+		remove(fd);
+		if(events)
+			watch(fd,events,p);
+		return true;
+	}
+	epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = p;
+	return epoll_ctl(epfd,EPOLL_CTL_MOD,fd,&ev) == 0;
+}
+
+inline void EventLoop::remove(int fd){
+	if(io == LOOP_URING){
+		auto it = watches.find(fd);
+		if(it != watches.end()){
+			forget(it->second);
+			watches.erase(it);
+		}
+		return;
+	}
+	epoll_ctl(epfd,EPOLL_CTL_DEL,fd,nullptr);
+}
+
+inline uint64_t EventLoop::start(io_uring_sqe* e,Done done,std::shared_ptr<void> keep){
+	uint64_t id = nextOp++;
+	e->user_data = id;
+	Op& op = ops[id];
+	op.done = std::move(done);
+	op.keep = std::move(keep);
+	op.dead = false;
+	return id;
+}
+
+// Cancellation completes with user_data 0, which names no operation.
+inline void EventLoop::abort(uint64_t op){
+	io_uring_sqe* e = ring.sqe();
+	e->opcode = IORING_OP_ASYNC_CANCEL;
+	e->addr = op;
+}
+
+// Multishot poll standing in for an epoll registration.
+inline void EventLoop::watch(int fd,uint32_t events,Pollable* p){
+	io_uring_sqe* e = ring.sqe();
+	e->opcode = IORING_OP_POLL_ADD;
+	e->fd = fd;
+	e->poll32_events = events;
+	e->len = IORING_POLL_ADD_MULTI;
+	watches[fd] = start(e,[this,fd,events,p](int32_t res,uint32_t flags){
+		// the kernel ends a multishot poll when the completion queue overflows
+		if(!(flags & IORING_CQE_F_MORE) && res >= 0)
+			watch(fd,events,p);
+		if(res > 0)
+			p->onEvents(res);
+	});
+}
+
+// Multishot receive into the buffers of the ring. done gets the bytes in
+// buffer(flags >> IORING_CQE_BUFFER_SHIFT) and has to recycle() it.
+inline uint64_t EventLoop::receive(int fd,Done done){
+	io_uring_sqe* e = ring.sqe();
+	e->opcode = IORING_OP_RECV;
+	e->fd = fd;
+	e->ioprio = IORING_RECV_MULTISHOT;
+	e->flags = IOSQE_BUFFER_SELECT;
+	e->buf_group = URING_BUFFER_GROUP;
+	return start(e,std::move(done));
+}
+
+// msg, its iovecs and the bytes they point to have to live as long as keep.
+inline uint64_t EventLoop::sendmsg(int fd,const msghdr* msg,std::shared_ptr<void> keep,Done done){
+	io_uring_sqe* e = ring.sqe();
+	e->opcode = IORING_OP_SENDMSG;
+	e->fd = fd;
+	e->addr = (uint64_t)(uintptr_t)msg;
+	e->len = 1;
+	e->msg_flags = MSG_NOSIGNAL;
+	return start(e,std::move(done),std::move(keep));
+}
+
+// fdatasync() without blocking the loop, done gets 0 or -errno.
+inline uint64_t EventLoop::fsync(int fd,std::function<void(int32_t)> done){
+	io_uring_sqe* e = ring.sqe();
+	e->opcode = IORING_OP_FSYNC;
+	e->fd = fd;
+	e->fsync_flags = IORING_FSYNC_DATASYNC;
+	return start(e,[done](int32_t res,uint32_t){ done(res); });
+}
+
+// unlink() without blocking the loop on freeing the blocks of a large file.
+inline uint64_t EventLoop::unlink(const std::string& path,std::function<void(int32_t)> done){
+	std::shared_ptr<std::string> name = std::make_shared<std::string>(path);
+	io_uring_sqe* e = ring.sqe();
+	e->opcode = IORING_OP_UNLINKAT;
+	e->fd = AT_FDCWD;
+	e->addr = (uint64_t)(uintptr_t)name->c_str();
+	e->unlink_flags = 0;
+	return start(e,[done](int32_t res,uint32_t){ done(res); },name);
+}
+
+// Cancels op, its done still sees the completions up to the last one.
+inline void EventLoop::interrupt(uint64_t op){
+	auto it = ops.find(op);
+	if(it != ops.end() && !it->second.dead)
+		abort(op);
+}
+
+// Cancels op without calling its done again, for owners that go away.
+inline void EventLoop::forget(uint64_t op){
+	auto it = ops.find(op);
+	if(it == ops.end() || it->second.dead)
+		return;
+	it->second.dead = true;
+	abort(op);
+}
+
+// done may start and forget operations, the entry is only erased with the
+// last completion and map references survive rehashing.
+inline void EventLoop::complete(uint64_t id,int32_t res,uint32_t flags){
+	auto it = ops.find(id);
+	bool last = !(flags & IORING_CQE_F_MORE);
+	if(it == ops.end() || it->second.dead){
+		if(flags & IORING_CQE_F_BUFFER)
+			ring.recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+		if(it != ops.end() && last)
+			ops.erase(it);
+		return;
+	}
+	if(!last){
+		it->second.done(res,flags);
+		return;
+	}
+	Done done = std::move(it->second.done);
+	std::shared_ptr<void> keep = std::move(it->second.keep);
+	ops.erase(it);
+	done(res,flags);
+}
+
+inline void EventLoop::post(std::function<void()> f){
+	if(scheduler){
+		scheduler->at(scheduler->now(),std::move(f));
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(postMutex);
+		posted.push_back(std::move(f));
+	}
+	uint64_t one = 1;
+	ssize_t rc = ::write(wakefd,&one,sizeof one);
+	(void)rc;
+}
+
+inline void EventLoop::onEvents(uint32_t){
+	uint64_t n;
+	while(::read(wakefd,&n,sizeof n) > 0)
+		;
+}
+
+inline void EventLoop::runPosted(){
+	std::vector<std::function<void()>> tasks;
+	{
+		std::lock_guard<std::mutex> lock(postMutex);
+		tasks.swap(posted);
+	}
+	for(auto& task : tasks)
+		task();
+}
+
+// Loop thread only. Runs f once, ms milliseconds from now. Returns an id for cancel().
+inline uint64_t EventLoop::after(int64_t ms,std::function<void()> f){
+	if(scheduler)
+		return scheduler->at(scheduler->now() + ms,std::move(f));
+	uint64_t id = nextTimer++;
+	int64_t deadline = nowMs() + ms;
+	timers.emplace(std::make_pair(deadline,id),std::move(f));
+	timerDeadlines.emplace(id,deadline);
+	return id;
+}
+
+inline void EventLoop::cancel(uint64_t timer){
+	if(scheduler){
+		scheduler->cancel(timer);
+		return;
+	}
+	auto it = timerDeadlines.find(timer);
+	if(it == timerDeadlines.end())
+		return;
+	timers.erase(std::make_pair(it->second,timer));
+	timerDeadlines.erase(it);
+}
+
+inline void EventLoop::runTimers(){
+	int64_t now = nowMs();
+	while(!timers.empty() && timers.begin()->first.first <= now){
+		std::function<void()> f = std::move(timers.begin()->second);
+		timerDeadlines.erase(timers.begin()->first.second);
+		timers.erase(timers.begin());
+		f();
+	}
+}
+
+// Handles one batch of events, due timers and everything posted meanwhile. Returns the number of events.
+inline int EventLoop::runOnce(int timeoutMs){
+	if(!timers.empty()){
+		int64_t wait = std::max<int64_t>(0,timers.begin()->first.first - nowMs());
+		if(timeoutMs < 0 || wait < timeoutMs)
+			timeoutMs = wait;
+	}
+	int n;
+	if(io == LOOP_URING){
+		ring.submit(1,timeoutMs);
+		n = ring.reap([this](uint64_t op,int32_t res,uint32_t flags){ complete(op,res,flags); });
+	}
+	else{
+		epoll_event events[EPOLL_EVENTS];
+		n = epoll_wait(epfd,events,EPOLL_EVENTS,timeoutMs);
+		for(int i = 0;i < n;i++)
+			static_cast<Pollable*>(events[i].data.ptr)->onEvents(events[i].events);
+	}
+	runTimers();
+	runPosted();
+	return n < 0 ? 0 : n;
+}
+
+inline void EventLoop::run(){
+	running = true;
+	while(running)
+		runOnce(-1);
+}
+
+inline void EventLoop::stop(){
+	post([this](){ running = false; });
+}
+
+// Growable byte buffer consumed from the front. Consumed bytes are only
+// moved once half of the storage is dead, so parsing frames is O(1) per frame.
+class ByteBuffer{
+	private:
+		std::vector<uint8_t> data;
+		size_t head;
+		size_t tail;
+	public:
+		ByteBuffer() : head(0),tail(0) {}
+		const uint8_t* begin() const { return data.data() + head; }
+		size_t size() const { return tail - head; }
+		bool empty() const { return head == tail; }
+		uint8_t* reserve(size_t n){
+			if(data.size() - tail < n){
+				if(head > 0 && head >= data.size() / 2){
+					memmove(data.data(),data.data() + head,tail - head);
+					tail -= head;
+					head = 0;
+				}
+				if(data.size() - tail < n)
+					data.resize(tail + n);
+			}
+			return data.data() + tail;
+		}
+		void commit(size_t n){ tail += n; }
+		void append(const void* p,size_t n){
+			memcpy(reserve(n),p,n);
+			commit(n);
+		}
+		void consume(size_t n){
+			head += n;
+			if(head == tail)
+				head = tail = 0;
+		}
+};
+
+inline void putU32(uint8_t* p,uint32_t v){
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+inline uint32_t getU32(const uint8_t* p){
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// A message serialized once, length prefix included. Send queues hold
+// references, so a broadcast to many peers shares one copy of the bytes.
+typedef std::shared_ptr<const std::vector<uint8_t>> Frame;
+
+// Frame whose payload starts with a message type byte.
+inline Frame makeFrame(uint8_t type,const void* data,size_t size){
+	std::shared_ptr<std::vector<uint8_t>> f = std::make_shared<std::vector<uint8_t>>(FRAME_HEADER + 1 + size);
+	putU32(f->data(),size + 1);
+	(*f)[FRAME_HEADER] = type;
+	if(size)
+		memcpy(f->data() + FRAME_HEADER + 1,data,size);
+	return f;
+}
+
+inline Frame makeFrame(const void* data,size_t size){
+	std::shared_ptr<std::vector<uint8_t>> f = std::make_shared<std::vector<uint8_t>>(FRAME_HEADER + size);
+	putU32(f->data(),size);
+	if(size)
+		memcpy(f->data() + FRAME_HEADER,data,size);
+	return f;
+}
+
+class PeerServer;
+
+// One peer socket with its own read buffer and a queue of frames to send.
+// Every message on the wire is a FRAME_HEADER length prefix followed by the
+// payload. A queue above SEND_HIGH_WATER stops reading from the peer until
+// it drained to SEND_LOW_WATER, since most of what we send answers what it
+// asks; above SEND_LIMIT the peer is not keeping up and is disconnected.
+// On a LOOP_URING loop the socket is not polled once connected: one
+// multishot receive stays armed while reading and one sendmsg at a time
+// takes whatever frames queued up behind the previous one.
+class Connection : public Pollable{
+	friend class PeerServer;
+	private:
+		// What an io_uring sendmsg reads, held until its completion even if the connection is gone.
+		struct SendBatch{
+			msghdr msg;
+			iovec iov[WRITEV_MAX];
+			Frame frames[WRITEV_MAX];
+		};
+		PeerServer* server;
+		EventLoop* loop;
+		int fd;
+		Link* link; // instead of fd
+		uint64_t connId;
+		bool uring;
+		bool connecting;
+		bool writing;
+		bool closed;
+		bool paused;
+		bool congested; // queue above SEND_HIGH_WATER, not reading
+		bool dropping;  // queue above SEND_LIMIT, closed after the current batch
+		uint64_t receiving; // io_uring operations, 0 for none
+		uint64_t sending;
+		ByteBuffer in;
+		std::deque<Frame> queue;
+		size_t queueHead; // bytes of queue.front() already sent
+		size_t queued;
+		void consume(size_t n);
+		void drained();
+		void readable();
+		void received(int32_t res,uint32_t flags);
+		void sent(int32_t res);
+		void deliver();
+		void connected();
+		void updateEvents();
+	public:
+		Connection(PeerServer* s,EventLoop* l,int f,uint64_t id,bool c);
+		~Connection();
+		uint64_t id() const { return connId; }
+		bool isClosed() const { return closed; }
+		bool isPaused() const { return paused; }
+		bool isCongested() const { return congested; }
+		size_t pendingBytes() const { return queued; }
+		void send(const Frame& frame);
+		void send(const void* data,size_t size);
+		void send(uint8_t type,const void* data,size_t size);
+		void receive(const uint8_t* data,size_t size);
+		void flush();
+		void close();
+		void pause();
+		void resume();
+		void onEvents(uint32_t events) override;
+};
+
+// Listening socket plus all connections that belong to one event loop.
+class PeerServer : public Pollable{
+	friend class Connection;
+	private:
+		EventLoop& loop;
+		int listenfd;
+		uint16_t listenPort;
+		uint64_t nextId;
+		std::unordered_map<uint64_t,std::unique_ptr<Connection>> connections;
+		std::shared_ptr<PeerServer*> alive; // posted work holds it weakly, reset when the server goes
+		Connection* adopt(int fd,bool connecting);
+		void closed(Connection* c);
+		template<class F> void post(F f);
+	public:
+		std::function<void(Connection&)> onConnect;
+		std::function<void(Connection&)> onDisconnect;
+		std::function<void(Connection&,const uint8_t*,size_t)> onMessage;
+		std::function<void(Connection&)> onDrained; // a congested connection is down to SEND_LOW_WATER
+		uint64_t bytesIn;  // over all connections, loop thread only
+		uint64_t bytesOut;
+
+		explicit PeerServer(EventLoop& l);
+		~PeerServer();
+		bool listen(uint16_t port,const char* host = "127.0.0.1");
+		uint16_t port() const { return listenPort; }
+		Connection* connect(const char* host,uint16_t port);
+		Connection* attach(Link* link);
+		Connection* find(uint64_t id);
+		size_t size() const { return connections.size(); }
+		void broadcast(const Frame& frame,uint64_t except = 0);
+		template<class F> void forEach(F f){
+			for(auto& c : connections)
+				if(!c.second->isClosed())
+					f(*c.second);
+		}
+		void onEvents(uint32_t events) override;
+};
+
+inline Connection::Connection(PeerServer* s,EventLoop* l,int f,uint64_t id,bool c){
+	this->server = s;
+	this->loop = l;
+	this->fd = f;
+	this->link = nullptr;
+	this->connId = id;
+	this->uring = f >= 0 && l->backend() == LOOP_URING;
+	this->connecting = c;
+	this->writing = c;
+	this->closed = false;
+	this->paused = false;
+	this->congested = false;
+	this->dropping = false;
+	this->receiving = 0;
+	this->sending = 0;
+	this->queueHead = 0;
+	this->queued = 0;
+}
+
+inline Connection::~Connection(){
+	if(receiving)
+		loop->forget(receiving);
+	if(sending)
+		loop->forget(sending);
+	if(fd >= 0)
+		::close(fd);
+}
+
+inline void Connection::updateEvents(){
+	if(fd < 0)
+		return;
+	bool reading = !paused && !congested;
+	if(uring){
+		// a receive interrupted while it had data still hands it over, and is armed again by received()
+		if(connecting || closed)
+			return;
+		if(reading && !receiving)
+			receiving = loop->receive(fd,[this](int32_t res,uint32_t flags){ received(res,flags); });
+		else if(!reading && receiving)
+			loop->interrupt(receiving);
+		return;
+	}
+	loop->modify(fd,(reading ? (uint32_t)(EPOLLIN | EPOLLRDHUP) : 0) | (writing ? (uint32_t)EPOLLOUT : 0),this);
+}
+
+inline void Connection::onEvents(uint32_t events){
+	if(closed)
+		return;
+	if(connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+		connected();
+	if(uring)
+		return;
+	if(!closed && (paused || congested) && (events & (EPOLLERR | EPOLLHUP))){
+		close();
+		return;
+	}
+	if(!closed && (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)))
+		readable();
+	if(!closed && (events & EPOLLOUT))
+		flush();
+}
+
+inline void Connection::connected(){
+	int err = 0;
+	socklen_t len = sizeof err;
+	getsockopt(fd,SOL_SOCKET,SO_ERROR,&err,&len);
+	if(err){
+		close();
+		return;
+	}
+	connecting = false;
+	if(uring){
+		loop->remove(fd);
+		updateEvents();
+	}
+	if(server->onConnect)
+		server->onConnect(*this);
+	flush();
+}
+
+inline void Connection::readable(){
+	bool eof = false;
+	for(;;){
+		uint8_t* p = in.reserve(READ_CHUNK);
+		ssize_t n = ::recv(fd,p,READ_CHUNK,0);
+		if(n > 0){
+			in.commit(n);
+			server->bytesIn += n;
+			continue;
+		}
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		// orderly shutdown or error, deliver the complete frames first
+		eof = true;
+		break;
+	}
+	deliver();
+	if(eof)
+		close();
+}
+
+// Completion of the multishot receive, the bytes are copied out and the
+// buffer goes straight back to the ring.
+inline void Connection::received(int32_t res,uint32_t flags){
+	if(flags & IORING_CQE_F_BUFFER){
+		uint16_t id = flags >> IORING_CQE_BUFFER_SHIFT;
+		if(res > 0 && !closed){
+			in.append(loop->buffer(id),res);
+			server->bytesIn += res;
+		}
+		loop->recycle(id);
+	}
+	if(!(flags & IORING_CQE_F_MORE))
+		receiving = 0;
+	if(closed)
+		return;
+	// -ENOBUFS: every buffer was in use, the new receive goes out after this batch gave them back
+	if(res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)){
+		deliver();
+		close();
+		return;
+	}
+	deliver();
+	if(!receiving)
+		updateEvents();
+}
+
+// Hands every complete frame to onMessage until the connection is paused
+// or congested.
+inline void Connection::deliver(){
+	while(in.size() >= FRAME_HEADER && !closed && !paused && !congested){
+		uint32_t len = getU32(in.begin());
+		if(len > FRAME_MAX){
+			close();
+			return;
+		}
+		if(in.size() < FRAME_HEADER + len)
+			break;
+		if(server->onMessage)
+			server->onMessage(*this,in.begin() + FRAME_HEADER,len);
+		in.consume(FRAME_HEADER + len);
+	}
+}
+
+// Stops reading from the socket, frames already buffered wait for resume().
+// The kernel buffers fill up and TCP pushes back on the sender.
+inline void Connection::pause(){
+	if(closed || paused)
+		return;
+	paused = true;
+	updateEvents();
+}
+
+inline void Connection::resume(){
+	if(closed || !paused)
+		return;
+	paused = false;
+	updateEvents();
+	deliver();
+}
+
+// Queues a reference to frame and writes what the socket takes right away.
+inline void Connection::send(const Frame& frame){
+	if(closed || dropping)
+		return;
+	queue.push_back(frame);
+	queued += frame->size();
+	flush();
+	if(closed || queued <= SEND_HIGH_WATER)
+		return;
+	if(queued > SEND_LIMIT){
+		// the caller may still use the connection, close it after the current batch
+		dropping = true;
+		uint64_t conn = connId;
+		PeerServer* s = server;
+		s->post([conn](PeerServer& server){
+			Connection* c = server.find(conn);
+			if(c)
+				c->close();
+		});
+	}
+	if(!congested){
+		congested = true;
+		updateEvents();
+	}
+}
+
+inline void Connection::send(const void* data,size_t size){
+	send(makeFrame(data,size));
+}
+
+// Frame whose payload starts with a message type byte.
+inline void Connection::send(uint8_t type,const void* data,size_t size){
+	send(makeFrame(type,data,size));
+}
+
+// Bytes the link delivered, in order.
+inline void Connection::receive(const uint8_t* data,size_t size){
+	if(closed)
+		return;
+	in.append(data,size);
+	server->bytesIn += size;
+	deliver();
+}
+
+// Drops n sent bytes from the front of the queue.
+inline void Connection::consume(size_t n){
+	server->bytesOut += n;
+	queued -= n;
+	while(n){
+		size_t left = queue.front()->size() - queueHead;
+		if(n < left){
+			queueHead += n;
+			return;
+		}
+		n -= left;
+		queueHead = 0;
+		queue.pop_front();
+	}
+}
+
+// Reading resumes once the queue is down to SEND_LOW_WATER. Buffered frames
+// are delivered from the loop, flush() may run inside onMessage.
+inline void Connection::drained(){
+	if(!congested || queued > SEND_LOW_WATER)
+		return;
+	congested = false;
+	updateEvents();
+	if(server->onDrained)
+		server->onDrained(*this);
+	uint64_t conn = connId;
+	PeerServer* s = server;
+	s->post([conn](PeerServer& server){
+		Connection* c = server.find(conn);
+		if(c)
+			c->deliver();
+	});
+}
+
+// Writes as many queued frames as the socket takes, up to WRITEV_MAX per
+// sendmsg() call, without copying them.
+inline void Connection::flush(){
+	if(closed || connecting)
+		return;
+	if(uring){
+		if(sending || queue.empty())
+			return;
+		std::shared_ptr<SendBatch> batch = std::make_shared<SendBatch>();
+		size_t n = 0;
+		for(auto it = queue.begin();it != queue.end() && n < WRITEV_MAX;++it,n++){
+			size_t skip = n ? 0 : queueHead;
+			batch->frames[n] = *it;
+			batch->iov[n].iov_base = (void*)((*it)->data() + skip);
+			batch->iov[n].iov_len = (*it)->size() - skip;
+		}
+		memset(&batch->msg,0,sizeof batch->msg);
+		batch->msg.msg_iov = batch->iov;
+		batch->msg.msg_iovlen = n;
+		sending = loop->sendmsg(fd,&batch->msg,batch,[this](int32_t res,uint32_t){ sent(res); });
+		return;
+	}
+	if(link){
+		while(!queue.empty()){
+			const Frame& f = queue.front();
+			link->carry(*this,f->data() + queueHead,f->size() - queueHead);
+			consume(f->size() - queueHead);
+		}
+		drained();
+		return;
+	}
+	while(!queue.empty()){
+		iovec iov[WRITEV_MAX];
+		size_t n = 0;
+		for(auto it = queue.begin();it != queue.end() && n < WRITEV_MAX;++it,n++){
+			size_t skip = n ? 0 : queueHead;
+			iov[n].iov_base = (void*)((*it)->data() + skip);
+			iov[n].iov_len = (*it)->size() - skip;
+		}
+		msghdr msg;
+		memset(&msg,0,sizeof msg);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+		ssize_t sent = ::sendmsg(fd,&msg,MSG_NOSIGNAL);
+		if(sent > 0){
+			consume(sent);
+			continue;
+		}
+		if(sent < 0 && errno == EINTR)
+			continue;
+		if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		close();
+		return;
+	}
+	bool want = !queue.empty();
+	if(want != writing){
+		writing = want;
+		updateEvents();
+	}
+	drained();
+}
+
+// Completion of the sendmsg started by flush().
+inline void Connection::sent(int32_t res){
+	sending = 0;
+	if(closed)
+		return;
+	if(res < 0){
+		close();
+		return;
+	}
+	consume(res);
+	flush();
+	drained();
+}
+
+inline void Connection::close(){
+	if(closed)
+		return;
+	closed = true;
+	if(fd >= 0)
+		loop->remove(fd);
+	// the ring holds its own reference to the socket, this ends the operations on it
+	if(uring)
+		shutdown(fd,SHUT_RDWR);
+	if(link)
+		link->closed(*this);
+	server->closed(this);
+}
+
+inline PeerServer::PeerServer(EventLoop& l) : loop(l){
+	listenfd = -1;
+	listenPort = 0;
+	nextId = 1;
+	bytesIn = 0;
+	bytesOut = 0;
+	alive = std::make_shared<PeerServer*>(this);
+}
+
+inline PeerServer::~PeerServer(){
+	alive.reset();
+	for(auto& c : connections)
+		if(c.second->fd >= 0)
+			loop.remove(c.second->fd);
+	if(listenfd >= 0){
+		loop.remove(listenfd);
+		::close(listenfd);
+	}
+}
+
+inline bool PeerServer::listen(uint16_t port,const char* host){
+	listenfd = socket(AF_INET,SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,0);
+	int one = 1;
+	setsockopt(listenfd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof one);
+	sockaddr_in addr;
+	memset(&addr,0,sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	inet_pton(AF_INET,host,&addr.sin_addr);
+	if(bind(listenfd,(sockaddr*)&addr,sizeof addr) != 0 || ::listen(listenfd,SOMAXCONN) != 0){
+		::close(listenfd);
+		listenfd = -1;
+		return false;
+	}
+	socklen_t len = sizeof addr;
+	getsockname(listenfd,(sockaddr*)&addr,&len);
+	listenPort = ntohs(addr.sin_port);
+	return loop.add(listenfd,EPOLLIN,this);
+}
+
+inline Connection* PeerServer::adopt(int fd,bool connecting){
+	int one = 1;
+	setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof one);
+	uint64_t id = nextId++;
+	Connection* c = new Connection(this,&loop,fd,id,connecting);
+	connections.emplace(id,std::unique_ptr<Connection>(c));
+	if(!c->uring)
+		loop.add(fd,EPOLLIN | EPOLLRDHUP | (connecting ? (uint32_t)EPOLLOUT : 0),c);
+	else if(connecting)
+		loop.add(fd,EPOLLOUT,c);
+	else
+		c->updateEvents();
+	return c;
+}
+
+// Accepts every pending connection.
+inline void PeerServer::onEvents(uint32_t){
+	for(;;){
+		int fd = accept4(listenfd,nullptr,nullptr,SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd < 0){
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		Connection* c = adopt(fd,false);
+		if(onConnect)
+			onConnect(*c);
+	}
+}
+
+inline Connection* PeerServer::connect(const char* host,uint16_t port){
+	int fd = socket(AF_INET,SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,0);
+	sockaddr_in addr;
+	memset(&addr,0,sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	inet_pton(AF_INET,host,&addr.sin_addr);
+	if(::connect(fd,(sockaddr*)&addr,sizeof addr) != 0 && errno != EINPROGRESS){
+		::close(fd);
+		return nullptr;
+	}
+	return adopt(fd,true);
+}
+
+// A connection whose bytes are carried by link instead of a socket, connected right away.
+inline Connection* PeerServer::attach(Link* link){
+	uint64_t id = nextId++;
+	Connection* c = new Connection(this,&loop,-1,id,false);
+	c->link = link;
+	connections.emplace(id,std::unique_ptr<Connection>(c));
+	if(onConnect)
+		onConnect(*c);
+	return c;
+}
+
+inline Connection* PeerServer::find(uint64_t id){
+	auto it = connections.find(id);
+	if(it == connections.end() || it->second->isClosed())
+		return nullptr;
+	return it->second.get();
+}
+
+// Queues the same frame on every open connection but except.
+inline void PeerServer::broadcast(const Frame& frame,uint64_t except){
+	std::vector<Connection*> targets;
+	forEach([&](Connection& c){
+		if(c.id() != except)
+			targets.push_back(&c);
+	});
+	for(Connection* c : targets)
+		c->send(frame);
+}
+
+// The connection may still be on the call stack, it is freed after the current batch.
+inline void PeerServer::closed(Connection* c){
+	uint64_t id = c->id();
+	if(onDisconnect)
+		onDisconnect(*c);
+	post([id](PeerServer& server){ server.connections.erase(id); });
+}
+
+// Runs f(server) on the loop after the current batch, unless the server
+// was destroyed by then.
+template<class F> inline void PeerServer::post(F f){
+	std::weak_ptr<PeerServer*> w = alive;
+	loop.post([w,f](){
+		std::shared_ptr<PeerServer*> s = w.lock();
+		if(s)
+			f(**s);
+	});
+}
+
+#endif
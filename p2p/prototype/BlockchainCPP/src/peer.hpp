@@ -0,0 +1,504 @@
+#ifndef PEER_HPP
+#define PEER_HPP
+
+#include <deque>
+#include <sys/stat.h>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include "blockchain.hpp"
+#include "net.hpp"
+#include "threadpool.hpp"
+#include "pipeline.hpp"
+#include "sign.hpp"
+#include "store.hpp"
+#include "state.hpp"
+#include "forks.hpp"
+#include "mempool.hpp"
+#include "gossip.hpp"
+#include "proof.hpp"
+#include "protocol.hpp"
+
+#define MAX_ORPHANS 1024 // blocks kept while their parent is still missing
+#define PEER_PIPELINE_DEPTH 256 // blocks in verification before connections are paused
+#define HEADERS_PER_MESSAGE 2000
+#define PEER_MEMPOOL_CAPACITY 16384
+
+// Results of Peer::link()
+#define LINK_OK 0
+#define LINK_ORPHAN 1   // parent not known yet
+#define LINK_INVALID 2  // state transition failed, could not be stored or forks off a final block
+
+// Peer daemon: one event loop thread owns the sockets and the chain,
+// blocks go through the verification pipeline on the worker pool and the
+// verdicts are posted back to the loop in arrival order, so the chain is
+// only ever touched by one thread. Linking a block hands it to the fork
+// choice, which applies it to the account state if it extends the chain
+// and switches branches when a longer one turns up; transactions of blocks
+// taken off the chain go back to the mempool. With a store opened, blocks
+// are persisted as they join the chain, the state is snapshotted at every
+// committed state root and a restart picks the longest stored branch and
+// loads the latest snapshot on it plus the blocks after it. Headers and stored bodies
+// are served to syncing nodes, see Sync. With gossip.relay set, linked
+// blocks and new transactions are announced to every connection. Light
+// clients get accounts and stored transactions with their Merkle proofs.
+// Without workers and with a scheduler instead of sockets, the node runs
+// single threaded inside a Simulator. On a LOOP_URING loop the store syncs
+// through the ring as well. With a disk budget the oldest segments of the
+// store are deleted while store and snapshot take more, down to the blocks
+// a restart replays on the snapshot and those the fork choice can still
+// switch away from; headers are kept, pruned bodies are not found.
+class Peer{
+	private:
+		struct Orphan{
+			std::shared_ptr<BlockData> block;
+			uint64_t conn;
+		};
+		struct Pending{
+			uint64_t conn;
+			std::vector<uint8_t> bytes;
+		};
+		std::unordered_map<Digest,Orphan,DigestHash> orphans; // keyed by their own hash
+		std::unordered_multimap<Digest,Digest,DigestHash> waiting; // orphan hashes by previous hash
+		std::deque<Pending> backlog;                           // blocks that did not fit into the pipeline
+		std::unordered_set<uint64_t> paused;                   // connections waiting for the backlog to drain
+		std::unordered_map<uint64_t,int64_t> linkFree;         // per connection, when the simulated link is idle again
+		void onMessage(Connection& c,const uint8_t* data,size_t size);
+		void receive(Connection& c,std::vector<uint8_t>&& bytes);
+		void serveHeaders(Connection& c,const uint8_t* data,size_t size);
+		void serveBodies(Connection& c,const uint8_t* data,size_t size);
+		void serveProof(Connection& c,uint8_t type,const uint8_t* data,size_t size);
+		void respond(uint64_t conn,uint8_t type,std::vector<uint8_t> payload);
+		void verified(uint64_t conn,std::shared_ptr<BlockData> block,bool ok);
+		void verdict(uint64_t conn,const Block& block,bool ok);
+		void adopt(const Digest& parent);
+		void dropOrphans(const Digest& parent);
+		void refill();
+		void prune();
+		int link(const std::shared_ptr<BlockData>& block,uint64_t conn);
+		std::vector<Block> storedChain() const;
+		std::string snapshotPath;
+		uint64_t snapshotHeight;
+		void reply(uint64_t conn,uint8_t type,const Digest& hash);
+	public:
+		EventLoop loop;
+		PeerServer server;
+		Blockchain chain;
+		ThreadPool pool;
+		Pipeline pipeline;
+		BlockStore store;
+		State state;
+		ForkChoice forks;
+		Mempool mempool;
+		Gossip gossip;
+		uint64_t replayed; // blocks applied to the state by open()
+		uint64_t received;
+		uint64_t accepted;
+		uint64_t rejected;
+		uint64_t reorgs;    // times the chain switched to another branch
+		uint32_t latencyMs; // responses to header and body requests are delayed as if sent
+		uint64_t bandwidth; // over a link this slow, in bytes per second, 0 for none; for tests
+		uint64_t diskBudget; // bytes for store and snapshot, 0 keeps every block
+
+		std::function<void(Connection&,const uint8_t*,size_t)> onReply; // MSG_HEADERS, MSG_BODY, MSG_NOT_FOUND and MSG_PROOF
+		std::function<void(const Block&,bool)> onVerdict;             // every block that was linked or rejected
+
+		explicit Peer(unsigned workers = std::max(1u,std::thread::hardware_concurrency()),Scheduler* scheduler = nullptr,size_t mempoolCapacity = PEER_MEMPOOL_CAPACITY,int io = LOOP_EPOLL);
+		bool listen(uint16_t port){ return server.listen(port); }
+		bool open(const std::string& dir);
+		void run(){ loop.run(); }
+		void stop(){ loop.stop(); }
+		size_t backlogged() const { return backlog.size(); }
+		static void sendBlock(Connection& c,const BlockData& block);
+		bool proveAccount(const Digest& key,AccountProof& proof) const;
+		bool proveTransaction(const Digest& block,uint32_t index,TransactionProof& proof) const;
+};
+
+inline Peer::Peer(unsigned workers,Scheduler* scheduler,size_t mempoolCapacity,int io) : loop(scheduler,io),server(loop),pool(workers),pipeline(pool,PEER_PIPELINE_DEPTH),forks(chain,state),mempool(mempoolCapacity),gossip(loop,server,mempool,chain,store){
+	snapshotHeight = 0;
+	replayed = 0;
+	received = 0;
+	accepted = 0;
+	rejected = 0;
+	reorgs = 0;
+	latencyMs = 0;
+	bandwidth = 0;
+	diskBudget = 0;
+	server.onMessage = [this](Connection& c,const uint8_t* data,size_t size){ onMessage(c,data,size); };
+	server.onDisconnect = [this](Connection& c){
+		paused.erase(c.id());
+		linkFree.erase(c.id());
+		gossip.forget(c.id());
+	};
+	gossip.submitBlock = [this](Connection& c,std::vector<uint8_t>&& bytes){ receive(c,std::move(bytes)); };
+	pipeline.checkSignature = verifyTransaction;
+	// Runs on a worker, in submission order. The block moves to the loop without a copy.
+	pipeline.done = [this](uint64_t conn,BlockData& block,int status){
+		std::shared_ptr<BlockData> b = std::make_shared<BlockData>(std::move(block));
+		loop.post([this,conn,b,status](){ verified(conn,b,status == PIPE_OK); });
+	};
+	// not from done, the block still counts as in flight there and the backlog would stall
+	pipeline.room = [this](){ loop.post([this](){ refill(); }); };
+	if(loop.backend() == LOOP_URING)
+		store.sync = [this](int fd,std::function<void(int)> done){ loop.fsync(fd,done); };
+	store.discard = [this](const std::string& path){
+		if(loop.backend() == LOOP_URING)
+			loop.unlink(path,[](int32_t){});
+		else
+			pool.submit([path](){ ::unlink(path.c_str()); });
+	};
+	forks.persist = [this](const BlockData& block){
+		return !store.isOpen() || store.contains(block.header.hash) || store.append(block) >= 0;
+	};
+}
+
+// Call before run(). The chain is rebuilt from headers.dat. The state comes
+// from the snapshot if the block it was taken at is on the chain and
+// commits to its hash, otherwise every stored block of the chain is
+// applied again. The blocks after the snapshot can be switched away from.
+// A pruned store cannot do without its snapshot.
+inline bool Peer::open(const std::string& dir){
+	if(store.open(dir) != STORE_OK)
+		return false;
+	std::vector<Block> path = storedChain();
+	snapshotPath = dir + "/state.snap";
+	uint64_t from = 0;
+	SnapshotInfo info;
+	if(state.load(snapshotPath,info) == SNAPSHOT_OK && info.height < path.size() && path[info.height].hash == info.block && path[info.height].state == info.state){
+		from = info.height + 1;
+		snapshotHeight = info.height;
+	}
+	else
+		state.clear();
+	for(uint64_t h = 0;h < from;h++)
+		chain.append(path[h]);
+	if(chain.validate() != CHAIN_VALID)
+		return false;
+	for(uint64_t h = from;h < path.size();h++){
+		std::shared_ptr<BlockData> block = std::make_shared<BlockData>();
+		if(!store.get(path[h].hash,*block) || forks.add(block) != FORK_EXTENDED)
+			return false;
+		replayed++;
+	}
+	prune();
+	return true;
+}
+
+// The store keeps every block that was ever on the chain, parents first.
+// The chain is the longest branch among them, the first stored of equally
+// long ones, like the fork choice picked it.
+inline std::vector<Block> Peer::storedChain() const {
+	std::vector<Block> headers;
+	std::vector<int64_t> parents;
+	std::vector<uint64_t> heights;
+	std::unordered_map<Digest,size_t,DigestHash> positions;
+	Digest none;
+	none.fill(0);
+	int64_t best = -1;
+	store.forEachHeader([&](const Block& header){
+		auto parent = positions.find(header.phash);
+		if(header.phash != none && parent == positions.end())
+			return;
+		positions.emplace(header.hash,headers.size());
+		headers.push_back(header);
+		parents.push_back(header.phash == none ? -1 : (int64_t)parent->second);
+		heights.push_back(header.phash == none ? 0 : heights[parent->second] + 1);
+		if(best < 0 || heights.back() > heights[best])
+			best = headers.size() - 1;
+	});
+	std::vector<Block> path;
+	for(int64_t i = best;i >= 0;i = parents[i])
+		path.push_back(headers[i]);
+	std::reverse(path.begin(),path.end());
+	return path;
+}
+
+inline void Peer::sendBlock(Connection& c,const BlockData& block){
+	std::vector<uint8_t> bytes = encodeBlock(block);
+	c.send(MSG_BLOCK,bytes.data(),bytes.size());
+}
+
+inline void Peer::onMessage(Connection& c,const uint8_t* data,size_t size){
+	if(size == 0)
+		return;
+	switch(data[0]){
+		case MSG_PING:
+			c.send(MSG_PONG,data + 1,size - 1);
+			break;
+		case MSG_BLOCK:
+			receive(c,std::vector<uint8_t>(data + 1,data + size));
+			break;
+		case MSG_GET_HEADERS:
+			serveHeaders(c,data + 1,size - 1);
+			break;
+		case MSG_GET_BODIES:
+			serveBodies(c,data + 1,size - 1);
+			break;
+		case MSG_GET_ACCOUNT_PROOF:
+		case MSG_GET_TX_PROOF:
+			serveProof(c,data[0],data + 1,size - 1);
+			break;
+		case MSG_HEADERS:
+		case MSG_BODY:
+		case MSG_NOT_FOUND:
+		case MSG_PROOF:
+			if(onReply)
+				onReply(c,data,size);
+			break;
+		case MSG_INV:
+		case MSG_GET_DATA:
+		case MSG_TX:
+		case MSG_COMPACT:
+		case MSG_GET_BLOCK_TXS:
+		case MSG_BLOCK_TXS:
+			gossip.onMessage(c,data,size);
+			break;
+		default:
+			break;
+	}
+}
+
+// An encoded block from c, whole or rebuilt from a compact block.
+inline void Peer::receive(Connection& c,std::vector<uint8_t>&& bytes){
+	received++;
+	// blocks queue up behind the backlog to keep their order
+	if(backlog.empty() && pipeline.trySubmit(std::move(bytes),c.id()))
+		return;
+	backlog.push_back(Pending{c.id(),std::move(bytes)});
+	c.pause();
+	paused.insert(c.id());
+}
+
+inline void Peer::serveHeaders(Connection& c,const uint8_t* data,size_t size){
+	uint64_t first;
+	uint32_t count;
+	if(size != sizeof first + sizeof count)
+		return;
+	memcpy(&first,data,sizeof first);
+	memcpy(&count,data + sizeof first,sizeof count);
+	count = std::min<uint64_t>(count,HEADERS_PER_MESSAGE);
+	uint64_t end = first < chain.size() ? std::min<uint64_t>(chain.size(),first + count) : first;
+	std::vector<uint8_t> payload(sizeof first + (end - first) * WIRE_HEADER_SIZE);
+	memcpy(payload.data(),&first,sizeof first);
+	for(uint64_t h = first;h < end;h++)
+		writeHeader(payload.data() + sizeof first + (h - first) * WIRE_HEADER_SIZE,chain.at(h));
+	respond(c.id(),MSG_HEADERS,std::move(payload));
+}
+
+// Bodies come straight from the store, without decoding them.
+inline void Peer::serveBodies(Connection& c,const uint8_t* data,size_t size){
+	Digest hash;
+	for(size_t i = 0;i + hash.size() <= size;i += hash.size()){
+		memcpy(hash.data(),data + i,hash.size());
+		Bytes body = store.find(hash);
+		if(body.data)
+			respond(c.id(),MSG_BODY,std::vector<uint8_t>((const uint8_t*)body.data,(const uint8_t*)body.data + body.size));
+		else
+			respond(c.id(),MSG_NOT_FOUND,std::vector<uint8_t>(hash.begin(),hash.end()));
+	}
+}
+
+// Proves against the tip, which has to commit to the state whose tree the
+// state kept. Blocks in between two commitments leave the accounts
+// unprovable until the next one.
+inline bool Peer::proveAccount(const Digest& key,AccountProof& proof) const {
+	if(chain.empty())
+		return false;
+	proof.header = chain.tip();
+	proof.key = key;
+	return state.prove(chain.tip().state,key,proof.account,proof.path);
+}
+
+// Any transaction of a stored block of the chain.
+inline bool Peer::proveTransaction(const Digest& block,uint32_t index,TransactionProof& proof) const {
+	const Block* header = chain.find(block);
+	BlockData data;
+	if(!header || !store.get(block,data) || index >= data.txs.size())
+		return false;
+	proof.header = *header;
+	proof.tx = data.txs[index];
+	proof.path = ::proveTransaction(data.txs,index);
+	return true;
+}
+
+inline void Peer::serveProof(Connection& c,uint8_t type,const uint8_t* data,size_t size){
+	Digest key;
+	uint32_t index = 0;
+	if(size != key.size() + (type == MSG_GET_TX_PROOF ? sizeof index : 0))
+		return;
+	memcpy(key.data(),data,key.size());
+	memcpy(&index,data + key.size(),size - key.size());
+	std::vector<uint8_t> payload;
+	AccountProof account;
+	TransactionProof tx;
+	if(type == MSG_GET_ACCOUNT_PROOF && proveAccount(key,account))
+		payload = encodeProof(account);
+	else if(type == MSG_GET_TX_PROOF && proveTransaction(key,index,tx))
+		payload = encodeProof(tx);
+	if(payload.empty())
+		respond(c.id(),MSG_NOT_FOUND,std::vector<uint8_t>(key.begin(),key.end()));
+	else
+		respond(c.id(),MSG_PROOF,std::move(payload));
+}
+
+// Sends now, or after the simulated link had time to carry the payload.
+// Responses on one connection queue up behind each other like on a wire.
+inline void Peer::respond(uint64_t conn,uint8_t type,std::vector<uint8_t> payload){
+	if(!latencyMs && !bandwidth){
+		Connection* c = server.find(conn);
+		if(c)
+			c->send(type,payload.data(),payload.size());
+		return;
+	}
+	int64_t now = loop.now();
+	int64_t& idle = linkFree[conn];
+	idle = std::max(now,idle) + (bandwidth ? (int64_t)(payload.size() * 1000 / bandwidth) : 0);
+	loop.after(idle + latencyMs - now,[this,conn,type,p = std::move(payload)](){
+		Connection* c = server.find(conn);
+		if(c)
+			c->send(type,p.data(),p.size());
+	});
+}
+
+inline void Peer::reply(uint64_t conn,uint8_t type,const Digest& hash){
+	Connection* c = server.find(conn);
+	if(c)
+		c->send(type,hash.data(),hash.size());
+}
+
+inline void Peer::verdict(uint64_t conn,const Block& block,bool ok){
+	reply(conn,ok ? MSG_ACCEPTED : MSG_REJECTED,block.hash);
+	if(onVerdict)
+		onVerdict(block,ok);
+}
+
+// Back on the loop thread. Blocks may finish verification out of order,
+// those whose parent is not there yet wait as orphans.
+inline void Peer::verified(uint64_t conn,std::shared_ptr<BlockData> data,bool ok){
+	const Block& block = data->header;
+	if(!ok){
+		rejected++;
+		verdict(conn,block,false);
+		return;
+	}
+	if(forks.contains(block.hash)){
+		verdict(conn,block,true);
+		return;
+	}
+	int rc = link(data,conn);
+	if(rc == LINK_ORPHAN && orphans.size() < MAX_ORPHANS){
+		if(orphans.emplace(block.hash,Orphan{data,conn}).second)
+			waiting.emplace(block.phash,block.hash);
+		return;
+	}
+	if(rc != LINK_OK){
+		rejected++;
+		verdict(conn,block,false);
+		return;
+	}
+	verdict(conn,block,true);
+	adopt(block.hash);
+}
+
+// Links the orphans that were waiting for parent, then theirs. The
+// descendants of one that fails are rejected with it.
+inline void Peer::adopt(const Digest& parent){
+	std::vector<Digest> linked = {parent};
+	while(!linked.empty()){
+		Digest hash = linked.back();
+		linked.pop_back();
+		auto range = waiting.equal_range(hash);
+		std::vector<Digest> children;
+		for(auto it = range.first;it != range.second;++it)
+			children.push_back(it->second);
+		waiting.erase(range.first,range.second);
+		for(const Digest& child : children){
+			auto it = orphans.find(child);
+			Orphan orphan = it->second;
+			orphans.erase(it);
+			if(link(orphan.block,orphan.conn) != LINK_OK){
+				rejected++;
+				verdict(orphan.conn,orphan.block->header,false);
+				dropOrphans(child);
+				continue;
+			}
+			verdict(orphan.conn,orphan.block->header,true);
+			linked.push_back(child);
+		}
+	}
+}
+
+// Rejects every orphan below parent.
+inline void Peer::dropOrphans(const Digest& parent){
+	std::vector<Digest> stack = {parent};
+	while(!stack.empty()){
+		Digest hash = stack.back();
+		stack.pop_back();
+		auto range = waiting.equal_range(hash);
+		for(auto it = range.first;it != range.second;++it){
+			auto o = orphans.find(it->second);
+			rejected++;
+			verdict(o->second.conn,o->second.block->header,false);
+			orphans.erase(o);
+			stack.push_back(it->second);
+		}
+		waiting.erase(range.first,range.second);
+	}
+}
+
+// Moves backlogged blocks into the pipeline as it makes room and lets the
+// paused connections read again once everything is submitted.
+inline void Peer::refill(){
+	while(!backlog.empty() && pipeline.trySubmit(std::move(backlog.front().bytes),backlog.front().conn))
+		backlog.pop_front();
+	if(!backlog.empty())
+		return;
+	for(uint64_t id : std::vector<uint64_t>(paused.begin(),paused.end())){
+		paused.erase(id);
+		Connection* c = server.find(id);
+		if(c)
+			c->resume();
+	}
+}
+
+// Blocks that joined the chain leave their transactions in the mempool
+// and are announced; those taken off it give theirs back first, the new
+// branch may contain them again.
+inline int Peer::link(const std::shared_ptr<BlockData>& data,uint64_t conn){
+	int rc = forks.add(data);
+	if(rc == FORK_ORPHAN)
+		return LINK_ORPHAN;
+	if(rc < 0)
+		return LINK_INVALID;
+	if(rc == FORK_KNOWN)
+		return LINK_OK;
+	accepted++;
+	if(rc == FORK_REORG)
+		reorgs++;
+	for(const std::shared_ptr<BlockData>& b : forks.disconnected())
+		for(const Transaction& tx : b->txs)
+			mempool.add(tx,0);
+	for(const std::shared_ptr<BlockData>& b : forks.connected())
+		gossip.linked(b,conn);
+	Digest none;
+	none.fill(0);
+	const Block& tip = chain.tip();
+	if(!forks.connected().empty() && store.isOpen() && tip.state != none && tip.height >= snapshotHeight + SNAPSHOT_INTERVAL && state.snapshot(snapshotPath,tip.height,tip.hash) == SNAPSHOT_OK)
+		snapshotHeight = tip.height;
+	if(!forks.connected().empty())
+		prune();
+	return LINK_OK;
+}
+
+// Nothing goes before the snapshot is taken, the first block is below every other.
+inline void Peer::prune(){
+	if(!diskBudget || !store.isOpen() || chain.empty())
+		return;
+	const Digest& keep = chain.at(std::min(snapshotHeight,forks.horizon())).hash;
+	struct stat st;
+	uint64_t snapshot = stat(snapshotPath.c_str(),&st) == 0 ? st.st_size : 0;
+	while(store.diskUsage() + snapshot > diskBudget && store.pruneOldest(keep))
+		;
+}
+
+#endif
@@ -0,0 +1,271 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+#include "wire.hpp"
+#include "threadpool.hpp"
+
+#define PIPE_OK 0
+#define PIPE_BAD_ENCODING -1
+#define PIPE_BAD_HASH -2
+#define PIPE_BAD_SIGNATURE -3
+#define PIPE_BAD_STATE -4
+
+#define STAGE_DECODE 0
+#define STAGE_HASH 1
+#define STAGE_SIGNATURE 2
+#define STAGE_APPLY 3
+#define STAGES 4
+
+#define SIGNATURE_BATCH 64 // transactions per signature task, larger blocks fan out across workers
+
+struct PipelineStats{
+	uint64_t blocks;
+	uint64_t transactions;
+	double seconds;
+	double blocksPerSecond;
+	double transactionsPerSecond;
+	size_t inflight;
+	size_t depth[STAGES];
+};
+
+// Staged block verification: decode -> hash -> signatures -> apply.
+// The first three stages run on the work-stealing pool, so independent
+// blocks and the signature batches of one block verify concurrently.
+// apply and done run strictly in submission order, one block at a time.
+// At most capacity blocks are in flight; that bounds every stage queue and
+// makes submit() block (or trySubmit() fail) when the node falls behind.
+class Pipeline{
+	public:
+		typedef std::function<bool(const Transaction&,const Digest&)> SignatureCheck;
+		typedef std::function<int(const BlockData&)> Apply;
+		typedef std::function<void(uint64_t,BlockData&,int)> Done;
+		typedef std::function<void()> Room;
+
+		SignatureCheck checkSignature; // called with the transaction and its hash, on any worker
+		Apply apply;                   // returns PIPE_OK or PIPE_BAD_STATE, in order
+		Done done;                     // gets the tag passed to submit() and the final status, in order, may move the block out
+		Room room;                     // after blocks left, when trySubmit() can succeed again, under the admission lock
+
+		Pipeline(ThreadPool& p,size_t capacity);
+		~Pipeline();
+		Pipeline(const Pipeline&) = delete;
+		Pipeline& operator=(const Pipeline&) = delete;
+
+		bool trySubmit(std::vector<uint8_t>&& bytes,uint64_t tag = 0);
+		void submit(std::vector<uint8_t> bytes,uint64_t tag = 0);
+		void drain();
+		PipelineStats stats();
+	private:
+		struct Job{
+			uint64_t seq;
+			uint64_t tag;
+			std::vector<uint8_t> bytes;
+			BlockView view; // over bytes until the hashes are checked
+			BlockData block;
+			std::vector<Digest> hashes;
+			std::atomic<size_t> batches;
+			std::atomic<bool> badSignature;
+			int status;
+		};
+		ThreadPool& pool;
+		size_t capacity;
+		std::mutex admitMutex;
+		std::condition_variable admitted;
+		size_t inflight;
+		uint64_t nextSeq;
+		std::mutex orderMutex;
+		std::vector<Job*> ready; // reorder window, slot seq % capacity
+		uint64_t nextApply;
+		std::atomic<size_t> depth[STAGES];
+		std::atomic<uint64_t> blocksDone;
+		std::atomic<uint64_t> transactionsDone;
+		std::chrono::steady_clock::time_point started;
+
+		void enqueue(Job* job);
+		void decode(Job* job);
+		void hash(Job* job);
+		void signatures(Job* job,size_t from,size_t to);
+		void finish(Job* job,int stage);
+};
+
+inline Pipeline::Pipeline(ThreadPool& p,size_t c) : pool(p),capacity(c ? c : 1),ready(capacity,nullptr){
+	inflight = 0;
+	nextSeq = 0;
+	nextApply = 0;
+	for(int i = 0;i < STAGES;i++)
+		depth[i] = 0;
+	blocksDone = 0;
+	transactionsDone = 0;
+	started = std::chrono::steady_clock::now();
+}
+
+inline Pipeline::~Pipeline(){
+	drain();
+}
+
+// Leaves bytes untouched when the pipeline is full.
+inline bool Pipeline::trySubmit(std::vector<uint8_t>&& bytes,uint64_t tag){
+	Job* job = new Job();
+	{
+		std::lock_guard<std::mutex> lock(admitMutex);
+		if(inflight >= capacity){
+			delete job;
+			return false;
+		}
+		inflight++;
+		job->seq = nextSeq++;
+	}
+	job->tag = tag;
+	job->bytes = std::move(bytes);
+	enqueue(job);
+	return true;
+}
+
+inline void Pipeline::submit(std::vector<uint8_t> bytes,uint64_t tag){
+	Job* job = new Job();
+	{
+		std::unique_lock<std::mutex> lock(admitMutex);
+		admitted.wait(lock,[this](){ return inflight < capacity; });
+		inflight++;
+		job->seq = nextSeq++;
+	}
+	job->tag = tag;
+	job->bytes = std::move(bytes);
+	enqueue(job);
+}
+
+inline void Pipeline::enqueue(Job* job){
+	job->status = PIPE_OK;
+	job->badSignature = false;
+	depth[STAGE_DECODE]++;
+	pool.submit([this,job](){ decode(job); });
+}
+
+// Waits until every submitted block went through apply and done.
+inline void Pipeline::drain(){
+	std::unique_lock<std::mutex> lock(admitMutex);
+	admitted.wait(lock,[this](){ return inflight == 0; });
+}
+
+inline void Pipeline::decode(Job* job){
+	if(!job->view.parse(job->bytes.data(),job->bytes.size())){
+		job->status = PIPE_BAD_ENCODING;
+		finish(job,STAGE_DECODE);
+		return;
+	}
+	decodeBlock(job->view,job->block);
+	depth[STAGE_DECODE]--;
+	depth[STAGE_HASH]++;
+	hash(job);
+}
+
+// Hashes straight over the encoded bytes, each one a single contiguous range.
+inline void Pipeline::hash(Job* job){
+	const std::vector<Transaction>& txs = job->block.txs;
+	job->hashes.resize(txs.size());
+	for(size_t i = 0;i < txs.size();i++)
+		job->hashes[i] = job->view.tx(i).computeHash();
+	const Block& header = job->block.header;
+	bool ok = header.root == transactionRoot(job->hashes.data(),job->hashes.size()) && header.hash == job->view.header().computeHash();
+	job->view = BlockView();
+	job->bytes = std::vector<uint8_t>();
+	if(!ok){
+		job->status = PIPE_BAD_HASH;
+		finish(job,STAGE_HASH);
+		return;
+	}
+	depth[STAGE_HASH]--;
+	depth[STAGE_SIGNATURE]++;
+	size_t n = txs.size();
+	size_t batches = (n + SIGNATURE_BATCH - 1) / SIGNATURE_BATCH;
+	if(batches <= 1 || !checkSignature){
+		signatures(job,0,n);
+		return;
+	}
+	job->batches = batches;
+	for(size_t b = 1;b < batches;b++){
+		size_t from = b * SIGNATURE_BATCH;
+		size_t to = std::min(n,from + SIGNATURE_BATCH);
+		pool.submit([this,job,from,to](){ signatures(job,from,to); });
+	}
+	signatures(job,0,SIGNATURE_BATCH);
+}
+
+// The last batch of a block to finish moves it on to apply.
+inline void Pipeline::signatures(Job* job,size_t from,size_t to){
+	if(checkSignature){
+		for(size_t i = from;i < to && !job->badSignature.load(std::memory_order_relaxed);i++){
+			if(!checkSignature(job->block.txs[i],job->hashes[i]))
+				job->badSignature = true;
+		}
+	}
+	size_t n = job->block.txs.size();
+	if(n > SIGNATURE_BATCH && checkSignature && job->batches.fetch_sub(1) != 1)
+		return;
+	if(job->badSignature)
+		job->status = PIPE_BAD_SIGNATURE;
+	finish(job,STAGE_SIGNATURE);
+}
+
+// Parks the job in the reorder window and applies every job that is next in line.
+inline void Pipeline::finish(Job* job,int stage){
+	depth[stage]--;
+	depth[STAGE_APPLY]++;
+	std::vector<Job*> applied;
+	{
+		std::lock_guard<std::mutex> lock(orderMutex);
+		ready[job->seq % capacity] = job;
+		for(;;){
+			Job*& slot = ready[nextApply % capacity];
+			if(!slot || slot->seq != nextApply)
+				break;
+			Job* next = slot;
+			slot = nullptr;
+			nextApply++;
+			if(next->status == PIPE_OK && apply)
+				next->status = apply(next->block);
+			if(done)
+				done(next->tag,next->block,next->status);
+			if(next->status == PIPE_OK){
+				blocksDone.fetch_add(1,std::memory_order_relaxed);
+				transactionsDone.fetch_add(next->block.txs.size(),std::memory_order_relaxed);
+			}
+			depth[STAGE_APPLY]--;
+			applied.push_back(next);
+		}
+	}
+	if(applied.empty())
+		return;
+	for(Job* j : applied)
+		delete j;
+	// notified under the lock, drain() may return and destroy the pipeline right after
+	std::lock_guard<std::mutex> lock(admitMutex);
+	inflight -= applied.size();
+	if(room)
+		room();
+	admitted.notify_all();
+}
+
+inline PipelineStats Pipeline::stats(){
+	PipelineStats s;
+	s.blocks = blocksDone.load(std::memory_order_relaxed);
+	s.transactions = transactionsDone.load(std::memory_order_relaxed);
+	s.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+	s.blocksPerSecond = s.seconds > 0 ? s.blocks / s.seconds : 0;
+	s.transactionsPerSecond = s.seconds > 0 ? s.transactions / s.seconds : 0;
+	{
+		std::lock_guard<std::mutex> lock(admitMutex);
+		s.inflight = inflight;
+	}
+	for(int i = 0;i < STAGES;i++)
+		s.depth[i] = depth[i].load(std::memory_order_relaxed);
+	return s;
+}
+
+#endif
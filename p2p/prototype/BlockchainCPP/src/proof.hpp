@@ -0,0 +1,149 @@
+#ifndef PROOF_HPP
+#define PROOF_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "crypt.hpp"
+#include "verify.hpp"
+#include "merkle.hpp"
+#include "blockchain.hpp"
+#include "transaction.hpp"
+#include "wire.hpp"
+
+// Light client proofs: one account or one transaction plus its Merkle
+// path to a block header. Whoever trusts the hash of that header, from a
+// header chain or a full node it knows, can check the proof in O(log n)
+// without the ledger. Headers and transactions are in the wire format of
+// wire.hpp, the other fields are listed one by one, so the encoding does
+// not depend on padding. The height in a header is not covered by its
+// hash, take it from the header chain. The codes, ProofReader and the
+// checks clients run on encoded proofs, checkAccountProof() and
+// checkTransactionProof(), are in verify.hpp, which needs nothing of the node.
+
+// Balance, nonce and referrer of key as of header.
+struct AccountProof{
+	Block header;
+	Digest key;
+	Account account;
+	MerkleProof path;
+};
+
+// tx is in the block of header, at path.index.
+struct TransactionProof{
+	Block header;
+	Transaction tx;
+	MerkleProof path;
+};
+
+class ProofWriter{
+	public:
+		std::vector<uint8_t> out;
+		template<class T> void value(const T& v){
+			const uint8_t* p = (const uint8_t*)&v;
+			out.insert(out.end(),p,p + sizeof v);
+		}
+		void digest(const Digest& d){
+			out.insert(out.end(),d.begin(),d.end());
+		}
+		uint8_t* append(size_t n){
+			out.resize(out.size() + n);
+			return out.data() + out.size() - n;
+		}
+};
+
+inline void encodeHeader(ProofWriter& w,const Block& b){
+	writeHeader(w.append(WIRE_HEADER_SIZE),b);
+}
+
+inline void decodeHeader(ProofReader& r,Block& b){
+	const uint8_t* p = r.take(WIRE_HEADER_SIZE);
+	if(p)
+		b = HeaderView(p).get();
+}
+
+inline void encodePath(ProofWriter& w,const MerkleProof& p){
+	w.value(p.index);
+	w.value(p.count);
+	w.value((uint8_t)p.path.size());
+	for(const Digest& d : p.path)
+		w.digest(d);
+}
+
+inline std::vector<uint8_t> encodeProof(const AccountProof& p){
+	ProofWriter w;
+	w.value((uint8_t)PROOF_ACCOUNT);
+	encodeHeader(w,p.header);
+	w.digest(p.key);
+	w.value(p.account.balance);
+	w.value(p.account.scooping);
+	w.digest(p.account.referrer);
+	w.value(p.account.nonce);
+	encodePath(w,p.path);
+	return w.out;
+}
+
+inline std::vector<uint8_t> encodeProof(const TransactionProof& p){
+	ProofWriter w;
+	w.value((uint8_t)PROOF_TRANSACTION);
+	encodeHeader(w,p.header);
+	writeTransaction(w.append(WIRE_TX_SIZE),p.tx);
+	encodePath(w,p.path);
+	return w.out;
+}
+
+inline bool decodeProof(const uint8_t* data,size_t size,AccountProof& p){
+	ProofReader r(data,size);
+	uint8_t type = 0;
+	r.value(type);
+	decodeHeader(r,p.header);
+	r.digest(p.key);
+	r.value(p.account.balance);
+	r.value(p.account.scooping);
+	r.digest(p.account.referrer);
+	r.value(p.account.nonce);
+	decodePath(r,p.path);
+	return type == PROOF_ACCOUNT && r.done();
+}
+
+inline bool decodeProof(const uint8_t* data,size_t size,TransactionProof& p){
+	ProofReader r(data,size);
+	uint8_t type = 0;
+	r.value(type);
+	decodeHeader(r,p.header);
+	const uint8_t* tx = r.take(WIRE_TX_SIZE);
+	if(tx)
+		TransactionView(tx).get(p.tx);
+	decodePath(r,p.path);
+	return type == PROOF_TRANSACTION && r.done();
+}
+
+inline int verifyHeader(const Block& header,const Digest& trusted){
+	if(header.hash != trusted || header.computeHash() != trusted)
+		return PROOF_BAD_HEADER;
+	return PROOF_OK;
+}
+
+inline int verifyProof(const AccountProof& p,const Digest& trusted){
+	int rc = verifyHeader(p.header,trusted);
+	if(rc != PROOF_OK)
+		return rc;
+	Digest none;
+	none.fill(0);
+	if(p.header.state == none)
+		return PROOF_NO_COMMITMENT;
+	if(!merkleVerify(p.header.state,accountLeaf(p.key,p.account),p.path))
+		return PROOF_BAD_PATH;
+	return PROOF_OK;
+}
+
+inline int verifyProof(const TransactionProof& p,const Digest& trusted){
+	int rc = verifyHeader(p.header,trusted);
+	if(rc != PROOF_OK)
+		return rc;
+	if(p.path.count != p.header.size || !merkleVerify(p.header.root,merkleLeaf(p.tx.computeHash()),p.path))
+		return PROOF_BAD_PATH;
+	return PROOF_OK;
+}
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+// First payload byte of every frame
+#define MSG_PING 1
+#define MSG_PONG 2
+#define MSG_BLOCK 3     // encoded block, see wire.hpp
+#define MSG_ACCEPTED 4  // hash of a block that is now part of the chain
+#define MSG_REJECTED 5  // hash of a block that failed verification
+#define MSG_GET_HEADERS 6 // u64 first height, u32 count
+#define MSG_HEADERS 7     // u64 first height, then the encoded headers from there on
+#define MSG_GET_BODIES 8  // hashes of the wanted blocks
+#define MSG_BODY 9        // encoded block, one frame per hash of MSG_GET_BODIES
+#define MSG_NOT_FOUND 10  // hash of a wanted block that is not stored here
+#define MSG_INV 11           // INV_ type byte and hash per item the sender has
+#define MSG_GET_DATA 12      // the same for items wanted
+#define MSG_TX 13            // one encoded transaction
+#define MSG_COMPACT 14       // encoded header, u64 nonce, SHORT_ID_BYTES per transaction
+#define MSG_GET_BLOCK_TXS 15 // block hash, u32 indices of the transactions missing
+#define MSG_BLOCK_TXS 16     // block hash, the encoded transactions asked for in that order
+#define MSG_GET_ACCOUNT_PROOF 17 // account key, answered with MSG_PROOF against the tip
+#define MSG_GET_TX_PROOF 18      // block hash, u32 index of the transaction in the block
+#define MSG_PROOF 19             // encoded AccountProof or TransactionProof, MSG_NOT_FOUND with the key or hash if there is none
+
+#endif
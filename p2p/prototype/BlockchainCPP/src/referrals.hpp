@@ -0,0 +1,241 @@
+#ifndef REFERRALS_HPP
+#define REFERRALS_HPP
+
+#include <cstdint>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <unordered_map>
+#include "state.hpp"
+
+#define MATE_LIMIT 10                 // direct referrals that count as mates, one THX each on top of SCOOP_REWARD
+#define REFERRAL_PARALLEL 65536       // accounts or frontier from which a pass runs on all cores
+#define REFERRAL_COMPACT 8            // the graph is rebuilt once 1/8 of its accounts were added since
+
+// Who referred whom, over the referrers of the accounts in the state. An
+// account is a dense id; the referrals of every account built so far are
+// one range of a single array (compressed sparse rows), so passes over all
+// accounts and breadth first walks read memory in order and split across
+// cores. Registrations after the build are added to a small overflow and
+// folded in by rebuilding once it has grown. The first accounts refer to
+// themselves and are the roots. Ids are only stable until the next build;
+// they are 64 bit like the account table, which holds more than 2^32.
+class ReferralGraph{
+	private:
+		std::vector<Digest> keys;       // by id, sorted up to built
+		std::vector<uint64_t> parents;  // referrer by id, the id itself for a root
+		std::vector<uint64_t> degrees;  // direct referrals by id
+		std::vector<uint64_t> offsets;  // referrals of built id i at targets[offsets[i]] up to targets[offsets[i + 1]]
+		std::vector<uint64_t> targets;
+		size_t built;
+		std::unordered_map<Digest,uint64_t,DigestHash> added;         // ids of accounts added since the build
+		std::unordered_map<uint64_t,std::vector<uint64_t>> overflow;  // their ids by referrer
+		template<class F> static void parallel(size_t n,F f);
+		template<class F> void forEachReferral(uint64_t id,F f) const;
+		std::vector<uint64_t> expand(const std::vector<uint64_t>& frontier) const;
+		void build(std::vector<std::pair<Digest,Digest>>& accounts);
+	public:
+		ReferralGraph(){ built = 0; }
+
+		void build(const State& state);
+		bool add(const Digest& key,const Digest& referrer);
+		void add(const BlockData& block);
+		void compact();
+		int64_t find(const Digest& key) const;
+		const Digest& key(uint64_t id) const { return keys[id]; }
+		uint64_t referrer(uint64_t id) const { return parents[id]; }
+		uint64_t referrals(uint64_t id) const { return degrees[id]; }
+		uint64_t mates(uint64_t id) const { return std::min<uint64_t>(degrees[id],MATE_LIMIT); }
+		std::vector<uint64_t> children(uint64_t id) const;
+		std::vector<uint64_t> levels(uint64_t id) const;
+		std::vector<uint64_t> depths() const;
+		std::vector<uint64_t> rewards() const;
+		size_t size() const { return keys.size(); }
+};
+
+// f(from,to) over n items, in chunks on all cores if there are enough.
+template<class F> void ReferralGraph::parallel(size_t n,F f){
+	unsigned threads = n >= REFERRAL_PARALLEL ? std::max(1u,std::thread::hardware_concurrency()) : 1;
+	if(threads == 1){
+		f(0,n);
+		return;
+	}
+	std::vector<std::thread> workers;
+	size_t chunk = (n + threads - 1) / threads;
+	for(size_t from = 0;from < n;from += chunk)
+		workers.emplace_back(f,from,std::min(n,from + chunk));
+	for(std::thread& w : workers)
+		w.join();
+}
+
+inline void ReferralGraph::build(const State& state){
+	std::vector<std::pair<Digest,Digest>> accounts;
+	accounts.reserve(state.size());
+	state.forEach([&](const Digest& key,const Account& a){ accounts.emplace_back(key,a.referrer); });
+	build(accounts);
+}
+
+// Accounts as key and referrer. A referrer that is not among them makes a root.
+inline void ReferralGraph::build(std::vector<std::pair<Digest,Digest>>& accounts){
+	size_t n = accounts.size();
+	std::sort(accounts.begin(),accounts.end(),[](const std::pair<Digest,Digest>& x,const std::pair<Digest,Digest>& y){ return x.first < y.first; });
+	keys.resize(n);
+	parents.resize(n);
+	degrees.assign(n,0);
+	parallel(n,[&](size_t from,size_t to){
+		for(size_t i = from;i < to;i++)
+			keys[i] = accounts[i].first;
+	});
+	parallel(n,[&](size_t from,size_t to){
+		for(size_t i = from;i < to;i++){
+			auto it = std::lower_bound(keys.begin(),keys.end(),accounts[i].second);
+			uint64_t p = it != keys.end() && *it == accounts[i].second ? it - keys.begin() : i;
+			parents[i] = p;
+			if(p != i)
+				std::atomic_ref<uint64_t>(degrees[p]).fetch_add(1,std::memory_order_relaxed);
+		}
+	});
+	offsets.assign(n + 1,0);
+	for(size_t i = 0;i < n;i++)
+		offsets[i + 1] = offsets[i] + degrees[i];
+	targets.resize(offsets[n]);
+	std::vector<uint64_t> next(offsets.begin(),offsets.end() - 1);
+	parallel(n,[&](size_t from,size_t to){
+		for(size_t i = from;i < to;i++)
+			if(parents[i] != i)
+				targets[std::atomic_ref<uint64_t>(next[parents[i]]).fetch_add(1,std::memory_order_relaxed)] = i;
+	});
+	// the order the threads filled them in is not the same from run to run
+	parallel(n,[&](size_t from,size_t to){
+		for(size_t i = from;i < to;i++)
+			std::sort(targets.begin() + offsets[i],targets.begin() + offsets[i + 1]);
+	});
+	built = n;
+	added.clear();
+	overflow.clear();
+}
+
+// A registration after the build. False if the account is known or its referrer is not.
+inline bool ReferralGraph::add(const Digest& key,const Digest& referrer){
+	if(find(key) >= 0)
+		return false;
+	uint64_t id = keys.size();
+	int64_t p = referrer == key ? (int64_t)id : find(referrer);
+	if(p < 0)
+		return false;
+	keys.push_back(key);
+	parents.push_back(p);
+	degrees.push_back(0);
+	added.emplace(key,id);
+	if((uint64_t)p != id){
+		degrees[p]++;
+		overflow[p].push_back(id);
+	}
+	if(added.size() * REFERRAL_COMPACT > keys.size())
+		compact();
+	return true;
+}
+
+// The registrations of a block that was applied.
+inline void ReferralGraph::add(const BlockData& block){
+	for(const Transaction& tx : block.txs)
+		if(tx.kind == TX_REGISTER)
+			add(tx.from,tx.to);
+}
+
+// Rebuilds with the added accounts, ids change.
+inline void ReferralGraph::compact(){
+	std::vector<std::pair<Digest,Digest>> accounts(keys.size());
+	for(size_t i = 0;i < keys.size();i++)
+		accounts[i] = std::make_pair(keys[i],keys[parents[i]]);
+	build(accounts);
+}
+
+// The id of the account or -1.
+inline int64_t ReferralGraph::find(const Digest& key) const {
+	auto it = std::lower_bound(keys.begin(),keys.begin() + built,key);
+	if(it != keys.begin() + built && *it == key)
+		return it - keys.begin();
+	auto a = added.find(key);
+	return a == added.end() ? -1 : (int64_t)a->second;
+}
+
+template<class F> void ReferralGraph::forEachReferral(uint64_t id,F f) const {
+	if(id < built)
+		for(uint64_t k = offsets[id];k < offsets[id + 1];k++)
+			f(targets[k]);
+	auto it = overflow.find(id);
+	if(it != overflow.end())
+		for(uint64_t c : it->second)
+			f(c);
+}
+
+// Direct referrals, the mates of the account.
+inline std::vector<uint64_t> ReferralGraph::children(uint64_t id) const {
+	std::vector<uint64_t> c;
+	c.reserve(degrees[id]);
+	forEachReferral(id,[&](uint64_t child){ c.push_back(child); });
+	return c;
+}
+
+// The referrals of every account in the frontier, the next level down.
+// A large frontier is split across cores, each part filling its own list.
+inline std::vector<uint64_t> ReferralGraph::expand(const std::vector<uint64_t>& frontier) const {
+	unsigned threads = frontier.size() >= REFERRAL_PARALLEL ? std::max(1u,std::thread::hardware_concurrency()) : 1;
+	std::vector<std::vector<uint64_t>> parts(threads);
+	size_t chunk = (frontier.size() + threads - 1) / threads;
+	parallel(frontier.size(),[&](size_t from,size_t to){
+		std::vector<uint64_t>& part = parts[from / std::max<size_t>(chunk,1)];
+		for(size_t i = from;i < to;i++)
+			forEachReferral(frontier[i],[&](uint64_t c){ part.push_back(c); });
+	});
+	if(threads == 1)
+		return std::move(parts[0]);
+	std::vector<uint64_t> next;
+	for(const std::vector<uint64_t>& part : parts)
+		next.insert(next.end(),part.begin(),part.end());
+	return next;
+}
+
+// Accounts below id by depth, direct referrals first.
+inline std::vector<uint64_t> ReferralGraph::levels(uint64_t id) const {
+	std::vector<uint64_t> counts;
+	std::vector<uint64_t> frontier = {id};
+	for(;;){
+		frontier = expand(frontier);
+		if(frontier.empty())
+			return counts;
+		counts.push_back(frontier.size());
+	}
+}
+
+// Depth of every account below its root, level by level from all roots at once.
+inline std::vector<uint64_t> ReferralGraph::depths() const {
+	std::vector<uint64_t> depth(keys.size(),0);
+	std::vector<uint64_t> frontier;
+	for(uint64_t i = 0;i < keys.size();i++)
+		if(parents[i] == i)
+			frontier.push_back(i);
+	for(uint64_t d = 1;!frontier.empty();d++){
+		frontier = expand(frontier);
+		parallel(frontier.size(),[&](size_t from,size_t to){
+			for(size_t i = from;i < to;i++)
+				depth[frontier[i]] = d;
+		});
+	}
+	return depth;
+}
+
+// What a finished scooping cycle earns every account in the app, the
+// reward plus one THX per mate. The ledger pays the reward alone so far.
+inline std::vector<uint64_t> ReferralGraph::rewards() const {
+	std::vector<uint64_t> r(keys.size());
+	parallel(keys.size(),[&](size_t from,size_t to){
+		for(size_t i = from;i < to;i++)
+			r[i] = SCOOP_REWARD + mates(i);
+	});
+	return r;
+}
+
+#endif
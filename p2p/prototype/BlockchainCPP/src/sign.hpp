@@ -0,0 +1,164 @@
+#ifndef SIGN_HPP
+#define SIGN_HPP
+
+#include <openssl/evp.h>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <stdexcept>
+#include "crypt.hpp"
+#include "transaction.hpp"
+
+typedef Digest PublicKey;  // raw Ed25519 public key, also the account id
+typedef Digest SecretKey;  // raw Ed25519 private key (the seed)
+
+struct KeyPair{
+	PublicKey publicKey;
+	SecretKey secretKey;
+};
+
+// One signature to check, the views point into memory owned by the caller.
+struct SignedMessage{
+	const PublicKey* publicKey;
+	Bytes message;
+	const Signature* signature;
+};
+
+// Turns a seed into a key pair, the same seed always gives the same keys.
+inline KeyPair keyPairFromSeed(const SecretKey& seed){
+	KeyPair keys;
+	keys.secretKey = seed;
+	EVP_PKEY* pkey = EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519,nullptr,seed.data(),seed.size());
+	size_t len = keys.publicKey.size();
+	if(!pkey || !EVP_PKEY_get_raw_public_key(pkey,keys.publicKey.data(),&len)){
+		EVP_PKEY_free(pkey);
+		throw std::runtime_error("ed25519 not available");
+	}
+	EVP_PKEY_free(pkey);
+	return keys;
+}
+
+inline KeyPair generateKeyPair(){
+	EVP_PKEY* pkey = nullptr;
+	EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519,nullptr);
+	if(!ctx || EVP_PKEY_keygen_init(ctx) <= 0 || EVP_PKEY_keygen(ctx,&pkey) <= 0){
+		EVP_PKEY_CTX_free(ctx);
+		throw std::runtime_error("ed25519 not available");
+	}
+	KeyPair keys;
+	size_t len = keys.secretKey.size();
+	EVP_PKEY_get_raw_private_key(pkey,keys.secretKey.data(),&len);
+	len = keys.publicKey.size();
+	EVP_PKEY_get_raw_public_key(pkey,keys.publicKey.data(),&len);
+	EVP_PKEY_free(pkey);
+	EVP_PKEY_CTX_free(ctx);
+	return keys;
+}
+
+// Ed25519 signer and verifier for one thread. The digest context is reused
+// and the key object of the last public key is kept, consecutive
+// transactions of one account skip parsing its key again.
+class SignatureContext{
+	private:
+		EVP_MD_CTX* ctx;
+		EVP_PKEY* key;
+		PublicKey keyId;
+	public:
+		SignatureContext(){
+			ctx = EVP_MD_CTX_new();
+			key = nullptr;
+			if(!ctx)
+				throw std::runtime_error("ed25519 not available");
+		}
+		~SignatureContext(){
+			EVP_PKEY_free(key);
+			EVP_MD_CTX_free(ctx);
+		}
+		SignatureContext(const SignatureContext&) = delete;
+		SignatureContext& operator=(const SignatureContext&) = delete;
+
+		Signature sign(const KeyPair& keys,Bytes message){
+			Signature sig;
+			sig.fill(0);
+			EVP_PKEY* pkey = EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519,nullptr,keys.secretKey.data(),keys.secretKey.size());
+			size_t len = sig.size();
+			EVP_MD_CTX_reset(ctx);
+			if(!pkey || EVP_DigestSignInit(ctx,nullptr,nullptr,nullptr,pkey) != 1 || EVP_DigestSign(ctx,sig.data(),&len,(const unsigned char*)message.data,message.size) != 1){
+				EVP_PKEY_free(pkey);
+				throw std::runtime_error("ed25519 signing failed");
+			}
+			EVP_PKEY_free(pkey);
+			return sig;
+		}
+		bool verify(const PublicKey& publicKey,Bytes message,const Signature& sig){
+			if(!key || keyId != publicKey){
+				EVP_PKEY_free(key);
+				key = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519,nullptr,publicKey.data(),publicKey.size());
+				keyId = publicKey;
+				if(!key)
+					return false;
+			}
+			EVP_MD_CTX_reset(ctx);
+			if(EVP_DigestVerifyInit(ctx,nullptr,nullptr,nullptr,key) != 1)
+				return false;
+			return EVP_DigestVerify(ctx,sig.data(),sig.size(),(const unsigned char*)message.data,message.size) == 1;
+		}
+};
+
+inline SignatureContext& threadSignatureContext(){
+	static thread_local SignatureContext context;
+	return context;
+}
+
+inline Signature sign(const KeyPair& keys,Bytes message){
+	return threadSignatureContext().sign(keys,message);
+}
+
+inline bool verify(const PublicKey& publicKey,Bytes message,const Signature& sig){
+	return threadSignatureContext().verify(publicKey,message,sig);
+}
+
+// Transactions are signed by the sending account over their hash.
+inline void signTransaction(Transaction& tx,const KeyPair& keys){
+	tx.from = keys.publicKey;
+	Digest hash = tx.computeHash();
+	tx.signature = sign(keys,hash);
+}
+
+// Matches Pipeline::SignatureCheck, hash is tx.computeHash().
+inline bool verifyTransaction(const Transaction& tx,const Digest& hash){
+	return verify(tx.from,hash,tx.signature);
+}
+
+// Checks many independent signatures, split over threads like hashMany().
+// ok[i] is set to 1 or 0, the number of bad signatures is returned.
+inline size_t verifyMany(const SignedMessage* items,size_t n,uint8_t* ok,unsigned threads = 1){
+	if(threads <= 1 || n < threads * 16){
+		size_t bad = 0;
+		SignatureContext& context = threadSignatureContext();
+		for(size_t i = 0;i < n;i++){
+			ok[i] = context.verify(*items[i].publicKey,items[i].message,*items[i].signature);
+			bad += !ok[i];
+		}
+		return bad;
+	}
+	std::vector<std::thread> workers;
+	std::vector<size_t> bad(threads,0);
+	size_t chunk = (n + threads - 1) / threads;
+	for(unsigned t = 0;t < threads;t++){
+		size_t from = t * chunk;
+		size_t to = std::min(n,from + chunk);
+		if(from >= to)
+			break;
+		workers.emplace_back([=,&bad](){ bad[t] = verifyMany(items + from,to - from,ok + from,1); });
+	}
+	size_t total = 0;
+	for(size_t t = 0;t < workers.size();t++){
+		workers[t].join();
+		total += bad[t];
+	}
+	return total;
+}
+
+#endif
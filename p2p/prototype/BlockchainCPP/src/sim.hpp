@@ -0,0 +1,341 @@
+#ifndef SIM_HPP
+#define SIM_HPP
+
+#include <map>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include "peer.hpp"
+
+#define SIM_RTO_MS 200              // a lost segment arrives this much later, like a TCP retransmission
+#define SIM_MEMPOOL_CAPACITY 2048   // per node, real nodes keep PEER_MEMPOOL_CAPACITY
+#define SIM_FILTER_ITEMS 4096       // gossip filter per connection, real nodes keep GOSSIP_FILTER_ITEMS
+
+// One direction of a simulated link.
+struct SimLinkConfig{
+	uint32_t latencyMs;
+	uint64_t bandwidth; // bytes per second, 0 for unlimited
+	double loss;        // probability that a segment has to be resent
+};
+
+struct SimStats{
+	uint64_t events;
+	double seconds;          // virtual time simulated
+	double wallSeconds;      // real time it took
+	uint64_t bytes;          // carried over all links
+	uint64_t segments;       // writes carried, one per frame
+	uint64_t lost;           // segments that were resent
+	double bytesPerNode;     // sent, mean over all nodes
+	uint64_t maxBytesPerNode;
+	size_t items;            // transactions and blocks tracked
+	double coverage;         // fraction of nodes each tracked item reached, mean
+	double p50Ms;            // propagation delay from the origin to the other nodes
+	double p90Ms;
+	double p99Ms;
+	double maxMs;
+};
+
+// Deterministic discrete event simulation of many Peers in one thread.
+// Every node is a real Peer without workers or sockets: its event loop takes
+// time and timers from the simulator, and its connections hand their bytes
+// to simulated links that delay them by serialization at the link's
+// bandwidth plus latency. Links are ordered streams like TCP, so a lost
+// segment holds back the ones behind it until it is resent. Verification
+// takes no virtual time, so signatures are only checked with
+// checkSignatures set, to find invalid transactions. Everything random,
+// from loss and topology to the gossip filter seeds, comes from the seed,
+// so a run can be repeated exactly.
+// Propagation is tracked for the transactions and blocks given to track()
+// and mine(), from the origin until every node has them.
+class Simulator : public Scheduler{
+	private:
+		// One direction of a link, the Link of the sending connection.
+		struct Pipe : public Link{
+			Simulator* sim;
+			size_t to;          // receiving node
+			uint64_t remote;    // connection id on that node
+			SimLinkConfig config;
+			int64_t busyUs;     // sender side is serializing until then
+			int64_t arrivalUs;  // last segment arrives then, later ones can not overtake it
+			void carry(Connection& from,const uint8_t* data,size_t size) override;
+			void closed(Connection& c) override;
+		};
+		struct Item{
+			int64_t origin;     // us
+			size_t reached;
+			std::unordered_set<size_t> nodes;
+		};
+		std::map<std::pair<int64_t,uint64_t>,std::function<void()>> events; // (time in us,id)
+		std::unordered_map<uint64_t,int64_t> eventTimes;
+		uint64_t nextEvent;
+		int64_t nowUs;
+		std::mt19937_64 random;
+		std::vector<std::unique_ptr<Pipe>> pipes;
+		std::vector<std::unique_ptr<Peer>> nodes;
+		std::unordered_map<Digest,Item,DigestHash> items;
+		std::vector<int64_t> delays; // us, per item and node reached except the origin
+		uint64_t processed;
+		uint64_t bytes;
+		uint64_t segments;
+		uint64_t lost;
+		double wallSeconds;
+
+		uint64_t atUs(int64_t time,std::function<void()> f);
+		uint64_t advance(int64_t endUs);
+		void reached(const Digest& item,size_t node);
+	public:
+		bool checkSignatures; // for nodes added from now on
+
+		explicit Simulator(uint64_t seed);
+		~Simulator();
+		Simulator(const Simulator&) = delete;
+		Simulator& operator=(const Simulator&) = delete;
+
+		int64_t now() const override { return nowUs / 1000; }
+		uint64_t at(int64_t time,std::function<void()> f) override { return atUs(time * 1000,std::move(f)); }
+		void cancel(uint64_t id) override;
+
+		size_t addNodes(size_t n);
+		size_t size() const { return nodes.size(); }
+		Peer& node(size_t i){ return *nodes[i]; }
+		void connect(size_t a,size_t b,const SimLinkConfig& config);
+		void connectRandom(size_t outbound,const SimLinkConfig& config,uint32_t jitterMs = 0);
+		int track(size_t node,const Transaction& tx);
+		bool mine(size_t node,const BlockData& block);
+		bool step();
+		uint64_t run(int64_t ms);
+		uint64_t runUntilIdle(int64_t maxMs);
+		SimStats stats() const;
+};
+
+inline Simulator::Simulator(uint64_t seed) : random(seed){
+	nextEvent = 1;
+	nowUs = 0;
+	processed = 0;
+	bytes = 0;
+	segments = 0;
+	lost = 0;
+	wallSeconds = 0;
+	checkSignatures = false;
+	gossipRandom().seed(seed ^ 0x9e3779b97f4a7c15ULL);
+}
+
+// The nodes cancel their timers on the way out, so they go first.
+inline Simulator::~Simulator(){
+	nodes.clear();
+}
+
+inline uint64_t Simulator::atUs(int64_t time,std::function<void()> f){
+	uint64_t id = nextEvent++;
+	time = std::max(time,nowUs);
+	events.emplace(std::make_pair(time,id),std::move(f));
+	eventTimes.emplace(id,time);
+	return id;
+}
+
+inline void Simulator::cancel(uint64_t id){
+	auto it = eventTimes.find(id);
+	if(it == eventTimes.end())
+		return;
+	events.erase(std::make_pair(it->second,id));
+	eventTimes.erase(it);
+}
+
+// Relaying nodes that record when tracked items reach them. Returns the index of the first.
+inline size_t Simulator::addNodes(size_t n){
+	size_t first = nodes.size();
+	for(size_t i = 0;i < n;i++){
+		size_t index = nodes.size();
+		nodes.emplace_back(new Peer(0,this,SIM_MEMPOOL_CAPACITY));
+		Peer& peer = *nodes.back();
+		peer.gossip.relay = true;
+		peer.gossip.filterItems = SIM_FILTER_ITEMS;
+		if(!checkSignatures){
+			peer.gossip.checkSignature = nullptr;
+			peer.pipeline.checkSignature = nullptr;
+		}
+		peer.gossip.onAdmitted = [this,index](const Transaction& tx){ reached(tx.computeHash(),index); };
+		peer.onVerdict = [this,index](const Block& block,bool ok){
+			if(ok)
+				reached(block.hash,index);
+		};
+	}
+	return first;
+}
+
+inline void Simulator::reached(const Digest& hash,size_t node){
+	auto it = items.find(hash);
+	if(it == items.end() || !it->second.nodes.insert(node).second)
+		return;
+	it->second.reached++;
+	delays.push_back(nowUs - it->second.origin);
+}
+
+// Both directions get the same configuration.
+inline void Simulator::connect(size_t a,size_t b,const SimLinkConfig& config){
+	Pipe* ab = new Pipe();
+	Pipe* ba = new Pipe();
+	pipes.emplace_back(ab);
+	pipes.emplace_back(ba);
+	for(Pipe* p : {ab,ba}){
+		p->sim = this;
+		p->config = config;
+		p->busyUs = 0;
+		p->arrivalUs = 0;
+	}
+	ab->to = b;
+	ba->to = a;
+	Connection* ca = nodes[a]->server.attach(ab);
+	Connection* cb = nodes[b]->server.attach(ba);
+	ab->remote = cb->id();
+	ba->remote = ca->id();
+}
+
+// Every node dials outbound distinct others at random, latencies spread
+// over [latencyMs,latencyMs + jitterMs].
+inline void Simulator::connectRandom(size_t outbound,const SimLinkConfig& config,uint32_t jitterMs){
+	size_t n = nodes.size();
+	std::unordered_set<uint64_t> linked;
+	std::vector<size_t> degree(n,0);
+	for(size_t a = 0;a < n;a++){
+		size_t dialed = 0;
+		while(dialed < outbound && degree[a] < n - 1){
+			size_t b = random() % n;
+			uint64_t key = std::min(a,b) * n + std::max(a,b);
+			if(b == a || !linked.insert(key).second)
+				continue;
+			degree[a]++;
+			degree[b]++;
+			SimLinkConfig c = config;
+			if(jitterMs)
+				c.latencyMs += random() % (jitterMs + 1);
+			connect(a,b,c);
+			dialed++;
+		}
+	}
+}
+
+// Bytes leave once the sender finished the segments before them and
+// arrive after the latency, or a retransmission timeout later if lost.
+inline void Simulator::Pipe::carry(Connection&,const uint8_t* data,size_t size){
+	int64_t now = sim->nowUs;
+	int64_t start = std::max(now,busyUs);
+	busyUs = start + (config.bandwidth ? (int64_t)(size * 1000000 / config.bandwidth) : 0);
+	int64_t arrival = busyUs + config.latencyMs * 1000;
+	if(config.loss > 0 && std::uniform_real_distribution<double>(0,1)(sim->random) < config.loss){
+		arrival += std::max<int64_t>(SIM_RTO_MS,2 * config.latencyMs) * 1000;
+		sim->lost++;
+	}
+	arrivalUs = std::max(arrival,arrivalUs);
+	sim->bytes += size;
+	sim->segments++;
+	size_t node = to;
+	uint64_t conn = remote;
+	Simulator* s = sim;
+	sim->atUs(arrivalUs,[s,node,conn,bytes = std::vector<uint8_t>(data,data + size)](){
+		Connection* c = s->nodes[node]->server.find(conn);
+		if(c)
+			c->receive(bytes.data(),bytes.size());
+	});
+}
+
+// The other end notices after everything sent before.
+inline void Simulator::Pipe::closed(Connection&){
+	size_t node = to;
+	uint64_t conn = remote;
+	Simulator* s = sim;
+	sim->atUs(std::max(arrivalUs,sim->nowUs + config.latencyMs * 1000),[s,node,conn](){
+		Connection* c = s->nodes[node]->server.find(conn);
+		if(c)
+			c->close();
+	});
+}
+
+// Submits a signed transaction at node and follows it through the network.
+// Returns the MEMPOOL_ code.
+inline int Simulator::track(size_t node,const Transaction& tx){
+	Digest hash = tx.computeHash();
+	items[hash] = Item{nowUs,1,{node}};
+	return nodes[node]->gossip.submit(tx);
+}
+
+// Hands a sealed block to the node's pipeline as if it had produced it.
+inline bool Simulator::mine(size_t node,const BlockData& block){
+	items[block.header.hash] = Item{nowUs,1,{node}};
+	return nodes[node]->pipeline.trySubmit(encodeBlock(block));
+}
+
+// Runs the next event. False if there is none.
+inline bool Simulator::step(){
+	if(events.empty())
+		return false;
+	auto it = events.begin();
+	nowUs = it->first.first;
+	std::function<void()> f = std::move(it->second);
+	eventTimes.erase(it->first.second);
+	events.erase(it);
+	f();
+	processed++;
+	return true;
+}
+
+inline uint64_t Simulator::advance(int64_t endUs){
+	auto started = std::chrono::steady_clock::now();
+	uint64_t n = 0;
+	while(!events.empty() && events.begin()->first.first <= endUs){
+		step();
+		n++;
+	}
+	wallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+	return n;
+}
+
+// Everything due within the next ms milliseconds, the clock ends there.
+inline uint64_t Simulator::run(int64_t ms){
+	int64_t end = nowUs + ms * 1000;
+	uint64_t n = advance(end);
+	nowUs = end;
+	return n;
+}
+
+// Until nothing is scheduled any more or maxMs passed. Returns the events run.
+inline uint64_t Simulator::runUntilIdle(int64_t maxMs){
+	return advance(nowUs + maxMs * 1000);
+}
+
+inline SimStats Simulator::stats() const {
+	SimStats s;
+	s.events = processed;
+	s.seconds = nowUs / 1e6;
+	s.wallSeconds = wallSeconds;
+	s.bytes = bytes;
+	s.segments = segments;
+	s.lost = lost;
+	s.maxBytesPerNode = 0;
+	for(const auto& node : nodes)
+		s.maxBytesPerNode = std::max(s.maxBytesPerNode,node->server.bytesOut);
+	s.bytesPerNode = nodes.empty() ? 0 : (double)bytes / nodes.size();
+	s.items = items.size();
+	size_t reachedTotal = 0;
+	for(const auto& item : items)
+		reachedTotal += item.second.reached;
+	s.coverage = items.empty() || nodes.empty() ? 0 : (double)reachedTotal / (items.size() * nodes.size());
+	std::vector<int64_t> sorted(delays);
+	std::sort(sorted.begin(),sorted.end());
+	auto percentile = [&sorted](double p){
+		if(sorted.empty())
+			return 0.0;
+		size_t i = std::min(sorted.size() - 1,(size_t)(p * sorted.size()));
+		return sorted[i] / 1000.0;
+	};
+	s.p50Ms = percentile(0.50);
+	s.p90Ms = percentile(0.90);
+	s.p99Ms = percentile(0.99);
+	s.maxMs = sorted.empty() ? 0 : sorted.back() / 1000.0;
+	return s;
+}
+
+#endif
@@ -0,0 +1,420 @@
+#ifndef STATE_HPP
+#define STATE_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <optional>
+#include <algorithm>
+#include <thread>
+#include <unordered_map>
+#include "accounts.hpp"
+
+#define STATE_OK 0
+#define STATE_UNKNOWN_ACCOUNT -1
+#define STATE_ACCOUNT_EXISTS -2
+#define STATE_BAD_NONCE -3
+#define STATE_INSUFFICIENT_FUNDS -4
+#define STATE_STILL_SCOOPING -5
+#define STATE_BAD_KIND -6
+#define STATE_BAD_COMMITMENT -7
+
+#define SNAPSHOT_OK 0
+#define SNAPSHOT_IO_ERROR -1
+#define SNAPSHOT_BAD_FILE -2
+#define SNAPSHOT_BAD_HASH -3
+
+#define REGISTER_REWARD 1              // THX on a new account, like the initial booking of the app
+#define SCOOP_REWARD 10                // THX for a finished scooping cycle
+#define SCOOP_SECONDS (20 * 60 * 60)   // length of one scooping cycle
+#define SNAPSHOT_INTERVAL 1000         // blocks between two state commitments
+#define SNAPSHOT_MAGIC 0x50414e5354464853ULL // "SHFTSNAP"
+#define STATE_PARALLEL_HASH 16384      // accounts from which the state tree is hashed on all cores
+
+// Identifies the block a snapshot was taken after.
+struct SnapshotInfo{
+	uint64_t magic;
+	uint64_t height;
+	Digest block;
+	Digest state;
+	uint64_t count;
+};
+
+// The accounts a block changed as they were before it, in the order they
+// were first changed; nullopt for one the block created. Undoing a block
+// costs as much as applying it, however large the state.
+typedef std::vector<AccountChange> Undo;
+
+// Account balances, scooping timestamps and referrers as of some block.
+// Blocks are applied all or nothing: every change is journaled and a
+// failing transaction rolls the whole block back, and the journal of the
+// last block is kept so it can be reverted. Handed out as the undo record
+// of the block, the journal takes it back at any later time, as long as
+// the blocks after it were undone first, see ForkChoice. The hash of the
+// state is the Merkle root over the accounts sorted by key, so it does not
+// depend on the order accounts were created in and a single account can
+// be proven to a light client, see prove(). The tree of the last state a
+// block committed to is kept, so its accounts are proven in O(log n).
+// A block is applied against the accounts it changes, held aside, and the
+// changes are written to the table in one batch, see AccountTable. With
+// spill() set, accounts beyond the resident count that were not written
+// for the longest time leave memory after every block.
+class State{
+	private:
+		AccountTable accounts;
+		std::unordered_map<Digest,std::optional<Account>,DigestHash> pending; // accounts changed and not yet written
+		Undo journal;
+		size_t written; // journal entries whose change is in the table
+		size_t resident;
+		std::vector<SnapshotEntry> proven; // accounts of the last committed state, sorted
+		MerkleTree provenTree;             // over their leaves
+
+		const Account* lookup(const Digest& key) const;
+		Account& change(const Digest& key);
+		int stage(const Transaction& tx);
+		void commit();
+		void rollback(const Undo& changes);
+		std::vector<SnapshotEntry> sorted() const;
+		static unsigned hashThreads(size_t n);
+		static std::vector<Digest> hashLeaves(const SnapshotEntry* entries,size_t n);
+		static Digest hashEntries(const SnapshotEntry* entries,size_t n);
+		bool keepProofs(const Digest& root);
+	public:
+		State();
+		State(const State&) = delete;
+		State& operator=(const State&) = delete;
+
+		int apply(const Transaction& tx);
+		int apply(const BlockData& block);
+		int apply(const BlockData& block,Undo& undo);
+		void revert();
+		void undo(const Undo& undo);
+		const Account* find(const Digest& key) const { return accounts.find(key); }
+		bool get(const Digest& key,Account& account) const { return accounts.get(key,account); }
+		Digest hash() const;
+		bool prove(const Digest& key,Account& account,MerkleProof& proof) const;
+		bool prove(const Digest& root,const Digest& key,Account& account,MerkleProof& proof) const;
+		size_t size() const { return accounts.size(); }
+		template<class F> void forEach(F f) const { accounts.forEach(f); }
+		void clear();
+		bool spill(const std::string& dir,size_t resident);
+
+		int snapshot(const std::string& path,uint64_t height,const Digest& block) const;
+		int load(const std::string& path,SnapshotInfo& info);
+};
+
+inline State::State(){
+	written = 0;
+	resident = 0;
+}
+
+// The account as changed so far by the block being applied.
+inline const Account* State::lookup(const Digest& key) const {
+	auto it = pending.find(key);
+	if(it == pending.end())
+		return accounts.find(key);
+	return it->second ? &*it->second : nullptr;
+}
+
+// The copy of the account the block changes, journaled the first time.
+// A new account has to be assigned.
+inline Account& State::change(const Digest& key){
+	auto it = pending.find(key);
+	if(it == pending.end()){
+		const Account* a = accounts.find(key);
+		journal.emplace_back(key,a ? std::optional<Account>(*a) : std::nullopt);
+		it = pending.emplace(key,journal.back().second).first;
+	}
+	if(!it->second)
+		it->second.emplace();
+	return *it->second;
+}
+
+// Checks the transaction against the accounts as changed so far and
+// changes them only if it passes.
+inline int State::stage(const Transaction& tx){
+	const Account* from = lookup(tx.from);
+	if(tx.kind == TX_REGISTER){
+		if(from)
+			return STATE_ACCOUNT_EXISTS;
+		if(tx.nonce != 0)
+			return STATE_BAD_NONCE;
+		// the very first accounts refer to themselves
+		if(tx.to != tx.from && !lookup(tx.to))
+			return STATE_UNKNOWN_ACCOUNT;
+		change(tx.from) = Account{REGISTER_REWARD,0,tx.to,1};
+		return STATE_OK;
+	}
+	if(!from)
+		return STATE_UNKNOWN_ACCOUNT;
+	if(tx.nonce != from->nonce)
+		return STATE_BAD_NONCE;
+	switch(tx.kind){
+		case TX_SCOOP:{
+			if(from->scooping && tx.timestamp - from->scooping < SCOOP_SECONDS)
+				return STATE_STILL_SCOOPING;
+			Account& a = change(tx.from);
+			if(a.scooping)
+				a.balance += SCOOP_REWARD;
+			a.scooping = tx.timestamp;
+			a.nonce++;
+			return STATE_OK;
+		}
+		case TX_TRANSFER:{
+			if(from->balance < tx.amount)
+				return STATE_INSUFFICIENT_FUNDS;
+			if(!lookup(tx.to))
+				return STATE_UNKNOWN_ACCOUNT;
+			Account& a = change(tx.from);
+			a.balance -= tx.amount;
+			a.nonce++;
+			change(tx.to).balance += tx.amount;
+			return STATE_OK;
+		}
+		default:
+			return STATE_BAD_KIND;
+	}
+}
+
+// Writes the accounts changed since the last commit in one batch.
+inline void State::commit(){
+	std::vector<AccountChange> changes;
+	changes.reserve(journal.size() - written);
+	for(size_t i = written;i < journal.size();i++)
+		changes.emplace_back(journal[i].first,pending[journal[i].first]);
+	accounts.update(changes);
+	pending.clear();
+	written = journal.size();
+}
+
+// Changes of the same key are undone latest first, the table keeps their order.
+inline void State::rollback(const Undo& changes){
+	accounts.update(Undo(changes.rbegin(),changes.rend()));
+}
+
+// Single transaction, the signature is checked by the pipeline before.
+// Its changes replace the journal like those of a block.
+inline int State::apply(const Transaction& tx){
+	journal.clear();
+	pending.clear();
+	written = 0;
+	int rc = stage(tx);
+	commit();
+	return rc;
+}
+
+// Applies all transactions of the block or none. A block that commits to
+// a state must arrive at exactly that state.
+inline int State::apply(const BlockData& block){
+	journal.clear();
+	pending.clear();
+	written = 0;
+	for(const Transaction& tx : block.txs){
+		int rc = stage(tx);
+		if(rc != STATE_OK){
+			journal.clear();
+			pending.clear();
+			return rc;
+		}
+	}
+	commit();
+	Digest none;
+	none.fill(0);
+	if(block.header.state != none && !keepProofs(block.header.state)){
+		revert();
+		return STATE_BAD_COMMITMENT;
+	}
+	if(resident)
+		accounts.spill(resident);
+	return STATE_OK;
+}
+
+// Like apply(block), the journal goes to undo instead of being kept.
+inline int State::apply(const BlockData& block,Undo& undo){
+	int rc = apply(block);
+	undo.clear();
+	if(rc == STATE_OK){
+		undo.swap(journal);
+		written = 0;
+	}
+	return rc;
+}
+
+// Undoes the block last passed to apply(), once.
+inline void State::revert(){
+	rollback(journal);
+	journal.clear();
+	written = 0;
+}
+
+inline void State::clear(){
+	accounts.clear();
+	journal.clear();
+	pending.clear();
+	written = 0;
+	proven.clear();
+	provenTree.clear();
+}
+
+// Keeps resident accounts in memory and spills the others to files in
+// dir, which hold nothing across restarts. Empties the state.
+inline bool State::spill(const std::string& dir,size_t resident){
+	clear();
+	this->resident = resident;
+	return accounts.open(dir);
+}
+
+// Undoes the block the record was taken from. It has to be the last one
+// still applied.
+inline void State::undo(const Undo& undo){
+	rollback(undo);
+}
+
+inline std::vector<SnapshotEntry> State::sorted() const {
+	std::vector<SnapshotEntry> entries;
+	entries.reserve(accounts.size());
+	accounts.forEach([&](const Digest& key,const Account& a){ entries.push_back(SnapshotEntry{key,a}); });
+	std::sort(entries.begin(),entries.end(),[](const SnapshotEntry& x,const SnapshotEntry& y){ return x.key < y.key; });
+	return entries;
+}
+
+inline unsigned State::hashThreads(size_t n){
+	return n >= STATE_PARALLEL_HASH ? std::max(1u,std::thread::hardware_concurrency()) : 1;
+}
+
+inline std::vector<Digest> State::hashLeaves(const SnapshotEntry* entries,size_t n){
+	unsigned threads = hashThreads(n);
+	std::vector<Digest> leaves(n);
+	auto hashLeaves = [entries,&leaves](size_t from,size_t to){
+		for(size_t i = from;i < to;i++)
+			leaves[i] = accountLeaf(entries[i].key,entries[i].account);
+	};
+	if(threads == 1)
+		hashLeaves(0,n);
+	else{
+		std::vector<std::thread> workers;
+		size_t chunk = (n + threads - 1) / threads;
+		for(size_t from = 0;from < n;from += chunk)
+			workers.emplace_back(hashLeaves,from,std::min(n,from + chunk));
+		for(std::thread& w : workers)
+			w.join();
+	}
+	return leaves;
+}
+
+inline Digest State::hashEntries(const SnapshotEntry* entries,size_t n){
+	std::vector<Digest> leaves = hashLeaves(entries,n);
+	return merkleRoot(leaves.data(),n,hashThreads(n));
+}
+
+// Hashes the state and keeps its tree for prove(root,...) if its root is
+// root. Otherwise the tree kept before stays, a block with a wrong
+// commitment does not take the proofs of the tip away.
+inline bool State::keepProofs(const Digest& root){
+	std::vector<SnapshotEntry> entries = sorted();
+	MerkleTree tree;
+	tree.build(hashLeaves(entries.data(),entries.size()),hashThreads(entries.size()));
+	if(tree.root() != root)
+		return false;
+	proven.swap(entries);
+	provenTree = std::move(tree);
+	return true;
+}
+
+inline Digest State::hash() const {
+	std::vector<SnapshotEntry> entries = sorted();
+	return hashEntries(entries.data(),entries.size());
+}
+
+// The account under key and its path to hash(). False if there is no such account.
+inline bool State::prove(const Digest& key,Account& account,MerkleProof& proof) const {
+	std::vector<SnapshotEntry> entries = sorted();
+	auto it = std::lower_bound(entries.begin(),entries.end(),key,[](const SnapshotEntry& e,const Digest& k){ return e.key < k; });
+	if(it == entries.end() || it->key != key)
+		return false;
+	std::vector<Digest> leaves(entries.size());
+	for(size_t i = 0;i < entries.size();i++)
+		leaves[i] = accountLeaf(entries[i].key,entries[i].account);
+	account = it->account;
+	proof = merkleProve(leaves.data(),leaves.size(),it - entries.begin());
+	return true;
+}
+
+// The same against the tree kept when the last block committing to the
+// state was applied, in O(log n). False if that block committed to another
+// root than root, or there is no such account.
+inline bool State::prove(const Digest& root,const Digest& key,Account& account,MerkleProof& proof) const {
+	if(provenTree.root() != root)
+		return false;
+	auto it = std::lower_bound(proven.begin(),proven.end(),key,[](const SnapshotEntry& e,const Digest& k){ return e.key < k; });
+	if(it == proven.end() || it->key != key)
+		return false;
+	account = it->account;
+	proof = provenTree.prove(it - proven.begin());
+	return true;
+}
+
+// Writes the state after block at height, replacing path atomically.
+inline int State::snapshot(const std::string& path,uint64_t height,const Digest& block) const {
+	std::vector<SnapshotEntry> entries = sorted();
+	SnapshotInfo info = {SNAPSHOT_MAGIC,height,block,hashEntries(entries.data(),entries.size()),entries.size()};
+	std::string tmp = path + ".tmp";
+	int fd = ::open(tmp.c_str(),O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0644);
+	if(fd < 0)
+		return SNAPSHOT_IO_ERROR;
+	size_t bytes = entries.size() * sizeof(SnapshotEntry);
+	bool ok = write(fd,&info,sizeof info) == sizeof info
+		&& (bytes == 0 || write(fd,entries.data(),bytes) == (ssize_t)bytes)
+		&& fsync(fd) == 0;
+	::close(fd);
+	if(!ok || rename(tmp.c_str(),path.c_str()) != 0)
+		return SNAPSHOT_IO_ERROR;
+	return SNAPSHOT_OK;
+}
+
+// Replaces the state with the snapshot if its content matches its hash.
+// Whether that hash belongs to the chain is up to the caller, see info.
+inline int State::load(const std::string& path,SnapshotInfo& info){
+	FILE* f = fopen(path.c_str(),"rb");
+	if(!f)
+		return SNAPSHOT_IO_ERROR;
+	std::vector<SnapshotEntry> entries;
+	bool ok = fread(&info,sizeof info,1,f) == 1 && info.magic == SNAPSHOT_MAGIC;
+	if(ok){
+		fseek(f,0,SEEK_END);
+		ok = (uint64_t)ftell(f) == sizeof info + info.count * sizeof(SnapshotEntry);
+		fseek(f,sizeof info,SEEK_SET);
+	}
+	if(ok){
+		entries.resize(info.count);
+		ok = info.count == 0 || fread(entries.data(),sizeof(SnapshotEntry),info.count,f) == info.count;
+	}
+	fclose(f);
+	if(!ok)
+		return SNAPSHOT_BAD_FILE;
+	for(size_t i = 1;i < entries.size();i++)
+		if(!(entries[i - 1].key < entries[i].key))
+			return SNAPSHOT_BAD_FILE;
+	// the snapshot block may be the tip, its accounts stay provable
+	MerkleTree tree;
+	tree.build(hashLeaves(entries.data(),entries.size()),hashThreads(entries.size()));
+	if(tree.root() != info.state)
+		return SNAPSHOT_BAD_HASH;
+	clear();
+	std::vector<AccountChange> changes;
+	changes.reserve(entries.size());
+	for(const SnapshotEntry& e : entries)
+		changes.emplace_back(e.key,e.account);
+	accounts.update(changes);
+	proven.swap(entries);
+	provenTree = std::move(tree);
+	if(resident)
+		accounts.spill(resident);
+	return SNAPSHOT_OK;
+}
+
+#endif
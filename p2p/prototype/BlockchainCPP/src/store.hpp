@@ -0,0 +1,597 @@
+#ifndef STORE_HPP
+#define STORE_HPP
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include "wire.hpp"
+
+#define STORE_OK 0
+#define STORE_IO_ERROR -1
+#define STORE_TOO_LARGE -2
+#define STORE_DUPLICATE -3
+#define STORE_BAD_BLOCK -4
+
+#define SEGMENT_SIZE (64 * 1024 * 1024) // bytes per segment file, reserved up front and mapped once
+#define RECORD_HEADER 8                 // payload size and checksum in front of every block
+#define RECORD_ALIGN 8                  // records start aligned, so headers can be read in place
+#define INDEX_MIN_SLOTS 1024
+#define INDEX_HEADER 64
+#define CHECKPOINT_INTERVAL 1024        // appended blocks between two automatic checkpoints
+#define STORE_MAGIC 0x4b4c425446494853ULL // "SHIFTBLK"
+
+// Persistent block store. Encoded blocks are appended to segment files that
+// are mapped read-only, so a lookup returns a view into the page cache.
+// Three small files sit next to the segments:
+//   index.dat       open addressing table hash -> (segment,offset), mapped
+//   headers.dat     the Block header of every stored block in append order
+//   checkpoint      how far segments, index and headers are known to be on disk
+// Opening the store maps the index and replays only the records written
+// after the last checkpoint. A torn record at the end is cut off.
+// With sync set, full segments and automatic checkpoints are flushed
+// through it, e.g. by the io_uring of the event loop, and append() never
+// waits for the disk: the checkpoint record is written once the files it
+// covers are synced. close() and checkpoint() still sync in place.
+// Pruning drops the oldest segment as a whole: its bodies are gone, the
+// headers and the other segments stay. Numbering goes on from where it
+// was. A pruned store needs its index, rebuilt from the segments it would
+// only know the headers of the blocks still there.
+class BlockStore{
+	private:
+		struct Segment{
+			int fd;
+			const uint8_t* map;
+		};
+		struct IndexEntry{
+			Digest hash;
+			uint32_t segment; // counts from 1, 0 is an empty slot
+			uint32_t offset;
+		};
+		struct IndexHeader{
+			uint64_t magic;
+			uint64_t slots;
+			uint64_t used;
+		};
+		struct Checkpoint{
+			uint64_t magic;
+			uint32_t segment;
+			uint32_t offset;
+			uint64_t count;
+		};
+		std::string dir;
+		size_t segmentSize;
+		std::vector<Segment> segments;
+		uint32_t first;            // number of segments[0], higher once pruned
+		size_t writeOffset;
+		int indexFd;
+		uint8_t* indexMap;
+		size_t indexBytes;
+		int headersFd;
+		uint64_t count;
+		uint64_t sinceCheckpoint;
+		uint64_t replayed;
+		size_t unsynced;           // first segment the next checkpoint has to sync
+		bool checkpointing;        // an asynchronous checkpoint is waiting for its syncs
+		std::shared_ptr<int> alive; // until close(), completions of an older open() see it expired
+
+		std::string path(const std::string& name) const { return dir + "/" + name; }
+		std::string segmentName(uint32_t n) const;
+		uint32_t last() const { return first + segments.size() - 1; }
+		uint32_t firstOnDisk() const;
+		IndexHeader& indexHeader() const { return *(IndexHeader*)indexMap; }
+		IndexEntry* slots() const { return (IndexEntry*)(indexMap + INDEX_HEADER); }
+		bool openSegment(uint32_t n,bool create);
+		bool mapIndex(const std::string& file,uint64_t slots,bool create);
+		void unmapIndex();
+		bool rebuildIndex();
+		IndexEntry* probe(const Digest& hash) const;
+		bool insert(const Digest& hash,uint32_t segment,uint32_t offset);
+		bool replay(uint32_t segment,uint32_t offset);
+		bool writeCheckpoint(const Checkpoint& cp);
+		void checkpointAsync();
+		static uint32_t checksum(const void* data,size_t size);
+		static size_t recordSize(size_t size){ return (RECORD_HEADER + size + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1); }
+	public:
+		// fdatasync(fd) in the background, done(0 or -errno) on the thread that appends
+		std::function<void(int,std::function<void(int)>)> sync;
+		// unlink(path) of a pruned segment in the background, in place if unset
+		std::function<void(const std::string&)> discard;
+
+		explicit BlockStore(size_t segmentSize = SEGMENT_SIZE);
+		~BlockStore();
+		BlockStore(const BlockStore&) = delete;
+		BlockStore& operator=(const BlockStore&) = delete;
+
+		int open(const std::string& directory);
+		void close();
+		bool isOpen() const { return !segments.empty(); }
+		int64_t append(const uint8_t* data,size_t size);
+		int64_t append(const BlockData& block);
+		Bytes find(const Digest& hash) const;
+		bool view(const Digest& hash,BlockView& block) const;
+		bool get(const Digest& hash,BlockData& block) const;
+		bool contains(const Digest& hash) const { return find(hash).data != nullptr; }
+		int checkpoint();
+		bool pruneOldest(const Digest& keep);
+		template<class F> bool forEachHeader(F f) const;
+		uint64_t size() const { return count; }
+		uint64_t recovered() const { return replayed; }
+		size_t segmentCount() const { return segments.size(); }
+		uint32_t firstSegment() const { return first; }
+		uint64_t diskUsage() const { return segments.size() * segmentSize + count * sizeof(Block) + indexBytes; }
+};
+
+inline BlockStore::BlockStore(size_t s){
+	this->segmentSize = s;
+	this->first = 1;
+	this->writeOffset = 0;
+	this->indexFd = -1;
+	this->indexMap = nullptr;
+	this->indexBytes = 0;
+	this->headersFd = -1;
+	this->count = 0;
+	this->sinceCheckpoint = 0;
+	this->replayed = 0;
+	this->unsynced = 0;
+	this->checkpointing = false;
+}
+
+inline BlockStore::~BlockStore(){
+	close();
+}
+
+inline std::string BlockStore::segmentName(uint32_t n) const {
+	char name[32];
+	snprintf(name,sizeof name,"segment-%06u.dat",n);
+	return path(name);
+}
+
+// Lowest segment number in the directory, 1 for a new store.
+inline uint32_t BlockStore::firstOnDisk() const {
+	uint32_t n = 0;
+	DIR* d = opendir(dir.c_str());
+	if(!d)
+		return 1;
+	while(dirent* e = readdir(d)){
+		unsigned k;
+		char end;
+		if(sscanf(e->d_name,"segment-%u.da%c",&k,&end) == 2 && end == 't' && k && (!n || k < n))
+			n = k;
+	}
+	closedir(d);
+	return n ? n : 1;
+}
+
+// Cheap integrity check of a record, catches torn and zero-filled writes.
+inline uint32_t BlockStore::checksum(const void* data,size_t size){
+	Digest d = sha256(data,size);
+	uint32_t c;
+	memcpy(&c,d.data(),sizeof c);
+	return c;
+}
+
+inline bool BlockStore::openSegment(uint32_t n,bool create){
+	int fd = ::open(segmentName(n).c_str(),O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0),0644);
+	if(fd < 0)
+		return false;
+	struct stat st;
+	if(create ? ftruncate(fd,segmentSize) != 0 : fstat(fd,&st) != 0 || (size_t)st.st_size != segmentSize){
+		::close(fd);
+		return false;
+	}
+	void* map = mmap(nullptr,segmentSize,PROT_READ,MAP_SHARED,fd,0);
+	if(map == MAP_FAILED){
+		::close(fd);
+		return false;
+	}
+	madvise(map,segmentSize,MADV_RANDOM);
+	segments.push_back(Segment{fd,(const uint8_t*)map});
+	return true;
+}
+
+inline bool BlockStore::mapIndex(const std::string& file,uint64_t n,bool create){
+	int fd = ::open(file.c_str(),O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0),0644);
+	if(fd < 0)
+		return false;
+	size_t bytes;
+	if(create){
+		bytes = INDEX_HEADER + n * sizeof(IndexEntry);
+		if(ftruncate(fd,bytes) != 0){
+			::close(fd);
+			return false;
+		}
+	}
+	else{
+		struct stat st;
+		fstat(fd,&st);
+		bytes = st.st_size;
+	}
+	void* map = mmap(nullptr,bytes,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+	if(map == MAP_FAILED){
+		::close(fd);
+		return false;
+	}
+	unmapIndex();
+	indexFd = fd;
+	indexMap = (uint8_t*)map;
+	indexBytes = bytes;
+	if(create){
+		indexHeader().magic = STORE_MAGIC;
+		indexHeader().slots = n;
+		indexHeader().used = 0;
+	}
+	else if(indexHeader().magic != STORE_MAGIC || bytes != INDEX_HEADER + indexHeader().slots * sizeof(IndexEntry)){
+		unmapIndex();
+		return false;
+	}
+	return true;
+}
+
+inline void BlockStore::unmapIndex(){
+	if(indexMap)
+		munmap(indexMap,indexBytes);
+	if(indexFd >= 0)
+		::close(indexFd);
+	indexMap = nullptr;
+	indexFd = -1;
+	indexBytes = 0;
+}
+
+// Linear probing, returns the slot holding hash or the empty slot where it would go.
+inline BlockStore::IndexEntry* BlockStore::probe(const Digest& hash) const {
+	uint64_t mask = indexHeader().slots - 1;
+	IndexEntry* table = slots();
+	for(uint64_t i = DigestHash()(hash) & mask;;i = (i + 1) & mask){
+		if(table[i].segment == 0 || table[i].hash == hash)
+			return &table[i];
+	}
+}
+
+// Rebuilds the table in a new file and swaps it in, without the blocks of
+// pruned segments and twice as large if still half full.
+inline bool BlockStore::rebuildIndex(){
+	std::vector<IndexEntry> entries;
+	entries.reserve(indexHeader().used);
+	for(uint64_t i = 0;i < indexHeader().slots;i++)
+		if(slots()[i].segment >= first)
+			entries.push_back(slots()[i]);
+	uint64_t n = indexHeader().slots;
+	while((entries.size() + 1) * 2 > n)
+		n *= 2;
+	std::string tmp = path("index.tmp");
+	if(!mapIndex(tmp,n,true))
+		return false;
+	for(const IndexEntry& e : entries)
+		*probe(e.hash) = e;
+	indexHeader().used = entries.size();
+	msync(indexMap,indexBytes,MS_SYNC);
+	return rename(tmp.c_str(),path("index.dat").c_str()) == 0;
+}
+
+inline bool BlockStore::insert(const Digest& hash,uint32_t segment,uint32_t offset){
+	if((indexHeader().used + 1) * 2 > indexHeader().slots && !rebuildIndex())
+		return false;
+	IndexEntry* e = probe(hash);
+	if(e->segment == 0)
+		indexHeader().used++;
+	e->hash = hash;
+	e->offset = offset;
+	e->segment = segment;
+	return true;
+}
+
+inline int BlockStore::open(const std::string& directory){
+	close();
+	dir = directory;
+	mkdir(dir.c_str(),0755);
+	Checkpoint cp = {STORE_MAGIC,1,0,0};
+	FILE* f = fopen(path("checkpoint").c_str(),"rb");
+	if(f){
+		if(fread(&cp,sizeof cp,1,f) != 1 || cp.magic != STORE_MAGIC)
+			cp = {STORE_MAGIC,1,0,0};
+		fclose(f);
+	}
+	if(!mapIndex(path("index.dat"),0,false)){
+		// without an index every segment has to be replayed
+		if(!mapIndex(path("index.dat"),INDEX_MIN_SLOTS,true))
+			return STORE_IO_ERROR;
+		cp = {STORE_MAGIC,1,0,0};
+	}
+	headersFd = ::open(path("headers.dat").c_str(),O_RDWR | O_CREAT | O_CLOEXEC,0644);
+	if(headersFd < 0 || ftruncate(headersFd,cp.count * sizeof(Block)) != 0){
+		close();
+		return STORE_IO_ERROR;
+	}
+	count = cp.count;
+	first = firstOnDisk();
+	// an existing store keeps the segment size it was created with
+	struct stat st;
+	if(stat(segmentName(first).c_str(),&st) == 0)
+		segmentSize = st.st_size;
+	for(uint32_t n = first;openSegment(n,false);n++)
+		;
+	if(segments.empty() && !openSegment(first,true)){
+		close();
+		return STORE_IO_ERROR;
+	}
+	if(!replay(cp.segment,cp.offset)){
+		close();
+		return STORE_IO_ERROR;
+	}
+	unsynced = std::min(std::max(cp.segment,first),last()) - first;
+	alive = std::make_shared<int>(0);
+	return checkpoint();
+}
+
+// Walks the records after the checkpoint and adds them to index and headers.
+// Everything from the first broken record on is dropped, later segments too.
+inline bool BlockStore::replay(uint32_t segment,uint32_t offset){
+	replayed = 0;
+	if(segment > last()){
+		segment = last();
+		offset = 0;
+	}
+	if(segment < first){
+		segment = first;
+		offset = 0;
+	}
+	for(uint32_t s = segment;s <= last();s++){
+		const uint8_t* map = segments[s - first].map;
+		size_t at = s == segment ? offset : 0;
+		bool broken = false;
+		while(at + RECORD_HEADER <= segmentSize){
+			uint32_t size;
+			uint32_t check;
+			memcpy(&size,map + at,sizeof size);
+			memcpy(&check,map + at + 4,sizeof check);
+			if(size == 0)
+				break;
+			BlockView view;
+			if(at + recordSize(size) > segmentSize || checksum(map + at + RECORD_HEADER,size) != check || !view.parse(map + at + RECORD_HEADER,size)){
+				broken = true;
+				break;
+			}
+			Block header = view.header().get();
+			if(!insert(header.hash,s,at) || pwrite(headersFd,&header,sizeof header,count * sizeof(Block)) != sizeof header)
+				return false;
+			count++;
+			replayed++;
+			at += recordSize(size);
+		}
+		writeOffset = at;
+		if(broken || s == last()){
+			// the next append starts here, clear what a torn write left behind
+			if(at + RECORD_HEADER <= segmentSize){
+				uint8_t zero[RECORD_HEADER] = {0};
+				if(pwrite(segments[s - first].fd,zero,sizeof zero,at) != sizeof zero)
+					return false;
+			}
+			while(last() > s){
+				munmap((void*)segments.back().map,segmentSize);
+				::close(segments.back().fd);
+				unlink(segmentName(last()).c_str());
+				segments.pop_back();
+			}
+			return true;
+		}
+	}
+	return true;
+}
+
+inline int64_t BlockStore::append(const BlockData& block){
+	std::vector<uint8_t> bytes = encodeBlock(block);
+	return append(bytes.data(),bytes.size());
+}
+
+// Returns the position of the block in append order, or an error code.
+inline int64_t BlockStore::append(const uint8_t* data,size_t size){
+	if(!isOpen())
+		return STORE_IO_ERROR;
+	BlockView view;
+	if(!view.parse(data,size))
+		return STORE_BAD_BLOCK;
+	if(recordSize(size) > segmentSize)
+		return STORE_TOO_LARGE;
+	Block header = view.header().get();
+	if(contains(header.hash))
+		return STORE_DUPLICATE;
+	if(writeOffset + recordSize(size) > segmentSize){
+		// a full segment is not written again, the next checkpoint finds it clean
+		if(sync)
+			sync(segments.back().fd,[](int){});
+		else
+			fdatasync(segments.back().fd);
+		if(!openSegment(last() + 1,true))
+			return STORE_IO_ERROR;
+		writeOffset = 0;
+	}
+	uint32_t record[2] = {(uint32_t)size,checksum(data,size)};
+	iovec iov[2] = {{record,RECORD_HEADER},{(void*)data,size}};
+	if(pwritev(segments.back().fd,iov,2,writeOffset) != (ssize_t)(RECORD_HEADER + size))
+		return STORE_IO_ERROR;
+	if(pwrite(headersFd,&header,sizeof header,count * sizeof(Block)) != sizeof header)
+		return STORE_IO_ERROR;
+	if(!insert(header.hash,last(),writeOffset))
+		return STORE_IO_ERROR;
+	writeOffset += recordSize(size);
+	// counted before the checkpoint, which covers this record
+	int64_t position = count++;
+	if(++sinceCheckpoint >= CHECKPOINT_INTERVAL){
+		if(sync)
+			checkpointAsync();
+		else if(checkpoint() != STORE_OK)
+			return STORE_IO_ERROR;
+	}
+	return position;
+}
+
+// One probe in the mapped index and one read in the mapped segment.
+// The view stays valid until the store is closed.
+inline Bytes BlockStore::find(const Digest& hash) const {
+	if(!isOpen())
+		return Bytes();
+	const IndexEntry* e = probe(hash);
+	if(e->segment < first || e->segment > last())
+		return Bytes();
+	size_t end = e->segment == last() ? writeOffset : segmentSize;
+	if(e->offset + RECORD_HEADER + WIRE_PREFIX + WIRE_HEADER_SIZE > end)
+		return Bytes();
+	const uint8_t* record = segments[e->segment - first].map + e->offset;
+	uint32_t size;
+	memcpy(&size,record,sizeof size);
+	// the index may be ahead of a segment that lost its tail in a crash
+	if(e->offset + recordSize(size) > end || memcmp(HeaderView(record + RECORD_HEADER + WIRE_PREFIX).hashBytes(),hash.data(),hash.size()) != 0)
+		return Bytes();
+	return Bytes(record + RECORD_HEADER,size);
+}
+
+// Parses the stored block in place, nothing is copied.
+inline bool BlockStore::view(const Digest& hash,BlockView& block) const {
+	Bytes b = find(hash);
+	return b.data && block.parse((const uint8_t*)b.data,b.size);
+}
+
+inline bool BlockStore::get(const Digest& hash,BlockData& block) const {
+	BlockView v;
+	if(!view(hash,v))
+		return false;
+	decodeBlock(v,block);
+	return true;
+}
+
+// Flushes segments, headers and index, then records the position atomically.
+inline int BlockStore::checkpoint(){
+	if(!isOpen())
+		return STORE_IO_ERROR;
+	for(size_t s = unsynced;s < segments.size();s++)
+		if(fdatasync(segments[s].fd) != 0)
+			return STORE_IO_ERROR;
+	if(fdatasync(headersFd) != 0 || msync(indexMap,indexBytes,MS_SYNC) != 0)
+		return STORE_IO_ERROR;
+	Checkpoint cp = {STORE_MAGIC,last(),(uint32_t)writeOffset,count};
+	if(!writeCheckpoint(cp))
+		return STORE_IO_ERROR;
+	unsynced = segments.size() - 1;
+	sinceCheckpoint = 0;
+	return STORE_OK;
+}
+
+inline bool BlockStore::writeCheckpoint(const Checkpoint& cp){
+	std::string tmp = path("checkpoint.tmp");
+	int fd = ::open(tmp.c_str(),O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0644);
+	if(fd < 0)
+		return false;
+	bool ok = write(fd,&cp,sizeof cp) == sizeof cp && fsync(fd) == 0;
+	::close(fd);
+	if(!ok || rename(tmp.c_str(),path("checkpoint").c_str()) != 0)
+		return false;
+	int dirfd = ::open(dir.c_str(),O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(dirfd >= 0){
+		fsync(dirfd);
+		::close(dirfd);
+	}
+	return true;
+}
+
+// checkpoint() with the data syncs in the background. The position is taken
+// now and recorded when every sync succeeded; after a failure the next
+// interval tries again. Records appended meanwhile are replayed on open.
+inline void BlockStore::checkpointAsync(){
+	if(checkpointing)
+		return;
+	checkpointing = true;
+	sinceCheckpoint = 0;
+	Checkpoint cp = {STORE_MAGIC,last(),(uint32_t)writeOffset,count};
+	std::vector<int> fds;
+	for(size_t s = unsynced;s < segments.size();s++)
+		fds.push_back(segments[s].fd);
+	fds.push_back(headersFd);
+	fds.push_back(indexFd); // fdatasync also writes back pages dirtied through the mapping
+	std::shared_ptr<size_t> left = std::make_shared<size_t>(fds.size());
+	std::shared_ptr<bool> failed = std::make_shared<bool>(false);
+	std::weak_ptr<int> token = alive;
+	for(int fd : fds)
+		sync(fd,[this,token,left,failed,cp](int res){
+			if(res < 0)
+				*failed = true;
+			if(--*left || token.expired())
+				return;
+			checkpointing = false;
+			if(!*failed && writeCheckpoint(cp))
+				unsynced = std::max<size_t>(unsynced,cp.segment - first);
+		});
+}
+
+// Deletes the oldest segment if every record in it was appended before
+// keep and a checkpoint covers it. Its blocks are not found any more,
+// their headers stay. Returns false if there was nothing to delete.
+inline bool BlockStore::pruneOldest(const Digest& keep){
+	if(!isOpen() || segments.size() < 2 || unsynced == 0)
+		return false;
+	const IndexEntry* e = probe(keep);
+	if(e->segment <= first || e->segment > last())
+		return false;
+	munmap((void*)segments.front().map,segmentSize);
+	::close(segments.front().fd);
+	std::string name = segmentName(first);
+	segments.erase(segments.begin());
+	first++;
+	unsynced--;
+	// freeing the blocks of a large file is what takes long
+	if(discard)
+		discard(name);
+	else
+		unlink(name.c_str());
+	return true;
+}
+
+inline void BlockStore::close(){
+	alive.reset();
+	checkpointing = false;
+	if(isOpen())
+		checkpoint();
+	for(Segment& s : segments){
+		munmap((void*)s.map,segmentSize);
+		::close(s.fd);
+	}
+	segments.clear();
+	first = 1;
+	unmapIndex();
+	if(headersFd >= 0)
+		::close(headersFd);
+	headersFd = -1;
+	count = 0;
+	writeOffset = 0;
+	sinceCheckpoint = 0;
+	unsynced = 0;
+}
+
+// Calls f(const Block&) for every stored header in append order, reading
+// headers.dat sequentially instead of touching the segments.
+template<class F> inline bool BlockStore::forEachHeader(F f) const {
+	std::vector<Block> chunk(BLOCKS_PER_CHUNK);
+	for(uint64_t at = 0;at < count;){
+		size_t n = std::min<uint64_t>(chunk.size(),count - at);
+		if(pread(headersFd,chunk.data(),n * sizeof(Block),at * sizeof(Block)) != (ssize_t)(n * sizeof(Block)))
+			return false;
+		for(size_t i = 0;i < n;i++)
+			f(chunk[i]);
+		at += n;
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,482 @@
+#ifndef SYNC_HPP
+#define SYNC_HPP
+
+#include <map>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include "peer.hpp"
+
+#define SYNC_IDLE 0
+#define SYNC_RUNNING 1
+#define SYNC_DONE 2
+#define SYNC_FAILED 3   // every source was dropped before the chain was complete
+
+#define SYNC_WINDOW 32          // bodies per request
+#define SYNC_MAX_AHEAD 512      // bodies fetched beyond the tip, must stay below MAX_ORPHANS
+#define SYNC_MAX_WINDOWS 8      // requests in flight to one source
+#define SYNC_TARGET_MS 200      // work queued at a source, in time at its measured rate
+#define SYNC_TIMEOUT_MS 2000    // for a source without a measured rate yet
+#define SYNC_SLACK_MS 100       // added to every expected response time
+#define SYNC_TICK_MS 20
+
+struct SyncStats{
+	uint64_t headers;     // validated headers beyond the starting tip
+	uint64_t blocks;      // linked so far
+	uint64_t bytes;       // body bytes received, duplicates included
+	uint64_t reassigned;  // bodies requested again from another source
+	double seconds;
+	double blocksPerSecond;
+	double megabytesPerSecond;
+};
+
+// Headers-first synchronisation of a Peer from the sources added before
+// start(). The header chain is fetched from one source at a time and
+// validated as it arrives; meanwhile bodies are requested in windows from
+// every source, more windows to the faster ones. A window that takes much
+// longer than its source's rate predicts is reassigned, and so is the one
+// holding back the tip when a faster source is idle. Bodies go through the
+// peer's pipeline in height order.
+// Everything runs on the peer's loop thread, only status() may be read elsewhere.
+class Sync{
+	private:
+		struct Source{
+			uint64_t conn;
+			double rate;       // blocks per second, moving average over finished windows
+			int64_t busyUntil; // when the last finished window was done, to measure service time
+			size_t windows;    // requests in flight
+			uint64_t blocks;   // bodies delivered
+			bool slow;         // last window timed out
+		};
+		struct Window{
+			size_t source;
+			std::vector<uint64_t> heights;
+			size_t missing;
+			int64_t sent;
+			int64_t deadline;
+		};
+		Peer& peer;
+		std::vector<Source> sources;
+		std::vector<bool> dropped;
+		std::vector<Block> headers; // validated, headers[i] is at height base + i
+		std::unordered_map<Digest,uint64_t,DigestHash> heights;
+		uint64_t base;
+		bool headersDone;
+		size_t headerSource;
+		int64_t headerDeadline;
+		std::map<uint64_t,Window> windows;           // by id
+		std::unordered_map<uint64_t,uint64_t> wanted; // height -> window id
+		std::unordered_map<uint64_t,size_t> deliveredBy;
+		uint64_t nextWindow;
+		std::deque<uint64_t> retry;                  // heights to request again
+		std::map<uint64_t,std::vector<uint8_t>> bodies; // received, waiting for their turn
+		std::deque<std::vector<uint8_t>> refetched;  // replacements for bodies the pipeline rejected
+		std::unordered_set<uint64_t> refetch;
+		uint64_t nextFetch;
+		uint64_t nextSubmit;
+		uint64_t timer;
+		int64_t started;
+		int64_t finished;
+		std::atomic<int> state;
+		SyncStats counters;
+
+		void requestHeaders();
+		void onHeaders(size_t source,const uint8_t* data,size_t size);
+		void onBody(size_t source,const uint8_t* data,size_t size);
+		void onMissing(size_t source,const uint8_t* data,size_t size);
+		void onVerdict(const Block& block,bool ok);
+		void received(uint64_t id);
+		void schedule();
+		void submit();
+		void tick();
+		void reassign(uint64_t id);
+		void drop(size_t source);
+		void finish(int status);
+		size_t capacity(const Source& s) const;
+		int64_t expected(const Source& s,size_t blocks) const;
+		size_t sourceOf(uint64_t conn) const;
+		uint64_t target() const { return base + headers.size(); }
+	public:
+		std::function<void(int)> onDone; // on the loop thread, with SYNC_DONE or SYNC_FAILED
+
+		explicit Sync(Peer& p);
+		~Sync();
+		Sync(const Sync&) = delete;
+		Sync& operator=(const Sync&) = delete;
+
+		void addSource(uint64_t conn);
+		void start();
+		int status() const { return state.load(); }
+		SyncStats stats() const;
+		uint64_t delivered(size_t source) const { return sources[source].blocks; }
+};
+
+inline Sync::Sync(Peer& p) : peer(p){
+	base = 0;
+	headersDone = false;
+	headerSource = 0;
+	headerDeadline = 0;
+	nextWindow = 1;
+	nextFetch = 0;
+	nextSubmit = 0;
+	timer = 0;
+	started = 0;
+	finished = 0;
+	state = SYNC_IDLE;
+	counters = SyncStats{0,0,0,0,0,0,0};
+}
+
+// Destroy on the loop thread or after the loop stopped.
+inline Sync::~Sync(){
+	if(timer)
+		peer.loop.cancel(timer);
+	if(state != SYNC_IDLE){
+		peer.onReply = nullptr;
+		peer.onVerdict = nullptr;
+	}
+}
+
+inline void Sync::addSource(uint64_t conn){
+	sources.push_back(Source{conn,0,0,0,0,false});
+	dropped.push_back(false);
+}
+
+// Takes over the peer's onReply and onVerdict for the lifetime of the Sync.
+inline void Sync::start(){
+	base = peer.chain.size();
+	nextFetch = base;
+	nextSubmit = base;
+	started = peer.loop.now();
+	state = SYNC_RUNNING;
+	peer.onReply = [this](Connection& c,const uint8_t* data,size_t size){
+		size_t s = sourceOf(c.id());
+		if(state != SYNC_RUNNING || s == sources.size() || dropped[s])
+			return;
+		if(data[0] == MSG_HEADERS)
+			onHeaders(s,data + 1,size - 1);
+		else if(data[0] == MSG_BODY)
+			onBody(s,data + 1,size - 1);
+		else
+			onMissing(s,data + 1,size - 1);
+	};
+	peer.onVerdict = [this](const Block& block,bool ok){
+		if(state == SYNC_RUNNING)
+			onVerdict(block,ok);
+	};
+	if(sources.empty()){
+		finish(SYNC_FAILED);
+		return;
+	}
+	requestHeaders();
+	timer = peer.loop.after(SYNC_TICK_MS,[this](){ tick(); });
+}
+
+inline size_t Sync::sourceOf(uint64_t conn) const {
+	for(size_t i = 0;i < sources.size();i++)
+		if(sources[i].conn == conn)
+			return i;
+	return sources.size();
+}
+
+inline void Sync::requestHeaders(){
+	uint64_t first = target();
+	uint32_t count = HEADERS_PER_MESSAGE;
+	uint8_t request[sizeof first + sizeof count];
+	memcpy(request,&first,sizeof first);
+	memcpy(request + sizeof first,&count,sizeof count);
+	Connection* c = peer.server.find(sources[headerSource].conn);
+	if(c)
+		c->send(MSG_GET_HEADERS,request,sizeof request);
+	headerDeadline = peer.loop.now() + SYNC_TIMEOUT_MS;
+}
+
+// Each header must hash correctly and extend the one before it, the
+// first one extends the local tip. A short batch ends the chain.
+inline void Sync::onHeaders(size_t source,const uint8_t* data,size_t size){
+	uint64_t first;
+	if(headersDone || source != headerSource || size < sizeof first || (size - sizeof first) % WIRE_HEADER_SIZE)
+		return;
+	memcpy(&first,data,sizeof first);
+	if(first != target())
+		return;
+	size_t n = (size - sizeof first) / WIRE_HEADER_SIZE;
+	Digest none;
+	none.fill(0);
+	for(size_t i = 0;i < n;i++){
+		HeaderView view(data + sizeof first + i * WIRE_HEADER_SIZE);
+		Block b = view.get();
+		const Block* prev = !headers.empty() ? &headers.back() : peer.chain.empty() ? nullptr : &peer.chain.tip();
+		bool ok = b.hash == view.computeHash() && (prev ? b.phash == prev->hash && b.timestamp >= prev->timestamp : b.phash == none);
+		if(!ok){
+			drop(source);
+			return;
+		}
+		b.height = target();
+		heights.emplace(b.hash,b.height);
+		headers.push_back(b);
+	}
+	counters.headers = headers.size();
+	if(n < HEADERS_PER_MESSAGE)
+		headersDone = true;
+	else
+		requestHeaders();
+	schedule();
+	if(headersDone && peer.chain.size() >= target())
+		finish(SYNC_DONE);
+}
+
+inline size_t Sync::capacity(const Source& s) const {
+	if(s.slow)
+		return 1;
+	if(s.rate <= 0)
+		return 2;
+	size_t n = (size_t)(s.rate * SYNC_TARGET_MS / 1000 / SYNC_WINDOW);
+	return std::max<size_t>(1,std::min<size_t>(n,SYNC_MAX_WINDOWS));
+}
+
+// Milliseconds until the source should have delivered blocks more bodies.
+inline int64_t Sync::expected(const Source& s,size_t blocks) const {
+	if(s.rate <= 0)
+		return SYNC_TIMEOUT_MS;
+	return (int64_t)(blocks * 1000 / s.rate) + SYNC_SLACK_MS;
+}
+
+// Hands out windows, retries first, to the source with the best rate that
+// still has room, until SYNC_MAX_AHEAD bodies beyond the tip are wanted.
+inline void Sync::schedule(){
+	uint64_t limit = std::min<uint64_t>(target(),peer.chain.size() + SYNC_MAX_AHEAD);
+	for(;;){
+		if(retry.empty() && nextFetch >= limit)
+			return;
+		size_t best = sources.size();
+		for(size_t i = 0;i < sources.size();i++){
+			if(dropped[i] || sources[i].windows >= capacity(sources[i]))
+				continue;
+			if(best == sources.size() || sources[i].rate > sources[best].rate || (sources[i].rate == sources[best].rate && sources[i].windows < sources[best].windows))
+				best = i;
+		}
+		if(best == sources.size())
+			return;
+		Source& s = sources[best];
+		uint64_t id = nextWindow++;
+		Window w;
+		w.source = best;
+		while(w.heights.size() < SYNC_WINDOW && !retry.empty()){
+			uint64_t h = retry.front();
+			retry.pop_front();
+			if(h >= nextSubmit ? !bodies.count(h) : refetch.count(h) != 0)
+				w.heights.push_back(h);
+		}
+		while(w.heights.size() < SYNC_WINDOW && nextFetch < limit)
+			w.heights.push_back(nextFetch++);
+		if(w.heights.empty())
+			continue;
+		std::vector<uint8_t> request(w.heights.size() * sizeof(Digest));
+		for(size_t i = 0;i < w.heights.size();i++){
+			memcpy(request.data() + i * sizeof(Digest),headers[w.heights[i] - base].hash.data(),sizeof(Digest));
+			wanted[w.heights[i]] = id;
+		}
+		w.missing = w.heights.size();
+		w.sent = peer.loop.now();
+		w.deadline = w.sent + expected(s,w.heights.size() * (s.windows + 1));
+		s.windows++;
+		windows.emplace(id,std::move(w));
+		Connection* c = peer.server.find(s.conn);
+		if(c)
+			c->send(MSG_GET_BODIES,request.data(),request.size());
+	}
+}
+
+inline void Sync::onBody(size_t source,const uint8_t* data,size_t size){
+	BlockView view;
+	if(!view.parse(data,size))
+		return;
+	counters.bytes += size;
+	auto it = heights.find(view.header().hash());
+	if(it == heights.end())
+		return;
+	uint64_t h = it->second;
+	// a late answer to a window that was reassigned
+	if(h < nextSubmit ? !refetch.count(h) : bodies.count(h) != 0)
+		return;
+	std::vector<uint8_t> bytes(data,data + size);
+	if(h < nextSubmit){
+		refetch.erase(h);
+		refetched.push_back(std::move(bytes));
+	}
+	else
+		bodies.emplace(h,std::move(bytes));
+	sources[source].blocks++;
+	deliveredBy[h] = source;
+	auto w = wanted.find(h);
+	if(w != wanted.end()){
+		uint64_t id = w->second;
+		wanted.erase(w);
+		received(id);
+	}
+	submit();
+	schedule();
+}
+
+// Counts a body of window id in, a finished window updates its source's rate.
+inline void Sync::received(uint64_t id){
+	auto it = windows.find(id);
+	if(it == windows.end() || --it->second.missing > 0)
+		return;
+	Window& w = it->second;
+	Source& s = sources[w.source];
+	int64_t now = peer.loop.now();
+	int64_t took = std::max<int64_t>(1,now - std::max(w.sent,s.busyUntil));
+	double rate = w.heights.size() * 1000.0 / took;
+	s.rate = s.rate > 0 ? s.rate * 0.7 + rate * 0.3 : rate;
+	s.busyUntil = now;
+	s.slow = false;
+	s.windows--;
+	windows.erase(it);
+}
+
+// The source does not have a block its own headers led to, it is not
+// following the same chain.
+inline void Sync::onMissing(size_t source,const uint8_t*,size_t){
+	drop(source);
+	schedule();
+}
+
+inline void Sync::submit(){
+	while(!refetched.empty() && peer.pipeline.trySubmit(std::move(refetched.front())))
+		refetched.pop_front();
+	if(!refetched.empty())
+		return;
+	for(auto it = bodies.begin();it != bodies.end() && it->first == nextSubmit;it = bodies.begin()){
+		if(!peer.pipeline.trySubmit(std::move(it->second)))
+			return;
+		bodies.erase(it);
+		nextSubmit++;
+	}
+}
+
+// A body that matched its header but failed verification came from a
+// source that forged the transactions: fetch it elsewhere.
+inline void Sync::onVerdict(const Block& block,bool ok){
+	auto it = heights.find(block.hash);
+	if(!ok && it != heights.end() && it->second >= peer.chain.size()){
+		uint64_t h = it->second;
+		auto by = deliveredBy.find(h);
+		if(by != deliveredBy.end())
+			drop(by->second);
+		refetch.insert(h);
+		retry.push_front(h);
+		counters.reassigned++;
+	}
+	counters.blocks = peer.chain.size() - base;
+	if(state == SYNC_RUNNING && headersDone && peer.chain.size() >= target()){
+		finish(SYNC_DONE);
+		return;
+	}
+	submit();
+	schedule();
+}
+
+// Returns the bodies of window id that are still missing to the retry queue.
+inline void Sync::reassign(uint64_t id){
+	auto it = windows.find(id);
+	if(it == windows.end())
+		return;
+	for(uint64_t h : it->second.heights){
+		auto w = wanted.find(h);
+		if(w == wanted.end() || w->second != id)
+			continue;
+		wanted.erase(w);
+		retry.push_back(h);
+		counters.reassigned++;
+	}
+	sources[it->second.source].windows--;
+	windows.erase(it);
+}
+
+inline void Sync::drop(size_t source){
+	if(dropped[source])
+		return;
+	dropped[source] = true;
+	std::vector<uint64_t> ids;
+	for(const auto& w : windows)
+		if(w.second.source == source)
+			ids.push_back(w.first);
+	for(uint64_t id : ids)
+		reassign(id);
+	if(!headersDone && source == headerSource){
+		for(size_t i = 1;i <= sources.size();i++){
+			size_t next = (headerSource + i) % sources.size();
+			if(!dropped[next]){
+				headerSource = next;
+				requestHeaders();
+				break;
+			}
+		}
+	}
+	if(std::find(dropped.begin(),dropped.end(),false) == dropped.end())
+		finish(SYNC_FAILED);
+}
+
+// Reassigns windows past their deadline, and the window the tip waits for
+// when the fastest source is idle and would deliver it sooner.
+inline void Sync::tick(){
+	timer = 0;
+	if(state != SYNC_RUNNING)
+		return;
+	int64_t now = peer.loop.now();
+	if(!headersDone && now > headerDeadline){
+		size_t s = headerSource;
+		headerSource = (headerSource + 1) % sources.size();
+		sources[s].slow = true;
+		while(dropped[headerSource])
+			headerSource = (headerSource + 1) % sources.size();
+		requestHeaders();
+	}
+	std::vector<uint64_t> late;
+	for(const auto& w : windows)
+		if(now > w.second.deadline)
+			late.push_back(w.first);
+	for(uint64_t id : late){
+		sources[windows[id].source].slow = true;
+		sources[windows[id].source].rate /= 2;
+		reassign(id);
+	}
+	auto blocking = wanted.find(nextSubmit);
+	if(blocking != wanted.end()){
+		const Window& w = windows[blocking->second];
+		size_t fastest = sources.size();
+		for(size_t i = 0;i < sources.size();i++)
+			if(!dropped[i] && sources[i].windows == 0 && (fastest == sources.size() || sources[i].rate > sources[fastest].rate))
+				fastest = i;
+		if(fastest != sources.size() && fastest != w.source && sources[fastest].rate > 0 && now + expected(sources[fastest],w.missing) < w.deadline)
+			reassign(blocking->second);
+	}
+	submit();
+	schedule();
+	if(state == SYNC_RUNNING)
+		timer = peer.loop.after(SYNC_TICK_MS,[this](){ tick(); });
+}
+
+inline void Sync::finish(int status){
+	if(state != SYNC_RUNNING)
+		return;
+	finished = peer.loop.now();
+	counters.blocks = peer.chain.size() - base;
+	state = status;
+	if(onDone)
+		onDone(status);
+}
+
+inline SyncStats Sync::stats() const {
+	SyncStats s = counters;
+	int64_t end = state == SYNC_RUNNING ? peer.loop.now() : finished;
+	s.seconds = started ? (end - started) / 1000.0 : 0;
+	s.blocksPerSecond = s.seconds > 0 ? s.blocks / s.seconds : 0;
+	s.megabytesPerSecond = s.seconds > 0 ? s.bytes / s.seconds / 1e6 : 0;
+	return s;
+}
+
+#endif
@@ -0,0 +1,538 @@
+#ifndef TASK_HPP
+#define TASK_HPP
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include "net.hpp"
+
+#define ARENA_CHUNK 65536  // bytes a FrameArena takes from the heap at a time
+#define ARENA_STEP 64      // frame sizes are rounded up to this
+#define ARENA_CLASSES 64   // free lists, frames above ARENA_STEP * ARENA_CLASSES go to the heap
+#define FRAME_PREFIX 16    // in front of every frame: the arena it came from, nullptr for the heap
+
+// Coroutines for protocol code on the event loop. A Task runs when it is
+// awaited or spawned and resumes its awaiter when it returns; awaiting
+// another Task hands control over directly, without going through the
+// loop. Everything runs on the loop thread. Failures are status codes like
+// everywhere else, an exception escaping a coroutine terminates.
+
+// Allocator for the coroutine frames of one connection. A coroutine always
+// has the same frame size, so freed frames go to a free list per size and
+// the next call of the same coroutine reuses them: after the first message
+// the protocol code of a connection allocates nothing. Frames have to be
+// freed before the arena, it releases its chunks as a whole.
+class FrameArena{
+	private:
+		struct Free{
+			Free* next;
+		};
+		std::vector<uint8_t*> chunks;
+		uint8_t* top;
+		size_t left;
+		Free* free[ARENA_CLASSES];
+		size_t live;
+	public:
+		FrameArena();
+		~FrameArena();
+		FrameArena(const FrameArena&) = delete;
+		FrameArena& operator=(const FrameArena&) = delete;
+
+		void* allocate(size_t n);
+		void release(void* p,size_t n);
+		size_t chunkCount() const { return chunks.size(); }
+		size_t liveFrames() const { return live; }
+};
+
+inline FrameArena::FrameArena(){
+	top = nullptr;
+	left = 0;
+	live = 0;
+	for(Free*& f : free)
+		f = nullptr;
+}
+
+inline FrameArena::~FrameArena(){
+	for(uint8_t* chunk : chunks)
+		delete[] chunk;
+}
+
+inline void* FrameArena::allocate(size_t n){
+	size_t c = (n + ARENA_STEP - 1) / ARENA_STEP;
+	live++;
+	if(c >= ARENA_CLASSES)
+		return ::operator new(n);
+	if(free[c]){
+		Free* f = free[c];
+		free[c] = f->next;
+		return f;
+	}
+	size_t bytes = c * ARENA_STEP;
+	if(left < bytes){
+		chunks.push_back(new uint8_t[ARENA_CHUNK]);
+		top = chunks.back();
+		left = ARENA_CHUNK;
+	}
+	void* p = top;
+	top += bytes;
+	left -= bytes;
+	return p;
+}
+
+inline void FrameArena::release(void* p,size_t n){
+	size_t c = (n + ARENA_STEP - 1) / ARENA_STEP;
+	live--;
+	if(c >= ARENA_CLASSES){
+		::operator delete(p);
+		return;
+	}
+	Free* f = (Free*)p;
+	f->next = free[c];
+	free[c] = f;
+}
+
+// The arena of a coroutine is the first of its arguments that is one or
+// has one, member coroutines included: a FrameArena& or an object with
+// frameArena(), like a Stream. Without one the frame comes from the heap.
+inline FrameArena* arenaOf(){
+	return nullptr;
+}
+
+template<class T,class... A> inline FrameArena* arenaOf(T& first,A&... rest){
+	if constexpr(std::is_same_v<std::remove_cv_t<T>,FrameArena>)
+		return const_cast<FrameArena*>(&first);
+	else if constexpr(requires{ first.frameArena(); })
+		return &first.frameArena();
+	else
+		return arenaOf(rest...);
+}
+
+template<class T> class Task;
+
+class TaskPromiseBase{
+	private:
+		struct Final{
+			bool await_ready() noexcept { return false; }
+			template<class P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+				TaskPromiseBase& p = h.promise();
+				if(p.detached){
+					h.destroy();
+					return std::noop_coroutine();
+				}
+				if(p.continuation)
+					return p.continuation;
+				return std::noop_coroutine();
+			}
+			void await_resume() noexcept {}
+		};
+	public:
+		std::coroutine_handle<> continuation;
+		bool detached = false; // spawned, frees itself at the end
+
+		static void* allocate(size_t n,FrameArena* arena){
+			uint8_t* p = (uint8_t*)(arena ? arena->allocate(n + FRAME_PREFIX) : ::operator new(n + FRAME_PREFIX));
+			memcpy(p,&arena,sizeof arena);
+			return p + FRAME_PREFIX;
+		}
+		template<class... A> static void* operator new(size_t n,A&... args){
+			return allocate(n,arenaOf(args...));
+		}
+		static void* operator new(size_t n){
+			return allocate(n,nullptr);
+		}
+		static void operator delete(void* frame,size_t n){
+			uint8_t* p = (uint8_t*)frame - FRAME_PREFIX;
+			FrameArena* arena;
+			memcpy(&arena,p,sizeof arena);
+			if(arena)
+				arena->release(p,n + FRAME_PREFIX);
+			else
+				::operator delete(p);
+		}
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		Final final_suspend() noexcept { return {}; }
+		void unhandled_exception(){ std::terminate(); }
+};
+
+template<class T> class TaskPromise : public TaskPromiseBase{
+	public:
+		std::optional<T> value;
+		Task<T> get_return_object();
+		void return_value(T v){ value = std::move(v); }
+};
+
+template<> class TaskPromise<void> : public TaskPromiseBase{
+	public:
+		Task<void> get_return_object();
+		void return_void(){}
+};
+
+// Lazily started coroutine returning T. Awaiting it runs it to its end
+// and yields the result; the frame is freed with the Task.
+template<class T = void> class Task{
+	public:
+		typedef TaskPromise<T> promise_type;
+	private:
+		std::coroutine_handle<promise_type> handle;
+	public:
+		explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+		Task(Task&& o) noexcept : handle(std::exchange(o.handle,nullptr)) {}
+		Task& operator=(Task&& o) noexcept {
+			if(this != &o){
+				if(handle)
+					handle.destroy();
+				handle = std::exchange(o.handle,nullptr);
+			}
+			return *this;
+		}
+		Task(const Task&) = delete;
+		Task& operator=(const Task&) = delete;
+		~Task(){
+			if(handle)
+				handle.destroy();
+		}
+
+		bool done() const { return !handle || handle.done(); }
+		// Runs it up to its first suspension, for a caller that is not a coroutine.
+		void start(){ handle.resume(); }
+		// Once done().
+		T result(){
+			if constexpr(!std::is_void_v<T>)
+				return std::move(*handle.promise().value);
+		}
+		// Gives the frame to the coroutine, which frees it when it returns.
+		std::coroutine_handle<promise_type> release(){ return std::exchange(handle,nullptr); }
+
+		bool await_ready() const noexcept { return false; }
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+			handle.promise().continuation = caller;
+			return handle;
+		}
+		T await_resume(){ return result(); }
+};
+
+template<class T> inline Task<T> TaskPromise<T>::get_return_object(){
+	return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object(){
+	return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// Starts task without anyone awaiting it. It has to run to its end, a
+// spawned coroutine still suspended when its loop goes away is leaked.
+inline void spawn(Task<void> task){
+	std::coroutine_handle<TaskPromise<void>> h = task.release();
+	h.promise().detached = true;
+	h.resume();
+}
+
+// co_await delay(loop,ms) resumes the coroutine from a loop timer. The
+// timer is cancelled if the coroutine is destroyed meanwhile.
+class Delay{
+	private:
+		EventLoop& loop;
+		int64_t ms;
+		uint64_t timer;
+	public:
+		Delay(EventLoop& l,int64_t m) : loop(l),ms(m),timer(0) {}
+		Delay(const Delay&) = delete;
+		~Delay(){
+			if(timer)
+				loop.cancel(timer);
+		}
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h){
+			timer = loop.after(ms,[this,h](){
+				timer = 0;
+				h.resume();
+			});
+		}
+		void await_resume() noexcept {}
+};
+
+inline Delay delay(EventLoop& loop,int64_t ms){
+	return Delay(loop,ms);
+}
+
+// Bounded FIFO between coroutines of one thread. A sender waits while it
+// is full, a receiver while it is empty; close() wakes both. The waiters
+// are linked through their awaiters, which live in the waiting frames, and
+// the slots are allocated once, so passing a value allocates nothing.
+template<class T> class Channel{
+	private:
+		struct Waiter{
+			std::coroutine_handle<> h;
+			Waiter* next;
+			std::optional<T>* into; // receivers
+			T* from;                // senders
+			bool ok;
+		};
+		std::vector<T> slots;
+		size_t head;
+		size_t count;
+		bool closed;
+		Waiter* senders;
+		Waiter* receivers;
+		static void push(Waiter*& list,Waiter* w){
+			w->next = nullptr;
+			Waiter** at = &list;
+			while(*at)
+				at = &(*at)->next;
+			*at = w;
+		}
+		static Waiter* pop(Waiter*& list){
+			Waiter* w = list;
+			list = w->next;
+			return w;
+		}
+	public:
+		class Send{
+			private:
+				Channel& ch;
+				T value;
+				Waiter w;
+			public:
+				Send(Channel& c,T v) : ch(c),value(std::move(v)) { w.ok = false; }
+				bool await_ready(){
+					if(ch.closed)
+						return true;
+					if(ch.receivers){
+						// straight to the receiver, which runs before this sender goes on
+						Waiter* r = pop(ch.receivers);
+						*r->into = std::move(value);
+						w.ok = true;
+						r->h.resume();
+						return true;
+					}
+					if(ch.count < ch.slots.size()){
+						ch.slots[(ch.head + ch.count++) % ch.slots.size()] = std::move(value);
+						w.ok = true;
+						return true;
+					}
+					return false;
+				}
+				void await_suspend(std::coroutine_handle<> h){
+					w.h = h;
+					w.from = &value;
+					push(ch.senders,&w);
+				}
+				// false if the channel was closed and value dropped
+				bool await_resume() const { return w.ok; }
+		};
+		class Receive{
+			private:
+				Channel& ch;
+				std::optional<T> value;
+				Waiter w;
+			public:
+				explicit Receive(Channel& c) : ch(c) {}
+				bool await_ready(){
+					if(ch.count){
+						value = std::move(ch.slots[ch.head]);
+						ch.head = (ch.head + 1) % ch.slots.size();
+						ch.count--;
+						if(ch.senders){
+							Waiter* s = pop(ch.senders);
+							ch.slots[(ch.head + ch.count++) % ch.slots.size()] = std::move(*s->from);
+							s->ok = true;
+							s->h.resume();
+						}
+						return true;
+					}
+					if(ch.senders){
+						// capacity 0, take it from the sender
+						Waiter* s = pop(ch.senders);
+						value = std::move(*s->from);
+						s->ok = true;
+						s->h.resume();
+						return true;
+					}
+					return ch.closed;
+				}
+				void await_suspend(std::coroutine_handle<> h){
+					w.h = h;
+					w.into = &value;
+					push(ch.receivers,&w);
+				}
+				// empty once the channel is closed and drained
+				std::optional<T> await_resume(){ return std::move(value); }
+		};
+
+		explicit Channel(size_t capacity) : slots(capacity),head(0),count(0),closed(false),senders(nullptr),receivers(nullptr) {}
+		Channel(const Channel&) = delete;
+		Channel& operator=(const Channel&) = delete;
+
+		Send send(T value){ return Send(*this,std::move(value)); }
+		Receive receive(){ return Receive(*this); }
+		size_t size() const { return count; }
+		bool isClosed() const { return closed; }
+		// Values already queued can still be received.
+		void close(){
+			closed = true;
+			while(receivers)
+				pop(receivers)->h.resume();
+			while(senders)
+				pop(senders)->h.resume();
+		}
+};
+
+// Coroutine side of one connection: read() waits for the next message,
+// write() queues one and waits while the connection is congested. The
+// owner of the PeerServer routes the callbacks of the connection here.
+// A message read while the coroutine waits is the connection's own buffer,
+// not a copy, and is valid until the coroutine suspends again. One that
+// arrives while it does something else is copied and the connection is
+// paused until it is read.
+// One reader and one writer at a time. Coroutines using the stream have
+// to end before it is destroyed, their frames come from its arena. The
+// connection is held until closed(), so reads and writes look nothing up.
+class Stream{
+	public:
+		struct Message{
+			const uint8_t* data; // type byte first
+			size_t size;
+			explicit operator bool() const { return data != nullptr; }
+			uint8_t type() const { return data[0]; }
+			const uint8_t* payload() const { return data + 1; }
+			size_t payloadSize() const { return size - 1; }
+		};
+	private:
+		Connection* connection; // null once closed
+		uint64_t conn;
+		bool open;
+		bool holding;      // paused the connection for the backlog
+		FrameArena arena;
+		ByteBuffer backlog; // length prefixed messages nobody was reading
+		size_t handedOut;   // bytes of the backlog message returned by the last read
+		Message current;
+		std::coroutine_handle<> reader;
+		std::coroutine_handle<> writer;
+		bool next();
+	public:
+		class Read{
+			private:
+				Stream& s;
+			public:
+				explicit Read(Stream& st) : s(st) {}
+				bool await_ready(){ return s.next(); }
+				void await_suspend(std::coroutine_handle<> h){ s.reader = h; }
+				// empty once the connection is closed
+				Message await_resume(){ return s.current; }
+		};
+		class Write{
+			private:
+				Stream& s;
+				bool ok;
+			public:
+				Write(Stream& st,const Frame& frame);
+				bool await_ready() const { return !ok || !s.congested(); }
+				void await_suspend(std::coroutine_handle<> h){ s.writer = h; }
+				// false if the connection is closed
+				bool await_resume() const { return ok && s.open; }
+		};
+
+		Stream(PeerServer& s,uint64_t c);
+		Stream(const Stream&) = delete;
+		Stream& operator=(const Stream&) = delete;
+
+		uint64_t id() const { return conn; }
+		bool isOpen() const { return open; }
+		bool congested() const;
+		FrameArena& frameArena(){ return arena; }
+		Read read(){ return Read(*this); }
+		Write write(const Frame& frame){ return Write(*this,frame); }
+		Write write(uint8_t type,const void* data,size_t size){ return Write(*this,makeFrame(type,data,size)); }
+		void close();
+
+		// From the callbacks of the PeerServer.
+		void push(const uint8_t* data,size_t size);
+		void drained();
+		void closed();
+};
+
+inline Stream::Stream(PeerServer& s,uint64_t c) : conn(c){
+	connection = s.find(c);
+	open = true;
+	holding = false;
+	handedOut = 0;
+	current = Message{nullptr,0};
+}
+
+inline bool Stream::congested() const {
+	return connection && connection->isCongested();
+}
+
+// Moves the next buffered message to current, false if there is none yet.
+inline bool Stream::next(){
+	if(handedOut){
+		backlog.consume(handedOut);
+		handedOut = 0;
+	}
+	if(backlog.empty() && holding){
+		// delivers what the connection buffered meanwhile, the first message lands in the backlog again
+		holding = false;
+		if(connection)
+			connection->resume();
+	}
+	if(!backlog.empty()){
+		uint32_t len = getU32(backlog.begin());
+		current = Message{backlog.begin() + FRAME_HEADER,len};
+		handedOut = FRAME_HEADER + len;
+		return true;
+	}
+	current = Message{nullptr,0};
+	return !open;
+}
+
+inline void Stream::push(const uint8_t* data,size_t size){
+	if(!open || size == 0)
+		return;
+	if(reader && backlog.empty()){
+		current = Message{data,size};
+		std::exchange(reader,nullptr).resume();
+		return;
+	}
+	uint8_t len[FRAME_HEADER];
+	putU32(len,size);
+	backlog.append(len,sizeof len);
+	backlog.append(data,size);
+	if(!holding){
+		holding = true;
+		if(connection)
+			connection->pause();
+	}
+}
+
+inline void Stream::drained(){
+	if(writer)
+		std::exchange(writer,nullptr).resume();
+}
+
+inline void Stream::closed(){
+	open = false;
+	connection = nullptr;
+	if(reader){
+		current = Message{nullptr,0};
+		std::exchange(reader,nullptr).resume();
+	}
+	if(writer)
+		std::exchange(writer,nullptr).resume();
+}
+
+inline void Stream::close(){
+	if(connection)
+		connection->close();
+}
+
+inline Stream::Write::Write(Stream& st,const Frame& frame) : s(st){
+	ok = s.connection != nullptr;
+	if(ok)
+		s.connection->send(frame);
+}
+
+#endif
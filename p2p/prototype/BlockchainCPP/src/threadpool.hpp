@@ -0,0 +1,134 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <algorithm>
+
+// Work-stealing pool. Every worker owns a deque: tasks submitted from a
+// worker go to its own deque and are taken newest first, which keeps a
+// stage's follow-up work on the same core. Idle workers steal the oldest
+// task from the other deques. Tasks from outside are spread round robin.
+// A pool of zero threads runs every task right away on the caller, which
+// keeps a simulated node single threaded and deterministic.
+class ThreadPool{
+	private:
+		struct Queue{
+			std::mutex mutex;
+			std::deque<std::function<void()>> tasks;
+		};
+		std::vector<std::unique_ptr<Queue>> queues;
+		std::vector<std::thread> workers;
+		std::atomic<size_t> pending;
+		std::atomic<unsigned> next;
+		std::mutex sleepMutex;
+		std::condition_variable ready;
+		bool stopping;
+
+		static ThreadPool*& currentPool(){
+			static thread_local ThreadPool* pool = nullptr;
+			return pool;
+		}
+		static unsigned& currentIndex(){
+			static thread_local unsigned index = 0;
+			return index;
+		}
+		bool take(unsigned self,std::function<void()>& task);
+		void work(unsigned self);
+	public:
+		explicit ThreadPool(unsigned threads = std::max(1u,std::thread::hardware_concurrency()));
+		~ThreadPool();
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		void submit(std::function<void()> task);
+		size_t size() const { return workers.size(); }
+		size_t queued() const { return pending.load(std::memory_order_relaxed); }
+};
+
+inline ThreadPool::ThreadPool(unsigned threads) : pending(0),next(0){
+	stopping = false;
+	for(unsigned i = 0;i < threads;i++)
+		queues.emplace_back(new Queue());
+	for(unsigned i = 0;i < threads;i++)
+		workers.emplace_back([this,i](){ work(i); });
+}
+
+// Finishes the queued tasks before the workers exit.
+inline ThreadPool::~ThreadPool(){
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		stopping = true;
+	}
+	ready.notify_all();
+	for(std::thread& w : workers)
+		w.join();
+}
+
+inline void ThreadPool::submit(std::function<void()> task){
+	if(workers.empty()){
+		task();
+		return;
+	}
+	unsigned target;
+	if(currentPool() == this)
+		target = currentIndex();
+	else
+		target = next.fetch_add(1,std::memory_order_relaxed) % queues.size();
+	{
+		std::lock_guard<std::mutex> lock(queues[target]->mutex);
+		queues[target]->tasks.push_back(std::move(task));
+	}
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		pending.fetch_add(1,std::memory_order_relaxed);
+	}
+	ready.notify_one();
+}
+
+inline bool ThreadPool::take(unsigned self,std::function<void()>& task){
+	{
+		Queue& own = *queues[self];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if(!own.tasks.empty()){
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			return true;
+		}
+	}
+	for(size_t i = 1;i < queues.size();i++){
+		Queue& victim = *queues[(self + i) % queues.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if(!victim.tasks.empty()){
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+inline void ThreadPool::work(unsigned self){
+	currentPool() = this;
+	currentIndex() = self;
+	for(;;){
+		std::function<void()> task;
+		if(take(self,task)){
+			pending.fetch_sub(1,std::memory_order_relaxed);
+			task();
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		ready.wait(lock,[this](){ return stopping || pending.load(std::memory_order_relaxed) > 0; });
+		if(stopping && pending.load(std::memory_order_relaxed) == 0)
+			return;
+	}
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef TRANSACTION_HPP
+#define TRANSACTION_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include "crypt.hpp"
+#include "merkle.hpp"
+#include "blockchain.hpp"
+
+typedef std::array<unsigned char,64> Signature;
+
+// Transaction kinds
+#define TX_TRANSFER 0 // amount THX from -> to
+#define TX_REGISTER 1 // opens the account of from, to is the referrer
+#define TX_SCOOP 2    // from starts scooping, a finished cycle is paid out
+
+// A signed action of one account, accounts are identified by their public key.
+struct Transaction{
+	Digest from;
+	Digest to;
+	uint64_t amount;
+	uint64_t nonce;
+	int64_t timestamp;
+	uint32_t kind;
+	Signature signature;
+
+	// Everything except the signature, this is what gets signed.
+	Digest computeHash() const {
+		return threadHasher().update(from).update(to).updateValue(amount).updateValue(nonce).updateValue(timestamp).updateValue(kind).final();
+	}
+};
+
+// A block header with the transactions it commits to.
+struct BlockData{
+	Block header;
+	std::vector<Transaction> txs;
+};
+
+// What the ledger knows about one account.
+struct Account{
+	uint64_t balance;
+	int64_t scooping; // start of the running cycle, 0 if not scooping
+	Digest referrer;
+	uint64_t nonce;   // transactions applied so far, the next one must carry this nonce
+};
+
+// Leaf of the state tree: key and account fields one after another, without padding.
+inline Digest accountLeaf(const Digest& key,const Account& a){
+	uint8_t prefix = MERKLE_LEAF;
+	return threadHasher().updateValue(prefix).update(key).updateValue(a.balance).updateValue(a.scooping).update(a.referrer).updateValue(a.nonce).final();
+}
+
+// Commitment of the header to its transactions: the Merkle root over the
+// transaction hashes in block order, so one transaction can be proven
+// without the others.
+inline Digest transactionRoot(const Digest* hashes,size_t n,unsigned threads = 1){
+	std::vector<Digest> leaves(n);
+	for(size_t i = 0;i < n;i++)
+		leaves[i] = merkleLeaf(hashes[i]);
+	return merkleRoot(leaves.data(),n,threads);
+}
+
+inline Digest transactionRoot(const std::vector<Transaction>& txs,unsigned threads = 1){
+	std::vector<Digest> hashes(txs.size());
+	for(size_t i = 0;i < txs.size();i++)
+		hashes[i] = txs[i].computeHash();
+	return transactionRoot(hashes.data(),hashes.size(),threads);
+}
+
+// Proof that the transaction at index is committed to by the root of its block.
+inline MerkleProof proveTransaction(const std::vector<Transaction>& txs,size_t index){
+	std::vector<Digest> leaves(txs.size());
+	for(size_t i = 0;i < txs.size();i++)
+		leaves[i] = merkleLeaf(txs[i].computeHash());
+	return merkleProve(leaves.data(),leaves.size(),index);
+}
+
+// Sets root and hash of the header from the transactions, state has to be set before.
+inline void seal(BlockData& block){
+	block.header.size = block.txs.size();
+	block.header.root = transactionRoot(block.txs);
+	block.header.hash = block.header.computeHash();
+}
+
+#endif
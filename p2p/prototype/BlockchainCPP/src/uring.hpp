@@ -0,0 +1,264 @@
+#ifndef URING_HPP
+#define URING_HPP
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#define URING_ENTRIES 4096        // submission queue entries, the completion queue gets twice as many
+#define URING_BUFFERS 512         // receive buffers registered with the ring, shared by all sockets
+#define URING_BUFFER_SIZE 16384
+#define URING_BUFFER_GROUP 0
+
+// Bare io_uring without liburing: the two mapped rings, a group of provided
+// receive buffers and the enter call. Submissions are only queued here and
+// go to the kernel together with the next wait, so a loop iteration costs
+// one syscall however many reads, writes and polls it starts.
+// open() fails on kernels without what the event loop needs: the extended
+// enter argument, provided buffer rings and multishot receive.
+class Uring{
+	private:
+		int fd;
+		uint8_t* sqRing;
+		uint8_t* cqRing;
+		size_t sqRingSize;
+		size_t cqRingSize;
+		io_uring_sqe* sqes;
+		size_t sqesSize;
+		unsigned* sqHead;
+		unsigned* sqTail;
+		unsigned sqMask;
+		unsigned sqEntries;
+		unsigned tail;
+		unsigned* cqHead;
+		unsigned* cqTail;
+		unsigned cqMask;
+		io_uring_cqe* cqes;
+		io_uring_buf_ring* bufRing;
+		uint8_t* buffers;
+		uint16_t bufTail;
+		bool registerBuffers();
+		bool probe();
+	public:
+		Uring();
+		~Uring();
+		Uring(const Uring&) = delete;
+		Uring& operator=(const Uring&) = delete;
+
+		bool open(unsigned entries = URING_ENTRIES);
+		void close();
+		bool isOpen() const { return fd >= 0; }
+		io_uring_sqe* sqe();
+		int submit(unsigned wait,int timeoutMs);
+		template<class F> unsigned reap(F f);
+		const uint8_t* buffer(uint16_t id) const { return buffers + (size_t)id * URING_BUFFER_SIZE; }
+		void recycle(uint16_t id);
+};
+
+inline Uring::Uring(){
+	fd = -1;
+	sqRing = nullptr;
+	cqRing = nullptr;
+	sqes = nullptr;
+	bufRing = nullptr;
+	buffers = nullptr;
+	sqRingSize = cqRingSize = sqesSize = 0;
+	tail = 0;
+	bufTail = 0;
+}
+
+inline Uring::~Uring(){
+	close();
+}
+
+inline bool Uring::open(unsigned entries){
+	io_uring_params p;
+	memset(&p,0,sizeof p);
+	p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+	fd = syscall(__NR_io_uring_setup,entries,&p);
+	if(fd < 0 && errno == EINVAL){
+		memset(&p,0,sizeof p);
+		fd = syscall(__NR_io_uring_setup,entries,&p);
+	}
+	if(fd < 0)
+		return false;
+	unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	if((p.features & need) != need){
+		close();
+		return false;
+	}
+	sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	sqRingSize = cqRingSize = std::max(sqRingSize,cqRingSize);
+	void* ring = mmap(nullptr,sqRingSize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+	if(ring == MAP_FAILED){
+		close();
+		return false;
+	}
+	sqRing = cqRing = (uint8_t*)ring;
+	sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+	void* s = mmap(nullptr,sqesSize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_SQES);
+	if(s == MAP_FAILED){
+		close();
+		return false;
+	}
+	sqes = (io_uring_sqe*)s;
+	sqHead = (unsigned*)(sqRing + p.sq_off.head);
+	sqTail = (unsigned*)(sqRing + p.sq_off.tail);
+	sqMask = *(unsigned*)(sqRing + p.sq_off.ring_mask);
+	sqEntries = p.sq_entries;
+	unsigned* array = (unsigned*)(sqRing + p.sq_off.array);
+	for(unsigned i = 0;i < sqEntries;i++)
+		array[i] = i;
+	tail = *sqTail;
+	cqHead = (unsigned*)(cqRing + p.cq_off.head);
+	cqTail = (unsigned*)(cqRing + p.cq_off.tail);
+	cqMask = *(unsigned*)(cqRing + p.cq_off.ring_mask);
+	cqes = (io_uring_cqe*)(cqRing + p.cq_off.cqes);
+	if(!registerBuffers() || !probe()){
+		close();
+		return false;
+	}
+	return true;
+}
+
+inline void Uring::close(){
+	if(fd >= 0)
+		::close(fd);
+	if(sqes)
+		munmap(sqes,sqesSize);
+	if(sqRing)
+		munmap(sqRing,sqRingSize);
+	// the ring is gone, the kernel does not write into the buffers any more
+	free(bufRing);
+	free(buffers);
+	fd = -1;
+	sqRing = cqRing = nullptr;
+	sqes = nullptr;
+	bufRing = nullptr;
+	buffers = nullptr;
+}
+
+// Receive buffers the kernel picks from for every completed read, so an
+// idle connection holds none.
+inline bool Uring::registerBuffers(){
+	long page = sysconf(_SC_PAGESIZE);
+	void* ring = nullptr;
+	void* data = nullptr;
+	if(posix_memalign(&ring,page,URING_BUFFERS * sizeof(io_uring_buf)) != 0)
+		return false;
+	bufRing = (io_uring_buf_ring*)ring;
+	memset(bufRing,0,URING_BUFFERS * sizeof(io_uring_buf));
+	if(posix_memalign(&data,page,(size_t)URING_BUFFERS * URING_BUFFER_SIZE) != 0)
+		return false;
+	buffers = (uint8_t*)data;
+	io_uring_buf_reg reg;
+	memset(&reg,0,sizeof reg);
+	reg.ring_addr = (uint64_t)(uintptr_t)bufRing;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BUFFER_GROUP;
+	if(syscall(__NR_io_uring_register,fd,IORING_REGISTER_PBUF_RING,&reg,1) != 0)
+		return false;
+	for(uint16_t i = 0;i < URING_BUFFERS;i++)
+		recycle(i);
+	return true;
+}
+
+// Multishot receive came after buffer rings, a kernel may have one and
+// not the other. One byte over a socket pair tells.
+inline bool Uring::probe(){
+	int pair[2];
+	if(socketpair(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0,pair) != 0)
+		return false;
+	io_uring_sqe* e = sqe();
+	e->opcode = IORING_OP_RECV;
+	e->fd = pair[0];
+	e->ioprio = IORING_RECV_MULTISHOT;
+	e->flags = IOSQE_BUFFER_SELECT;
+	e->buf_group = URING_BUFFER_GROUP;
+	e->user_data = 1;
+	bool ok = ::write(pair[1],"x",1) == 1 && submit(1,1000) >= 0;
+	bool more = false;
+	auto handle = [&](uint64_t,int32_t res,uint32_t flags){
+		more = flags & IORING_CQE_F_MORE;
+		ok = ok && res >= 0;
+		if(flags & IORING_CQE_F_BUFFER)
+			recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+	};
+	ok = ok && reap(handle) == 1 && more;
+	// closing the pair ends the receive, its last completion is reaped here
+	::close(pair[1]);
+	::close(pair[0]);
+	for(int i = 0;more && i < 10;i++){
+		submit(1,100);
+		reap(handle);
+	}
+	return ok && !more;
+}
+
+// Returns a cleared entry, the caller fills it in. Queued until submit().
+inline io_uring_sqe* Uring::sqe(){
+	if(tail - __atomic_load_n(sqHead,__ATOMIC_ACQUIRE) >= sqEntries)
+		submit(0,0);
+	io_uring_sqe* e = &sqes[tail & sqMask];
+	memset(e,0,sizeof *e);
+	tail++;
+	return e;
+}
+
+// Hands everything queued to the kernel and waits for wait completions or
+// timeoutMs, -1 for no limit. One syscall.
+inline int Uring::submit(unsigned wait,int timeoutMs){
+	__atomic_store_n(sqTail,tail,__ATOMIC_RELEASE);
+	unsigned pending = tail - __atomic_load_n(sqHead,__ATOMIC_ACQUIRE);
+	if(!pending && !wait)
+		return 0;
+	timespec ts;
+	ts.tv_sec = timeoutMs / 1000;
+	ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+	io_uring_getevents_arg arg;
+	memset(&arg,0,sizeof arg);
+	arg.sigmask_sz = _NSIG / 8;
+	arg.ts = timeoutMs >= 0 ? (uint64_t)(uintptr_t)&ts : 0;
+	unsigned flags = IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0);
+	int rc = syscall(__NR_io_uring_enter,fd,pending,wait,flags,&arg,sizeof arg);
+	if(rc < 0 && (errno == ETIME || errno == EINTR || errno == EBUSY))
+		return 0;
+	return rc;
+}
+
+// Calls f(user_data,res,flags) for every completion. Returns how many.
+template<class F> inline unsigned Uring::reap(F f){
+	unsigned n = 0;
+	unsigned head = *cqHead;
+	while(head != __atomic_load_n(cqTail,__ATOMIC_ACQUIRE)){
+		io_uring_cqe c = cqes[head & cqMask];
+		__atomic_store_n(cqHead,++head,__ATOMIC_RELEASE);
+		f(c.user_data,c.res,c.flags);
+		n++;
+	}
+	return n;
+}
+
+// Gives a buffer back to the kernel. Only addr, len and bid are written,
+// resv of the first entry is the ring tail. The entries are indexed from
+// the start of the ring: compiled as C++ the bufs member of the header sits
+// behind an empty struct and is off by eight bytes.
+inline void Uring::recycle(uint16_t id){
+	io_uring_buf& b = ((io_uring_buf*)bufRing)[bufTail & (URING_BUFFERS - 1)];
+	b.addr = (uint64_t)(uintptr_t)(buffers + (size_t)id * URING_BUFFER_SIZE);
+	b.len = URING_BUFFER_SIZE;
+	b.bid = id;
+	__atomic_store_n(&bufRing->tail,++bufTail,__ATOMIC_RELEASE);
+}
+
+#endif
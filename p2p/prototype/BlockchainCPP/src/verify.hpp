@@ -0,0 +1,319 @@
+#ifndef VERIFY_HPP
+#define VERIFY_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// What a light client needs to check a proof, without the node: digests,
+// SHA-256, the Merkle path check and the proof format. Plain C++11 and no
+// other header of the node or OpenSSL, so the Qt client on the phones
+// builds against this alone. merkle.hpp, wire.hpp and proof.hpp build on
+// it, so the node and the clients read proofs the same way.
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the wire format is read and written with memcpy, which needs a little endian host"
+#endif
+
+typedef std::array<unsigned char,32> Digest;
+
+// The parts of the wire format of wire.hpp a proof carries.
+#define WIRE_HEADER_SIZE 152
+#define WIRE_HEADER_HASHED 112    // version to state
+#define WIRE_TX_SIZE 156
+#define WIRE_TX_HASHED 92         // from to kind
+
+#define MERKLE_LEAF 0
+#define MERKLE_NODE 1
+#define MERKLE_MAX_DEPTH 32 // 2^32 leaves at most, MerkleProof::count is 32 bit
+
+#define PROOF_OK 0
+#define PROOF_BAD_ENCODING -1
+#define PROOF_BAD_HEADER -2     // header does not hash to itself or not to the trusted hash
+#define PROOF_NO_COMMITMENT -3  // header does not commit to a state
+#define PROOF_BAD_PATH -4       // item is not under the root of the header
+
+#define PROOF_ACCOUNT 1
+#define PROOF_TRANSACTION 2
+
+// SHA-256 in plain C++. The node hashes with OpenSSL in crypt.hpp, which is
+// faster; a proof is a few dozen hashes, for which this is plenty.
+class Sha256{
+	private:
+		uint32_t h[8];
+		uint8_t block[64];
+		size_t used;
+		uint64_t length;
+		static uint32_t rotr(uint32_t x,int n){ return (x >> n) | (x << (32 - n)); }
+		void compress(const uint8_t* p);
+	public:
+		Sha256(){ reset(); }
+		void reset();
+		Sha256& update(const void* data,size_t size);
+		Sha256& update(const Digest& d){ return update(d.data(),d.size()); }
+		template<class T> Sha256& updateValue(const T& value){ return update(&value,sizeof value); }
+		Digest final();
+};
+
+inline void Sha256::reset(){
+	static const uint32_t init[8] = {
+		0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19
+	};
+	memcpy(h,init,sizeof h);
+	used = 0;
+	length = 0;
+}
+
+inline void Sha256::compress(const uint8_t* p){
+	static const uint32_t k[64] = {
+		0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+		0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+		0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+		0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+		0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+		0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+		0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+		0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+	};
+	uint32_t w[64];
+	for(int i = 0;i < 16;i++)
+		w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+	for(int i = 16;i < 64;i++){
+		uint32_t s0 = rotr(w[i - 15],7) ^ rotr(w[i - 15],18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = rotr(w[i - 2],17) ^ rotr(w[i - 2],19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+	uint32_t a = h[0],b = h[1],c = h[2],d = h[3],e = h[4],f = h[5],g = h[6],x = h[7];
+	for(int i = 0;i < 64;i++){
+		uint32_t t1 = x + (rotr(e,6) ^ rotr(e,11) ^ rotr(e,25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+		uint32_t t2 = (rotr(a,2) ^ rotr(a,13) ^ rotr(a,22)) + ((a & b) ^ (a & c) ^ (b & c));
+		x = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+	h[5] += f;
+	h[6] += g;
+	h[7] += x;
+}
+
+inline Sha256& Sha256::update(const void* data,size_t size){
+	const uint8_t* p = (const uint8_t*)data;
+	length += size;
+	if(used){
+		size_t n = size < 64 - used ? size : 64 - used;
+		memcpy(block + used,p,n);
+		used += n;
+		p += n;
+		size -= n;
+		if(used < 64)
+			return *this;
+		compress(block);
+		used = 0;
+	}
+	for(;size >= 64;p += 64,size -= 64)
+		compress(p);
+	memcpy(block,p,size);
+	used = size;
+	return *this;
+}
+
+// The digest, starts over for the next message like Hasher::final().
+inline Digest Sha256::final(){
+	uint64_t bits = length * 8;
+	uint8_t pad[72] = {0x80};
+	size_t n = (used < 56 ? 56 : 120) - used;
+	for(int i = 0;i < 8;i++)
+		pad[n + i] = (uint8_t)(bits >> (56 - i * 8));
+	update(pad,n + 8);
+	Digest d;
+	for(int i = 0;i < 8;i++){
+		d[i * 4] = (uint8_t)(h[i] >> 24);
+		d[i * 4 + 1] = (uint8_t)(h[i] >> 16);
+		d[i * 4 + 2] = (uint8_t)(h[i] >> 8);
+		d[i * 4 + 3] = (uint8_t)h[i];
+	}
+	reset();
+	return d;
+}
+
+struct MerkleProof{
+	uint32_t index;            // of the leaf
+	uint32_t count;            // leaves in the tree
+	std::vector<Digest> path;  // siblings from the leaf up, levels where the node is promoted have none
+};
+
+// O(log n): true if leaf is at proof.index of a tree with this root.
+inline bool merkleVerify(const Digest& root,const Digest& leaf,const MerkleProof& proof){
+	if(proof.index >= proof.count)
+		return false;
+	Sha256 hasher;
+	uint8_t prefix = MERKLE_NODE;
+	Digest h = leaf;
+	size_t index = proof.index;
+	size_t n = proof.count;
+	size_t used = 0;
+	while(n > 1){
+		if((index ^ 1) < n){
+			if(used == proof.path.size())
+				return false;
+			const Digest& sibling = proof.path[used++];
+			hasher.updateValue(prefix);
+			if(index & 1)
+				hasher.update(sibling).update(h);
+			else
+				hasher.update(h).update(sibling);
+			h = hasher.final();
+		}
+		n = (n + 1) / 2;
+		index /= 2;
+	}
+	return used == proof.path.size() && h == root;
+}
+
+class ProofReader{
+	private:
+		const uint8_t* data;
+		size_t size;
+		size_t pos;
+	public:
+		bool ok;
+		ProofReader(const uint8_t* d,size_t s) : data(d),size(s),pos(0),ok(true) {}
+		template<class T> void value(T& v){
+			if(!ok || size - pos < sizeof v){
+				ok = false;
+				return;
+			}
+			memcpy(&v,data + pos,sizeof v);
+			pos += sizeof v;
+		}
+		void digest(Digest& d){
+			value(d);
+		}
+		// The next n bytes in place, null past the end.
+		const uint8_t* take(size_t n){
+			if(!ok || size - pos < n){
+				ok = false;
+				return nullptr;
+			}
+			pos += n;
+			return data + pos - n;
+		}
+		bool done() const { return ok && pos == size; }
+};
+
+inline void decodePath(ProofReader& r,MerkleProof& p){
+	uint8_t n = 0;
+	r.value(p.index);
+	r.value(p.count);
+	r.value(n);
+	if(n > MERKLE_MAX_DEPTH)
+		r.ok = false;
+	p.path.resize(r.ok ? n : 0);
+	for(Digest& d : p.path)
+		r.digest(d);
+}
+
+// Account as committed to by the state of a header.
+struct ProvenAccount{
+	Digest key;
+	uint64_t balance;
+	int64_t scooping;
+	Digest referrer;
+	uint64_t nonce;
+};
+
+// Transaction at index of the block of a header.
+struct ProvenTransaction{
+	Digest from;
+	Digest to;
+	uint64_t amount;
+	uint64_t nonce;
+	int64_t timestamp;
+	uint32_t kind;
+	uint32_t index;
+};
+
+// WIRE_HEADER_SIZE bytes of a header, at the offsets of HeaderView.
+inline int checkHeader(const uint8_t* header,const Digest& trusted){
+	Digest hash;
+	memcpy(hash.data(),header + 120,hash.size());
+	if(hash != trusted || Sha256().update(header,WIRE_HEADER_HASHED).final() != trusted)
+		return PROOF_BAD_HEADER;
+	return PROOF_OK;
+}
+
+// The same checks as verifyProof() of proof.hpp on an encoded account proof.
+inline int checkAccountProof(const uint8_t* data,size_t size,const Digest& trusted,ProvenAccount& a){
+	ProofReader r(data,size);
+	uint8_t type = 0;
+	MerkleProof path;
+	r.value(type);
+	const uint8_t* header = r.take(WIRE_HEADER_SIZE);
+	r.digest(a.key);
+	r.value(a.balance);
+	r.value(a.scooping);
+	r.digest(a.referrer);
+	r.value(a.nonce);
+	decodePath(r,path);
+	if(type != PROOF_ACCOUNT || !r.done())
+		return PROOF_BAD_ENCODING;
+	int rc = checkHeader(header,trusted);
+	if(rc != PROOF_OK)
+		return rc;
+	Digest state,none;
+	memcpy(state.data(),header + 80,state.size());
+	none.fill(0);
+	if(state == none)
+		return PROOF_NO_COMMITMENT;
+	uint8_t prefix = MERKLE_LEAF;
+	Digest leaf = Sha256().updateValue(prefix).update(a.key).updateValue(a.balance).updateValue(a.scooping).update(a.referrer).updateValue(a.nonce).final();
+	if(!merkleVerify(state,leaf,path))
+		return PROOF_BAD_PATH;
+	return PROOF_OK;
+}
+
+// The same checks as verifyProof() of proof.hpp on an encoded transaction proof.
+inline int checkTransactionProof(const uint8_t* data,size_t size,const Digest& trusted,ProvenTransaction& tx){
+	ProofReader r(data,size);
+	uint8_t type = 0;
+	MerkleProof path;
+	r.value(type);
+	const uint8_t* header = r.take(WIRE_HEADER_SIZE);
+	const uint8_t* p = r.take(WIRE_TX_SIZE);
+	decodePath(r,path);
+	if(type != PROOF_TRANSACTION || !r.done())
+		return PROOF_BAD_ENCODING;
+	int rc = checkHeader(header,trusted);
+	if(rc != PROOF_OK)
+		return rc;
+	uint32_t count;
+	Digest root;
+	memcpy(&count,header + 4,sizeof count);
+	memcpy(root.data(),header + 48,root.size());
+	uint8_t prefix = MERKLE_LEAF;
+	Digest leaf = Sha256().updateValue(prefix).update(Sha256().update(p,WIRE_TX_HASHED).final()).final();
+	if(path.count != count || !merkleVerify(root,leaf,path))
+		return PROOF_BAD_PATH;
+	memcpy(tx.from.data(),p,32);
+	memcpy(tx.to.data(),p + 32,32);
+	memcpy(&tx.amount,p + 64,sizeof tx.amount);
+	memcpy(&tx.nonce,p + 72,sizeof tx.nonce);
+	memcpy(&tx.timestamp,p + 80,sizeof tx.timestamp);
+	memcpy(&tx.kind,p + 88,sizeof tx.kind);
+	tx.index = path.index;
+	return PROOF_OK;
+}
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef WIRE_HPP
+#define WIRE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "crypt.hpp"
+#include "verify.hpp"
+#include "blockchain.hpp"
+#include "transaction.hpp"
+
+// Binary format of blocks and transactions. The same bytes go over the
+// wire, into the block store and into the hashes: the fields covered by a
+// hash come first in the order the hash takes them, so a hash is one pass
+// over a contiguous range. Everything is little endian without padding.
+//
+//   block        u32 WIRE_VERSION, header, header.size transactions
+//   header       u32 version, u32 size, i64 timestamp, phash, root, state,  hashed
+//                u64 height, hash
+//   transaction  from, to, u64 amount, u64 nonce, i64 timestamp, u32 kind,  hashed
+//                signature
+//
+// A block is parsed once into a BlockView, which checks the version and
+// that the length matches the transaction count. The views then read
+// fields in place, from a network buffer or a mapped segment, without
+// allocating. The length of a block itself is the frame or record around it.
+
+// The sizes of headers and transactions and the little endian check are in
+// verify.hpp, which light clients read proofs with.
+
+#define WIRE_VERSION 1
+#define WIRE_PREFIX 4             // format version in front of a block
+
+template<class T> inline T wireLoad(const uint8_t* p){
+	T v;
+	memcpy(&v,p,sizeof v);
+	return v;
+}
+
+template<class T> inline uint8_t* wireStore(uint8_t* p,const T& v){
+	memcpy(p,&v,sizeof v);
+	return p + sizeof v;
+}
+
+inline Digest wireDigest(const uint8_t* p){
+	Digest d;
+	memcpy(d.data(),p,d.size());
+	return d;
+}
+
+// Writes WIRE_HEADER_SIZE bytes.
+inline void writeHeader(uint8_t* p,const Block& b){
+	p = wireStore(p,b.version);
+	p = wireStore(p,b.size);
+	p = wireStore(p,b.timestamp);
+	p = wireStore(p,b.phash);
+	p = wireStore(p,b.root);
+	p = wireStore(p,b.state);
+	p = wireStore(p,b.height);
+	wireStore(p,b.hash);
+}
+
+// Writes WIRE_TX_SIZE bytes.
+inline void writeTransaction(uint8_t* p,const Transaction& tx){
+	p = wireStore(p,tx.from);
+	p = wireStore(p,tx.to);
+	p = wireStore(p,tx.amount);
+	p = wireStore(p,tx.nonce);
+	p = wireStore(p,tx.timestamp);
+	p = wireStore(p,tx.kind);
+	wireStore(p,tx.signature);
+}
+
+// WIRE_HEADER_SIZE bytes of a header, read in place.
+class HeaderView{
+	private:
+		const uint8_t* p;
+	public:
+		explicit HeaderView(const uint8_t* data = nullptr) : p(data) {}
+		const uint8_t* data() const { return p; }
+		uint32_t version() const { return wireLoad<uint32_t>(p); }
+		uint32_t size() const { return wireLoad<uint32_t>(p + 4); }
+		int64_t timestamp() const { return wireLoad<int64_t>(p + 8); }
+		Digest phash() const { return wireDigest(p + 16); }
+		Digest root() const { return wireDigest(p + 48); }
+		Digest state() const { return wireDigest(p + 80); }
+		uint64_t height() const { return wireLoad<uint64_t>(p + 112); }
+		Digest hash() const { return wireDigest(p + 120); }
+		const uint8_t* hashBytes() const { return p + 120; }
+		Digest computeHash() const { return sha256(p,WIRE_HEADER_HASHED); }
+		Block get() const {
+			Block b;
+			b.version = version();
+			b.size = size();
+			b.timestamp = timestamp();
+			b.phash = phash();
+			b.root = root();
+			b.state = state();
+			b.height = height();
+			b.hash = hash();
+			return b;
+		}
+};
+
+// WIRE_TX_SIZE bytes of a transaction, read in place.
+class TransactionView{
+	private:
+		const uint8_t* p;
+	public:
+		explicit TransactionView(const uint8_t* data = nullptr) : p(data) {}
+		const uint8_t* data() const { return p; }
+		Digest from() const { return wireDigest(p); }
+		Digest to() const { return wireDigest(p + 32); }
+		uint64_t amount() const { return wireLoad<uint64_t>(p + 64); }
+		uint64_t nonce() const { return wireLoad<uint64_t>(p + 72); }
+		int64_t timestamp() const { return wireLoad<int64_t>(p + 80); }
+		uint32_t kind() const { return wireLoad<uint32_t>(p + 88); }
+		Digest computeHash() const { return sha256(p,WIRE_TX_HASHED); }
+		void get(Transaction& tx) const {
+			memcpy(tx.from.data(),p,32);
+			memcpy(tx.to.data(),p + 32,32);
+			tx.amount = amount();
+			tx.nonce = nonce();
+			tx.timestamp = timestamp();
+			tx.kind = kind();
+			memcpy(tx.signature.data(),p + 92,tx.signature.size());
+		}
+};
+
+// An encoded block. Valid as long as the bytes it was parsed from.
+class BlockView{
+	private:
+		const uint8_t* p;
+		size_t length;
+	public:
+		BlockView() : p(nullptr),length(0) {}
+		// Checks version and length, the accessors trust them afterwards.
+		bool parse(const uint8_t* data,size_t size){
+			p = nullptr;
+			length = 0;
+			if(size < WIRE_PREFIX + WIRE_HEADER_SIZE || wireLoad<uint32_t>(data) != WIRE_VERSION)
+				return false;
+			uint64_t n = HeaderView(data + WIRE_PREFIX).size();
+			if((size - WIRE_PREFIX - WIRE_HEADER_SIZE) / WIRE_TX_SIZE != n || (size - WIRE_PREFIX - WIRE_HEADER_SIZE) % WIRE_TX_SIZE)
+				return false;
+			p = data;
+			length = size;
+			return true;
+		}
+		bool valid() const { return p != nullptr; }
+		Bytes bytes() const { return Bytes(p,length); }
+		HeaderView header() const { return HeaderView(p + WIRE_PREFIX); }
+		size_t count() const { return header().size(); }
+		TransactionView tx(size_t i) const { return TransactionView(p + WIRE_PREFIX + WIRE_HEADER_SIZE + i * WIRE_TX_SIZE); }
+};
+
+inline size_t encodedSize(size_t transactions){
+	return WIRE_PREFIX + WIRE_HEADER_SIZE + transactions * WIRE_TX_SIZE;
+}
+
+inline std::vector<uint8_t> encodeBlock(const BlockData& block){
+	std::vector<uint8_t> out(encodedSize(block.txs.size()));
+	uint8_t* p = wireStore(out.data(),(uint32_t)WIRE_VERSION);
+	writeHeader(p,block.header);
+	p += WIRE_HEADER_SIZE;
+	for(const Transaction& tx : block.txs){
+		writeTransaction(p,tx);
+		p += WIRE_TX_SIZE;
+	}
+	return out;
+}
+
+// Copies a parsed block into structs, for code that keeps it past the buffer.
+inline void decodeBlock(const BlockView& view,BlockData& block){
+	block.header = view.header().get();
+	block.txs.resize(view.count());
+	for(size_t i = 0;i < block.txs.size();i++)
+		view.tx(i).get(block.txs[i]);
+}
+
+inline bool decodeBlock(const uint8_t* data,size_t size,BlockData& block){
+	BlockView view;
+	if(!view.parse(data,size))
+		return false;
+	decodeBlock(view,block);
+	return true;
+}
+
+#endif
@@ -1,27 +1,1900 @@
 #include <iostream>
 #include "src/crypt.hpp"
 #include "src/blockchain.hpp"
+#include "src/peer.hpp"
+#include "src/pipeline.hpp"
+#include "src/sign.hpp"
+#include "src/store.hpp"
+#include "src/state.hpp"
+#include "src/sync.hpp"
+#include "src/mempool.hpp"
+#include "src/gossip.hpp"
+#include "src/proof.hpp"
+#include "src/sim.hpp"
+#include "src/task.hpp"
+#include "src/light.hpp"
+#include "src/referrals.hpp"
+#include <future>
 #include <ctime>
+#include <thread>
+#include <csignal>
+#include <sys/wait.h>
+
+static int failures = 0;
+
+#define check(x) if(!(x)){ std::cout << "FAIL " << __FILE__ << ":" << __LINE__ << " : " << #x << std::endl; failures++; }
+
+Digest digestOf(uint64_t n){
+	Digest d;
+	d.fill(0);
+	memcpy(d.data(),&n,sizeof n);
+	return d;
+}
+
+void testChain(){
+	Blockchain chain;
+	Digest none;
+	none.fill(0);
+	// more than one arena chunk
+	const uint64_t n = BLOCKS_PER_CHUNK * 2 + 10;
+	for(uint64_t i = 0;i < n;i++){
+		check(chain.append(Block(0,digestOf(i + 1),i ? digestOf(i) : none,1000 + i)) == (int64_t)i);
+	}
+	check(chain.size() == n);
+	check(chain.validate() == CHAIN_VALID);
+	check(chain.find(digestOf(BLOCKS_PER_CHUNK + 5))->height == BLOCKS_PER_CHUNK + 4);
+	check(chain.find(digestOf(n + 1)) == nullptr);
+	check(chain.append(Block(0,digestOf(3),digestOf(n),2000)) == CHAIN_DUPLICATE);
+	// cut back below a chunk boundary and grown again on another branch
+	chain.truncate(BLOCKS_PER_CHUNK - 1);
+	check(chain.size() == BLOCKS_PER_CHUNK - 1 && !chain.find(digestOf(BLOCKS_PER_CHUNK + 5)) && chain.find(digestOf(BLOCKS_PER_CHUNK - 1)));
+	for(uint64_t i = BLOCKS_PER_CHUNK - 1;i < n;i++)
+		check(chain.append(Block(0,digestOf(n + i + 1),i == BLOCKS_PER_CHUNK - 1 ? digestOf(i) : digestOf(n + i),3000 + i)) == (int64_t)i);
+	check(chain.validate() == CHAIN_VALID && chain.at(BLOCKS_PER_CHUNK + 4).hash == digestOf(n + BLOCKS_PER_CHUNK + 5));
+
+	Blockchain broken;
+	broken.append(Block(0,digestOf(1),none,1000));
+	broken.append(Block(0,digestOf(2),digestOf(1),1001));
+	broken.append(Block(0,digestOf(3),digestOf(7),1002));
+	uint64_t bad = 0;
+	check(broken.validate(0,&bad) == CHAIN_BAD_LINK);
+	check(bad == 2);
+
+	Blockchain late;
+	late.append(Block(0,digestOf(1),none,1000));
+	late.append(Block(0,digestOf(2),digestOf(1),999));
+	check(late.validate() == CHAIN_BAD_TIMESTAMP);
+}
+
+void testHash(){
+	check(toHex(sha256(std::string("abc"))) == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+	check(toHex(sha256(std::string(""))) == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+
+	// streaming in pieces gives the same digest as one shot
+	std::string msg(1000,'x');
+	Hasher h;
+	h.update(msg.data(),1).update(msg.data() + 1,499).update(msg.data() + 500,500);
+	check(h.final() == sha256(msg));
+	check(h.update(std::string("abc")).final() == sha256(std::string("abc")));
+
+	// the plain C++ one of the light clients agrees, across block boundaries too
+	Sha256 plain;
+	for(size_t n = 0;n < 300;n++)
+		check(plain.update(msg.data(),n).final() == sha256(msg.data(),n));
+	plain.update(msg.data(),63).update(msg.data() + 63,1).update(msg.data() + 64,936);
+	check(plain.final() == sha256(msg));
+
+	std::vector<std::string> messages;
+	std::vector<Bytes> spans;
+	for(int i = 0;i < 1000;i++)
+		messages.push_back(std::string(i,(char)i));
+	for(const std::string& m : messages)
+		spans.push_back(Bytes(m));
+	std::vector<Digest> one(messages.size()),many(messages.size());
+	hashMany(spans.data(),spans.size(),one.data());
+	hashMany(spans.data(),spans.size(),many.data(),4);
+	for(size_t i = 0;i < messages.size();i++){
+		check(one[i] == sha256(messages[i]));
+		check(many[i] == one[i]);
+	}
+
+	unsigned char bytes[] = {0x00,0x0f,0xa5,0xff};
+	char hex[9];
+	toHex(bytes,sizeof bytes,hex);
+	check(std::string(hex) == "000fa5ff");
+}
+
+// Blocking loopback client for the peer tests.
+int dial(uint16_t port){
+	int fd = socket(AF_INET,SOCK_STREAM,0);
+	sockaddr_in addr;
+	memset(&addr,0,sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	inet_pton(AF_INET,"127.0.0.1",&addr.sin_addr);
+	if(connect(fd,(sockaddr*)&addr,sizeof addr) != 0){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool readAll(int fd,void* p,size_t n){
+	uint8_t* b = (uint8_t*)p;
+	while(n){
+		ssize_t r = read(fd,b,n);
+		if(r <= 0)
+			return false;
+		b += r;
+		n -= r;
+	}
+	return true;
+}
+
+void sendFrame(int fd,uint8_t type,const void* data,size_t size){
+	std::vector<uint8_t> frame(FRAME_HEADER + 1 + size);
+	putU32(frame.data(),size + 1);
+	frame[FRAME_HEADER] = type;
+	memcpy(frame.data() + FRAME_HEADER + 1,data,size);
+	check(write(fd,frame.data(),frame.size()) == (ssize_t)frame.size());
+}
+
+bool readFrame(int fd,std::vector<uint8_t>& payload){
+	uint8_t header[FRAME_HEADER];
+	if(!readAll(fd,header,sizeof header))
+		return false;
+	payload.resize(getU32(header));
+	return readAll(fd,payload.data(),payload.size());
+}
+
+Digest fromHex(const char* hex){
+	Digest d;
+	for(size_t i = 0;i < d.size();i++)
+		sscanf(hex + i * 2,"%2hhx",&d[i]);
+	return d;
+}
+
+KeyPair account(uint64_t n){
+	return keyPairFromSeed(digestOf(n));
+}
+
+// Signed by account(from). Registrations refer to the new account itself.
+Transaction makeTransaction(uint64_t from,uint64_t amount,uint32_t kind = TX_TRANSFER,uint64_t nonce = 0,const Digest* to = nullptr){
+	KeyPair keys = account(from);
+	Transaction tx;
+	tx.to = to ? *to : kind == TX_REGISTER ? keys.publicKey : digestOf(from + 1);
+	tx.amount = amount;
+	tx.nonce = nonce;
+	tx.timestamp = 1000;
+	tx.kind = kind;
+	signTransaction(tx,keys);
+	return tx;
+}
+
+BlockData makeBlock(const Digest& phash,int64_t timestamp,size_t txs = 0,uint32_t kind = TX_TRANSFER){
+	BlockData b;
+	b.header = Block(0,Digest(),phash,timestamp);
+	for(size_t i = 0;i < txs;i++)
+		b.txs.push_back(makeTransaction(timestamp * 16 + i,i,kind));
+	seal(b);
+	return b;
+}
+
+void testSign(){
+	// RFC 8032 test 1
+	KeyPair keys = keyPairFromSeed(fromHex("9d61b19deffd5a60ba844af492ec2cc44449c5697b326919703bac031cae7f60"));
+	check(toHex(keys.publicKey) == "d75a980182b10ab7d54bfed3c964073a0ee172f3daa62325af021a68f707511a");
+	Signature sig = sign(keys,Bytes());
+	check(memcmp(sig.data(),fromHex("e5564300c360ac729086e2cc806e828a84877f1eb8e5d974d873e06522490155").data(),32) == 0);
+	check(memcmp(sig.data() + 32,fromHex("5fb8821590a33bacc61e39701cf9b46bd25bf5f0595bbe24655141438e7a100b").data(),32) == 0);
+	check(verify(keys.publicKey,Bytes(),sig));
+	check(!verify(keys.publicKey,std::string("x"),sig));
+
+	KeyPair other = generateKeyPair();
+	check(other.publicKey != keys.publicKey);
+	check(keyPairFromSeed(other.secretKey).publicKey == other.publicKey);
+
+	Transaction tx = makeTransaction(7,100);
+	check(tx.from == keyPairFromSeed(digestOf(7)).publicKey);
+	check(verifyTransaction(tx,tx.computeHash()));
+	tx.amount++;
+	check(!verifyTransaction(tx,tx.computeHash()));
+
+	// many signers, some forged, across threads
+	std::vector<KeyPair> signers;
+	for(int i = 0;i < 8;i++)
+		signers.push_back(generateKeyPair());
+	const size_t n = 500;
+	std::vector<Digest> messages(n);
+	std::vector<Signature> signatures(n);
+	std::vector<SignedMessage> items(n);
+	for(size_t i = 0;i < n;i++){
+		messages[i] = digestOf(i);
+		signatures[i] = sign(signers[i % signers.size()],messages[i]);
+	}
+	signatures[3][10] ^= 1;
+	signatures[444][63] ^= 1;
+	for(size_t i = 0;i < n;i++)
+		items[i] = SignedMessage{&signers[i % signers.size()].publicKey,Bytes(messages[i]),&signatures[i]};
+	items[201].publicKey = &signers[0].publicKey; // somebody else's key
+	std::vector<uint8_t> one(n),many(n);
+	check(verifyMany(items.data(),n,one.data()) == 3);
+	check(verifyMany(items.data(),n,many.data(),4) == 3);
+	check(one == many);
+	check(!one[3] && !one[444] && !one[201] && one[200]);
+}
+
+void testWire(){
+	Digest none;
+	none.fill(0);
+	BlockData block = makeBlock(none,1000,5);
+	block.header.height = 42;
+	std::vector<uint8_t> bytes = encodeBlock(block);
+	check(bytes.size() == WIRE_PREFIX + WIRE_HEADER_SIZE + 5 * WIRE_TX_SIZE);
+
+	// the views read the fields in place and hash the same ranges the structs do
+	BlockView view;
+	check(view.parse(bytes.data(),bytes.size()));
+	HeaderView header = view.header();
+	check(header.version() == block.header.version && header.size() == 5 && header.height() == 42);
+	check(header.timestamp() == 1000 && header.phash() == none && header.root() == block.header.root);
+	check(header.hash() == block.header.hash && header.computeHash() == block.header.computeHash());
+	check(view.count() == 5);
+	for(size_t i = 0;i < view.count();i++){
+		const Transaction& tx = block.txs[i];
+		TransactionView t = view.tx(i);
+		check(t.from() == tx.from && t.to() == tx.to && t.amount() == tx.amount && t.nonce() == tx.nonce);
+		check(t.timestamp() == tx.timestamp && t.kind() == tx.kind);
+		check(t.computeHash() == tx.computeHash());
+	}
+	BlockData decoded;
+	check(decodeBlock(bytes.data(),bytes.size(),decoded));
+	check(encodeBlock(decoded) == bytes);
+	check(decoded.txs[4].signature == block.txs[4].signature);
+
+	// padding in the structs never reaches the bytes
+	BlockData dirty;
+	memset((void*)&dirty.header,0xff,sizeof dirty.header);
+	dirty.txs.resize(5);
+	memset((void*)dirty.txs.data(),0xff,5 * sizeof(Transaction));
+	dirty.header = block.header;
+	for(size_t i = 0;i < 5;i++){
+		dirty.txs[i].from = block.txs[i].from;
+		dirty.txs[i].to = block.txs[i].to;
+		dirty.txs[i].amount = block.txs[i].amount;
+		dirty.txs[i].nonce = block.txs[i].nonce;
+		dirty.txs[i].timestamp = block.txs[i].timestamp;
+		dirty.txs[i].kind = block.txs[i].kind;
+		dirty.txs[i].signature = block.txs[i].signature;
+	}
+	check(encodeBlock(dirty) == bytes);
+
+	// rejected up front: other versions, lengths that do not match the count
+	std::vector<uint8_t> bad = bytes;
+	bad[0] = WIRE_VERSION + 1;
+	check(!view.parse(bad.data(),bad.size()) && !view.valid());
+	check(!view.parse(bytes.data(),bytes.size() - 1));
+	check(!view.parse(bytes.data(),WIRE_PREFIX + WIRE_HEADER_SIZE - 1));
+	bad = bytes;
+	bad.resize(bytes.size() + WIRE_TX_SIZE);
+	check(!view.parse(bad.data(),bad.size()));
+	bad = bytes;
+	bad[WIRE_PREFIX + 4] = 0xff; // transaction count
+	check(!view.parse(bad.data(),bad.size()));
+
+	// a view straight into the mapped segment of the store
+	char dir[] = "/tmp/wireXXXXXX";
+	check(mkdtemp(dir) != nullptr);
+	{
+		BlockStore store;
+		check(store.open(dir) == STORE_OK);
+		check(store.append(bytes.data(),bytes.size()) == 0);
+		check(store.append(bad.data(),bad.size()) == STORE_BAD_BLOCK);
+		BlockView stored;
+		check(store.view(block.header.hash,stored));
+		check(stored.bytes().data != bytes.data() && memcmp(stored.bytes().data,bytes.data(),bytes.size()) == 0);
+		check(stored.tx(3).computeHash() == block.txs[3].computeHash());
+	}
+	check(system((std::string("rm -rf ") + dir).c_str()) == 0);
+}
+
+void testPipeline(){
+	ThreadPool pool(4);
+	Digest none;
+	none.fill(0);
+	std::vector<BlockData> blocks;
+	for(int i = 0;i < 100;i++)
+		blocks.push_back(makeBlock(i ? blocks.back().header.hash : none,1000 + i,i == 60 ? SIGNATURE_BATCH * 3 : i % 8));
+	blocks[10].txs[1].amount++;                  // no longer matches the root
+	blocks[60].txs[150].signature[0] ^= 1;       // in the third signature batch
+	blocks[25].header.hash[0] ^= 1;              // header hash
+	std::vector<std::vector<uint8_t>> encoded;
+	for(const BlockData& b : blocks)
+		encoded.push_back(encodeBlock(b));
+	encoded[30].pop_back();                      // truncated
+
+	std::vector<uint64_t> applied;
+	std::vector<uint64_t> tags;
+	std::vector<int> statuses(blocks.size(),1);
+	{
+		Pipeline pipe(pool,8);
+		pipe.checkSignature = verifyTransaction;
+		pipe.apply = [&](const BlockData& b){
+			if(b.header.timestamp == 1040)
+				return PIPE_BAD_STATE;
+			applied.push_back(b.header.timestamp - 1000);
+			return PIPE_OK;
+		};
+		pipe.done = [&](uint64_t tag,BlockData&,int status){
+			tags.push_back(tag);
+			statuses[tag] = status;
+		};
+		for(size_t i = 0;i < encoded.size();i++)
+			pipe.submit(std::move(encoded[i]),i);
+		pipe.drain();
+		PipelineStats stats = pipe.stats();
+		check(stats.blocks == 95);
+		check(stats.inflight == 0);
+		for(int i = 0;i < STAGES;i++)
+			check(stats.depth[i] == 0);
+	}
+	check(tags.size() == blocks.size());
+	for(size_t i = 0;i < tags.size();i++)
+		check(tags[i] == i);
+	check(applied.size() == 95);
+	for(size_t i = 1;i < applied.size();i++)
+		check(applied[i] > applied[i - 1]);
+	check(statuses[0] == PIPE_OK);
+	check(statuses[10] == PIPE_BAD_HASH);
+	check(statuses[60] == PIPE_BAD_SIGNATURE);
+	check(statuses[25] == PIPE_BAD_HASH);
+	check(statuses[30] == PIPE_BAD_ENCODING);
+	check(statuses[40] == PIPE_BAD_STATE);
+	check(statuses[99] == PIPE_OK);
+
+	// a full pipeline turns blocks away and leaves them with the caller
+	std::atomic<bool> release(false);
+	Pipeline pipe(pool,1);
+	pipe.checkSignature = [&](const Transaction& tx,const Digest& hash){
+		while(!release)
+			std::this_thread::yield();
+		return verifyTransaction(tx,hash);
+	};
+	std::vector<uint8_t> first = encodeBlock(blocks[1]);
+	std::vector<uint8_t> second = encodeBlock(blocks[2]);
+	check(pipe.trySubmit(std::move(first)));
+	check(!pipe.trySubmit(std::move(second)));
+	check(!second.empty());
+	check(pipe.stats().inflight == 1);
+	release = true;
+	pipe.drain();
+	check(pipe.trySubmit(std::move(second)));
+	pipe.drain();
+	check(pipe.stats().blocks == 2);
+}
+
+// Block count of the last checkpoint record in a store directory.
+uint64_t checkpointed(const char* dir){
+	uint64_t cp[3] = {0,0,0}; // magic, segment and offset, count
+	FILE* f = fopen((std::string(dir) + "/checkpoint").c_str(),"rb");
+	if(f){
+		check(fread(cp,sizeof cp,1,f) == 1);
+		fclose(f);
+	}
+	return cp[2];
+}
+
+void testStore(){
+	char dir[] = "/tmp/storeXXXXXX";
+	check(mkdtemp(dir) != nullptr);
+	Digest none;
+	none.fill(0);
+	std::vector<BlockData> blocks;
+	for(int i = 0;i < 3000;i++)
+		blocks.push_back(makeBlock(i ? blocks.back().header.hash : none,1000 + i,i % 3,TX_REGISTER));
+	{
+		// small segments, so blocks spread over several files and the index grows
+		BlockStore store(64 * 1024);
+		check(store.open(dir) == STORE_OK);
+		for(size_t i = 0;i < 2000;i++)
+			check(store.append(blocks[i]) == (int64_t)i);
+		check(store.append(blocks[5]) == STORE_DUPLICATE);
+		BlockData huge = makeBlock(none,1,1);
+		huge.txs.resize(1000);
+		seal(huge);
+		check(store.append(huge) == STORE_TOO_LARGE);
+		check(store.segmentCount() > 1);
+		BlockData b;
+		check(store.get(blocks[1234].header.hash,b));
+		check(b.header.hash == blocks[1234].header.hash && b.txs.size() == blocks[1234].txs.size());
+		check(b.txs.empty() || b.txs[0].signature == blocks[1234].txs[0].signature);
+		Bytes view = store.find(blocks[7].header.hash);
+		check(view.size == encodeBlock(blocks[7]).size() && (uintptr_t)view.data % RECORD_ALIGN == 0);
+		check(!store.contains(blocks[2500].header.hash));
+	}
+	{
+		// clean reopen maps the index, nothing to replay
+		BlockStore store(64 * 1024);
+		check(store.open(dir) == STORE_OK);
+		check(store.size() == 2000);
+		check(store.recovered() == 0);
+		check(store.contains(blocks[0].header.hash) && store.contains(blocks[1999].header.hash));
+		uint64_t n = 0;
+		store.forEachHeader([&](const Block& h){ n += h.hash == blocks[n].header.hash; });
+		check(n == 2000);
+	}
+	// a crash: the child appends without reaching a checkpoint, then leaves a torn record behind
+	pid_t child = fork();
+	if(child == 0){
+		BlockStore* store = new BlockStore(64 * 1024);
+		if(store->open(dir) != STORE_OK)
+			_exit(1);
+		for(size_t i = 2000;i < 2100;i++)
+			store->append(blocks[i]);
+		std::vector<uint8_t> bytes = encodeBlock(blocks[2100]);
+		bytes[100] ^= 1;
+		uint32_t record[2] = {(uint32_t)bytes.size(),0};
+		char name[64];
+		snprintf(name,sizeof name,"%s/segment-%06zu.dat",dir,store->segmentCount());
+		int fd = open(name,O_RDWR);
+		// the torn record goes right behind the last good one
+		off_t end = 0;
+		for(;;){
+			uint32_t size;
+			if(pread(fd,&size,sizeof size,end) != sizeof size || size == 0)
+				break;
+			end += (RECORD_HEADER + size + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+		}
+		if(end + RECORD_HEADER + (off_t)bytes.size() > 64 * 1024 || pwrite(fd,record,sizeof record,end) != sizeof record || pwrite(fd,bytes.data(),bytes.size(),end + RECORD_HEADER) != (ssize_t)bytes.size())
+			_exit(1);
+		_exit(0);
+	}
+	int status = 0;
+	waitpid(child,&status,0);
+	check(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	{
+		BlockStore store(64 * 1024);
+		check(store.open(dir) == STORE_OK);
+		check(store.recovered() == 100);
+		check(store.size() == 2100);
+		check(store.contains(blocks[2099].header.hash));
+		check(!store.contains(blocks[2100].header.hash));
+		for(size_t i = 2100;i < blocks.size();i++)
+			check(store.append(blocks[i]) == (int64_t)i);
+	}
+	{
+		Peer peer(1);
+		check(peer.open(dir));
+		check(peer.chain.size() == blocks.size());
+		check(peer.chain.tip().hash == blocks.back().header.hash);
+	}
+	check(system((std::string("rm -rf ") + dir).c_str()) == 0);
+
+	// with sync set the automatic checkpoint is recorded once the syncs it queued completed, after a failed one it is not
+	strcpy(dir,"/tmp/storeXXXXXX");
+	check(mkdtemp(dir) != nullptr);
+	{
+		BlockStore store(64 * 1024);
+		std::vector<std::function<void(int)>> pending;
+		store.sync = [&](int,std::function<void(int)> done){ pending.push_back(done); };
+		check(store.open(dir) == STORE_OK);
+		for(size_t i = 0;i < CHECKPOINT_INTERVAL;i++)
+			check(store.append(blocks[i]) == (int64_t)i);
+		check(pending.size() > 3 && checkpointed(dir) == 0);
+		pending.back()(-EIO);
+		pending.pop_back();
+		for(auto& done : pending)
+			done(0);
+		pending.clear();
+		check(checkpointed(dir) == 0);
+		for(size_t i = CHECKPOINT_INTERVAL;i < CHECKPOINT_INTERVAL * 2;i++)
+			check(store.append(blocks[i]) == (int64_t)i);
+		check(checkpointed(dir) == 0);
+		for(auto& done : pending)
+			done(0);
+		check(checkpointed(dir) == CHECKPOINT_INTERVAL * 2);
+	}
+	check(checkpointed(dir) == CHECKPOINT_INTERVAL * 2);
+	check(system((std::string("rm -rf ") + dir).c_str()) == 0);
+
+	// pruning drops the oldest segments a checkpoint covers, headers and segment numbers stay
+	strcpy(dir,"/tmp/storeXXXXXX");
+	check(mkdtemp(dir) != nullptr);
+	{
+		BlockStore store(64 * 1024);
+		std::vector<std::string> discarded;
+		store.discard = [&](const std::string& path){ discarded.push_back(path); unlink(path.c_str()); };
+		check(store.open(dir) == STORE_OK);
+		for(size_t i = 0;i < 1000;i++)
+			check(store.append(blocks[i]) == (int64_t)i);
+		check(store.segmentCount() > 2);
+		check(!store.pruneOldest(blocks[999].header.hash));
+		check(store.checkpoint() == STORE_OK);
+		uint64_t usage = store.diskUsage();
+		check(store.pruneOldest(blocks[999].header.hash));
+		check(store.firstSegment() == 2 && store.diskUsage() == usage - 64 * 1024);
+		check(!store.contains(blocks[0].header.hash) && discarded.size() == 1 && access(discarded[0].c_str(),F_OK) != 0);
+		check(!store.pruneOldest(blocks[0].header.hash));
+		while(store.pruneOldest(blocks[999].header.hash))
+			;
+		check(store.contains(blocks[999].header.hash) && store.segmentCount() == 1);
+		// the index grows without the pruned blocks
+		for(size_t i = 1000;i < 2000;i++)
+			check(store.append(blocks[i]) == (int64_t)i);
+		check(store.contains(blocks[1999].header.hash) && !store.contains(blocks[0].header.hash));
+	}
+	{
+		BlockStore store(64 * 1024);
+		check(store.open(dir) == STORE_OK);
+		check(store.firstSegment() > 2 && store.size() == 2000 && store.recovered() == 0);
+		check(store.contains(blocks[1999].header.hash) && !store.contains(blocks[0].header.hash));
+		uint64_t n = 0;
+		store.forEachHeader([&](const Block& h){ n += h.hash == blocks[n].header.hash; });
+		check(n == 2000);
+		check(store.append(blocks[2000]) == 2000);
+	}
+	check(system((std::string("rm -rf ") + dir).c_str()) == 0);
+}
+
+void testState(){
+	State state;
+	Digest a = account(1).publicKey;
+	Digest b = account(2).publicKey;
+	check(state.apply(makeTransaction(1,0,TX_REGISTER)) == STATE_OK);
+	check(state.apply(makeTransaction(2,0,TX_REGISTER,0,&a)) == STATE_OK);
+	check(state.apply(makeTransaction(3,0,TX_REGISTER,0,&b)) == STATE_OK);
+	Digest nobody = digestOf(99);
+	check(state.apply(makeTransaction(4,0,TX_REGISTER,0,&nobody)) == STATE_UNKNOWN_ACCOUNT);
+	check(state.apply(makeTransaction(1,0,TX_REGISTER)) == STATE_ACCOUNT_EXISTS);
+	check(state.find(b)->referrer == a && state.find(a)->referrer == a);
+	check(state.find(a)->balance == REGISTER_REWARD);
+
+	check(state.apply(makeTransaction(1,1,TX_TRANSFER,1,&b)) == STATE_OK);
+	check(state.find(a)->balance == 0 && state.find(b)->balance == 2);
+	check(state.apply(makeTransaction(1,0,TX_TRANSFER,1,&b)) == STATE_BAD_NONCE);
+	check(state.apply(makeTransaction(2,5,TX_TRANSFER,1,&a)) == STATE_INSUFFICIENT_FUNDS);
+	check(state.apply(makeTransaction(2,1,TX_TRANSFER,1,&nobody)) == STATE_UNKNOWN_ACCOUNT);
+
+	Transaction scoop = makeTransaction(2,0,TX_SCOOP,1);
+	check(state.apply(scoop) == STATE_OK);
+	scoop.nonce = 2;
+	scoop.timestamp += SCOOP_SECONDS - 1;
+	check(state.apply(scoop) == STATE_STILL_SCOOPING);
+	scoop.timestamp++;
+	check(state.apply(scoop) == STATE_OK);
+	check(state.find(b)->balance == 2 + SCOOP_REWARD && state.find(b)->scooping == scoop.timestamp);
+	// the journal holds the last transaction alone
+	Digest scooped = state.hash();
+	check(state.apply(makeTransaction(2,1,TX_TRANSFER,3,&a)) == STATE_OK);
+	state.revert();
+	check(state.hash() == scooped);
+
+	// a block is applied all or nothing
+	Digest before = state.hash();
+	BlockData block;
+	block.txs.push_back(makeTransaction(2,1,TX_TRANSFER,3,&a));
+	block.txs.push_back(makeTransaction(5,0,TX_REGISTER));
+	block.txs.push_back(makeTransaction(1,100,TX_TRANSFER,2,&b));
+	check(state.apply(block) == STATE_INSUFFICIENT_FUNDS);
+	check(state.hash() == before && !state.find(account(5).publicKey));
+	block.txs.pop_back();
+	block.header.state = digestOf(1);
+	check(state.apply(block) == STATE_BAD_COMMITMENT);
+	check(state.hash() == before);
+	block.header.state.fill(0);
+	check(state.apply(block) == STATE_OK);
+	check(state.find(account(5).publicKey) && state.hash() != before);
+	state.revert();
+	check(state.hash() == before);
+
+	// the hash does not depend on the order accounts were created in
+	State x,y;
+	x.apply(makeTransaction(10,0,TX_REGISTER));
+	x.apply(makeTransaction(11,0,TX_REGISTER));
+	y.apply(makeTransaction(11,0,TX_REGISTER));
+	y.apply(makeTransaction(10,0,TX_REGISTER));
+	check(x.hash() == y.hash());
+
+	char dir[] = "/tmp/stateXXXXXX";
+	check(mkdtemp(dir) != nullptr);
+	std::string snap = std::string(dir) + "/state.snap";
+	check(state.snapshot(snap,7,digestOf(7)) == SNAPSHOT_OK);
+	State loaded;
+	SnapshotInfo info;
+	check(loaded.load(snap,info) == SNAPSHOT_OK);
+	check(loaded.hash() == state.hash() && info.state == state.hash() && info.height == 7 && info.block == digestOf(7));
+	int fd = open(snap.c_str(),O_RDWR);
+	uint8_t byte;
+	check(pread(fd,&byte,1,sizeof(SnapshotInfo) + 40) == 1);
+	byte ^= 1;
+	check(pwrite(fd,&byte,1,sizeof(SnapshotInfo) + 40) == 1);
+	close(fd);
+	check(loaded.load(snap,info) == SNAPSHOT_BAD_HASH);
+
+	// bootstrap: a chain committing to its state every SNAPSHOT_INTERVAL blocks
+	State producer;
+	Digest none;
+	none.fill(0);
+	Digest root = account(100000).publicKey;
+	std::vector<BlockData> blocks;
+	const uint64_t n = SNAPSHOT_INTERVAL * 2 + SNAPSHOT_INTERVAL / 2;
+	for(uint64_t i = 0;i < n;i++){
+		BlockData bd;
+		bd.header = Block(0,Digest(),i ? blocks.back().header.hash : none,1000 + i);
+		bd.txs.push_back(makeTransaction(100000 + i,0,TX_REGISTER,0,i ? &root : nullptr));
+		check(producer.apply(bd) == STATE_OK);
+		if(i % SNAPSHOT_INTERVAL == 0 && i)
+			bd.header.state = producer.hash();
+		seal(bd);
+		if(i == SNAPSHOT_INTERVAL * 2)
+			check(producer.snapshot(std::string(dir) + "/latest.snap",i,bd.header.hash) == SNAPSHOT_OK);
+		if(i == SNAPSHOT_INTERVAL + 1)
+			check(producer.snapshot(std::string(dir) + "/uncommitted.snap",i,bd.header.hash) == SNAPSHOT_OK);
+		blocks.push_back(bd);
+	}
+	{
+		BlockStore store;
+		check(store.open(dir) == STORE_OK);
+		for(const BlockData& bd : blocks)
+			check(store.append(bd) >= 0);
+	}
+	{
+		Peer peer(1);
+		check(peer.open(dir));
+		check(peer.replayed == n);
+		check(peer.state.hash() == producer.hash());
+	}
+	check(rename((std::string(dir) + "/latest.snap").c_str(),snap.c_str()) == 0);
+	{
+		Peer peer(1);
+		check(peer.open(dir));
+		check(peer.replayed == n - SNAPSHOT_INTERVAL * 2 - 1);
+		check(peer.state.hash() == producer.hash());
+	}
+	// with a disk budget the oldest segments go, down to the fork choice horizon below the snapshot
+	char pruned[] = "/tmp/stateXXXXXX";
+	check(mkdtemp(pruned) != nullptr);
+	check(system(("cp " + snap + " " + pruned + "/state.snap").c_str()) == 0);
+	{
+		BlockStore store(64 * 1024);
+		check(store.open(pruned) == STORE_OK);
+		for(const BlockData& bd : blocks)
+			check(store.append(bd) >= 0);
+	}
+	uint64_t horizon = n - FORK_WINDOW;
+	for(int i = 0;i < 2;i++){
+		Peer peer(1);
+		peer.diskBudget = 1;
+		check(peer.open(pruned));
+		check(peer.chain.size() == n && peer.state.hash() == producer.hash());
+		check(peer.store.firstSegment() > 1 && peer.store.size() == n);
+		check(!peer.store.contains(blocks[0].header.hash) && peer.store.contains(blocks[horizon].header.hash));
+		check(!peer.store.pruneOldest(blocks[horizon].header.hash));
+	}
+	check(system((std::string("rm -rf ") + pruned).c_str()) == 0);
+	// the chain does not commit to the state at that block, so it is not trusted
+	check(rename((std::string(dir) + "/uncommitted.snap").c_str(),snap.c_str()) == 0);
+	{
+		Peer peer(1);
+		check(peer.open(dir));
+		check(peer.replayed == n);
+		check(peer.state.hash() == producer.hash());
+	}
+	check(system((std::string("rm -rf ") + dir).c_str()) == 0);
+}
+
+// Keys spread over the shards like public keys do.
+Digest hashOf(uint64_t n){
+	return threadHasher().updateValue(n).final();
+}
+
+Account balanceOf(uint64_t n){
+	Account a;
+	memset(&a,0,sizeof a);
+	a.balance = n;
+	a.nonce = 1;
+	return a;
+}
+
+void testAccounts(){
+	// a batch large enough to be written in parallel, a later change of a key wins
+	AccountTable table;
+	std::vector<AccountChange> changes;
+	for(uint64_t i = 0;i < ACCOUNT_PARALLEL_BATCH * 4;i++)
+		changes.emplace_back(hashOf(i),balanceOf(i));
+	changes.emplace_back(hashOf(7),balanceOf(70));
+	changes.emplace_back(hashOf(8),std::nullopt);
+	table.update(changes);
+	check(table.size() == ACCOUNT_PARALLEL_BATCH * 4 - 1 && table.resident() == table.size());
+	check(table.find(hashOf(7))->balance == 70 && !table.find(hashOf(8)) && table.find(hashOf(9))->balance == 9);
+	Account a;
+	check(table.get(hashOf(100),a) && a.balance == 100 && !table.get(hashOf(8),a));
+	AccountTable serial;
+	for(const AccountChange& c : changes)
+		serial.update(&c,1);
+	bool same = serial.size() == table.size();
+	serial.forEach([&](const Digest& key,const Account& a){ same &= table.find(key) && table.find(key)->balance == a.balance; });
+	check(same);
+	table.clear();
+	check(table.size() == 0 && !table.find(hashOf(9)));
+
+	// the accounts written longest ago are spilled and still found
+	char dir[] = "/tmp/accountsXXXXXX";
+	check(mkdtemp(dir) != nullptr);
+	const uint64_t n = 20000;
+	AccountTable spilled;
+	check(spilled.spill(n / 2) == 0);
+	check(spilled.open(dir));
+	for(uint64_t i = 0;i < n;i++){
+		AccountChange c(hashOf(i),balanceOf(i));
+		spilled.update(&c,1);
+	}
+	check(spilled.spill(n / 2) > 0 && spilled.resident() < n / 2 && spilled.size() == n);
+	check(spilled.find(hashOf(0)) && spilled.find(hashOf(0))->balance == 0 && spilled.find(hashOf(n - 1))->balance == n - 1);
+	// a write brings an account back into memory, a removal hides the spilled copy
+	spilled.update({{hashOf(1),balanceOf(11)},{hashOf(2),std::nullopt}});
+	check(spilled.find(hashOf(1))->balance == 11 && !spilled.find(hashOf(2)) && spilled.size() == n - 1);
+	// spilling again merges into the files
+	changes.clear();
+	for(uint64_t i = n;i < n * 2;i++)
+		changes.emplace_back(hashOf(i),balanceOf(i));
+	spilled.update(changes);
+	check(spilled.spill(n / 2) > 0 && spilled.size() == n * 2 - 1);
+	check(spilled.find(hashOf(1))->balance == 11 && !spilled.find(hashOf(2)) && spilled.find(hashOf(3))->balance == 3);
+	uint64_t count = 0;
+	uint64_t sum = 0;
+	spilled.forEach([&](const Digest&,const Account& a){ count++; sum += a.balance; });
+	check(count == n * 2 - 1 && sum == (n * 2) * (n * 2 - 1) / 2 - 2 + 10);
+	spilled.update({{hashOf(2),balanceOf(2)}});
+	check(spilled.find(hashOf(2))->balance == 2 && spilled.size() == n * 2);
+
+	// a state that spills arrives at the same hash, and undoes blocks across spills
+	State plain;
+	State small;
+	check(small.spill(std::string(dir) + "/state",1000));
+	std::vector<BlockData> blocks(4);
+	for(uint64_t i = 0;i < 6000;i++){
+		Transaction tx;
+		memset(&tx,0,sizeof tx);
+		tx.from = hashOf(i);
+		tx.to = i ? hashOf(0) : tx.from;
+		tx.kind = TX_REGISTER;
+		blocks[i < 3000 ? 0 : 1].txs.push_back(tx);
+	}
+	for(uint64_t i = 0;i < 3000;i++){
+		Transaction tx;
+		memset(&tx,0,sizeof tx);
+		tx.from = hashOf(i);
+		tx.to = hashOf(5999 - i);
+		tx.amount = 1;
+		tx.nonce = 1;
+		tx.kind = TX_TRANSFER;
+		blocks[2].txs.push_back(tx);
+		tx.from = hashOf(5999 - i);
+		tx.to = hashOf(i);
+		blocks[3].txs.push_back(tx);
+	}
+	Undo undos[4];
+	Digest hashes[4];
+	for(int i = 0;i < 4;i++){
+		check(plain.apply(blocks[i]) == STATE_OK);
+		hashes[i] = plain.hash();
+		check(small.apply(blocks[i],undos[i]) == STATE_OK && small.hash() == hashes[i]);
+	}
+	check(small.size() == 6000 && small.find(hashOf(0))->balance == REGISTER_REWARD && small.find(hashOf(0))->nonce == 2);
+	for(int i = 3;i > 0;i--){
+		small.undo(undos[i]);
+		check(small.hash() == hashes[i - 1]);
+	}
+	check(system((std::string("rm -rf ") + dir).c_str()) == 0);
+}
+
+Transaction registration(const Digest& key,const Digest& referrer){
+	Transaction tx;
+	memset(&tx,0,sizeof tx);
+	tx.from = key;
+	tx.to = referrer;
+	tx.kind = TX_REGISTER;
+	return tx;
+}
+
+void testReferrals(){
+	// a root, two mates of it, three below the first and twelve below the second
+	BlockData block;
+	block.txs.push_back(registration(hashOf(0),hashOf(0)));
+	block.txs.push_back(registration(hashOf(1),hashOf(0)));
+	block.txs.push_back(registration(hashOf(2),hashOf(0)));
+	for(uint64_t i = 3;i < 6;i++)
+		block.txs.push_back(registration(hashOf(i),hashOf(1)));
+	for(uint64_t i = 6;i < 18;i++)
+		block.txs.push_back(registration(hashOf(i),hashOf(2)));
+	State state;
+	check(state.apply(block) == STATE_OK);
+	ReferralGraph graph;
+	graph.build(state);
+	check(graph.size() == 18);
+	uint64_t root = graph.find(hashOf(0));
+	uint64_t second = graph.find(hashOf(2));
+	check(graph.referrer(root) == root && graph.referrer(second) == root && graph.find(digestOf(99)) == -1);
+	check(graph.referrals(root) == 2 && graph.referrals(second) == 12 && graph.mates(second) == MATE_LIMIT);
+	check(graph.levels(root) == std::vector<uint64_t>({2,15}) && graph.levels(second) == std::vector<uint64_t>({12}));
+	std::vector<uint64_t> depths = graph.depths();
+	check(depths[root] == 0 && depths[second] == 1 && depths[graph.find(hashOf(17))] == 2);
+	std::vector<uint64_t> rewards = graph.rewards();
+	check(rewards[root] == SCOOP_REWARD + 2 && rewards[second] == SCOOP_REWARD + MATE_LIMIT && rewards[graph.find(hashOf(3))] == SCOOP_REWARD);
+
+	// registrations after the build are counted right away
+	check(graph.add(hashOf(18),hashOf(3)) && !graph.add(hashOf(18),hashOf(3)) && !graph.add(hashOf(19),digestOf(99)));
+	uint64_t third = graph.find(hashOf(3));
+	check(graph.referrals(third) == 1 && graph.children(third) == std::vector<uint64_t>({(uint64_t)graph.find(hashOf(18))}));
+	check(graph.levels(root) == std::vector<uint64_t>({2,15,1}));
+
+	// a large tree: every account referred by one added before it, built at once and added one by one
+	const uint64_t n = REFERRAL_PARALLEL * 2;
+	BlockData large;
+	large.txs.push_back(registration(hashOf(1000000),hashOf(1000000)));
+	for(uint64_t i = 1;i < n;i++)
+		large.txs.push_back(registration(hashOf(1000000 + i),hashOf(1000000 + (i * 7919) % i)));
+	State big;
+	check(big.apply(large) == STATE_OK);
+	ReferralGraph whole;
+	whole.build(big);
+	ReferralGraph grown;
+	grown.add(large);
+	check(whole.size() == n && grown.size() == n);
+	uint32_t top = whole.find(hashOf(1000000));
+	std::vector<uint64_t> levels = whole.levels(top);
+	uint64_t below = 0;
+	for(uint64_t l : levels)
+		below += l;
+	check(below == n - 1 && levels == grown.levels(grown.find(hashOf(1000000))));
+	bool same = true;
+	for(uint64_t i = 0;i < n;i += 97){
+		Digest key = hashOf(1000000 + i);
+		same &= whole.referrals(whole.find(key)) == grown.referrals(grown.find(key));
+		same &= whole.key(whole.referrer(whole.find(key))) == grown.key(grown.referrer(grown.find(key)));
+	}
+	check(same);
+	std::vector<uint64_t> all = whole.depths();
+	check(*std::max_element(all.begin(),all.end()) == levels.size());
+}
+
+// Registers two accounts and pays 1 THX from payer to to. Branches that
+// spend from the same payer conflict like a double spend.
+std::shared_ptr<BlockData> branchBlock(const Digest& phash,int64_t timestamp,uint64_t payer,const Digest& to){
+	std::shared_ptr<BlockData> b = std::make_shared<BlockData>(makeBlock(phash,timestamp,2,TX_REGISTER));
+	b->txs.push_back(makeTransaction(payer,1,TX_TRANSFER,1,&to));
+	seal(*b);
+	return b;
+}
+
+void testForks(){
+	Digest none;
+	none.fill(0);
+	State state;
+	Blockchain chain;
+	ForkChoice forks(chain,state,8);
+	std::shared_ptr<BlockData> genesis = std::make_shared<BlockData>(makeBlock(none,1000,20,TX_REGISTER));
+	check(forks.add(genesis) == FORK_EXTENDED);
+	Digest a = account(1000 * 16).publicKey;
+	Digest b = account(1000 * 16 + 1).publicKey;
+	std::vector<std::shared_ptr<BlockData>> left;
+	std::vector<std::shared_ptr<BlockData>> right;
+	for(int i = 0;i < 5;i++)
+		left.push_back(branchBlock(i ? left.back()->header.hash : genesis->header.hash,2000 + i,1000 * 16 + 2 + i,a));
+	for(int i = 0;i < 6;i++)
+		right.push_back(branchBlock(i ? right.back()->header.hash : genesis->header.hash,3000 + i,1000 * 16 + 2 + i,b));
+	for(int i = 0;i < 3;i++)
+		check(forks.add(left[i]) == FORK_EXTENDED);
+	Digest leftState = state.hash();
+	for(int i = 0;i < 3;i++)
+		check(forks.add(right[i]) == FORK_SIDE);
+	check(chain.tip().hash == left[2]->header.hash && state.hash() == leftState);
+	check(forks.add(right[2]) == FORK_KNOWN && forks.add(left[1]) == FORK_KNOWN);
+	check(forks.add(right[3]) == FORK_REORG);
+	check(forks.disconnected().size() == 3 && forks.disconnected()[0] == left[2]);
+	check(forks.connected().size() == 4 && forks.connected()[0] == right[0] && forks.connected()[3] == right[3]);
+	check(chain.size() == 5 && chain.tip().hash == right[3]->header.hash && !chain.find(left[0]->header.hash));
+	check(chain.validate() == CHAIN_VALID && forks.contains(left[0]->header.hash));
+	State direct;
+	check(direct.apply(*genesis) == STATE_OK);
+	for(int i = 0;i < 4;i++)
+		check(direct.apply(*right[i]) == STATE_OK);
+	check(state.hash() == direct.hash());
+	check(state.find(a)->balance == REGISTER_REWARD && state.find(b)->balance == REGISTER_REWARD + 4);
+	check(!state.find(account(2000 * 16).publicKey) && state.find(account(3000 * 16).publicKey));
+
+	// and back once the first branch is longer
+	check(forks.add(left[3]) == FORK_SIDE);
+	check(forks.add(left[4]) == FORK_REORG);
+	check(chain.size() == 6 && chain.tip().hash == left[4]->header.hash);
+	check(state.find(a)->balance == REGISTER_REWARD + 5 && state.find(b)->balance == REGISTER_REWARD);
+
+	// a branch with a block that does not apply leaves the chain as it was
+	Digest before = state.hash();
+	check(forks.add(right[4]) == FORK_SIDE);
+	std::shared_ptr<BlockData> spent = branchBlock(right[4]->header.hash,3005,1000 * 16 + 2,b);
+	check(forks.add(spent) == FORK_INVALID);
+	check(forks.connected().empty() && forks.disconnected().empty());
+	check(chain.size() == 6 && chain.tip().hash == left[4]->header.hash && state.hash() == before);
+	check(!forks.contains(spent->header.hash) && forks.contains(right[4]->header.hash));
+	check(forks.add(spent) == FORK_INVALID);
+	check(forks.add(branchBlock(spent->header.hash,3006,1000 * 16 + 12,b)) == FORK_INVALID);
+	check(forks.add(right[5]) == FORK_REORG && state.find(b)->balance == REGISTER_REWARD + 6);
+	check(forks.add(branchBlock(digestOf(5),4000,1000 * 16 + 13,a)) == FORK_ORPHAN);
+
+	// blocks more than the window below the tip are final
+	for(int i = 0;i < 10;i++){
+		std::shared_ptr<BlockData> empty = std::make_shared<BlockData>(makeBlock(chain.tip().hash,5000 + i));
+		check(forks.add(empty) == FORK_EXTENDED);
+	}
+	check(chain.size() == 17 && forks.size() == 8);
+	check(forks.add(branchBlock(genesis->header.hash,6000,1000 * 16 + 14,a)) == FORK_FINAL);
+	check(forks.add(branchBlock(chain.at(9).hash,6001,1000 * 16 + 14,a)) == FORK_SIDE);
+
+	// a peer switching branches as the blocks come in, and after a restart
+	char dir[] = "/tmp/forksXXXXXX";
+	check(mkdtemp(dir) != nullptr);
+	{
+		Peer peer(1);
+		check(peer.open(dir));
+		check(peer.listen(0));
+		std::thread loop([&](){ peer.run(); });
+		int fd = dial(peer.server.port());
+		std::vector<std::shared_ptr<BlockData>> order = {genesis,left[0],left[1],left[2],right[0],right[1],right[2],right[3]};
+		bool accepted = true;
+		for(const std::shared_ptr<BlockData>& block : order){
+			std::vector<uint8_t> bytes = encodeBlock(*block);
+			sendFrame(fd,MSG_BLOCK,bytes.data(),bytes.size());
+			std::vector<uint8_t> payload;
+			accepted &= readFrame(fd,payload) && payload[0] == MSG_ACCEPTED;
+		}
+		check(accepted);
+		close(fd);
+		peer.stop();
+		loop.join();
+		check(peer.reorgs == 1 && peer.accepted == order.size() && peer.chain.tip().hash == right[3]->header.hash);
+		check(peer.state.hash() == direct.hash());
+		// the transfers of the old branch are pending again
+		check(peer.mempool.contains(left[0]->txs[2].computeHash()) && !peer.mempool.contains(right[0]->txs[2].computeHash()));
+	}
+	{
+		Peer peer(1);
+		check(peer.open(dir));
+		check(peer.chain.size() == 5 && peer.chain.tip().hash == right[3]->header.hash);
+		check(peer.state.hash() == direct.hash() && peer.store.size() == 8);
+	}
+	check(system((std::string("rm -rf ") + dir).c_str()) == 0);
+
+	// orphans with the same parent all wait, one that fails takes its descendants along
+	{
+		Peer peer(1);
+		check(peer.listen(0));
+		std::thread loop([&](){ peer.run(); });
+		int fd = dial(peer.server.port());
+		std::shared_ptr<BlockData> sibling = branchBlock(left[0]->header.hash,7000,1000 * 16 + 4,b);
+		std::shared_ptr<BlockData> bad = branchBlock(left[0]->header.hash,7001,1000 * 16 + 2,b);
+		std::shared_ptr<BlockData> below = branchBlock(bad->header.hash,7002,1000 * 16 + 5,b);
+		std::vector<std::shared_ptr<BlockData>> order = {genesis,left[1],sibling,bad,below,left[0]};
+		for(const std::shared_ptr<BlockData>& block : order){
+			std::vector<uint8_t> bytes = encodeBlock(*block);
+			sendFrame(fd,MSG_BLOCK,bytes.data(),bytes.size());
+		}
+		size_t accepted = 0;
+		std::unordered_set<Digest,DigestHash> rejected;
+		for(size_t i = 0;i < order.size();i++){
+			std::vector<uint8_t> payload;
+			check(readFrame(fd,payload) && payload.size() == 1 + sizeof(Digest));
+			Digest hash;
+			memcpy(hash.data(),payload.data() + 1,hash.size());
+			if(payload[0] == MSG_ACCEPTED)
+				accepted++;
+			else
+				rejected.insert(hash);
+		}
+		close(fd);
+		peer.stop();
+		loop.join();
+		check(accepted == 4 && rejected.size() == 2 && rejected.count(bad->header.hash) && rejected.count(below->header.hash));
+		check(peer.forks.contains(left[1]->header.hash) && peer.forks.contains(sibling->header.hash));
+		check(peer.rejected == 2);
+	}
+}
+
+// Unsigned, the mempool does not look at signatures. Distinct per n.
+Transaction poolTransaction(uint64_t n){
+	Transaction tx;
+	tx.from = digestOf(n);
+	tx.to = digestOf(n + 1);
+	tx.amount = n;
+	tx.nonce = 0;
+	tx.timestamp = 1000;
+	tx.kind = TX_TRANSFER;
+	tx.signature.fill(0);
+	return tx;
+}
+
+void testMempool(){
+	Mempool pool(64);
+	check(pool.add(poolTransaction(1),5) == MEMPOOL_OK);
+	check(pool.add(poolTransaction(1),9) == MEMPOOL_DUPLICATE);
+	check(pool.add(poolTransaction(2),7) == MEMPOOL_OK);
+	check(pool.add(poolTransaction(3),5) == MEMPOOL_OK);
+	check(pool.contains(poolTransaction(3).computeHash()));
+	check(!pool.contains(poolTransaction(4).computeHash()));
+	Transaction got;
+	check(pool.get(poolTransaction(2).computeHash(),got) && got.amount == 2);
+	// by priority, then first come first served
+	std::vector<Transaction> batch;
+	check(pool.take(2,batch) == 2);
+	check(batch[0].amount == 2 && batch[1].amount == 1);
+	check(pool.size() == 1);
+	check(pool.erase(poolTransaction(3).computeHash()));
+	check(!pool.erase(poolTransaction(3).computeHash()));
+	check(pool.size() == 0);
+	// taken transactions may come again
+	check(pool.add(poolTransaction(1),5) == MEMPOOL_OK);
+	batch.clear();
+	check(pool.take(10,batch) == 1);
+
+	// the lowest ranked go when the pool fills up, then lower ones are turned away
+	for(uint64_t i = 0;i < 64;i++)
+		check(pool.add(poolTransaction(100 + i),i) == MEMPOOL_OK);
+	check(pool.add(poolTransaction(200),100) == MEMPOOL_FULL);
+	check(!pool.erase(poolTransaction(999).computeHash()));
+	check(pool.size() == 56);
+	check(pool.evicted() == 8);
+	check(!pool.contains(poolTransaction(100).computeHash()));
+	check(pool.contains(poolTransaction(108).computeHash()));
+	check(pool.add(poolTransaction(201),3) == MEMPOOL_LOW_PRIORITY);
+	check(pool.add(poolTransaction(202),50) == MEMPOOL_OK);
+	batch.clear();
+	check(pool.take(1000,batch) == 56);
+	check(batch[0].amount == 163 && batch[1].amount == 162);
+
+	// producers racing on overlapping transactions, each one gets in once
+	const int threads = 8;
+	const uint64_t each = 10000;
+	Mempool shared(threads * each);
+	std::atomic<uint64_t> admitted(0);
+	std::vector<std::thread> producers;
+	for(int t = 0;t < threads;t++){
+		producers.emplace_back([&,t](){
+			for(uint64_t i = 0;i < each;i++){
+				uint64_t n = (t / 2) * each + i; // pairs of threads share their transactions
+				admitted += shared.add(poolTransaction(n),n % 7) == MEMPOOL_OK;
+			}
+		});
+	}
+	for(std::thread& p : producers)
+		p.join();
+	check(admitted == threads / 2 * each);
+	check(shared.size() == threads / 2 * each);
+
+	// a small pool with the consumer taking batches, evicting and compacting meanwhile
+	Mempool small(1024);
+	admitted = 0;
+	std::atomic<bool> producing(true);
+	producers.clear();
+	for(int t = 0;t < threads;t++){
+		producers.emplace_back([&,t](){
+			for(uint64_t i = 0;i < each;i++){
+				uint64_t n = t * each + i;
+				int rc;
+				while((rc = small.add(poolTransaction(n),n % 7)) == MEMPOOL_FULL)
+					std::this_thread::yield();
+				admitted += rc == MEMPOOL_OK;
+			}
+		});
+	}
+	uint64_t taken = 0;
+	std::thread consumer([&](){
+		std::vector<Transaction> out;
+		while(producing || small.size()){
+			out.clear();
+			taken += small.take(64,out);
+		}
+	});
+	for(std::thread& p : producers)
+		p.join();
+	producing = false;
+	consumer.join();
+	check(admitted > 0);
+	check(admitted == taken + small.evicted());
+}
+
+void testPeers(int io){
+	Peer peer(2,nullptr,PEER_MEMPOOL_CAPACITY,io);
+	check(peer.listen(0));
+	std::thread loop([&](){ peer.run(); });
+
+	// many concurrent peers on one loop thread
+	const int clients = 1000;
+	std::vector<int> fds;
+	for(int i = 0;i < clients;i++)
+		fds.push_back(dial(peer.server.port()));
+	for(int i = 0;i < clients;i++)
+		sendFrame(fds[i],MSG_PING,&i,sizeof i);
+	int pongs = 0;
+	for(int i = 0;i < clients;i++){
+		std::vector<uint8_t> payload;
+		int n;
+		if(readFrame(fds[i],payload) && payload.size() == 1 + sizeof n && payload[0] == MSG_PONG){
+			memcpy(&n,payload.data() + 1,sizeof n);
+			pongs += n == i;
+		}
+	}
+	check(pongs == clients);
+
+	// more blocks than the pipeline holds, the connection is paused meanwhile
+	Digest none;
+	none.fill(0);
+	const size_t count = PEER_PIPELINE_DEPTH * 3;
+	std::vector<BlockData> blocks;
+	for(size_t i = 0;i < count;i++)
+		blocks.push_back(makeBlock(i ? blocks.back().header.hash : none,1000 + i,i % 4,TX_REGISTER));
+	BlockData forged = makeBlock(blocks.back().header.hash,5000,2,TX_REGISTER);
+	forged.header.timestamp++;
+	std::thread sender([&](){
+		for(const BlockData& b : blocks){
+			std::vector<uint8_t> bytes = encodeBlock(b);
+			sendFrame(fds[0],MSG_BLOCK,bytes.data(),bytes.size());
+		}
+	});
+	std::vector<uint8_t> forgedBytes = encodeBlock(forged);
+	sendFrame(fds[1],MSG_BLOCK,forgedBytes.data(),forgedBytes.size());
+	size_t acceptedCount = 0;
+	for(size_t i = 0;i < blocks.size();i++){
+		std::vector<uint8_t> payload;
+		if(readFrame(fds[0],payload) && payload[0] == MSG_ACCEPTED)
+			acceptedCount++;
+	}
+	sender.join();
+	check(acceptedCount == count);
+	std::vector<uint8_t> verdict;
+	check(readFrame(fds[1],verdict) && verdict[0] == MSG_REJECTED);
+
+	for(int fd : fds)
+		close(fd);
+	peer.stop();
+	loop.join();
+	check(peer.chain.size() == count);
+	check(peer.backlogged() == 0);
+	check(peer.chain.validate() == CHAIN_VALID);
+	check(peer.rejected == 1);
+}
+
+// One frame queued on many connections, a reader that stops reading and
+// one that never drains. Runs the loop on this thread.
+void testBroadcast(int io){
+	EventLoop loop(nullptr,io);
+	PeerServer server(loop);
+	check(server.listen(0));
+	std::vector<uint64_t> ids;
+	std::vector<uint64_t> gone;
+	size_t messages = 0;
+	server.onConnect = [&](Connection& c){ ids.push_back(c.id()); };
+	server.onDisconnect = [&](Connection& c){ gone.push_back(c.id()); };
+	server.onMessage = [&](Connection&,const uint8_t*,size_t){ messages++; };
+	int fds[3];
+	for(int& fd : fds)
+		fd = dial(server.port());
+	for(int i = 0;i < 100 && ids.size() < 3;i++)
+		loop.runOnce(10);
+	check(ids.size() == 3);
+
+	// every connection but the excluded one gets the same bytes, the queues only hold references
+	std::vector<uint8_t> small(1000,7);
+	Frame frame = makeFrame(MSG_PING,small.data(),small.size());
+	server.broadcast(frame,ids[0]);
+	// io_uring sends go out with the next iteration
+	for(int i = 0;i < 100 && frame.use_count() > 1;i++)
+		loop.runOnce(1);
+	check(frame.use_count() == 1);
+	for(int i = 1;i < 3;i++){
+		std::vector<uint8_t> payload;
+		check(readFrame(fds[i],payload) && payload.size() == small.size() + 1 && payload[0] == MSG_PING);
+	}
+	uint8_t byte;
+	check(recv(fds[0],&byte,1,MSG_DONTWAIT) < 0 && errno == EAGAIN);
+
+	// a peer that does not read is not read from either, until its queue drained
+	Connection* c = server.find(ids[1]);
+	Frame large = makeFrame(MSG_BLOCK,std::vector<uint8_t>(1 << 20).data(),1 << 20);
+	while(!c->isCongested())
+		c->send(large);
+	check(c->pendingBytes() > SEND_HIGH_WATER);
+	sendFrame(fds[1],MSG_PING,&byte,1);
+	for(int i = 0;i < 10;i++)
+		loop.runOnce(1);
+	check(messages == 0);
+	std::vector<uint8_t> sink(READ_CHUNK);
+	for(int i = 0;i < 100000 && (c->isCongested() || messages == 0);i++){
+		recv(fds[1],sink.data(),sink.size(),MSG_DONTWAIT);
+		loop.runOnce(0);
+	}
+	check(!c->isCongested() && c->pendingBytes() <= SEND_LOW_WATER);
+	check(messages == 1);
+
+	// one that never drains is dropped, the frame is still shared and not copied 64 times
+	c = server.find(ids[2]);
+	while(server.find(ids[2]) && c->pendingBytes() <= SEND_LIMIT)
+		c->send(large);
+	check(large.use_count() > SEND_LIMIT / (1 << 20) / 2);
+	loop.runOnce(0);
+	check(!server.find(ids[2]));
+	check(gone.size() == 1 && gone[0] == ids[2]);
+	loop.runOnce(0);
+	check(server.size() == 2);
+
+	// a server destroyed while its loop still holds work it posted
+	{
+		struct Quiet : public Link{
+			void carry(Connection&,const uint8_t*,size_t) override {}
+			void closed(Connection&) override {}
+		};
+		Quiet quiet;
+		std::unique_ptr<PeerServer> gone(new PeerServer(loop));
+		gone->attach(&quiet)->close();
+		gone.reset();
+		loop.runOnce(0);
+	}
+
+	for(int fd : fds)
+		close(fd);
+}
+
+// Syncs and a block store on the ring. Falls back to epoll where the kernel
+// has no io_uring, then only the fallback is checked.
+void testUring(){
+	EventLoop loop(nullptr,LOOP_URING);
+	int fired = 0;
+	loop.post([&](){ fired++; });
+	loop.after(1,[&](){ fired++; });
+	for(int i = 0;i < 100 && fired < 2;i++)
+		loop.runOnce(10);
+	check(fired == 2);
+	if(loop.backend() != LOOP_URING){
+		std::cout << "io_uring not available, epoll fallback" << std::endl;
+		return;
+	}
+
+	char file[] = "/tmp/uringXXXXXX";
+	int fd = mkstemp(file);
+	check(fd >= 0 && write(fd,file,sizeof file) == sizeof file);
+	int results[2] = {1,1};
+	loop.fsync(fd,[&](int32_t res){ results[0] = res; });
+	loop.fsync(-1,[&](int32_t res){ results[1] = res; });
+	for(int i = 0;i < 100 && (results[0] == 1 || results[1] == 1);i++)
+		loop.runOnce(10);
+	check(results[0] == 0 && results[1] == -EBADF);
+	close(fd);
+	unlink(file);
+
+	// a forgotten operation never calls back, even when it completes
+	int pair[2];
+	check(socketpair(AF_UNIX,SOCK_STREAM,0,pair) == 0);
+	bool called = false;
+	uint64_t op = loop.receive(pair[0],[&](int32_t,uint32_t flags){
+		called = true;
+		if(flags & IORING_CQE_F_BUFFER)
+			loop.recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+	});
+	loop.runOnce(0);
+	loop.forget(op);
+	check(write(pair[1],"x",1) == 1);
+	for(int i = 0;i < 10;i++)
+		loop.runOnce(1);
+	check(!called);
+	close(pair[0]);
+	close(pair[1]);
+
+	// a node syncs its store through the ring
+	char dir[] = "/tmp/uringstoreXXXXXX";
+	check(mkdtemp(dir) != nullptr);
+	Digest none;
+	none.fill(0);
+	{
+		Peer peer(1,nullptr,PEER_MEMPOOL_CAPACITY,LOOP_URING);
+		check(peer.loop.backend() == LOOP_URING && peer.store.sync);
+		check(peer.open(dir));
+		BlockData b;
+		for(size_t i = 0;i < CHECKPOINT_INTERVAL;i++){
+			b = makeBlock(i ? b.header.hash : none,1000 + i,0,TX_REGISTER);
+			check(peer.store.append(b) == (int64_t)i);
+		}
+		check(checkpointed(dir) == 0);
+		for(int i = 0;i < 100 && checkpointed(dir) == 0;i++)
+			peer.loop.runOnce(10);
+		check(checkpointed(dir) == CHECKPOINT_INTERVAL);
+	}
+	check(system((std::string("rm -rf ") + dir).c_str()) == 0);
+}
+
+// Three full sources over simulated links, one of them slow, and one that
+// only has the start of the chain. The node must end with the same chain
+// and state and get most bodies from the fast links.
+void testSync(){
+	Digest none;
+	none.fill(0);
+	const size_t count = HEADERS_PER_MESSAGE + 1000;
+	std::vector<BlockData> blocks;
+	for(size_t i = 0;i < count;i++)
+		blocks.push_back(makeBlock(i ? blocks.back().header.hash : none,1000 + i,i % 2,TX_REGISTER));
+	const int n = 4;
+	const uint32_t latency[n] = {2,5,300,2};
+	const uint64_t bandwidth[n] = {4000000,1000000,100000,4000000};
+	std::vector<std::string> dirs;
+	std::vector<std::unique_ptr<Peer>> sources;
+	std::vector<std::thread> loops;
+	for(int i = 0;i < n;i++){
+		char dir[] = "/tmp/blocksync.XXXXXX";
+		check(mkdtemp(dir) != nullptr);
+		dirs.push_back(dir);
+		{
+			BlockStore store;
+			check(store.open(dir) == STORE_OK);
+			for(size_t b = 0;b < (i == n - 1 ? count / 4 : count);b++)
+				check(store.append(blocks[b]) >= 0);
+		}
+		sources.emplace_back(new Peer(1));
+		check(sources[i]->open(dir));
+		check(sources[i]->listen(0));
+		sources[i]->latencyMs = latency[i];
+		sources[i]->bandwidth = bandwidth[i];
+	}
+	Digest expected = sources[0]->state.hash();
+	for(int i = 0;i < n;i++)
+		loops.emplace_back([&sources,i](){ sources[i]->run(); });
+
+	Peer node(2);
+	std::thread loop([&](){ node.run(); });
+	Sync sync(node);
+	node.loop.post([&](){
+		for(int i = 0;i < n;i++)
+			sync.addSource(node.server.connect("127.0.0.1",sources[i]->server.port())->id());
+		sync.start();
+	});
+	for(int waited = 0;waited < 600 && sync.status() <= SYNC_RUNNING;waited++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	node.stop();
+	loop.join();
+	for(int i = 0;i < n;i++){
+		sources[i]->stop();
+		loops[i].join();
+	}
+
+	SyncStats s = sync.stats();
+	check(sync.status() == SYNC_DONE);
+	check(s.headers == count);
+	check(s.blocks == count);
+	check(node.chain.size() == count);
+	check(node.chain.validate() == CHAIN_VALID);
+	check(node.state.hash() == expected);
+	check(sync.delivered(0) > sync.delivered(2));
+	check(sync.delivered(3) < count / 4);
+	std::cout << "sync: " << s.blocks << " blocks in " << s.seconds << " s, " << s.blocksPerSecond << " blocks/s, " << s.megabytesPerSecond << " MB/s, " << s.reassigned << " reassigned" << std::endl;
+	sources.clear();
+	for(const std::string& dir : dirs)
+		check(system(("rm -rf " + dir).c_str()) == 0);
+}
+
+// Runs f on the peer's loop thread and waits for its result.
+template<class F> auto onLoop(Peer& peer,F f) -> decltype(f()){
+	std::promise<decltype(f())> result;
+	peer.loop.post([&](){ result.set_value(f()); });
+	return result.get_future().get();
+}
+
+template<class F> bool waitFor(F done,int seconds = 30){
+	for(int i = 0;i < seconds * 100;i++){
+		if(done())
+			return true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return false;
+}
+
+void testBloom(){
+	RollingBloom bloom(1000,GOSSIP_FILTER_HASHES);
+	for(uint64_t i = 0;i < 500;i++)
+		bloom.insert(digestOf(i));
+	for(uint64_t i = 0;i < 500;i++)
+		check(bloom.contains(digestOf(i)));
+	int falsePositives = 0;
+	for(uint64_t i = 0;i < 10000;i++)
+		falsePositives += bloom.contains(sha256(digestOf(i)));
+	check(falsePositives <= 1);
+	// the last half of the capacity is always remembered, older items roll off
+	for(uint64_t i = 500;i < 1500;i++)
+		bloom.insert(digestOf(i));
+	for(uint64_t i = 1000;i < 1500;i++)
+		check(bloom.contains(digestOf(i)));
+	check(!bloom.contains(digestOf(1)));
+	Digest d = digestOf(7);
+	check(shortId(1,2,d) == shortId(1,2,d));
+	check(shortId(1,2,d) != shortId(3,2,d));
+	check(shortId(1,2,d) >> (SHORT_ID_BYTES * 8) == 0);
+}
+
+// Transactions start at one node and a block follows as a compact block
+// that two of its transactions never were gossiped for. Every node sees
+// everything, and what one node receives does not depend on the network size.
+double gossipNetwork(int n,size_t txs){
+	std::vector<std::unique_ptr<Peer>> nodes;
+	std::vector<std::thread> loops;
+	for(int i = 0;i < n;i++){
+		nodes.emplace_back(new Peer(1));
+		check(nodes[i]->listen(0));
+		nodes[i]->gossip.relay = true;
+	}
+	for(int i = 0;i < n;i++)
+		loops.emplace_back([&nodes,i](){ nodes[i]->run(); });
+	// a ring with chords, four neighbours each
+	for(int i = 0;i < n;i++){
+		onLoop(*nodes[i],[&](){
+			nodes[i]->server.connect("127.0.0.1",nodes[(i + 1) % n]->server.port());
+			nodes[i]->server.connect("127.0.0.1",nodes[(i + 2) % n]->server.port());
+			return 0;
+		});
+	}
+	check(waitFor([&](){
+		for(auto& node : nodes)
+			if(onLoop(*node,[&](){ return node->server.size(); }) != 4)
+				return false;
+		return true;
+	}));
+	Digest none;
+	none.fill(0);
+	BlockData block;
+	block.header = Block(0,Digest(),none,1000);
+	for(size_t i = 0;i < txs + 2;i++)
+		block.txs.push_back(makeTransaction(500000 + i,0,TX_REGISTER));
+	seal(block);
+	for(size_t i = 0;i < txs;i++)
+		check(onLoop(*nodes[0],[&](){ return nodes[0]->gossip.submit(block.txs[i]); }) == MEMPOOL_OK);
+	check(waitFor([&](){
+		for(auto& node : nodes)
+			if(node->mempool.size() != txs)
+				return false;
+		return true;
+	}));
+	onLoop(*nodes[0],[&](){ return nodes[0]->pipeline.trySubmit(encodeBlock(block)); });
+	check(waitFor([&](){
+		for(auto& node : nodes)
+			if(onLoop(*node,[&](){ return node->chain.size(); }) != 1 || node->mempool.size() != 0)
+				return false;
+		return true;
+	}));
+	uint64_t bytes = 0;
+	GossipStats total = GossipStats{0,0,0,0,0,0};
+	for(int i = 0;i < n;i++){
+		nodes[i]->stop();
+		loops[i].join();
+		bytes += nodes[i]->server.bytesIn;
+		GossipStats s = nodes[i]->gossip.stats();
+		total.transactions += s.transactions;
+		total.compactBlocks += s.compactBlocks;
+		total.missing += s.missing;
+		total.fullBlocks += s.fullBlocks;
+	}
+	// everybody but the origin admitted each transaction once and rebuilt the block
+	check(total.transactions == (n - 1) * txs);
+	check(total.compactBlocks == (uint64_t)n - 1);
+	check(total.fullBlocks == 0);
+	check(total.missing >= 2);
+	return (double)bytes / n;
+}
+
+void testGossip(){
+	const size_t txs = 100;
+	double small = gossipNetwork(4,txs);
+	double large = gossipNetwork(16,txs);
+	// flooding would send every transaction over all four links of a node
+	double flood = 4.0 * txs * (WIRE_TX_SIZE + FRAME_HEADER + 1);
+	std::cout << "gossip: " << small << " bytes per node with 4 nodes, " << large << " with 16, flooding " << flood << std::endl;
+	check(large < small * 1.5);
+	check(large < flood);
+
+	// a compact block nobody asked for is only filled in if it extends a known block
+	Peer peer(1);
+	check(peer.listen(0));
+	std::thread loop([&](){ peer.run(); });
+	int fd = dial(peer.server.port());
+	Digest none;
+	none.fill(0);
+	BlockData genesis = makeBlock(none,1000,4,TX_REGISTER);
+	std::vector<uint8_t> bytes = encodeBlock(genesis);
+	std::vector<uint8_t> payload;
+	sendFrame(fd,MSG_BLOCK,bytes.data(),bytes.size());
+	check(readFrame(fd,payload) && payload[0] == MSG_ACCEPTED);
+	std::vector<uint8_t> replies;
+	for(const BlockData& b : {makeBlock(digestOf(9),2000,4,TX_REGISTER),makeBlock(genesis.header.hash,3000,4,TX_REGISTER)}){
+		Frame f = Gossip::compactFrame(b);
+		check(write(fd,f->data(),f->size()) == (ssize_t)f->size());
+		uint8_t n = 0;
+		sendFrame(fd,MSG_PING,&n,1);
+		while(readFrame(fd,payload) && payload[0] != MSG_PONG)
+			replies.push_back(payload[0]);
+	}
+	check(replies == std::vector<uint8_t>({MSG_GET_BLOCK_TXS}));
+	close(fd);
+	peer.stop();
+	loop.join();
+}
+
+// Parallel roots match sequential ones, every leaf proves and nothing else
+// does, and a peer hands out account and transaction proofs a light client
+// can check against nothing but a trusted header hash.
+Task<int> twice(FrameArena&,int v){
+	co_return v * 2;
+}
+
+Task<int> sumTwice(FrameArena& arena,int n){
+	int total = 0;
+	for(int i = 0;i < n;i++)
+		total += co_await twice(arena,i);
+	co_return total;
+}
+
+Task<void> produce(Channel<int>& ch,int n){
+	for(int i = 0;i < n;i++)
+		co_await ch.send(i);
+	ch.close();
+}
+
+Task<void> consume(Channel<int>& ch,int& total,size_t& most){
+	for(;;){
+		most = std::max(most,ch.size());
+		std::optional<int> v = co_await ch.receive();
+		if(!v)
+			break;
+		total += *v;
+	}
+}
+
+Task<void> ticks(EventLoop& loop,int& n){
+	for(int i = 0;i < 3;i++){
+		co_await delay(loop,5);
+		n++;
+	}
+}
+
+// Answers pings in order. It sleeps after the first, the rest wait in the backlog meanwhile.
+Task<void> pong(Stream& s,EventLoop& loop,int& served){
+	for(;;){
+		Stream::Message m = co_await s.read();
+		if(!m)
+			break;
+		if(m.type() == MSG_PING)
+			co_await s.write(MSG_PONG,m.payload(),m.payloadSize());
+		if(++served == 1)
+			co_await delay(loop,20);
+	}
+}
+
+void testTask(){
+	FrameArena arena;
+	{
+		Task<int> t = sumTwice(arena,1000);
+		t.start();
+		check(t.done() && t.result() == 999 * 1000);
+		// the frames of twice() came back and were reused
+		check(arena.liveFrames() == 1 && arena.chunkCount() == 1);
+	}
+	check(arena.liveFrames() == 0);
+	Task<int> again = sumTwice(arena,10);
+	again.start();
+	check(again.done() && again.result() == 90 && arena.chunkCount() == 1);
+
+	// the producer fills the channel before the consumer starts
+	Channel<int> ch(4);
+	int total = 0;
+	size_t most = 0;
+	spawn(produce(ch,100));
+	check(ch.size() == 4 && !ch.isClosed());
+	spawn(consume(ch,total,most));
+	check(total == 99 * 100 / 2 && most == 4 && ch.isClosed());
+	Channel<int> closed(1);
+	closed.close();
+	bool sent = true;
+	spawn([](Channel<int>& c,bool& ok) -> Task<void> { ok = co_await c.send(1); }(closed,sent));
+	check(!sent && closed.size() == 0);
+
+	EventLoop loop;
+	int n = 0;
+	int64_t start = EventLoop::nowMs();
+	spawn(ticks(loop,n));
+	for(int i = 0;i < 100 && n < 3;i++)
+		loop.runOnce(10);
+	check(n == 3 && EventLoop::nowMs() - start >= 15);
+
+	PeerServer server(loop);
+	check(server.listen(0));
+	std::unordered_map<uint64_t,std::unique_ptr<Stream>> streams;
+	int served = 0;
+	server.onConnect = [&](Connection& c){
+		Stream* s = new Stream(server,c.id());
+		streams.emplace(c.id(),std::unique_ptr<Stream>(s));
+		spawn(pong(*s,loop,served));
+	};
+	server.onMessage = [&](Connection& c,const uint8_t* data,size_t size){ streams[c.id()]->push(data,size); };
+	server.onDrained = [&](Connection& c){ streams[c.id()]->drained(); };
+	server.onDisconnect = [&](Connection& c){ streams[c.id()]->closed(); };
+	int fd = dial(server.port());
+	for(int i = 0;i < 10;i++)
+		sendFrame(fd,MSG_PING,&i,sizeof i);
+	for(int i = 0;i < 200 && served < 10;i++)
+		loop.runOnce(5);
+	check(served == 10);
+	bool ordered = true;
+	for(int i = 0;i < 10;i++){
+		std::vector<uint8_t> payload;
+		int v = -1;
+		ordered &= readFrame(fd,payload) && payload[0] == MSG_PONG && payload.size() == 1 + sizeof v;
+		if(ordered)
+			memcpy(&v,payload.data() + 1,sizeof v);
+		ordered &= v == i;
+	}
+	check(ordered);
+	check(streams.size() == 1);
+	FrameArena& frames = streams.begin()->second->frameArena();
+	check(frames.liveFrames() == 1 && frames.chunkCount() == 1);
+	close(fd);
+	for(int i = 0;i < 100 && frames.liveFrames();i++)
+		loop.runOnce(5);
+	check(frames.liveFrames() == 0 && !streams.begin()->second->isOpen());
+}
+
+Task<void> lightRequests(LightClient& light,Stream& s,const Digest& key,const Digest& nobody,const Digest& block,Account& a,Transaction& tx,int* rc){
+	rc[0] = co_await light.account(s,key,a);
+	rc[1] = co_await light.account(s,nobody,a);
+	rc[2] = co_await light.transaction(s,block,7,tx);
+	rc[3] = co_await light.transaction(s,block,10,tx);
+}
+
+void testMerkle(){
+	std::vector<Digest> leaves;
+	for(uint64_t i = 0;i < 5000;i++)
+		leaves.push_back(merkleLeaf(digestOf(i)));
+	check(merkleRoot(leaves.data(),1) == leaves[0]);
+	check(merkleRoot(leaves.data(),2) == merkleNode(leaves[0],leaves[1]));
+	check(merkleRoot(leaves.data(),3) == merkleNode(merkleNode(leaves[0],leaves[1]),leaves[2]));
+	for(size_t n : {255,256,257,1000,4097,5000})
+		check(merkleRoot(leaves.data(),n,4) == merkleRoot(leaves.data(),n));
+	check(merkleRoot(leaves.data(),4) != merkleRoot(leaves.data(),5));
+	bool all = true;
+	for(size_t n = 1;n <= 40;n++){
+		Digest root = merkleRoot(leaves.data(),n);
+		for(size_t i = 0;i < n;i++){
+			MerkleProof proof = merkleProve(leaves.data(),n,i);
+			all &= merkleVerify(root,leaves[i],proof);
+			all &= !merkleVerify(root,leaves[(i + 1) % n],proof) || n == 1;
+			if((i ^ 1) < n){
+				proof.index = i ^ 1;
+				all &= !merkleVerify(root,leaves[i],proof);
+			}
+		}
+	}
+	check(all);
+	MerkleProof proof = merkleProve(leaves.data(),leaves.size(),1234);
+	check(proof.path.size() == 13);
+	proof.path.push_back(leaves[0]);
+	check(!merkleVerify(merkleRoot(leaves.data(),leaves.size()),leaves[1234],proof));
+	// a kept tree gives the same root and paths, built on one core or four
+	MerkleTree tree;
+	for(size_t n : {0,1,2,3,40,257,5000}){
+		tree.build(std::vector<Digest>(leaves.begin(),leaves.begin() + n),n > 1000 ? 4 : 1);
+		all &= tree.size() == n && tree.root() == merkleRoot(leaves.data(),n);
+		for(size_t i : {(size_t)0,n / 3,n - 1})
+			all &= i >= n || tree.prove(i).path == merkleProve(leaves.data(),n,i).path;
+	}
+	check(all);
+
+	char dir[] = "/tmp/merkleXXXXXX";
+	check(mkdtemp(dir) != nullptr);
+	Digest none;
+	none.fill(0);
+	State producer;
+	BlockData first = makeBlock(none,1000,10,TX_REGISTER);
+	check(producer.apply(first) == STATE_OK);
+	BlockData second;
+	second.header = Block(0,Digest(),first.header.hash,1001);
+	Digest to = account(1000 * 16 + 1).publicKey;
+	second.txs.push_back(makeTransaction(1000 * 16,1,TX_TRANSFER,1,&to));
+	check(producer.apply(second) == STATE_OK);
+	second.header.state = producer.hash();
+	seal(second);
+	{
+		State replica;
+		Account a;
+		MerkleProof path;
+		check(replica.apply(first) == STATE_OK && !replica.prove(second.header.state,to,a,path));
+		check(replica.apply(second) == STATE_OK && replica.prove(second.header.state,to,a,path));
+		check(a.balance == REGISTER_REWARD + 1 && merkleVerify(second.header.state,accountLeaf(to,a),path));
+		check(!replica.prove(digestOf(1),to,a,path));
+		// a block with a wrong commitment leaves the kept tree alone
+		BlockData wrong;
+		wrong.header.state = digestOf(2);
+		check(replica.apply(wrong) == STATE_BAD_COMMITMENT && replica.prove(second.header.state,to,a,path));
+	}
+	{
+		BlockStore store;
+		check(store.open(dir) == STORE_OK);
+		check(store.append(first) >= 0 && store.append(second) >= 0);
+	}
+	Peer peer(1);
+	check(peer.open(dir));
+	check(peer.listen(0));
+	std::thread loop([&](){ peer.run(); });
+	Digest trusted = second.header.hash;
+
+	int fd = dial(peer.server.port());
+	sendFrame(fd,MSG_GET_ACCOUNT_PROOF,to.data(),to.size());
+	std::vector<uint8_t> payload;
+	check(readFrame(fd,payload) && payload[0] == MSG_PROOF);
+	std::cout << "account proof: " << payload.size() - 1 << " bytes" << std::endl;
+	AccountProof ap;
+	check(decodeProof(payload.data() + 1,payload.size() - 1,ap));
+	check(verifyProof(ap,trusted) == PROOF_OK && ap.key == to && ap.account.balance == REGISTER_REWARD + 1);
+	check(verifyProof(ap,first.header.hash) == PROOF_BAD_HEADER);
+	check(!decodeProof(payload.data() + 1,payload.size() - 2,ap));
+	// verify.hpp, which the phones use, comes to the same on the encoded proofs
+	ProvenAccount pa;
+	check(checkAccountProof(payload.data() + 1,payload.size() - 1,trusted,pa) == PROOF_OK);
+	check(pa.key == to && pa.balance == REGISTER_REWARD + 1 && pa.referrer == ap.account.referrer && pa.nonce == ap.account.nonce);
+	check(checkAccountProof(payload.data() + 1,payload.size() - 1,first.header.hash,pa) == PROOF_BAD_HEADER);
+	check(checkAccountProof(payload.data() + 1,payload.size() - 2,trusted,pa) == PROOF_BAD_ENCODING);
+	ap.account.balance++;
+	check(verifyProof(ap,trusted) == PROOF_BAD_PATH);
+	std::vector<uint8_t> bytes = encodeProof(ap);
+	check(checkAccountProof(bytes.data(),bytes.size(),trusted,pa) == PROOF_BAD_PATH);
+	ap.account.balance--;
+	ap.header.state = none;
+	ap.header.hash = ap.header.computeHash();
+	check(verifyProof(ap,ap.header.hash) == PROOF_NO_COMMITMENT);
+	bytes = encodeProof(ap);
+	check(checkAccountProof(bytes.data(),bytes.size(),ap.header.hash,pa) == PROOF_NO_COMMITMENT);
+	Digest nobody = digestOf(77);
+	sendFrame(fd,MSG_GET_ACCOUNT_PROOF,nobody.data(),nobody.size());
+	check(readFrame(fd,payload) && payload[0] == MSG_NOT_FOUND);
+
+	uint8_t request[36];
+	uint32_t index = 7;
+	memcpy(request,first.header.hash.data(),32);
+	memcpy(request + 32,&index,sizeof index);
+	sendFrame(fd,MSG_GET_TX_PROOF,request,sizeof request);
+	check(readFrame(fd,payload) && payload[0] == MSG_PROOF);
+	TransactionProof tp;
+	check(decodeProof(payload.data() + 1,payload.size() - 1,tp));
+	check(!decodeProof(payload.data() + 1,payload.size() - 1,ap));
+	check(verifyProof(tp,first.header.hash) == PROOF_OK);
+	check(tp.tx.computeHash() == first.txs[7].computeHash() && tp.path.index == 7);
+	ProvenTransaction pt;
+	check(checkTransactionProof(payload.data() + 1,payload.size() - 1,first.header.hash,pt) == PROOF_OK);
+	check(pt.from == tp.tx.from && pt.to == tp.tx.to && pt.amount == tp.tx.amount && pt.kind == tp.tx.kind && pt.index == 7);
+	check(checkAccountProof(payload.data() + 1,payload.size() - 1,first.header.hash,pa) == PROOF_BAD_ENCODING);
+	tp.path.index = 6;
+	check(verifyProof(tp,first.header.hash) == PROOF_BAD_PATH);
+	bytes = encodeProof(tp);
+	check(checkTransactionProof(bytes.data(),bytes.size(),first.header.hash,pt) == PROOF_BAD_PATH);
+	tp.path.index = 7;
+	tp.tx.amount++;
+	check(verifyProof(tp,first.header.hash) == PROOF_BAD_PATH);
+	bytes = encodeProof(tp);
+	check(checkTransactionProof(bytes.data(),bytes.size(),first.header.hash,pt) == PROOF_BAD_PATH);
+	index = 10;
+	memcpy(request + 32,&index,sizeof index);
+	sendFrame(fd,MSG_GET_TX_PROOF,request,sizeof request);
+	check(readFrame(fd,payload) && payload[0] == MSG_NOT_FOUND);
+
+	// the same through the light client, which fetches the headers on its own
+	{
+		EventLoop clientLoop;
+		LightClient light(clientLoop);
+		Stream* s = light.connect("127.0.0.1",peer.server.port());
+		check(s != nullptr);
+		Account a;
+		Transaction tx;
+		int rc[4] = {1,1,1,1};
+		Task<void> t = lightRequests(light,*s,to,nobody,first.header.hash,a,tx,rc);
+		t.start();
+		for(int i = 0;i < 500 && !t.done();i++)
+			clientLoop.runOnce(10);
+		check(t.done());
+		check(rc[0] == LIGHT_OK && a.balance == REGISTER_REWARD + 1);
+		check(rc[1] == LIGHT_NOT_FOUND);
+		check(rc[2] == LIGHT_OK && tx.computeHash() == first.txs[7].computeHash());
+		check(rc[3] == LIGHT_NOT_FOUND);
+		check(light.headers.size() == 2 && light.headers.tip().hash == trusted);
+	}
+
+	close(fd);
+	peer.stop();
+	loop.join();
+	check(system((std::string("rm -rf ") + dir).c_str()) == 0);
+}
+
+// Transactions from random nodes, then a block with all of them, over a
+// random graph of simulated links.
+SimStats simulate(uint64_t seed,size_t n,double loss){
+	Simulator sim(seed);
+	sim.addNodes(n);
+	sim.connectRandom(4,SimLinkConfig{20,1000000,loss},30);
+	const size_t txs = 50;
+	BlockData block;
+	Digest none;
+	none.fill(0);
+	block.header = Block(0,Digest(),none,1000);
+	for(size_t i = 0;i < txs;i++){
+		block.txs.push_back(makeTransaction(700000 + i,0,TX_REGISTER));
+		check(sim.track(i * 7 % n,block.txs.back()) == MEMPOOL_OK);
+		sim.run(10);
+	}
+	sim.runUntilIdle(60000);
+	seal(block);
+	check(sim.mine(0,block));
+	sim.runUntilIdle(60000);
+	for(size_t i = 0;i < n;i++)
+		check(sim.node(i).chain.size() == 1 && sim.node(i).mempool.size() == 0);
+	return sim.stats();
+}
+
+void testSim(){
+	SimStats a = simulate(1,60,0);
+	SimStats b = simulate(1,60,0);
+	SimStats c = simulate(2,60,0);
+	std::cout << "sim: 60 nodes, " << a.items << " items, p50 " << a.p50Ms << " ms, p99 " << a.p99Ms << " ms, " << a.bytesPerNode << " bytes per node, " << a.events << " events in " << a.wallSeconds << " s" << std::endl;
+	check(a.items == 51 && a.coverage == 1.0);
+	// every item needs at least one hop of at least 20 ms
+	check(a.p50Ms >= 20 && a.p99Ms < 1000);
+	check(a.events == b.events && a.bytes == b.bytes && a.p50Ms == b.p50Ms && a.maxMs == b.maxMs);
+	check(a.bytes != c.bytes || a.maxMs != c.maxMs);
+	SimStats lossy = simulate(1,60,0.05);
+	std::cout << "sim: 5% loss, p50 " << lossy.p50Ms << " ms, p99 " << lossy.p99Ms << " ms, " << lossy.lost << " segments resent" << std::endl;
+	check(lossy.coverage == 1.0 && lossy.lost > 0 && lossy.p99Ms > a.p99Ms);
+
+	// a forged transaction stops at the first neighbours that check it
+	Simulator sim(3);
+	sim.checkSignatures = true;
+	sim.addNodes(10);
+	sim.connectRandom(3,SimLinkConfig{10,0,0});
+	Transaction forged = makeTransaction(800000,0,TX_REGISTER);
+	forged.amount = 1;
+	check(sim.track(0,forged) == MEMPOOL_OK);
+	sim.runUntilIdle(10000);
+	check(sim.stats().coverage == 0.1);
+}
 
 int main(){
-	// Init
-	char str[] = "Do not do it";
-	char dstr[33];
-	int ssize = sizeof str;
-	
-	char prevhash[] = "Man";
-	char prevhashd[33];
-	int phsize = sizeof(prevhash);
-	
-	// Load Current Transaction Hash
-	hash(str,ssize,dstr);
-	// Load Previous Hash (Testing)
-	hash(prevhash,phsize,prevhashd);
-		
-	Block* bl = new Block(sizeof dstr,dstr,prevhashd,std::time(0));
-
-	bl->getDetails();
-		
-	
+	signal(SIGPIPE,SIG_IGN);
+	testChain();
+	testHash();
+	testSign();
+	testWire();
+	testPipeline();
+	testStore();
+	testState();
+	testAccounts();
+	testReferrals();
+	testForks();
+	testMempool();
+	testPeers(LOOP_EPOLL);
+	testPeers(LOOP_URING);
+	testBroadcast(LOOP_EPOLL);
+	testBroadcast(LOOP_URING);
+	testUring();
+	testSync();
+	testBloom();
+	testGossip();
+	testTask();
+	testMerkle();
+	testSim();
+
+	if(failures){
+		std::cout << failures << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << "All tests passed" << std::endl;
 	return 0;
 }
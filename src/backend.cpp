@@ -39,6 +39,10 @@
 #include <QQmlComponent>
 #include <QQmlEngine>
 #include "plugin.h"
+#include "logger.h"
+#include "metrics.h"
+#include "trace.h"
+#include "lightclient.h"
 
 #include "../../private/shift.keys"
 
@@ -54,6 +58,20 @@ BackEnd::BackEnd(QObject *parent) :
     m_crypto.setKey(SHIFT_ENCRYPT_KEY);
     m_crypto.setCompressionMode(SimpleCrypt::CompressionAlways);
     m_crypto.setIntegrityProtectionMode(SimpleCrypt::ProtectionHash);
+    m_baseUrl = qEnvironmentVariable("SHIFT_BASE_URL", DEFAULT_BASE_URL);
+    m_lastErrorTimer.setSingleShot(true);
+    m_lastErrorTimer.setInterval(LAST_ERROR_INTERVAL);
+    connect(&m_lastErrorTimer, SIGNAL(timeout()), this, SIGNAL(lastErrorChanged()));
+}
+
+void BackEnd::setBaseUrl(const QString &baseUrl)
+{
+    m_baseUrl = baseUrl;
+}
+
+QString BackEnd::getBaseUrl()
+{
+    return m_baseUrl;
 }
 
 BookingModel *BackEnd::getBookingModel()
@@ -93,6 +111,8 @@ void BackEnd::createAccount(QString name, QString ruuid, QString country, QStrin
     m_language = language;
     m_balance = 0;
     m_scooping = 0;
+    if (!m_signer.generate())
+        setLastError("Could not create the account keys");
     registerAccount();
 }
 
@@ -103,6 +123,7 @@ bool BackEnd::getWritepermission()
 
 bool BackEnd::checkPermission()
 {
+    TRACE_SPAN("checkPermission");
     m_writepermission = false;
     QString msg_text = "Welcome, please set the permission to write to external storage in the settings of your mobile phone and restart the app.<br><br>You will find it under: Settings -> Apps -> Apps -> Shift -> Permission -> Memory";
             
@@ -145,7 +166,8 @@ QString BackEnd::getVersion()
 void BackEnd::setScooping()
 {
     QNetworkRequest request;
-    request.setUrl(QUrl("http://artanidosatcrowdwareat.pythonanywhere.com/setscooping"));
+    request.setUrl(QUrl(m_baseUrl + "/setscooping"));
+    request.setAttribute(QNetworkRequest::User, Metrics::now());
     request.setRawHeader("User-Agent", "Shift 1.0");
     request.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
     QJsonObject obj;
@@ -165,6 +187,8 @@ void BackEnd::setScooping()
 
 void BackEnd::onSetScoopingReply(QNetworkReply* reply)
 {
+    TRACE_SPAN("onSetScoopingReply");
+    recordReply("setscooping", reply);
     if(reply->error() == QNetworkReply::NoError)
     {
     	int httpstatuscode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toUInt();
@@ -182,6 +206,7 @@ void BackEnd::onSetScoopingReply(QNetworkReply* reply)
                         return;
                     }
                     m_check = "setScooping: ok";
+                    emit scoopingConfirmed();
     		    }
                 else
                 {
@@ -207,7 +232,8 @@ void BackEnd::registerAccount()
     emit registerErrorChanged();
 
     QNetworkRequest request;
-    request.setUrl(QUrl("http://artanidosatcrowdwareat.pythonanywhere.com/register"));
+    request.setUrl(QUrl(m_baseUrl + "/register"));
+    request.setAttribute(QNetworkRequest::User, Metrics::now());
     request.setRawHeader("User-Agent", "Shift 1.0");
     request.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
     QJsonObject obj;
@@ -231,6 +257,8 @@ void BackEnd::registerAccount()
 
 void BackEnd::onRegisterReply(QNetworkReply* reply)
 {
+    TRACE_SPAN("onRegisterReply");
+    recordReply("register", reply);
     if(reply->error() == QNetworkReply::NoError)
     {
     	int httpstatuscode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toUInt();
@@ -253,7 +281,9 @@ void BackEnd::onRegisterReply(QNetworkReply* reply)
                     emit registerErrorChanged();
 
                     m_balance = 1;
-                    m_bookingModel.append(new Booking("Initial booking", 1, QDate::currentDate()));
+                    Booking *initial = new Booking("Initial booking", 1, QDate::currentDate());
+                    signBooking(initial);
+                    m_bookingModel.append(initial);
                     saveChain();
                     emit uuidChanged();
                     m_message = "Welcome, " + m_name + " please tap on the logo.";
@@ -289,7 +319,8 @@ void BackEnd::loadMessage()
     if (m_name == "")
         return;
     QNetworkRequest request;
-    request.setUrl(QUrl("http://artanidosatcrowdwareat.pythonanywhere.com/message"));
+    request.setUrl(QUrl(m_baseUrl + "/message"));
+    request.setAttribute(QNetworkRequest::User, Metrics::now());
     request.setRawHeader("User-Agent", "Shift 1.0");
     request.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
     QJsonObject obj;
@@ -309,6 +340,8 @@ void BackEnd::loadMessage()
 
 void BackEnd::onNetworkReply(QNetworkReply* reply)
 {
+    TRACE_SPAN("onNetworkReply");
+    recordReply("message", reply);
     if(reply->error() == QNetworkReply::NoError)
     {
     	int httpstatuscode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toUInt();
@@ -354,7 +387,8 @@ void BackEnd::loadMatelist()
     if (m_uuid == "")
         return;
     QNetworkRequest request;
-    request.setUrl(QUrl("http://artanidosatcrowdwareat.pythonanywhere.com/matelist"));
+    request.setUrl(QUrl(m_baseUrl + "/matelist"));
+    request.setAttribute(QNetworkRequest::User, Metrics::now());
     request.setRawHeader("User-Agent", "Shift 1.0");
     request.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
     QJsonObject obj;
@@ -374,6 +408,8 @@ void BackEnd::loadMatelist()
 
 void BackEnd::onMatelistReply(QNetworkReply* reply)
 {
+    TRACE_SPAN("onMatelistReply");
+    recordReply("matelist", reply);
     if(reply->error() == QNetworkReply::NoError)
     {
     	int httpstatuscode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toUInt();
@@ -401,6 +437,7 @@ void BackEnd::onMatelistReply(QNetworkReply* reply)
                         QJsonObject obj = value.toObject();
                         m_mateModel.append(new Mate(obj["name"].toString(), obj["uuid"].toString(), obj["scooping"].toBool()));
     		        }
+                    emit matesChanged();
                 }    
                 else
                 {
@@ -420,6 +457,14 @@ void BackEnd::onMatelistReply(QNetworkReply* reply)
     reply->deleteLater();
 }
 
+void BackEnd::recordReply(const QString &endpoint, QNetworkReply *reply)
+{
+    quint64 start = reply->request().attribute(QNetworkRequest::User).toULongLong();
+    Metrics::instance().histogram("net." + endpoint).record(Metrics::now() - start);
+    if (reply->error() != QNetworkReply::NoError)
+        Metrics::instance().counter("net." + endpoint + ".errors").add();
+}
+
 QString BackEnd::lastError()
 {
     return m_lastError;
@@ -432,11 +477,26 @@ QString BackEnd::getMessage()
 
 void BackEnd::setLastError(const QString &lastError)
 {
-    if (m_lastError.length() < 200)
-    {
-        m_lastError += lastError + "\n";
-        emit lastErrorChanged();
-    }
+    // already shown, only write it to the log file
+    Logger::instance().log(QtWarningMsg, lastError, false);
+    appendLastError(lastError);
+}
+
+// pulls the warnings other threads have logged since the last call
+void BackEnd::showLogErrors()
+{
+    foreach (const QString &error, Logger::instance().takeRecentErrors())
+        appendLastError(error);
+}
+
+void BackEnd::appendLastError(const QString &lastError)
+{
+    // keep the newest errors, the ui is only updated every LAST_ERROR_INTERVAL msecs
+    m_lastError += lastError + "\n";
+    if (m_lastError.length() > LAST_ERROR_LENGTH)
+        m_lastError = m_lastError.right(LAST_ERROR_LENGTH);
+    if (!m_lastErrorTimer.isActive())
+        m_lastErrorTimer.start();
 }
 
 int BackEnd::getBalance()
@@ -466,9 +526,14 @@ int BackEnd::mintedBalance(qint64 time)
                 Booking *prev = m_bookingModel.get(m_bookingModel.count() - 2);
                 prev->setAmount(prev->amount() + last->amount());
                 prev->setDescription("Subtotal");
+                signBooking(prev);
                 m_bookingModel.remove(m_bookingModel.count() - 1);
             }
-            m_bookingModel.insert(0, new Booking("Liquid scooped", grow, QDate::currentDate()));
+            Booking *scooped = new Booking("Liquid scooped", grow, QDate::currentDate());
+            signBooking(scooped);
+            m_bookingModel.insert(0, scooped);
+            Metrics::instance().counter("mint.cycles").add();
+            Metrics::instance().gauge("mint.balance").set(m_balance);
             saveChain();
             emit scoopingChanged();
             emit balanceChanged();
@@ -487,6 +552,74 @@ QString BackEnd::getUuid()
     return m_uuid;
 }
 
+QString BackEnd::getPublicKey()
+{
+    return m_signer.publicKey().toHex();
+}
+
+void BackEnd::signBooking(Booking *booking)
+{
+    booking->setSignature(m_signer.sign(booking->record(m_signer.publicKey())));
+}
+
+// Checks the signatures of all bookings in parallel, returns the number of bad ones.
+int BackEnd::verifyBookings()
+{
+    TRACE_SPAN("verifyBookings");
+    MetricTimer timer(Metrics::instance().histogram("bookings.verify"));
+    QVector<SignedRecord> records;
+    records.reserve(m_bookingModel.count());
+    for (int i = 0; i < m_bookingModel.count(); i++)
+    {
+        Booking *booking = m_bookingModel.get(i);
+        records.append({m_signer.publicKey(), booking->record(m_signer.publicKey()), booking->signature()});
+    }
+    QVector<int> bad = Signer::verifyMany(records);
+    if (!bad.isEmpty())
+    {
+        Metrics::instance().counter("bookings.bad_signature").add(bad.size());
+        setLastError(QString::number(bad.size()) + " bookings with a bad signature");
+    }
+    return bad.size();
+}
+
+// Checks the balance in shift.db against a proof from a full peer for a
+// block header the app trusts, returns LIGHT_OK or the LIGHT_ error.
+int BackEnd::verifyBalance(QByteArray proof, QByteArray headerHash)
+{
+    TRACE_SPAN("verifyBalance");
+    MetricTimer timer(Metrics::instance().histogram("proofs.verify"));
+    LightAccount account;
+    int rc = LightClient::verifyAccount(proof, headerHash, &account);
+    if (rc == LIGHT_OK && account.key != m_signer.publicKey())
+        rc = LIGHT_OTHER_ACCOUNT;
+    else if (rc == LIGHT_OK && account.balance != m_balance)
+        rc = LIGHT_BALANCE_MISMATCH;
+    if (rc != LIGHT_OK)
+    {
+        Metrics::instance().counter("proofs.bad").add();
+        setLastError("balance proof failed: " + QString::number(rc));
+    }
+    return rc;
+}
+
+// Same for one transaction of the account, it has to be sent or received by us.
+int BackEnd::verifyBooking(QByteArray proof, QByteArray headerHash)
+{
+    TRACE_SPAN("verifyBooking");
+    MetricTimer timer(Metrics::instance().histogram("proofs.verify"));
+    LightTransaction transaction;
+    int rc = LightClient::verifyTransaction(proof, headerHash, &transaction);
+    if (rc == LIGHT_OK && transaction.from != m_signer.publicKey() && transaction.to != m_signer.publicKey())
+        rc = LIGHT_OTHER_ACCOUNT;
+    if (rc != LIGHT_OK)
+    {
+        Metrics::instance().counter("proofs.bad").add();
+        setLastError("booking proof failed: " + QString::number(rc));
+    }
+    return rc;
+}
+
 void BackEnd::start()
 {
     m_scooping = QDateTime::currentSecsSinceEpoch();
@@ -496,6 +629,11 @@ void BackEnd::start()
 
 int BackEnd::saveChain()
 {
+    TRACE_SPAN("saveChain");
+    static MetricHistogram &saveTime = Metrics::instance().histogram("chain.save");
+    static MetricCounter &saveFailed = Metrics::instance().counter("chain.save.failed");
+    MetricTimer timer(saveTime);
+
     QBuffer buffer;
     buffer.open(QIODevice::WriteOnly);
     QDataStream out(&buffer);
@@ -512,17 +650,20 @@ int BackEnd::saveChain()
         if (file.error() != QFile::NoError) 
         {
             setLastError(file.errorString() + ":" + path);
+            saveFailed.add();
             return FILE_COULD_NOT_OPEN;
         }
     }
     out << (quint16)0x3113; // magic number
-    out << (quint16)100;    // version
+    out << (quint16)CHAIN_VERSION;
     out << m_scooping;
     out << m_uuid;
     out << m_ruuid;
     out << m_name;
     out << m_country;
     out << m_language;
+    out << m_signer.publicKey();
+    out << m_signer.secretKey();
 
     out << m_bookingModel.count();
     for(int i = 0; i < m_bookingModel.count(); i++)
@@ -531,6 +672,7 @@ int BackEnd::saveChain()
         out << booking->amount();
         out << booking->date();
         out << booking->description();
+        out << booking->signature();
     }
 
     QByteArray cypherText = m_crypto.encryptToByteArray(buffer.data());
@@ -542,6 +684,7 @@ int BackEnd::saveChain()
     {
         buffer.close();
         file.close();
+        saveFailed.add();
         return CRYPTO_ERROR;
     }
     
@@ -552,6 +695,12 @@ int BackEnd::saveChain()
 
 int BackEnd::loadChain()
 {
+    TRACE_SPAN("loadChain");
+    static MetricHistogram &loadTime = Metrics::instance().histogram("chain.load");
+    static MetricCounter &loadFailed = Metrics::instance().counter("chain.load.failed");
+    static MetricGauge &bookings = Metrics::instance().gauge("chain.bookings");
+    MetricTimer timer(loadTime);
+
     quint16 magic;
     quint16 version;
     int count;
@@ -569,6 +718,7 @@ int BackEnd::loadChain()
         if (file.error() != QFile::NoError) 
         {
             setLastError(file.errorString());
+            loadFailed.add();
             return FILE_COULD_NOT_OPEN;
         }
     }
@@ -585,13 +735,16 @@ int BackEnd::loadChain()
         if (magic != 0x3113)
         {
             file.close();
+            loadFailed.add();
             return BAD_FILE_FORMAT;
         }
         // check the version
         in >> version;
-        if (version < 100)
+        if (version != 100 && version != CHAIN_VERSION)
         {
+            buffer.close();
             file.close();
+            loadFailed.add();
             return UNSUPPORTED_VERSION;
         }
         in >> m_scooping;
@@ -600,6 +753,25 @@ int BackEnd::loadChain()
         in >> m_name;
         in >> m_country;
         in >> m_language;
+        // a 100 chain has no keys and unsigned bookings, it gets a key pair,
+        // its bookings are signed once and it is saved as CHAIN_VERSION right away
+        bool migrate = version == 100;
+        if (migrate)
+            m_signer.generate();
+        else
+        {
+            QByteArray publicKey;
+            QByteArray secretKey;
+            in >> publicKey;
+            in >> secretKey;
+            if (!m_signer.setKeys(publicKey, secretKey))
+            {
+                buffer.close();
+                file.close();
+                loadFailed.add();
+                return BAD_FILE_FORMAT;
+            }
+        }
         in >> count;
         m_bookingModel.clear();
         m_balance = 0;
@@ -608,19 +780,38 @@ int BackEnd::loadChain()
             quint64 amount;
             QDate date;
             QString description;
+            QByteArray signature;
             in >> amount;
             in >> date;
             in >> description;
-            m_bookingModel.append(new Booking(description, amount, date));
+            if (!migrate)
+                in >> signature;
+            Booking *booking = new Booking(description, amount, date);
+            if (migrate)
+                signBooking(booking);
+            else
+                booking->setSignature(signature);
+            m_bookingModel.append(booking);
             m_balance += amount;
         }
+        bookings.set(count);
         m_message = "Welcome, back " + m_name;
         emit messageChanged();
         buffer.close();
         emit balanceChanged();
+        if (migrate)
+        {
+            // the new key pair must not get lost
+            int rc = saveChain();
+            if (rc != CHAIN_SAVED)
+                return rc;
+        }
     }
     else
+    {
+        loadFailed.add();
         return CRYPTO_ERROR;
+    }
 
     return CHAIN_LOADED;
 }
@@ -633,6 +824,9 @@ void BackEnd::loadMenu()
 
 void BackEnd::loadPlugins()
 {
+    TRACE_SPAN("loadPlugins");
+    MetricTimer timer(Metrics::instance().histogram("plugins.load"));
+    int plugins = 0;
     QString path = QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/crowdware";
     QDir dir(path + "/shift/plugins");
     dir.setFilter(QDir::Dirs | QDir::NoDotAndDotDot);
@@ -652,15 +846,18 @@ void BackEnd::loadPlugins()
                 QObject *obj = component.create();
                 Plugin *plugin = qobject_cast<Plugin *>(obj);
                 m_menuModel.append(new Menu(plugin->title(), plugin->source()));
+                plugins++;
             }
         }
     }
+    Metrics::instance().gauge("plugins.count").set(plugins);
 }
 
 void BackEnd::HttpGet(QString url)
 {
     QNetworkRequest request;
     request.setUrl(QUrl(url));
+    request.setAttribute(QNetworkRequest::User, Metrics::now());
     request.setRawHeader("User-Agent", "Shift 1.0");
     request.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
     QNetworkAccessManager* networkManager = new QNetworkAccessManager(this);
@@ -670,6 +867,8 @@ void BackEnd::HttpGet(QString url)
 
 void BackEnd::onGetReply(QNetworkReply* reply)
 {
+    TRACE_SPAN("onGetReply");
+    recordReply("get", reply);
     if(reply->error() == QNetworkReply::NoError)
     {
     	int httpstatuscode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toUInt();
@@ -706,6 +905,27 @@ QString BackEnd::getResult()
     return m_result;
 }
 
+QVariantMap BackEnd::getMetrics()
+{
+    return Metrics::instance().toVariantMap();
+}
+
+void BackEnd::updateMetrics()
+{
+    emit metricsChanged();
+}
+
+int BackEnd::dumpMetrics()
+{
+    QString path = QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/crowdware/metrics.json";
+    if (!Metrics::instance().dump(path))
+    {
+        setLastError("Could not write " + path);
+        return FILE_COULD_NOT_OPEN;
+    }
+    return METRICS_DUMPED;
+}
+
 // used for unit tests only
 #ifdef TEST
 void BackEnd::setScooping_test(qint64 time)
@@ -725,6 +945,9 @@ qint64 BackEnd::getScooping_test()
 
 void BackEnd::addBooking_test(Booking *booking)
 {
+    if (!m_signer.hasKeys())
+        m_signer.generate();
+    signBooking(booking);
     m_balance += booking->amount();
     m_bookingModel.insert(0, booking);
 }
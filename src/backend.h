@@ -29,10 +29,13 @@
 #include <QNetworkReply>
 #include <QAbstractListModel>
 #include <QColor>
+#include <QTimer>
+#include <QVariantMap>
 #include "simplecrypt.h"
 #include "bookingmodel.h"
 #include "matemodel.h"
 #include "menumodel.h" 
+#include "signer.h"
 
 #define BAD_FILE_FORMAT -1
 #define UNSUPPORTED_VERSION -2
@@ -42,6 +45,13 @@
 #define FILE_NOT_EXISTS -6
 #define CHAIN_LOADED 0
 #define CHAIN_SAVED 0
+#define METRICS_DUMPED 0
+#define CHAIN_VERSION 101 // 101 added the key pair and a signature over the public key and each booking
+
+#define LAST_ERROR_LENGTH 200   // characters of lastError kept for the ui
+#define LAST_ERROR_INTERVAL 500 // minimum msecs between two lastErrorChanged signals
+
+#define DEFAULT_BASE_URL "http://artanidosatcrowdwareat.pythonanywhere.com"
 
 
 class BackEnd : public QObject
@@ -52,6 +62,7 @@ class BackEnd : public QObject
     Q_PROPERTY(qint64 scooping READ getScooping NOTIFY scoopingChanged)
     Q_PROPERTY(QString message READ getMessage NOTIFY messageChanged)
     Q_PROPERTY(QString uuid READ getUuid NOTIFY uuidChanged)
+    Q_PROPERTY(QString publicKey READ getPublicKey NOTIFY uuidChanged)
     Q_PROPERTY(BookingModel *bookingModel READ getBookingModel CONSTANT)
     Q_PROPERTY(MateModel *mateModel READ getMateModel CONSTANT)
     Q_PROPERTY(MenuModel *menuModel READ getMenuModel CONSTANT)
@@ -59,6 +70,7 @@ class BackEnd : public QObject
     Q_PROPERTY(QString version READ getVersion CONSTANT)
     Q_PROPERTY(bool writepermission READ getWritepermission CONSTANT)
     Q_PROPERTY(QString result READ getResult NOTIFY resultChanged)
+    Q_PROPERTY(QVariantMap metrics READ getMetrics NOTIFY metricsChanged)
     
 public:
     explicit BackEnd(QObject *parent = nullptr);
@@ -66,19 +78,28 @@ public:
     Q_INVOKABLE void start();
     Q_INVOKABLE void createAccount(QString name, QString ruuid, QString country, QString language);
     Q_INVOKABLE void HttpGet(QString url);
+    Q_INVOKABLE void updateMetrics();
+    Q_INVOKABLE int dumpMetrics();
+    Q_INVOKABLE int verifyBookings();
+    Q_INVOKABLE int verifyBalance(QByteArray proof, QByteArray headerHash);
+    Q_INVOKABLE int verifyBooking(QByteArray proof, QByteArray headerHash);
 
     void setName(QString name);
     void setRuuid(QString ruuid);
+    void setBaseUrl(const QString &baseUrl);
+    QString getBaseUrl();
     QString lastError();
     void setLastError(const QString &lastError);
     int getBalance();
     QString getUuid();
+    QString getPublicKey();
     qint64 getScooping();
     QString getMessage();
     QString getRegisterError();
     QString getVersion();
     QString getResult();
     bool getWritepermission();
+    QVariantMap getMetrics();
     bool checkPermission();
     int saveChain();
     int loadChain();
@@ -96,6 +117,7 @@ private:
     int mintedBalance(qint64 time);
     void registerAccount();
     void setScooping();
+    void signBooking(Booking *booking);
 
 #ifdef TEST
 public:
@@ -121,6 +143,9 @@ signals:
     void balanceChanged();
     void registerErrorChanged();
     void resultChanged();
+    void matesChanged();
+    void scoopingConfirmed();
+    void metricsChanged();
 
 public slots:
     void onNetworkReply(QNetworkReply* reply);
@@ -128,10 +153,17 @@ public slots:
     void onRegisterReply(QNetworkReply* reply);
     void onSetScoopingReply(QNetworkReply* reply);
     void onGetReply(QNetworkReply* reply);
+    void showLogErrors();
+
+private:
+    void appendLastError(const QString &lastError);
+    void recordReply(const QString &endpoint, QNetworkReply *reply);
 
 private:
     QString m_lastError;
+    QTimer m_lastErrorTimer;
     SimpleCrypt m_crypto;
+    Signer m_signer;
     quint64 m_balance;
     qint64 m_scooping;
     QString m_message;
@@ -149,5 +181,6 @@ private:
     int m_mates;
     bool m_writepermission;
     QString m_result;
+    QString m_baseUrl;
 };
 #endif // BACKEND_H
\ No newline at end of file
@@ -0,0 +1,298 @@
+#include <QtTest/QtTest>
+#include <QCryptographicHash>
+#include "backend.h"
+#include "simplecrypt.h"
+
+// Benchmarks for the chain persistence pipeline at production scale.
+// Each stage of saveChain()/loadChain() is measured separately, so a
+// regression can be traced to serialization, compression, hashing,
+// encryption, file I/O or model population.
+// Run with "-o bench.csv,csv" or "-o bench.xml,xml" to get machine
+// readable results (see bench.sh).
+class BenchChain: public QObject
+{
+    Q_OBJECT
+private slots:
+    void initTestCase();
+    void serialize_data();
+    void serialize();
+    void deserialize_data();
+    void deserialize();
+    void compress_data();
+    void compress();
+    void hash_data();
+    void hash();
+    void encrypt_data();
+    void encrypt();
+    void decrypt_data();
+    void decrypt();
+    void fileIO_data();
+    void fileIO();
+    void populateModel_data();
+    void populateModel();
+    void saveChain_data();
+    void saveChain();
+    void loadChain_data();
+    void loadChain();
+
+private:
+    void sizes();
+    QByteArray chain(int count);
+    SimpleCrypt crypto();
+};
+
+void BenchChain::initTestCase()
+{
+    // never touch the real shift.db of the developer
+    QStandardPaths::setTestModeEnabled(true);
+}
+
+void BenchChain::sizes()
+{
+    QTest::addColumn<int>("count");
+    QTest::newRow("10k") << 10000;
+    QTest::newRow("100k") << 100000;
+    QTest::newRow("1M") << 1000000;
+}
+
+// same layout saveChain() writes before encryption
+QByteArray BenchChain::chain(int count)
+{
+    QByteArray data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+    out << (quint16)0x3113;
+    out << (quint16)CHAIN_VERSION;
+    out << (qint64)1234567890;
+    out << QString("uuid") << QString("ruuid") << QString("name");
+    out << QString("Germany") << QString("English");
+    out << QByteArray(SIGNER_KEY_SIZE, 'p') << QByteArray(SIGNER_KEY_SIZE, 's');
+    out << count;
+    for (int i = 0; i < count; i++)
+    {
+        out << (quint64)10;
+        out << QDate(1900, 1, 1).addDays(i);
+        out << QString("Liquid scooped");
+        out << QByteArray(SIGNER_SIGNATURE_SIZE, 'x');
+    }
+    return data;
+}
+
+SimpleCrypt BenchChain::crypto()
+{
+    SimpleCrypt crypto(Q_UINT64_C(0x0c2ad4a4acb9f023));
+    crypto.setCompressionMode(SimpleCrypt::CompressionAlways);
+    crypto.setIntegrityProtectionMode(SimpleCrypt::ProtectionHash);
+    return crypto;
+}
+
+void BenchChain::serialize_data()
+{
+    sizes();
+}
+
+void BenchChain::serialize()
+{
+    QFETCH(int, count);
+    BookingModel model;
+    for (int i = 0; i < count; i++)
+    {
+        Booking *booking = new Booking("Liquid scooped", 10, QDate(1900, 1, 1).addDays(i), &model);
+        booking->setSignature(QByteArray(SIGNER_SIGNATURE_SIZE, 'x'));
+        model.append(booking);
+    }
+
+    QBENCHMARK {
+        QByteArray data;
+        QDataStream out(&data, QIODevice::WriteOnly);
+        out << model.count();
+        for (int i = 0; i < model.count(); i++)
+        {
+            Booking *booking = model.get(i);
+            out << booking->amount();
+            out << booking->date();
+            out << booking->description();
+            out << booking->signature();
+        }
+    }
+}
+
+void BenchChain::deserialize_data()
+{
+    sizes();
+}
+
+void BenchChain::deserialize()
+{
+    QFETCH(int, count);
+    QByteArray data = chain(count);
+
+    QBENCHMARK {
+        QDataStream in(data);
+        quint16 magic, version;
+        qint64 scooping;
+        QString uuid, ruuid, name, country, language;
+        QByteArray publicKey, secretKey;
+        int n;
+        in >> magic >> version >> scooping >> uuid >> ruuid >> name >> country >> language >> publicKey >> secretKey >> n;
+        quint64 balance = 0;
+        for (int i = 0; i < n; i++)
+        {
+            quint64 amount;
+            QDate date;
+            QString description;
+            QByteArray signature;
+            in >> amount >> date >> description >> signature;
+            balance += amount;
+        }
+        QCOMPARE(balance, (quint64)count * 10);
+    }
+}
+
+void BenchChain::compress_data()
+{
+    sizes();
+}
+
+void BenchChain::compress()
+{
+    QFETCH(int, count);
+    QByteArray data = chain(count);
+
+    QBENCHMARK {
+        QByteArray compressed = qCompress(data, 9);
+        Q_UNUSED(compressed);
+    }
+}
+
+void BenchChain::hash_data()
+{
+    sizes();
+}
+
+void BenchChain::hash()
+{
+    QFETCH(int, count);
+    QByteArray data = qCompress(chain(count), 9);
+
+    QBENCHMARK {
+        QByteArray digest = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+        Q_UNUSED(digest);
+    }
+}
+
+void BenchChain::encrypt_data()
+{
+    sizes();
+}
+
+void BenchChain::encrypt()
+{
+    QFETCH(int, count);
+    QByteArray data = chain(count);
+    SimpleCrypt crypt = crypto();
+
+    QBENCHMARK {
+        QByteArray cypherText = crypt.encryptToByteArray(data);
+        Q_UNUSED(cypherText);
+    }
+    QCOMPARE(crypt.lastError(), SimpleCrypt::ErrorNoError);
+}
+
+void BenchChain::decrypt_data()
+{
+    sizes();
+}
+
+void BenchChain::decrypt()
+{
+    QFETCH(int, count);
+    SimpleCrypt crypt = crypto();
+    QByteArray cypherText = crypt.encryptToByteArray(chain(count));
+
+    QBENCHMARK {
+        QByteArray plaintext = crypt.decryptToByteArray(cypherText);
+        Q_UNUSED(plaintext);
+    }
+    QCOMPARE(crypt.lastError(), SimpleCrypt::ErrorNoError);
+}
+
+void BenchChain::fileIO_data()
+{
+    sizes();
+}
+
+void BenchChain::fileIO()
+{
+    QFETCH(int, count);
+    SimpleCrypt crypt = crypto();
+    QByteArray cypherText = crypt.encryptToByteArray(chain(count));
+    QTemporaryFile file;
+    QVERIFY(file.open());
+
+    QBENCHMARK {
+        file.resize(0);
+        file.seek(0);
+        file.write(cypherText);
+        file.flush();
+        file.seek(0);
+        QByteArray data = file.readAll();
+        QCOMPARE(data.size(), cypherText.size());
+    }
+}
+
+void BenchChain::populateModel_data()
+{
+    sizes();
+}
+
+void BenchChain::populateModel()
+{
+    QFETCH(int, count);
+
+    QBENCHMARK {
+        BookingModel model;
+        for (int i = 0; i < count; i++)
+            model.append(new Booking("Liquid scooped", 10, QDate(1900, 1, 1).addDays(i), &model));
+    }
+}
+
+void BenchChain::saveChain_data()
+{
+    sizes();
+}
+
+void BenchChain::saveChain()
+{
+    QFETCH(int, count);
+    BackEnd backend;
+    backend.resetBookings_test();
+    for (int i = 0; i < count; i++)
+        backend.addBooking_test(new Booking("Liquid scooped", 10, QDate(1900, 1, 1).addDays(i), &backend));
+
+    QBENCHMARK {
+        QCOMPARE(backend.saveChain(), CHAIN_SAVED);
+    }
+}
+
+void BenchChain::loadChain_data()
+{
+    sizes();
+}
+
+void BenchChain::loadChain()
+{
+    QFETCH(int, count);
+    BackEnd backend;
+    backend.resetBookings_test();
+    for (int i = 0; i < count; i++)
+        backend.addBooking_test(new Booking("Liquid scooped", 10, QDate(1900, 1, 1).addDays(i), &backend));
+    QCOMPARE(backend.saveChain(), CHAIN_SAVED);
+
+    QBENCHMARK {
+        QCOMPARE(backend.loadChain(), CHAIN_LOADED);
+    }
+    QCOMPARE(backend.getBalance_test(), (quint64)count * 10);
+}
+
+QTEST_MAIN(BenchChain)
+#include "bench.moc"
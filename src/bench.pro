@@ -0,0 +1,43 @@
+QT += widgets testlib sql quick quickcontrols2 network concurrent
+
+CONFIG += c++11
+INCLUDEPATH += ../p2p/prototype/BlockchainCPP/src
+
+TARGET = bench
+
+SOURCES += \
+    bench.cpp \
+    backend.cpp \
+    simplecrypt.cpp \
+    signer.cpp \
+    lightclient.cpp \
+    booking.cpp \
+    bookingmodel.cpp \
+    mate.cpp \
+    matemodel.cpp \
+    menu.cpp \
+    menumodel.cpp \
+    plugin.cpp \
+    logger.cpp \
+    metrics.cpp \
+    trace.cpp
+
+HEADERS += \
+    backend.h \
+    simplecrypt.h \
+    signer.h \
+    lightclient.h \
+    booking.h \
+    bookingmodel.h \
+    mate.h \
+    matemodel.h \
+    menu.h \
+    menumodel.h \
+    plugin.h \
+    logger.h \
+    metrics.h \
+    trace.h
+
+DEFINES += TEST
+
+LIBS += -lcrypto
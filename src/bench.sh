@@ -0,0 +1,6 @@
+mkdir build-bench
+cd build-bench
+/Users/art/qt/5.12.3/clang_64/bin/qmake ../bench.pro
+make
+./bench -o ../bench-$(date +%Y%m%d).csv,csv -o ../bench-$(date +%Y%m%d).xml,xml -o -,txt
+cd ..
@@ -19,6 +19,7 @@
 ****************************************************************************/
 
 #include "booking.h"
+#include <QDataStream>
 
 Booking::Booking(QString description, quint64 amount, QDate date, QObject *parent) :
     QObject(parent)
@@ -60,3 +61,25 @@ void Booking:: setDate(QDate date)
     m_date = date;
     emit dateChanged();
 }
+
+QByteArray Booking::signature()
+{
+    return m_signature;
+}
+
+void Booking::setSignature(const QByteArray &signature)
+{
+    m_signature = signature;
+}
+
+// The bytes that get signed, the key of the signer and every field except the signature.
+QByteArray Booking::record(const QByteArray &publicKey)
+{
+    QByteArray bytes;
+    QDataStream out(&bytes, QIODevice::WriteOnly);
+    out << publicKey;
+    out << m_amount;
+    out << m_date;
+    out << m_description;
+    return bytes;
+}
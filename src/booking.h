@@ -24,6 +24,7 @@
 #include <QObject>
 #include <QString>
 #include <QDate>
+#include <QByteArray>
 
 
 class Booking : public QObject
@@ -42,6 +43,9 @@ public:
     void setDescription(const QString &description);
     void setAmount(quint64 amount);
     void setDate(QDate date);
+    QByteArray signature();
+    void setSignature(const QByteArray &signature);
+    QByteArray record(const QByteArray &publicKey);
 
 signals:
     void descriptionChanged();
@@ -52,5 +56,6 @@ private:
     QString m_description;
     quint64 m_amount;
     QDate m_date;
+    QByteArray m_signature;
 };
 #endif // BOOKING_H
\ No newline at end of file
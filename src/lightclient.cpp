@@ -0,0 +1,78 @@
+/****************************************************************************
+# Copyright (C) 2021 CrowdWare
+#
+# This file is part of SHIFT.
+#
+#  SHIFT is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  SHIFT is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with SHIFT.  If not, see <http://www.gnu.org/licenses/>.
+#
+****************************************************************************/
+
+
+#include "lightclient.h"
+#include "verify.hpp"
+
+static QByteArray toByteArray(const Digest &digest)
+{
+    return QByteArray((const char *)digest.data(), digest.size());
+}
+
+static bool toDigest(const QByteArray &bytes, Digest &digest)
+{
+    if (bytes.size() != (int)digest.size())
+        return false;
+    memcpy(digest.data(), bytes.constData(), digest.size());
+    return true;
+}
+
+int LightClient::verifyAccount(const QByteArray &proof, const QByteArray &headerHash, LightAccount *account)
+{
+    ProvenAccount p;
+    Digest trusted;
+    if (!toDigest(headerHash, trusted))
+        return LIGHT_BAD_HEADER;
+    int rc = checkAccountProof((const uint8_t *)proof.constData(), proof.size(), trusted, p);
+    if (rc != PROOF_OK)
+        return rc; // the PROOF_ codes are the LIGHT_ codes
+    if (account)
+    {
+        account->key = toByteArray(p.key);
+        account->balance = p.balance;
+        account->scooping = p.scooping;
+        account->referrer = toByteArray(p.referrer);
+        account->nonce = p.nonce;
+    }
+    return LIGHT_OK;
+}
+
+int LightClient::verifyTransaction(const QByteArray &proof, const QByteArray &headerHash, LightTransaction *transaction)
+{
+    ProvenTransaction p;
+    Digest trusted;
+    if (!toDigest(headerHash, trusted))
+        return LIGHT_BAD_HEADER;
+    int rc = checkTransactionProof((const uint8_t *)proof.constData(), proof.size(), trusted, p);
+    if (rc != PROOF_OK)
+        return rc; // the PROOF_ codes are the LIGHT_ codes
+    if (transaction)
+    {
+        transaction->from = toByteArray(p.from);
+        transaction->to = toByteArray(p.to);
+        transaction->amount = p.amount;
+        transaction->nonce = p.nonce;
+        transaction->timestamp = p.timestamp;
+        transaction->kind = p.kind;
+        transaction->index = p.index;
+    }
+    return LIGHT_OK;
+}
@@ -0,0 +1,68 @@
+/****************************************************************************
+# Copyright (C) 2021 CrowdWare
+#
+# This file is part of SHIFT.
+#
+#  SHIFT is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  SHIFT is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with SHIFT.  If not, see <http://www.gnu.org/licenses/>.
+#
+****************************************************************************/
+
+
+#ifndef LIGHTCLIENT_H
+#define LIGHTCLIENT_H
+
+#include <QByteArray>
+
+#define LIGHT_OK 0
+#define LIGHT_BAD_ENCODING -1
+#define LIGHT_BAD_HEADER -2        // header does not hash to the trusted header hash
+#define LIGHT_NO_COMMITMENT -3     // header does not commit to the account state
+#define LIGHT_BAD_PATH -4          // account or transaction is not under that header
+#define LIGHT_OTHER_ACCOUNT -5     // proof is fine but about somebody else
+#define LIGHT_BALANCE_MISMATCH -6  // ledger disagrees with the balance in shift.db
+
+// Account as committed to by a block of the peer network.
+struct LightAccount
+{
+    QByteArray key;
+    quint64 balance;
+    qint64 scooping;
+    QByteArray referrer;
+    quint64 nonce;
+};
+
+// Transaction as included in a block of the peer network.
+struct LightTransaction
+{
+    QByteArray from;
+    QByteArray to;
+    quint64 amount;
+    quint64 nonce;
+    qint64 timestamp;
+    quint32 kind;
+    quint32 index; // in its block
+};
+
+// Checks the Merkle proofs full peers hand out (MSG_PROOF) against the
+// hash of a block header the app trusts, so the phone can confirm its
+// balance and bookings without the ledger. Uses verify.hpp of the peer,
+// which needs nothing else of the node; a proof costs O(log n) bytes and hashes.
+class LightClient
+{
+public:
+    static int verifyAccount(const QByteArray &proof, const QByteArray &headerHash, LightAccount *account);
+    static int verifyTransaction(const QByteArray &proof, const QByteArray &headerHash, LightTransaction *transaction);
+};
+
+#endif // LIGHTCLIENT_H
@@ -0,0 +1,233 @@
+/****************************************************************************
+# Copyright (C) 2021 CrowdWare
+#
+# This file is part of SHIFT.
+#
+#  SHIFT is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  SHIFT is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with SHIFT.  If not, see <http://www.gnu.org/licenses/>.
+#
+****************************************************************************/
+
+
+#include "logger.h"
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <string.h>
+
+Logger &Logger::instance()
+{
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger() :
+    m_head(0),
+    m_tail(0),
+    m_dropped(0),
+    m_running(false),
+    m_thread(nullptr),
+    m_fileSize(0)
+{
+    for (quint64 i = 0; i < LOG_CAPACITY; i++)
+        m_slots[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+Logger::~Logger()
+{
+    stop();
+}
+
+void Logger::start(const QString &path)
+{
+    if (m_thread)
+        return;
+    m_path = path;
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    m_fileSize = QFileInfo(path).size();
+    m_running = true;
+    m_thread = QThread::create([this]() { run(); });
+    m_thread->start(QThread::LowPriority);
+}
+
+void Logger::stop()
+{
+    if (!m_thread)
+        return;
+    m_running = false;
+    m_thread->wait();
+    delete m_thread;
+    m_thread = nullptr;
+}
+
+void Logger::run()
+{
+    while (m_running.load(std::memory_order_relaxed))
+    {
+        if (drain() == 0)
+            QThread::msleep(20);
+    }
+    // flush what is left after stop()
+    drain();
+}
+
+bool Logger::log(QtMsgType type, const QString &msg, bool notify, const char *file, int line, const char *function)
+{
+    LogRecord record;
+    record.time = QDateTime::currentMSecsSinceEpoch();
+    record.type = type;
+    record.notify = notify;
+    QByteArray text = msg.toUtf8();
+    if (file)
+        text += " (" + QByteArray(file) + ":" + QByteArray::number(line) + "," + QByteArray(function ? function : "undefined") + ")";
+    int len = qMin(text.size(), LOG_RECORD_SIZE - 1);
+    memcpy(record.text, text.constData(), len);
+    record.text[len] = 0;
+    if (type == QtFatalMsg)
+    {
+        // the process aborts once the handler returns, nothing would drain the queue
+        drain();
+        QMutexLocker locker(&m_drainMutex);
+        QFile out(m_path);
+        write(out, record);
+        out.flush();
+        return true;
+    }
+    return push(record);
+}
+
+bool Logger::push(const LogRecord &record)
+{
+    quint64 pos = m_head.load(std::memory_order_relaxed);
+    Slot *slot;
+    for (;;)
+    {
+        slot = &m_slots[pos & (LOG_CAPACITY - 1)];
+        quint64 seq = slot->sequence.load(std::memory_order_acquire);
+        qint64 diff = (qint64)seq - (qint64)pos;
+        if (diff == 0)
+        {
+            if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // queue is full, never block the caller
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        else
+            pos = m_head.load(std::memory_order_relaxed);
+    }
+    slot->record = record;
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool Logger::pop(LogRecord &record)
+{
+    Slot *slot = &m_slots[m_tail & (LOG_CAPACITY - 1)];
+    if (slot->sequence.load(std::memory_order_acquire) != m_tail + 1)
+        return false;
+    record = slot->record;
+    slot->sequence.store(m_tail + LOG_CAPACITY, std::memory_order_release);
+    m_tail++;
+    return true;
+}
+
+// Safe from any thread, the drain thread and a fatal message on another thread take turns.
+int Logger::drain()
+{
+    QMutexLocker locker(&m_drainMutex);
+    LogRecord record;
+    QFile file(m_path);
+    int count = 0;
+    while (pop(record))
+    {
+        count++;
+        write(file, record);
+    }
+    return count;
+}
+
+void Logger::write(QFile &file, const LogRecord &record)
+{
+    QByteArray data = format(record);
+    if (m_path.isEmpty())
+        return;
+    if (m_fileSize + data.size() > LOG_FILE_SIZE)
+    {
+        file.close();
+        rotate();
+    }
+    if (!file.isOpen() && !file.open(QIODevice::WriteOnly | QIODevice::Append))
+        return;
+    file.write(data);
+    m_fileSize += data.size();
+}
+
+QByteArray Logger::format(const LogRecord &record)
+{
+    QString typ = "Undefined";
+    switch (record.type)
+    {
+    case QtDebugMsg:
+        typ = "Debug";
+        break;
+    case QtInfoMsg:
+        typ = "Info";
+        break;
+    case QtWarningMsg:
+        typ = "Warning";
+        break;
+    case QtCriticalMsg:
+        typ = "Critical";
+        break;
+    case QtFatalMsg:
+        typ = "Fatal";
+        break;
+    }
+    QString line = typ + ":" + QString::fromUtf8(record.text);
+
+    if (record.notify && record.type != QtDebugMsg && record.type != QtInfoMsg)
+    {
+        QMutexLocker locker(&m_recentMutex);
+        m_recent.append(line);
+        while (m_recent.count() > LOG_RECENT_ERRORS)
+            m_recent.removeFirst();
+    }
+    return QDateTime::fromMSecsSinceEpoch(record.time).toString(Qt::ISODateWithMs).toUtf8() + " " + line.toUtf8() + "\n";
+}
+
+void Logger::rotate()
+{
+    QFile::remove(m_path + "." + QString::number(LOG_FILE_COUNT - 1));
+    for (int i = LOG_FILE_COUNT - 2; i > 0; i--)
+        QFile::rename(m_path + "." + QString::number(i), m_path + "." + QString::number(i + 1));
+    QFile::rename(m_path, m_path + ".1");
+    m_fileSize = 0;
+}
+
+QStringList Logger::takeRecentErrors()
+{
+    QMutexLocker locker(&m_recentMutex);
+    QStringList recent = m_recent;
+    m_recent.clear();
+    return recent;
+}
+
+quint64 Logger::dropped()
+{
+    return m_dropped.load(std::memory_order_relaxed);
+}
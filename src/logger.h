@@ -0,0 +1,99 @@
+/****************************************************************************
+# Copyright (C) 2021 CrowdWare
+#
+# This file is part of SHIFT.
+#
+#  SHIFT is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  SHIFT is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with SHIFT.  If not, see <http://www.gnu.org/licenses/>.
+#
+****************************************************************************/
+
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QMutex>
+#include <QThread>
+#include <atomic>
+
+class QFile;
+
+#define LOG_CAPACITY 1024        // number of records, must be a power of two
+#define LOG_RECORD_SIZE 240      // bytes of text per record, longer messages are truncated
+#define LOG_FILE_SIZE (512 * 1024) // rotate the log file after this many bytes
+#define LOG_FILE_COUNT 3         // shift.log, shift.log.1, shift.log.2
+#define LOG_RECENT_ERRORS 10     // warnings and errors kept for the ui
+
+struct LogRecord
+{
+    qint64 time;
+    int type;
+    bool notify;
+    char text[LOG_RECORD_SIZE];
+};
+
+// Bounded lock-free multi producer, single consumer log queue.
+// log() can be called from any thread and never blocks. Converting the
+// message to utf-8 allocates, the queue itself does not. When the queue
+// is full the record is dropped and counted. A background thread drains
+// the queue into a rotating log file and keeps the most recent warnings
+// of records logged with notify set for the ui. A fatal message is
+// written by the caller after draining the queue, Qt aborts right after.
+class Logger
+{
+public:
+    static Logger &instance();
+
+    void start(const QString &path);
+    void stop();
+
+    bool log(QtMsgType type, const QString &msg, bool notify, const char *file = nullptr, int line = 0, const char *function = nullptr);
+    int drain();
+    QStringList takeRecentErrors();
+    quint64 dropped();
+
+private:
+    Logger();
+    ~Logger();
+    Logger(const Logger &) = delete;
+    Logger &operator=(const Logger &) = delete;
+
+    bool push(const LogRecord &record);
+    bool pop(LogRecord &record);
+    QByteArray format(const LogRecord &record);
+    void write(QFile &file, const LogRecord &record);
+    void rotate();
+    void run();
+
+    struct Slot
+    {
+        std::atomic<quint64> sequence;
+        LogRecord record;
+    };
+
+    Slot m_slots[LOG_CAPACITY];
+    alignas(64) std::atomic<quint64> m_head;
+    alignas(64) quint64 m_tail;
+    std::atomic<quint64> m_dropped;
+    std::atomic<bool> m_running;
+    QThread *m_thread;
+    QMutex m_drainMutex;
+    QString m_path;
+    qint64 m_fileSize;
+    QMutex m_recentMutex;
+    QStringList m_recent;
+};
+#endif // LOGGER_H
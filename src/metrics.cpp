@@ -0,0 +1,178 @@
+/****************************************************************************
+# Copyright (C) 2021 CrowdWare
+#
+# This file is part of SHIFT.
+#
+#  SHIFT is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  SHIFT is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with SHIFT.  If not, see <http://www.gnu.org/licenses/>.
+#
+****************************************************************************/
+
+
+#include "metrics.h"
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+
+MetricHistogram::MetricHistogram() :
+    m_count(0),
+    m_sum(0),
+    m_max(0)
+{
+    for (int i = 0; i < METRICS_BUCKETS; i++)
+        m_buckets[i].store(0, std::memory_order_relaxed);
+}
+
+void MetricHistogram::record(quint64 usecs)
+{
+    int bucket = 0;
+    for (quint64 v = usecs; v && bucket < METRICS_BUCKETS - 1; v >>= 1)
+        bucket++;
+    m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(usecs, std::memory_order_relaxed);
+    quint64 max = m_max.load(std::memory_order_relaxed);
+    while (usecs > max && !m_max.compare_exchange_weak(max, usecs, std::memory_order_relaxed))
+        ;
+}
+
+quint64 MetricHistogram::count() const
+{
+    return m_count.load(std::memory_order_relaxed);
+}
+
+quint64 MetricHistogram::sum() const
+{
+    return m_sum.load(std::memory_order_relaxed);
+}
+
+quint64 MetricHistogram::max() const
+{
+    return m_max.load(std::memory_order_relaxed);
+}
+
+// upper bound of the bucket holding the p-th percentile, capped by the largest value seen
+quint64 MetricHistogram::percentile(double p) const
+{
+    quint64 total = count();
+    if (total == 0)
+        return 0;
+    quint64 rank = (quint64)(p * total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    quint64 seen = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++)
+    {
+        seen += m_buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+            return qMin(i == 0 ? (quint64)0 : ((quint64)1 << i) - 1, max());
+    }
+    return max();
+}
+
+QVariantMap MetricHistogram::toVariantMap() const
+{
+    QVariantMap map;
+    quint64 n = count();
+    map["count"] = n;
+    map["sum"] = sum();
+    map["avg"] = n ? sum() / n : 0;
+    map["p50"] = percentile(0.50);
+    map["p95"] = percentile(0.95);
+    map["max"] = max();
+    return map;
+}
+
+MetricTimer::MetricTimer(MetricHistogram &histogram) :
+    m_histogram(histogram),
+    m_start(Metrics::now())
+{
+}
+
+MetricTimer::~MetricTimer()
+{
+    m_histogram.record(Metrics::now() - m_start);
+}
+
+Metrics &Metrics::instance()
+{
+    static Metrics metrics;
+    return metrics;
+}
+
+// monotonic microseconds since the first call
+quint64 Metrics::now()
+{
+    static QElapsedTimer timer;
+    static bool started = (timer.start(), true);
+    Q_UNUSED(started);
+    return timer.nsecsElapsed() / 1000;
+}
+
+MetricCounter &Metrics::counter(const QString &name)
+{
+    QMutexLocker locker(&m_mutex);
+    MetricCounter *&counter = m_counters[name];
+    if (!counter)
+        counter = new MetricCounter();
+    return *counter;
+}
+
+MetricGauge &Metrics::gauge(const QString &name)
+{
+    QMutexLocker locker(&m_mutex);
+    MetricGauge *&gauge = m_gauges[name];
+    if (!gauge)
+        gauge = new MetricGauge();
+    return *gauge;
+}
+
+MetricHistogram &Metrics::histogram(const QString &name)
+{
+    QMutexLocker locker(&m_mutex);
+    MetricHistogram *&histogram = m_histograms[name];
+    if (!histogram)
+        histogram = new MetricHistogram();
+    return *histogram;
+}
+
+QVariantMap Metrics::toVariantMap()
+{
+    QMutexLocker locker(&m_mutex);
+    QVariantMap map;
+    for (auto it = m_counters.constBegin(); it != m_counters.constEnd(); ++it)
+        map[it.key()] = it.value()->value();
+    for (auto it = m_gauges.constBegin(); it != m_gauges.constEnd(); ++it)
+        map[it.key()] = it.value()->value();
+    for (auto it = m_histograms.constBegin(); it != m_histograms.constEnd(); ++it)
+        map[it.key()] = it.value()->toVariantMap();
+    return map;
+}
+
+QJsonObject Metrics::toJson()
+{
+    return QJsonObject::fromVariantMap(toVariantMap());
+}
+
+bool Metrics::dump(const QString &path)
+{
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    file.write(QJsonDocument(toJson()).toJson());
+    file.close();
+    return true;
+}
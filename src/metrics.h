@@ -0,0 +1,115 @@
+/****************************************************************************
+# Copyright (C) 2021 CrowdWare
+#
+# This file is part of SHIFT.
+#
+#  SHIFT is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  SHIFT is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with SHIFT.  If not, see <http://www.gnu.org/licenses/>.
+#
+****************************************************************************/
+
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QString>
+#include <QMap>
+#include <QMutex>
+#include <QVariantMap>
+#include <QJsonObject>
+#include <atomic>
+
+#define METRICS_BUCKETS 32 // bucket i counts values below 2^i microseconds, the last one counts everything else
+
+class MetricCounter
+{
+public:
+    MetricCounter() : m_value(0) {}
+    void add(quint64 n = 1) { m_value.fetch_add(n, std::memory_order_relaxed); }
+    quint64 value() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<quint64> m_value;
+};
+
+class MetricGauge
+{
+public:
+    MetricGauge() : m_value(0) {}
+    void set(qint64 value) { m_value.store(value, std::memory_order_relaxed); }
+    void add(qint64 n) { m_value.fetch_add(n, std::memory_order_relaxed); }
+    qint64 value() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<qint64> m_value;
+};
+
+// Fixed power of two buckets, recording is a bit scan and two relaxed atomic adds.
+class MetricHistogram
+{
+public:
+    MetricHistogram();
+    void record(quint64 usecs);
+    quint64 count() const;
+    quint64 sum() const;
+    quint64 max() const;
+    quint64 percentile(double p) const;
+    QVariantMap toVariantMap() const;
+
+private:
+    std::atomic<quint64> m_buckets[METRICS_BUCKETS];
+    std::atomic<quint64> m_count;
+    std::atomic<quint64> m_sum;
+    std::atomic<quint64> m_max;
+};
+
+// Records the time between construction and destruction into a histogram.
+class MetricTimer
+{
+public:
+    explicit MetricTimer(MetricHistogram &histogram);
+    ~MetricTimer();
+
+private:
+    MetricHistogram &m_histogram;
+    quint64 m_start;
+};
+
+// Process wide registry. Metrics are created on first use and live until the
+// process ends, so hot paths look them up once and keep the reference:
+//     static MetricCounter &failed = Metrics::instance().counter("chain.save.failed");
+class Metrics
+{
+public:
+    static Metrics &instance();
+    static quint64 now();
+
+    MetricCounter &counter(const QString &name);
+    MetricGauge &gauge(const QString &name);
+    MetricHistogram &histogram(const QString &name);
+
+    QVariantMap toVariantMap();
+    QJsonObject toJson();
+    bool dump(const QString &path);
+
+private:
+    Metrics() {}
+    Metrics(const Metrics &) = delete;
+    Metrics &operator=(const Metrics &) = delete;
+
+    QMutex m_mutex;
+    QMap<QString, MetricCounter *> m_counters;
+    QMap<QString, MetricGauge *> m_gauges;
+    QMap<QString, MetricHistogram *> m_histograms;
+};
+#endif // METRICS_H
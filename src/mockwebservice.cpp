@@ -0,0 +1,261 @@
+/****************************************************************************
+# Copyright (C) 2021 CrowdWare
+#
+# This file is part of SHIFT.
+#
+#  SHIFT is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  SHIFT is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with SHIFT.  If not, see <http://www.gnu.org/licenses/>.
+#
+****************************************************************************/
+
+
+#include "mockwebservice.h"
+#include <QTimer>
+#include <QPointer>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QJsonDocument>
+
+MockWebService::MockWebService(QObject *parent) :
+    QObject(parent)
+{
+    reset();
+    connect(&m_server, SIGNAL(newConnection()), this, SLOT(onNewConnection()));
+}
+
+bool MockWebService::listen(quint16 port)
+{
+    return m_server.listen(QHostAddress::LocalHost, port);
+}
+
+void MockWebService::close()
+{
+    m_server.close();
+}
+
+QString MockWebService::baseUrl()
+{
+    return "http://127.0.0.1:" + QString::number(m_server.serverPort());
+}
+
+void MockWebService::setApiKey(const QString &key)
+{
+    m_apiKey = key;
+}
+
+void MockWebService::setLatency(int msecs)
+{
+    m_latency = msecs;
+}
+
+void MockWebService::setHttpStatus(int status)
+{
+    m_httpStatus = status;
+}
+
+void MockWebService::setApiError(const QString &message)
+{
+    m_apiError = message;
+}
+
+void MockWebService::setDropConnection(bool drop)
+{
+    m_dropConnection = drop;
+}
+
+void MockWebService::setMateCount(int count)
+{
+    m_mateCount = count;
+}
+
+void MockWebService::setMessageSize(int bytes)
+{
+    m_messageSize = bytes;
+}
+
+void MockWebService::reset()
+{
+    m_apiKey = "";
+    m_apiError = "";
+    m_latency = 0;
+    m_httpStatus = 200;
+    m_dropConnection = false;
+    m_mateCount = 3;
+    m_messageSize = 0;
+    m_bytesReceived = 0;
+    m_bytesSent = 0;
+    m_requests.clear();
+}
+
+int MockWebService::requestCount(const QString &path)
+{
+    return m_requests.value(path, 0);
+}
+
+int MockWebService::totalRequests()
+{
+    int total = 0;
+    foreach (int count, m_requests)
+        total += count;
+    return total;
+}
+
+qint64 MockWebService::bytesReceived()
+{
+    return m_bytesReceived;
+}
+
+qint64 MockWebService::bytesSent()
+{
+    return m_bytesSent;
+}
+
+void MockWebService::onNewConnection()
+{
+    while (m_server.hasPendingConnections())
+    {
+        QTcpSocket *socket = m_server.nextPendingConnection();
+        m_pending.insert(socket, QByteArray());
+        connect(socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+        connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+        connect(socket, &QObject::destroyed, this, [this, socket]() { m_pending.remove(socket); });
+    }
+}
+
+void MockWebService::onReadyRead()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    if (!socket)
+        return;
+    QByteArray data = socket->readAll();
+    m_bytesReceived += data.size();
+    QByteArray &buffer = m_pending[socket];
+    buffer.append(data);
+
+    int headerEnd = buffer.indexOf("\r\n\r\n");
+    if (headerEnd < 0)
+        return;
+
+    QList<QByteArray> lines = buffer.left(headerEnd).split('\n');
+    QList<QByteArray> requestLine = lines.first().trimmed().split(' ');
+    if (requestLine.count() < 2)
+    {
+        sendReply(socket, 400, QByteArray());
+        return;
+    }
+    int contentLength = 0;
+    for (int i = 1; i < lines.count(); i++)
+    {
+        QByteArray line = lines.at(i).trimmed();
+        if (line.toLower().startsWith("content-length:"))
+            contentLength = line.mid(15).trimmed().toInt();
+    }
+    if (buffer.size() < headerEnd + 4 + contentLength)
+        return;
+
+    QString path = QString::fromLatin1(requestLine.at(1));
+    QByteArray body = buffer.mid(headerEnd + 4, contentLength);
+    buffer.clear();
+    m_requests[path] = m_requests.value(path, 0) + 1;
+
+    if (m_latency > 0)
+    {
+        QPointer<QTcpSocket> guard(socket);
+        QTimer::singleShot(m_latency, this, [this, guard, path, body]() {
+            if (guard)
+                handleRequest(guard, path, body);
+        });
+    }
+    else
+        handleRequest(socket, path, body);
+}
+
+void MockWebService::handleRequest(QTcpSocket *socket, const QString &path, const QByteArray &body)
+{
+    if (m_dropConnection)
+    {
+        socket->abort();
+        return;
+    }
+    if (m_httpStatus != 200)
+    {
+        sendReply(socket, m_httpStatus, QByteArray());
+        return;
+    }
+    sendReply(socket, 200, dispatch(path, body));
+    emit requestServed(path);
+}
+
+void MockWebService::sendReply(QTcpSocket *socket, int status, const QByteArray &json)
+{
+    QByteArray reason = status == 200 ? "OK" : "Error";
+    QByteArray reply = "HTTP/1.1 " + QByteArray::number(status) + " " + reason + "\r\n";
+    reply += "Content-Type: application/json\r\n";
+    reply += "Content-Length: " + QByteArray::number(json.size()) + "\r\n";
+    reply += "Connection: close\r\n\r\n";
+    reply += json;
+    m_bytesSent += reply.size();
+    socket->write(reply);
+    socket->disconnectFromHost();
+}
+
+QByteArray MockWebService::dispatch(const QString &path, const QByteArray &body)
+{
+    QJsonObject content = QJsonDocument::fromJson(body).object();
+    QJsonObject reply;
+    reply["statusCode"] = 200;
+
+    if (!m_apiKey.isEmpty() && content["key"].toString() != m_apiKey)
+    {
+        reply["isError"] = true;
+        reply["message"] = "wrong api key";
+        return QJsonDocument(reply).toJson(QJsonDocument::Compact);
+    }
+    if (!m_apiError.isEmpty())
+    {
+        reply["isError"] = true;
+        reply["message"] = m_apiError;
+        return QJsonDocument(reply).toJson(QJsonDocument::Compact);
+    }
+
+    reply["isError"] = false;
+    reply["message"] = "Success";
+    if (path == "/message")
+    {
+        QString message = "Message from server";
+        if (m_messageSize > message.length())
+            message = message.leftJustified(m_messageSize, '.');
+        reply["data"] = message;
+    }
+    else if (path == "/matelist")
+    {
+        // same fixture as main.py in test mode, padded up to m_mateCount
+        QJsonArray accounts;
+        for (int i = 0; i < m_mateCount; i++)
+        {
+            QJsonObject account;
+            account["uuid"] = QString::number(1234567890 + i);
+            account["name"] = "Testuser " + QString::number(i + 1);
+            // only Testuser 3 started scooping less than 20 hours ago
+            account["scooping"] = (i == 2);
+            accounts.append(account);
+        }
+        reply["data"] = accounts;
+    }
+    else if (path != "/register" && path != "/setscooping")
+    {
+        reply["isError"] = true;
+        reply["message"] = "unknown endpoint " + path;
+    }
+    return QJsonDocument(reply).toJson(QJsonDocument::Compact);
+}
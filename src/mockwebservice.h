@@ -0,0 +1,86 @@
+/****************************************************************************
+# Copyright (C) 2021 CrowdWare
+#
+# This file is part of SHIFT.
+#
+#  SHIFT is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  SHIFT is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with SHIFT.  If not, see <http://www.gnu.org/licenses/>.
+#
+****************************************************************************/
+
+
+#ifndef MOCKWEBSERVICE_H
+#define MOCKWEBSERVICE_H
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include <QMap>
+#include <QTcpServer>
+#include <QTcpSocket>
+
+// In-process stand-in for webservice/main.py.
+// Answers /message, /register, /setscooping and /matelist the same way the
+// real service does in test mode, so unit tests run offline and fast.
+// Latency, errors and payload sizes can be injected per instance.
+class MockWebService : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit MockWebService(QObject *parent = nullptr);
+
+    bool listen(quint16 port = 0);
+    void close();
+    QString baseUrl();
+
+    void setApiKey(const QString &key);
+    void setLatency(int msecs);
+    void setHttpStatus(int status);
+    void setApiError(const QString &message);
+    void setDropConnection(bool drop);
+    void setMateCount(int count);
+    void setMessageSize(int bytes);
+    void reset();
+
+    int requestCount(const QString &path);
+    int totalRequests();
+    qint64 bytesReceived();
+    qint64 bytesSent();
+
+signals:
+    void requestServed(const QString &path);
+
+private slots:
+    void onNewConnection();
+    void onReadyRead();
+
+private:
+    void handleRequest(QTcpSocket *socket, const QString &path, const QByteArray &body);
+    void sendReply(QTcpSocket *socket, int status, const QByteArray &json);
+    QByteArray dispatch(const QString &path, const QByteArray &body);
+
+    QTcpServer m_server;
+    QMap<QTcpSocket *, QByteArray> m_pending;
+    QMap<QString, int> m_requests;
+    QString m_apiKey;
+    QString m_apiError;
+    int m_latency;
+    int m_httpStatus;
+    bool m_dropConnection;
+    int m_mateCount;
+    int m_messageSize;
+    qint64 m_bytesReceived;
+    qint64 m_bytesSent;
+};
+#endif // MOCKWEBSERVICE_H
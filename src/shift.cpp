@@ -28,38 +28,19 @@
 #include <QList>
 #include <QQuickView>
 #include <QUuid>
+#include <QTimer>
 #include "backend.h"
 #include "plugin.h"
 #include "shareutils.h"
+#include "logger.h"
+#include "trace.h"
 
 BackEnd backend;
     
+// called from any thread, must never block or touch the backend
 void myMessageOutput(QtMsgType type, const QMessageLogContext &context, const QString &msg)
 {
-    QByteArray localMsg = msg.toLocal8Bit();
-    QString typ = "Undefined";
-    const char *file = context.file ? context.file : "undefined";
-    const char *function = context.function ? context.function : "undefined";
-
-    switch (type) 
-    {
-    case QtDebugMsg:
-        typ = "Debug";
-        break;
-    case QtInfoMsg:
-        typ = "Info";
-        break;
-    case QtWarningMsg:
-        typ = "Warning";
-        break;
-    case QtCriticalMsg:
-        typ = "Critical";
-        break;
-    case QtFatalMsg:
-        typ = "Fatal";
-        break;
-    }
-    backend.setLastError(typ + ":" + QString(localMsg.constData()) + " (" + file + ":" + QString(context.line) + "," + function + ")");
+    Logger::instance().log(type, msg, true, context.file ? context.file : "undefined", context.line, context.function);
 }
 
 int main(int argc, char *argv[])
@@ -69,8 +50,21 @@ int main(int argc, char *argv[])
     QGuiApplication::setApplicationVersion("1.1.0");
     QGuiApplication::setAttribute(Qt::AA_EnableHighDpiScaling);
 
-    qInstallMessageHandler(myMessageOutput);
     QGuiApplication app(argc, argv);
+    Logger::instance().start(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/crowdware/shift.log");
+    qInstallMessageHandler(myMessageOutput);
+
+    // SHIFT_TRACE=<file> or the trace setting writes a Chrome trace of startup and stalls
+    QString tracePath = qEnvironmentVariable("SHIFT_TRACE");
+    if (tracePath.isEmpty() && QSettings().value("trace", false).toBool())
+        tracePath = QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/crowdware/shift.trace.json";
+    if (!tracePath.isEmpty())
+        Trace::instance().start(tracePath);
+
+    // errors logged by other threads reach the ui at most once a second
+    QTimer logTimer;
+    QObject::connect(&logTimer, SIGNAL(timeout()), &backend, SLOT(showLogErrors()));
+    logTimer.start(1000);
     qmlRegisterType<BackEnd>("at.crowdware.backend", 1, 0, "BackEnd");
     qmlRegisterType<Plugin>("at.crowdware.backend", 1, 0, "Plugin");
     qmlRegisterType<ShareUtils> ("com.lasconic", 1, 0, "ShareUtils");
@@ -95,8 +89,15 @@ int main(int argc, char *argv[])
     }
     QQmlApplicationEngine engine;
     engine.rootContext()->setContextProperty("backend", &backend);
-    engine.load(QUrl("qrc:/shift.qml"));
-    if (engine.rootObjects().isEmpty())
-        return -1;
-    return app.exec();
+    {
+        TRACE_SPAN("qml load");
+        engine.load(QUrl("qrc:/shift.qml"));
+    }
+    int rc = -1;
+    if (!engine.rootObjects().isEmpty())
+        rc = app.exec();
+    qInstallMessageHandler(0);
+    Trace::instance().stop();
+    Logger::instance().stop();
+    return rc;
 }
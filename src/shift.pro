@@ -1,7 +1,11 @@
 TEMPLATE = app
 TARGET = shift
-QT += quick quickcontrols2 core 
+QT += quick quickcontrols2 core concurrent
 CONFIG += c++11
+# for verify.hpp of the peer, the app includes no other header of it
+INCLUDEPATH += ../p2p/prototype/BlockchainCPP/src
+# signing needs OpenSSL 1.1.1 or later, phones get their own build below
+!android:!ios: LIBS += -lcrypto
 
 SOURCES += \
     shift.cpp \
@@ -14,7 +18,12 @@ SOURCES += \
     plugin.cpp \
     menumodel.cpp \ 
     simplecrypt.cpp \
-    shareutils.cpp
+    signer.cpp \
+    lightclient.cpp \
+    shareutils.cpp \
+    logger.cpp \
+    metrics.cpp \
+    trace.cpp
 
 HEADERS += \
     backend.h \
@@ -26,7 +35,13 @@ HEADERS += \
     plugin.h \
     menumodel.h \
     simplecrypt.h \
-    shareutils.h
+    signer.h \
+    lightclient.h \
+    ../p2p/prototype/BlockchainCPP/src/verify.hpp \
+    shareutils.h \
+    logger.h \
+    metrics.h \
+    trace.h
 
 RESOURCES += \
     shift.qml \
@@ -76,6 +91,17 @@ android {
         android/AndroidManifest.xml \
         android/build.gradle \
         android/res/values/libs.xml
+
+    # static libcrypto from https://github.com/KDAB/android_openssl, checked out next to Shift
+    # or wherever ANDROID_OPENSSL points, so the app does not depend on the one of the system
+    ANDROID_OPENSSL = $$(ANDROID_OPENSSL)
+    isEmpty(ANDROID_OPENSSL): ANDROID_OPENSSL = $$PWD/../../android_openssl
+    equals(ANDROID_TARGET_ARCH, armeabi-v7a): OPENSSL_ARCH = arm
+    equals(ANDROID_TARGET_ARCH, arm64-v8a): OPENSSL_ARCH = arm64
+    equals(ANDROID_TARGET_ARCH, x86): OPENSSL_ARCH = x86
+    equals(ANDROID_TARGET_ARCH, x86_64): OPENSSL_ARCH = x86_64
+    INCLUDEPATH += $$ANDROID_OPENSSL/static/include
+    LIBS += $$ANDROID_OPENSSL/static/lib/$$OPENSSL_ARCH/libcrypto.a
 }
 
 ios {
@@ -85,4 +111,11 @@ ios {
     Q_ENABLE_BITCODE.name = ENABLE_BITCODE
     Q_ENABLE_BITCODE.value = NO
     QMAKE_MAC_XCODE_SETTINGS += Q_ENABLE_BITCODE
+
+    # static libcrypto built for iOS (device and simulator in one library), checked out
+    # next to Shift or wherever IOS_OPENSSL points, with include/ and lib/libcrypto.a
+    IOS_OPENSSL = $$(IOS_OPENSSL)
+    isEmpty(IOS_OPENSSL): IOS_OPENSSL = $$PWD/../../openssl-ios
+    INCLUDEPATH += $$IOS_OPENSSL/include
+    LIBS += $$IOS_OPENSSL/lib/libcrypto.a
 }
\ No newline at end of file
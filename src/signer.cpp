@@ -0,0 +1,115 @@
+/****************************************************************************
+# Copyright (C) 2021 CrowdWare
+#
+# This file is part of SHIFT.
+#
+#  SHIFT is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  SHIFT is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with SHIFT.  If not, see <http://www.gnu.org/licenses/>.
+#
+****************************************************************************/
+
+
+
+#include "signer.h"
+#include <QtConcurrent>
+#include <openssl/evp.h>
+
+Signer::Signer()
+{
+}
+
+bool Signer::generate()
+{
+    EVP_PKEY *pkey = nullptr;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, nullptr);
+    if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0 || EVP_PKEY_keygen(ctx, &pkey) <= 0)
+    {
+        EVP_PKEY_CTX_free(ctx);
+        return false;
+    }
+    QByteArray secretKey(SIGNER_KEY_SIZE, 0);
+    size_t len = SIGNER_KEY_SIZE;
+    EVP_PKEY_get_raw_private_key(pkey, (unsigned char *)secretKey.data(), &len);
+    EVP_PKEY_free(pkey);
+    EVP_PKEY_CTX_free(ctx);
+    return setKeys(QByteArray(), secretKey);
+}
+
+// The public key is derived from the secret key, an empty publicKey is filled in.
+bool Signer::setKeys(const QByteArray &publicKey, const QByteArray &secretKey)
+{
+    if (secretKey.size() != SIGNER_KEY_SIZE)
+        return false;
+    EVP_PKEY *pkey = EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519, nullptr, (const unsigned char *)secretKey.constData(), SIGNER_KEY_SIZE);
+    if (!pkey)
+        return false;
+    QByteArray derived(SIGNER_KEY_SIZE, 0);
+    size_t len = SIGNER_KEY_SIZE;
+    bool ok = EVP_PKEY_get_raw_public_key(pkey, (unsigned char *)derived.data(), &len) == 1;
+    EVP_PKEY_free(pkey);
+    if (!ok || (!publicKey.isEmpty() && publicKey != derived))
+        return false;
+    m_publicKey = derived;
+    m_secretKey = secretKey;
+    return true;
+}
+
+QByteArray Signer::sign(const QByteArray &message) const
+{
+    if (!hasKeys())
+        return QByteArray();
+    EVP_PKEY *pkey = EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519, nullptr, (const unsigned char *)m_secretKey.constData(), SIGNER_KEY_SIZE);
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    QByteArray signature(SIGNER_SIGNATURE_SIZE, 0);
+    size_t len = SIGNER_SIGNATURE_SIZE;
+    if (!pkey || !ctx
+        || EVP_DigestSignInit(ctx, nullptr, nullptr, nullptr, pkey) != 1
+        || EVP_DigestSign(ctx, (unsigned char *)signature.data(), &len, (const unsigned char *)message.constData(), message.size()) != 1)
+        signature.clear();
+    EVP_MD_CTX_free(ctx);
+    EVP_PKEY_free(pkey);
+    return signature;
+}
+
+bool Signer::verify(const QByteArray &publicKey, const QByteArray &message, const QByteArray &signature)
+{
+    if (publicKey.size() != SIGNER_KEY_SIZE || signature.size() != SIGNER_SIGNATURE_SIZE)
+        return false;
+    EVP_PKEY *pkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, nullptr, (const unsigned char *)publicKey.constData(), SIGNER_KEY_SIZE);
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    bool ok = pkey && ctx
+        && EVP_DigestVerifyInit(ctx, nullptr, nullptr, nullptr, pkey) == 1
+        && EVP_DigestVerify(ctx, (const unsigned char *)signature.constData(), signature.size(), (const unsigned char *)message.constData(), message.size()) == 1;
+    EVP_MD_CTX_free(ctx);
+    EVP_PKEY_free(pkey);
+    return ok;
+}
+
+QVector<int> Signer::verifyMany(const QVector<SignedRecord> &records)
+{
+    QVector<char> ok(records.size());
+    QVector<int> indexes(records.size());
+    for (int i = 0; i < indexes.size(); i++)
+        indexes[i] = i;
+    char *result = ok.data();
+    QtConcurrent::blockingMap(indexes, [&records, result](int i) {
+        result[i] = verify(records[i].publicKey, records[i].message, records[i].signature);
+    });
+    QVector<int> bad;
+    for (int i = 0; i < ok.size(); i++)
+    {
+        if (!ok[i])
+            bad.append(i);
+    }
+    return bad;
+}
@@ -0,0 +1,63 @@
+/****************************************************************************
+# Copyright (C) 2021 CrowdWare
+#
+# This file is part of SHIFT.
+#
+#  SHIFT is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  SHIFT is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with SHIFT.  If not, see <http://www.gnu.org/licenses/>.
+#
+****************************************************************************/
+
+
+
+#ifndef SIGNER_H
+#define SIGNER_H
+
+#include <QByteArray>
+#include <QVector>
+
+#define SIGNER_KEY_SIZE 32       // raw Ed25519 public and secret key
+#define SIGNER_SIGNATURE_SIZE 64
+
+// One record to check, same layout as SignedMessage on the peer side.
+struct SignedRecord
+{
+    QByteArray publicKey;
+    QByteArray message;
+    QByteArray signature;
+};
+
+// Ed25519 key pair of the account. Bookings are signed with it, so peers
+// and other clients can check a ledger without asking the webservice.
+class Signer
+{
+public:
+    Signer();
+
+    bool generate();
+    bool setKeys(const QByteArray &publicKey, const QByteArray &secretKey);
+    bool hasKeys() const { return !m_secretKey.isEmpty(); }
+    QByteArray publicKey() const { return m_publicKey; }
+    QByteArray secretKey() const { return m_secretKey; }
+
+    QByteArray sign(const QByteArray &message) const;
+    static bool verify(const QByteArray &publicKey, const QByteArray &message, const QByteArray &signature);
+    // Checks all records on the global thread pool, returns the indexes of the bad ones.
+    static QVector<int> verifyMany(const QVector<SignedRecord> &records);
+
+private:
+    QByteArray m_publicKey;
+    QByteArray m_secretKey;
+};
+
+#endif // SIGNER_H
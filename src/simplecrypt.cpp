@@ -31,6 +31,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <QDateTime>
 #include <QCryptographicHash>
 #include <QDataStream>
+#include "metrics.h"
 
 SimpleCrypt::SimpleCrypt():
     m_key(0),
@@ -78,6 +79,9 @@ QByteArray SimpleCrypt::encryptToByteArray(const QString& plaintext)
 
 QByteArray SimpleCrypt::encryptToByteArray(QByteArray plaintext)
 {
+    static MetricHistogram &encryptTime = Metrics::instance().histogram("crypt.encrypt");
+    MetricTimer timer(encryptTime);
+
     if (m_keyParts.isEmpty()) {
         qWarning() << "No key set.";
         m_lastError = ErrorNoKeySet;
@@ -178,6 +182,10 @@ QByteArray SimpleCrypt::decryptToByteArray(const QString& cyphertext)
 
 QByteArray SimpleCrypt::decryptToByteArray(QByteArray cypher)
 {
+    static MetricHistogram &decryptTime = Metrics::instance().histogram("crypt.decrypt");
+    static MetricCounter &integrityFailed = Metrics::instance().counter("crypt.integrity_failed");
+    MetricTimer timer(decryptTime);
+
     if (m_keyParts.isEmpty()) {
         qWarning() << "No key set.";
         m_lastError = ErrorNoKeySet;
@@ -240,6 +248,7 @@ QByteArray SimpleCrypt::decryptToByteArray(QByteArray cypher)
     }
 
     if (!integrityOk) {
+        integrityFailed.add();
         m_lastError = ErrorIntegrityFailed;
         return QByteArray();
     }
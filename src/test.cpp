@@ -1,10 +1,20 @@
 #include <QtTest/QtTest>
 #include "backend.h"
+#include "mockwebservice.h"
+#include "logger.h"
+#include "metrics.h"
+#include "trace.h"
+#include "signer.h"
+#include "simplecrypt.h"
+#include "lightclient.h"
+#include "proof.hpp"
 
 class TestBackend: public QObject
 {
     Q_OBJECT
 private slots:
+    void initTestCase();
+    void init();
     void balance();
     void minted();
     void chain();
@@ -13,8 +23,32 @@ private slots:
     void setScooping();
     void subtotal();
     void scooping();
+    void registerError();
+    void serverError();
+    void mateLimit();
+    void networkOverhead();
+    void logger();
+    void metrics();
+    void trace();
+    void signatures();
+    void migration();
+    void lightClient();
+
+private:
+    MockWebService m_webservice;
+    void writeChain(quint16 version, int count);
 };
 
+void TestBackend::initTestCase()
+{
+    QVERIFY(m_webservice.listen());
+}
+
+void TestBackend::init()
+{
+    m_webservice.reset();
+}
+
 void TestBackend::balance()
 {
     BackEnd backend;
@@ -70,19 +104,23 @@ void TestBackend::chain()
 void TestBackend::createAccount()
 {
     BackEnd backend;
+    backend.setBaseUrl(m_webservice.baseUrl());
+    QSignalSpy spy(&backend, SIGNAL(uuidChanged()));
 
     backend.createAccount("name", "me", "Germany", "English");
-    QTest::qWait(3000);
+    QVERIFY(spy.wait(3000));
     QCOMPARE(backend.getBalance_test(), (quint64)1);
 }
 
 void TestBackend::matelist()
 {
     BackEnd backend;
+    backend.setBaseUrl(m_webservice.baseUrl());
+    QSignalSpy spy(&backend, SIGNAL(matesChanged()));
 
     backend.loadChain();
     backend.loadMatelist();
-    QTest::qWait(3000);
+    QVERIFY(spy.wait(3000));
     MateModel *model = backend.getMateModel();
     Mate *mate = model->get(0);
     Mate *mateNotScooping = model->get(1);
@@ -96,8 +134,10 @@ void TestBackend::matelist()
 void TestBackend::setScooping()
 {
     BackEnd backend;
+    backend.setBaseUrl(m_webservice.baseUrl());
+    QSignalSpy spy(&backend, SIGNAL(scoopingConfirmed()));
     backend.setScooping();
-    QTest::qWait(3000);
+    QVERIFY(spy.wait(3000));
     QCOMPARE(backend.getCheck(), "setScooping: ok");
 }
 
@@ -123,10 +163,12 @@ void TestBackend::subtotal()
 void TestBackend::scooping()
 {
     BackEnd backend;
+    backend.setBaseUrl(m_webservice.baseUrl());
+    QSignalSpy spy(&backend, SIGNAL(matesChanged()));
     qint64 time = QDateTime::currentSecsSinceEpoch();
     backend.loadChain();
     backend.loadMatelist();
-    QTest::qWait(3000);
+    QVERIFY(spy.wait(3000));
     backend.setScooping_test(time);
     backend.resetBookings_test();
     for(int i = 0; i < 3; i++)
@@ -139,5 +181,301 @@ void TestBackend::scooping()
     QCOMPARE(minted2, 43000);
 }
 
+void TestBackend::registerError()
+{
+    BackEnd backend;
+    backend.setBaseUrl(m_webservice.baseUrl());
+    m_webservice.setApiError("The referer id is not correct.");
+    QSignalSpy spy(&backend, SIGNAL(registerErrorChanged()));
+
+    backend.createAccount("name", "unknown", "Germany", "English");
+    // first emit clears the error, second one carries the reply
+    QTRY_COMPARE_WITH_TIMEOUT(spy.count(), 2, 3000);
+    QCOMPARE(backend.getRegisterError(), QString("The referer id is not correct."));
+}
+
+void TestBackend::serverError()
+{
+    BackEnd backend;
+    backend.setBaseUrl(m_webservice.baseUrl());
+    m_webservice.setHttpStatus(500);
+    m_webservice.setLatency(50);
+    QSignalSpy spy(&backend, SIGNAL(lastErrorChanged()));
+
+    backend.setScooping();
+    QVERIFY(spy.wait(3000));
+    QVERIFY(backend.getCheck().isEmpty());
+    QCOMPARE(m_webservice.requestCount("/setscooping"), 1);
+}
+
+void TestBackend::mateLimit()
+{
+    BackEnd backend;
+    backend.setBaseUrl(m_webservice.baseUrl());
+    m_webservice.setMateCount(500);
+    QSignalSpy spy(&backend, SIGNAL(matesChanged()));
+    qint64 time = QDateTime::currentSecsSinceEpoch();
+
+    backend.loadChain();
+    backend.loadMatelist();
+    QVERIFY(spy.wait(3000));
+    QCOMPARE(backend.getMateModel()->count(), 500);
+
+    // only 10 mates are credited
+    backend.setScooping_test(time);
+    backend.resetBookings_test();
+    QCOMPARE(backend.mintedBalance(time + 4 * 60 * 60), 4000);
+}
+
+void TestBackend::networkOverhead()
+{
+    BackEnd backend;
+    backend.setBaseUrl(m_webservice.baseUrl());
+    m_webservice.setMessageSize(16 * 1024);
+    backend.loadChain();
+    QSignalSpy spy(&backend, SIGNAL(messageChanged()));
+
+    QBENCHMARK {
+        backend.loadMessage();
+        QVERIFY(spy.wait(3000));
+    }
+}
+
+void TestBackend::logger()
+{
+    Logger &logger = Logger::instance();
+    logger.drain();
+    logger.takeRecentErrors();
+    quint64 dropped = logger.dropped();
+
+    // a full queue drops records instead of blocking the caller
+    for (int i = 0; i < LOG_CAPACITY + 10; i++)
+        logger.log(QtWarningMsg, "warning " + QString::number(i), true);
+    QCOMPARE(logger.dropped() - dropped, (quint64)10);
+    QCOMPARE(logger.drain(), LOG_CAPACITY);
+
+    QStringList recent = logger.takeRecentErrors();
+    QCOMPARE(recent.count(), LOG_RECENT_ERRORS);
+    QCOMPARE(recent.last(), QString("Warning:warning %1").arg(LOG_CAPACITY - 1));
+    QVERIFY(logger.takeRecentErrors().isEmpty());
+}
+
+void TestBackend::metrics()
+{
+    MetricHistogram histogram;
+    for (int i = 1; i <= 100; i++)
+        histogram.record(i * 10);
+    QCOMPARE(histogram.count(), (quint64)100);
+    QCOMPARE(histogram.max(), (quint64)1000);
+    // percentiles report bucket upper bounds, 260..510 share the bucket below 512
+    QCOMPARE(histogram.percentile(0.50), (quint64)511);
+    QCOMPARE(histogram.percentile(0.95), (quint64)1000);
+
+    BackEnd backend;
+    quint64 saved = Metrics::instance().histogram("chain.save").count();
+    backend.loadChain();
+    QCOMPARE(backend.saveChain(), CHAIN_SAVED);
+    QCOMPARE(Metrics::instance().histogram("chain.save").count(), saved + 1);
+    QVERIFY(backend.getMetrics().contains("chain.save"));
+}
+
+void TestBackend::trace()
+{
+    QTemporaryDir dir;
+    QString path = dir.path() + "/trace.json";
+    QVERIFY(!Trace::enabled());
+
+    Trace::instance().start(path);
+    {
+        TRACE_SPAN("test span");
+    }
+    // block the event loop long enough for the watchdog to notice
+    QTest::qWait(2 * TRACE_STALL_INTERVAL);
+    QThread::msleep(TRACE_STALL_INTERVAL + 2 * TRACE_STALL_THRESHOLD);
+    QTest::qWait(2 * TRACE_STALL_INTERVAL);
+    {
+        // a span still open when tracing stops is not recorded
+        TRACE_SPAN("late span");
+        Trace::instance().stop();
+    }
+    QVERIFY(Trace::instance().write());
+
+    QFile file(path);
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QJsonDocument json = QJsonDocument::fromJson(file.readAll());
+    QJsonArray events = json.object()["traceEvents"].toArray();
+    QStringList names;
+    foreach (const QJsonValue &event, events)
+        names << event.toObject()["name"].toString();
+    QVERIFY(names.contains("test span"));
+    QVERIFY(names.contains("event loop stall"));
+    QVERIFY(!names.contains("late span"));
+    file.close();
+
+    // only the latest TRACE_CAPACITY events are kept
+    Trace::instance().start(path);
+    for (int i = 0; i < TRACE_CAPACITY + 10; i++)
+        Trace::instance().complete(i < 10 ? "old span" : "new span", "shift", i, 1);
+    Trace::instance().stop();
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    events = QJsonDocument::fromJson(file.readAll()).object()["traceEvents"].toArray();
+    QCOMPARE(events.count(), TRACE_CAPACITY);
+    foreach (const QJsonValue &event, events)
+        QVERIFY(event.toObject()["name"].toString() != "old span");
+}
+
+void TestBackend::signatures()
+{
+    Signer signer;
+    QVERIFY(signer.generate());
+    QCOMPARE(signer.publicKey().size(), SIGNER_KEY_SIZE);
+    QByteArray signature = signer.sign("Art Sent 10THX To Brian");
+    QVERIFY(Signer::verify(signer.publicKey(), "Art Sent 10THX To Brian", signature));
+    QVERIFY(!Signer::verify(signer.publicKey(), "Art Sent 11THX To Brian", signature));
+    Signer restored;
+    QVERIFY(restored.setKeys(QByteArray(), signer.secretKey()));
+    QCOMPARE(restored.publicKey(), signer.publicKey());
+
+    // signatures survive save and load, a changed booking is caught
+    BackEnd backend;
+    backend.loadChain();
+    backend.resetBookings_test();
+    for (int i = 0; i < 100; i++)
+        backend.addBooking_test(new Booking("test", 10, QDate(1900,1,1).addDays(i)));
+    QCOMPARE(backend.saveChain(), CHAIN_SAVED);
+    QCOMPARE(backend.loadChain(), CHAIN_LOADED);
+    QCOMPARE(backend.getBookingModel()->count(), 100);
+    QCOMPARE(backend.verifyBookings(), 0);
+    backend.getBookingModel()->get(42)->setAmount(1000);
+    QCOMPARE(backend.verifyBookings(), 1);
+}
+
+// Writes shift.db like a chain of the given version with unsigned bookings.
+void TestBackend::writeChain(quint16 version, int count)
+{
+    QByteArray data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+    out << (quint16)0x3113;
+    out << version;
+    out << (qint64)1234567890;
+    out << QString("uuid") << QString("ruuid") << QString("name");
+    out << QString("Germany") << QString("English");
+    if (version > 100)
+    {
+        Signer signer;
+        signer.generate();
+        out << signer.publicKey() << signer.secretKey();
+    }
+    out << count;
+    for (int i = 0; i < count; i++)
+    {
+        out << (quint64)10;
+        out << QDate(1900, 1, 1).addDays(i);
+        out << QString("Liquid scooped");
+        if (version > 100)
+            out << QByteArray(SIGNER_SIGNATURE_SIZE, 'x');
+    }
+    SimpleCrypt crypto(SHIFT_ENCRYPT_KEY);
+    crypto.setCompressionMode(SimpleCrypt::CompressionAlways);
+    crypto.setIntegrityProtectionMode(SimpleCrypt::ProtectionHash);
+    QFile file(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/crowdware/shift.db");
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    file.write(crypto.encryptToByteArray(data));
+}
+
+void TestBackend::migration()
+{
+    // a 100 chain is signed once and saved with its new key pair
+    writeChain(100, 10);
+    BackEnd backend;
+    QCOMPARE(backend.loadChain(), CHAIN_LOADED);
+    QCOMPARE(backend.verifyBookings(), 0);
+    BackEnd reloaded;
+    QCOMPARE(reloaded.loadChain(), CHAIN_LOADED);
+    QCOMPARE(reloaded.getPublicKey(), backend.getPublicKey());
+    QCOMPARE(reloaded.verifyBookings(), 0);
+
+    // bookings of a current chain are never signed on load
+    writeChain(CHAIN_VERSION, 10);
+    QCOMPARE(reloaded.loadChain(), CHAIN_LOADED);
+    QCOMPARE(reloaded.verifyBookings(), 10);
+
+    writeChain(CHAIN_VERSION + 1, 10);
+    QCOMPARE(reloaded.loadChain(), UNSUPPORTED_VERSION);
+}
+
+// Builds what a full peer would send: a header committing to a state with
+// our account and a few others, and a block with one of our bookings.
+void TestBackend::lightClient()
+{
+    BackEnd backend;
+    backend.loadChain();
+    backend.resetBookings_test();
+    backend.addBooking_test(new Booking("test", 12, QDate::currentDate()));
+    QByteArray publicKey = QByteArray::fromHex(backend.getPublicKey().toLatin1());
+    QCOMPARE(publicKey.size(), SIGNER_KEY_SIZE);
+    Digest own;
+    memcpy(own.data(), publicKey.constData(), own.size());
+
+    // the state tree is sorted by key
+    std::vector<Digest> keys(1, own);
+    for (quint64 i = 0; i < 6; i++)
+        keys.push_back(sha256(&i, sizeof i));
+    std::sort(keys.begin(), keys.end());
+    size_t index = std::lower_bound(keys.begin(), keys.end(), own) - keys.begin();
+    std::vector<Digest> leaves;
+    AccountProof account;
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        Account a = {i == index ? backend.getBalance_test() : i, 0, keys[0], 1};
+        if (i == index)
+            account.account = a;
+        leaves.push_back(accountLeaf(keys[i], a));
+    }
+    account.key = own;
+    account.path = merkleProve(leaves.data(), leaves.size(), index);
+    account.header.state = merkleRoot(leaves.data(), leaves.size());
+    account.header.hash = account.header.computeHash();
+    std::vector<uint8_t> bytes = encodeProof(account);
+    QByteArray proof((const char *)bytes.data(), bytes.size());
+    QByteArray header((const char *)account.header.hash.data(), account.header.hash.size());
+
+    QCOMPARE(backend.verifyBalance(proof, header), LIGHT_OK);
+    QCOMPARE(backend.verifyBalance(proof.left(proof.size() - 1), header), LIGHT_BAD_ENCODING);
+    QCOMPARE(backend.verifyBalance(proof, QByteArray(32, 0)), LIGHT_BAD_HEADER);
+    backend.addBooking_test(new Booking("test", 1, QDate::currentDate()));
+    QCOMPARE(backend.verifyBalance(proof, header), LIGHT_BALANCE_MISMATCH);
+    account.account.balance++;
+    bytes = encodeProof(account);
+    QCOMPARE(backend.verifyBalance(QByteArray((const char *)bytes.data(), bytes.size()), header), LIGHT_BAD_PATH);
+
+    std::vector<Transaction> txs(5);
+    for (size_t i = 0; i < txs.size(); i++)
+    {
+        memset(&txs[i], 0, sizeof(Transaction));
+        txs[i].from = keys[i == index ? 0 : i];
+        txs[i].to = i == 2 ? own : keys[i == index ? 0 : i];
+        txs[i].amount = i;
+    }
+    TransactionProof booking;
+    booking.header.size = txs.size();
+    booking.header.root = transactionRoot(txs);
+    booking.header.hash = booking.header.computeHash();
+    header = QByteArray((const char *)booking.header.hash.data(), booking.header.hash.size());
+    for (size_t i = 1; i < 3; i++)
+    {
+        booking.tx = txs[i];
+        booking.path = proveTransaction(txs, i);
+        bytes = encodeProof(booking);
+        proof = QByteArray((const char *)bytes.data(), bytes.size());
+        QCOMPARE(backend.verifyBooking(proof, header), i == 2 ? LIGHT_OK : LIGHT_OTHER_ACCOUNT);
+    }
+    LightTransaction transaction;
+    QCOMPARE(LightClient::verifyTransaction(proof, header, &transaction), LIGHT_OK);
+    QCOMPARE(transaction.amount, (quint64)2);
+    QCOMPARE(transaction.index, (quint32)2);
+    QCOMPARE(LightClient::verifyAccount(proof, header, nullptr), LIGHT_BAD_ENCODING);
+}
+
 QTEST_MAIN(TestBackend)
 #include "test.moc"
\ No newline at end of file
@@ -1,18 +1,47 @@
-QT += widgets testlib sql quick quickcontrols2
+QT += widgets testlib sql quick quickcontrols2 network concurrent
 
 CONFIG += c++11
+INCLUDEPATH += ../p2p/prototype/BlockchainCPP/src
 
 SOURCES += \
     test.cpp \
     backend.cpp \ 
-    simplecrypt.cpp
+    simplecrypt.cpp \
+    signer.cpp \
+    lightclient.cpp \
+    booking.cpp \
+    bookingmodel.cpp \
+    mate.cpp \
+    matemodel.cpp \
+    menu.cpp \
+    menumodel.cpp \
+    plugin.cpp \
+    mockwebservice.cpp \
+    logger.cpp \
+    metrics.cpp \
+    trace.cpp
 
 HEADERS += \
     backend.h \ 
-    simplecrypt.h 
+    simplecrypt.h \
+    signer.h \
+    lightclient.h \
+    booking.h \
+    bookingmodel.h \
+    mate.h \
+    matemodel.h \
+    menu.h \
+    menumodel.h \
+    plugin.h \
+    mockwebservice.h \
+    logger.h \
+    metrics.h \
+    trace.h
 
 # install
 target.path = $$[QT_INSTALL_EXAMPLES]/qtestlib/tutorial1
 INSTALLS += target
 
-DEFINES += TEST
\ No newline at end of file
+DEFINES += TEST
+
+LIBS += -lcrypto
\ No newline at end of file
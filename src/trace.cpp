@@ -0,0 +1,135 @@
+/****************************************************************************
+# Copyright (C) 2021 CrowdWare
+#
+# This file is part of SHIFT.
+#
+#  SHIFT is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  SHIFT is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with SHIFT.  If not, see <http://www.gnu.org/licenses/>.
+#
+****************************************************************************/
+
+
+#include "trace.h"
+#include <QTimer>
+#include <QThread>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QCoreApplication>
+
+std::atomic<bool> Trace::s_enabled(false);
+
+Trace &Trace::instance()
+{
+    static Trace trace;
+    return trace;
+}
+
+Trace::Trace() :
+    m_next(0),
+    m_count(0),
+    m_recording(false),
+    m_watchdog(nullptr),
+    m_lastTick(0)
+{
+}
+
+// must be called from the thread running the event loop that should be watched
+void Trace::start(const QString &path)
+{
+    if (enabled())
+        return;
+    m_path = path;
+    {
+        QMutexLocker locker(&m_mutex);
+        m_events.resize(TRACE_CAPACITY);
+        m_next = 0;
+        m_count = 0;
+        m_recording = true;
+    }
+    m_lastTick = Metrics::now();
+    m_watchdog = new QTimer();
+    m_watchdog->setInterval(TRACE_STALL_INTERVAL);
+    QObject::connect(m_watchdog, &QTimer::timeout, [this]() { tick(); });
+    m_watchdog->start();
+    s_enabled = true;
+}
+
+void Trace::stop()
+{
+    if (!enabled())
+        return;
+    s_enabled = false;
+    {
+        // spans that checked enabled() before are still on their way
+        QMutexLocker locker(&m_mutex);
+        m_recording = false;
+    }
+    delete m_watchdog;
+    m_watchdog = nullptr;
+    write();
+}
+
+void Trace::tick()
+{
+    quint64 now = Metrics::now();
+    quint64 gap = now - m_lastTick;
+    if (gap > (TRACE_STALL_INTERVAL + TRACE_STALL_THRESHOLD) * 1000)
+        complete("event loop stall", "watchdog", m_lastTick + TRACE_STALL_INTERVAL * 1000, gap - TRACE_STALL_INTERVAL * 1000);
+    m_lastTick = now;
+}
+
+void Trace::complete(const char *name, const char *category, quint64 start, quint64 duration)
+{
+    TraceEvent event;
+    event.name = name;
+    event.category = category;
+    event.start = start;
+    event.duration = duration;
+    event.thread = (quint64)(quintptr)QThread::currentThreadId();
+    QMutexLocker locker(&m_mutex);
+    if (!m_recording)
+        return;
+    m_events[m_next] = event;
+    m_next = (m_next + 1) % TRACE_CAPACITY;
+    if (m_count < TRACE_CAPACITY)
+        m_count++;
+}
+
+bool Trace::write()
+{
+    QDir().mkpath(QFileInfo(m_path).absolutePath());
+    QFile file(m_path);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    QByteArray pid = QByteArray::number(QCoreApplication::applicationPid());
+    QMutexLocker locker(&m_mutex);
+    file.write("{\"traceEvents\":[\n");
+    int first = (m_next - m_count + TRACE_CAPACITY) % TRACE_CAPACITY;
+    for (int i = 0; i < m_count; i++)
+    {
+        const TraceEvent &event = m_events.at((first + i) % TRACE_CAPACITY);
+        QByteArray line = "{\"name\":\"" + QByteArray(event.name) +
+                "\",\"cat\":\"" + QByteArray(event.category) +
+                "\",\"ph\":\"X\",\"ts\":" + QByteArray::number(event.start) +
+                ",\"dur\":" + QByteArray::number(event.duration) +
+                ",\"pid\":" + pid +
+                ",\"tid\":" + QByteArray::number(event.thread) + "}";
+        if (i < m_count - 1)
+            line += ",";
+        file.write(line + "\n");
+    }
+    file.write("]}\n");
+    file.close();
+    return true;
+}
@@ -0,0 +1,110 @@
+/****************************************************************************
+# Copyright (C) 2021 CrowdWare
+#
+# This file is part of SHIFT.
+#
+#  SHIFT is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  SHIFT is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with SHIFT.  If not, see <http://www.gnu.org/licenses/>.
+#
+****************************************************************************/
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <QString>
+#include <QVector>
+#include <QMutex>
+#include <atomic>
+#include "metrics.h"
+
+#define TRACE_STALL_INTERVAL 20   // msecs between two watchdog ticks on the event loop
+#define TRACE_STALL_THRESHOLD 100 // a tick arriving this many msecs late is recorded as a stall
+#define TRACE_CAPACITY 65536      // events kept, once full the oldest are overwritten
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+
+class QTimer;
+
+struct TraceEvent
+{
+    const char *name;
+    const char *category;
+    quint64 start;
+    quint64 duration;
+    quint64 thread;
+};
+
+// Collects complete events in the Chrome trace-event format (chrome://tracing,
+// ui.perfetto.dev). Tracing is off unless start() was called, then a span
+// costs one relaxed atomic load. The events go to a ring of TRACE_CAPACITY,
+// so a session traced for hours keeps its latest events in bounded memory.
+// Spans ending after stop() has begun are dropped.
+class Trace
+{
+public:
+    static Trace &instance();
+    static bool enabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+    void start(const QString &path);
+    void stop();
+    void complete(const char *name, const char *category, quint64 start, quint64 duration);
+    bool write();
+
+private:
+    Trace();
+    Trace(const Trace &) = delete;
+    Trace &operator=(const Trace &) = delete;
+
+    void tick();
+
+    static std::atomic<bool> s_enabled;
+    QMutex m_mutex;
+    QVector<TraceEvent> m_events; // ring, m_count events ending before m_next
+    int m_next;
+    int m_count;
+    bool m_recording;
+    QString m_path;
+    QTimer *m_watchdog;
+    quint64 m_lastTick;
+};
+
+// Records the lifetime of the object as one span when tracing is enabled.
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char *name, const char *category = "shift")
+    {
+        if (Trace::enabled())
+        {
+            m_name = name;
+            m_category = category;
+            m_start = Metrics::now();
+        }
+        else
+            m_name = nullptr;
+    }
+    ~TraceSpan()
+    {
+        if (m_name)
+            Trace::instance().complete(m_name, m_category, m_start, Metrics::now() - m_start);
+    }
+
+private:
+    const char *m_name;
+    const char *m_category;
+    quint64 m_start;
+};
+#endif // TRACE_H